@@ -9,8 +9,13 @@ expr
     | (ADD | SUB) expr  # UnaryOp
     | expr (MUL | DIV) expr  # BinaryOp
     | expr (ADD | SUB) expr  # BinaryOp
-    | CELL  # Cell
+    | expr (EQ | NE | LT | LE | GT | GE) expr  # Comparison
+    // a lookup argument (VLOOKUP(A1,D1:F100,3,0)) or an operand of an
+    // array formula, computed for each element: A1:A10*B1:B10
+    | CELL ':' CELL  # Range
+    | (CELL | REF)  # Cell
     | NUMBER  # Literal
+    | NAME '(' (expr (',' expr)*)? ')'  # Call
     ;
 
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
@@ -26,5 +31,15 @@ ADD: '+' ;
 SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
+EQ: '=' ;
+NE: '<>' ;
+LT: '<' ;
+LE: '<=' ;
+GT: '>' ;
+GE: '>=' ;
 CELL: [A-Z]+[0-9]+ ;
+// a function name; a cell is a longer match, so A1 is never lexed as a name
+NAME: [A-Z]+ ;
+// a reference to a deleted cell (see Sheet::DeleteRows)
+REF: '#REF!' ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
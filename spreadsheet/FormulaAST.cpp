@@ -4,17 +4,22 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cctype>
 #include <cmath>
+#include <cstdint>
 #include <memory>
 #include <optional>
 #include <sstream>
+#include <unordered_map>
 
 using namespace std;
 
 namespace ASTImpl {
 
 enum ExprPrecedence {
+    EP_COMPARE,
     EP_ADD,
     EP_SUB,
     EP_MUL,
@@ -60,21 +65,60 @@ enum PrecedenceRule {
 //     (currently in the table we're always putting in the parentheses)
 // +(A * B) - always okay (the resulting binary op has the highest grammatic precedence)
 // +(A / B) - always okay (the resulting binary op has the highest grammatic precedence)
+// A = (B = C) - never okay (comparisons are left-associative, (A = B) = C is fine)
+// A + (B = C), -(A = B) etc. - never okay (a comparison has the lowest grammatic precedence)
 constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
-    /* EP_ADD */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_SUB */ {PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
-    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
-    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_COMPARE */ {PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ADD */ {PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_SUB */ {PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_MUL */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_DIV */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_RIGHT, PR_RIGHT, PR_NONE, PR_NONE},
+    /* EP_UNARY */ {PR_BOTH, PR_BOTH, PR_BOTH, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+    /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
+};
+
+// where the cell and range nodes of a copied AST point: the positions and
+// ranges of the original mapped onto the lists of the copy
+struct CopyContext {
+    unordered_map<const Position*, const Position*> cells;
+    unordered_map<const Range*, const Range*> ranges;
+    const Position* element = nullptr;
+    // the copy replaces the original in place (see FormulaAST::Clone)
+    bool in_place = false;
 };
 
 class Expr {
 public:
     virtual ~Expr() = default;
+    // a deep copy of the subtree for the lists of context
+    virtual unique_ptr<Expr> Copy(const CopyContext& context) const = 0;
     virtual void Print(ostream& out) const = 0;
     virtual void DoPrintFormula(ostream& out, ExprPrecedence precedence) const = 0;
     virtual double Evaluate(const SheetInterface& sheet) const = 0;
+    virtual bool Compile(Position origin, FormulaProgram& program) const = 0;
+    // binds the cell references of the subtree; leaves have nothing to bind
+    virtual void BindInputs(const FormulaInterface::InputResolver& /* resolve */) {
+    }
+    // bytes taken by this node and its subtree
+    virtual size_t GetMemoryUsage() const = 0;
+    // appends the valid cells of the subtree read by its last evaluation
+    // (see FormulaAST::GetLiveCells); leaves other than cells read none
+    virtual void AddLiveCells(vector<Position>& /* cells */) const {
+    }
+    // the cells the node refers to when it is passed to a function:
+    // nullopt if it is not a reference at all, an invalid range for #REF!
+    virtual optional<Range> GetRange() const {
+        return nullopt;
+    }
+    // the value a lookup function searches for (see SheetInterface::GetLookupKey);
+    // only a cell reference may be text
+    virtual LookupKey EvaluateKey(const SheetInterface& sheet) const {
+        return Evaluate(sheet);
+    }
+    // appends the ranges evaluated element by element (see FormulaAST::GetArraySize);
+    // lookup functions read their range arguments as a whole
+    virtual void AddArrayOperands(vector<const Range*>& /* ranges */) const {
+    }
 
     // higher is tighter
     virtual ExprPrecedence GetPrecedence() const = 0;
@@ -113,6 +157,10 @@ public:
         , rhs_(move(rhs)) {
     }
 
+    unique_ptr<Expr> Copy(const CopyContext& context) const override {
+        return make_unique<BinaryOpExpr>(type_, lhs_->Copy(context), rhs_->Copy(context));
+    }
+
     void Print(ostream& out) const override {
         out << '(' << static_cast<char>(type_) << ' ';
         lhs_->Print(out);
@@ -173,6 +221,50 @@ public:
         return result;
     }
 
+    bool Compile(Position origin, FormulaProgram& program) const override {
+        if (!lhs_->Compile(origin, program) || !rhs_->Compile(origin, program)) {
+            return false;
+        }
+
+        using OpCode = FormulaProgram::OpCode;
+        switch (type_) {
+            case Type::Add:
+                program.ops.push_back({OpCode::Add});
+                break;
+            case Type::Subtract:
+                program.ops.push_back({OpCode::Subtract});
+                break;
+            case Type::Multiply:
+                program.ops.push_back({OpCode::Multiply});
+                break;
+            case Type::Divide:
+                program.ops.push_back({OpCode::Divide});
+                break;
+            default:
+                assert(false && "Unknown Bionary Op");
+        }
+        return true;
+    }
+
+    void BindInputs(const FormulaInterface::InputResolver& resolve) override {
+        lhs_->BindInputs(resolve);
+        rhs_->BindInputs(resolve);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+    void AddLiveCells(vector<Position>& cells) const override {
+        lhs_->AddLiveCells(cells);
+        rhs_->AddLiveCells(cells);
+    }
+
+    void AddArrayOperands(vector<const Range*>& ranges) const override {
+        lhs_->AddArrayOperands(ranges);
+        rhs_->AddArrayOperands(ranges);
+    }
+
 private:
     Type type_;
     unique_ptr<Expr> lhs_;
@@ -192,6 +284,10 @@ public:
         , operand_(move(operand)) {
     }
 
+    unique_ptr<Expr> Copy(const CopyContext& context) const override {
+        return make_unique<UnaryOpExpr>(type_, operand_->Copy(context));
+    }
+
     void Print(ostream& out) const override {
         out << '(' << static_cast<char>(type_) << ' ';
         operand_->Print(out);
@@ -223,17 +319,199 @@ public:
         return result;
     }
 
+    bool Compile(Position origin, FormulaProgram& program) const override {
+        if (!operand_->Compile(origin, program)) {
+            return false;
+        }
+        if (type_ == Type::UnaryMinus) {
+            program.ops.push_back({FormulaProgram::OpCode::Negate});
+        }
+        return true;
+    }
+
+    void BindInputs(const FormulaInterface::InputResolver& resolve) override {
+        operand_->BindInputs(resolve);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + operand_->GetMemoryUsage();
+    }
+
+    void AddLiveCells(vector<Position>& cells) const override {
+        operand_->AddLiveCells(cells);
+    }
+
+    void AddArrayOperands(vector<const Range*>& ranges) const override {
+        operand_->AddArrayOperands(ranges);
+    }
+
 private:
     Type type_;
     unique_ptr<Expr> operand_;
 };
 
+// Orders two compared values the way spreadsheets do: numbers by value,
+// text case-insensitively and after any number; an empty cell is both 0 and ""
+int CompareValues(const LookupKey& lhs, const LookupKey& rhs) {
+    auto is_empty = [](const LookupKey& key) {
+        return holds_alternative<string>(key) && get<string>(key).empty();
+    };
+    if (lhs.index() != rhs.index() && (is_empty(lhs) || is_empty(rhs))) {
+        return CompareValues(is_empty(lhs) ? LookupKey{0.0} : lhs, is_empty(rhs) ? LookupKey{0.0} : rhs);
+    }
+
+    if (holds_alternative<double>(lhs) && holds_alternative<double>(rhs)) {
+        double left = get<double>(lhs);
+        double right = get<double>(rhs);
+        return left < right ? -1 : (right < left ? 1 : 0);
+    }
+    if (lhs.index() != rhs.index()) {
+        return holds_alternative<double>(lhs) ? -1 : 1;
+    }
+
+    const string& left = get<string>(lhs);
+    const string& right = get<string>(rhs);
+    for (size_t i = 0; i < left.size() && i < right.size(); ++i) {
+        int l = tolower(static_cast<unsigned char>(left[i]));
+        int r = tolower(static_cast<unsigned char>(right[i]));
+        if (l != r) {
+            return l < r ? -1 : 1;
+        }
+    }
+    return left.size() < right.size() ? -1 : (right.size() < left.size() ? 1 : 0);
+}
+
+// A1>0, A1<>B1: 1 if the comparison holds, 0 otherwise
+class ComparisonExpr final : public Expr {
+public:
+    enum Type : char {
+        Equal,
+        NotEqual,
+        Less,
+        LessOrEqual,
+        Greater,
+        GreaterOrEqual,
+    };
+
+public:
+    explicit ComparisonExpr(Type type, unique_ptr<Expr> lhs, unique_ptr<Expr> rhs)
+        : type_(type)
+        , lhs_(move(lhs))
+        , rhs_(move(rhs)) {
+    }
+
+    unique_ptr<Expr> Copy(const CopyContext& context) const override {
+        return make_unique<ComparisonExpr>(type_, lhs_->Copy(context), rhs_->Copy(context));
+    }
+
+    void Print(ostream& out) const override {
+        out << '(' << GetSymbol() << ' ';
+        lhs_->Print(out);
+        out << ' ';
+        rhs_->Print(out);
+        out << ')';
+    }
+
+    void DoPrintFormula(ostream& out, ExprPrecedence precedence) const override {
+        lhs_->PrintFormula(out, precedence);
+        out << GetSymbol();
+        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_COMPARE;
+    }
+
+    // text cells are compared as text, so operands are read as lookup keys
+    double Evaluate(const SheetInterface& sheet) const override {
+        LookupKey left = lhs_->EvaluateKey(sheet);
+        LookupKey right = rhs_->EvaluateKey(sheet);
+        int order = CompareValues(left, right);
+
+        switch (type_) {
+            case Type::Equal:
+                return order == 0;
+            case Type::NotEqual:
+                return order != 0;
+            case Type::Less:
+                return order < 0;
+            case Type::LessOrEqual:
+                return order <= 0;
+            case Type::Greater:
+                return order > 0;
+            case Type::GreaterOrEqual:
+                return order >= 0;
+            default:
+                assert(false && "Unknown Comparison");
+                return 0;
+        }
+    }
+
+    // the postfix form has no comparisons
+    bool Compile(Position /* origin */, FormulaProgram& /* program */) const override {
+        return false;
+    }
+
+    void BindInputs(const FormulaInterface::InputResolver& resolve) override {
+        lhs_->BindInputs(resolve);
+        rhs_->BindInputs(resolve);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + lhs_->GetMemoryUsage() + rhs_->GetMemoryUsage();
+    }
+
+    void AddLiveCells(vector<Position>& cells) const override {
+        lhs_->AddLiveCells(cells);
+        rhs_->AddLiveCells(cells);
+    }
+
+    void AddArrayOperands(vector<const Range*>& ranges) const override {
+        lhs_->AddArrayOperands(ranges);
+        rhs_->AddArrayOperands(ranges);
+    }
+
+private:
+    Type type_;
+    unique_ptr<Expr> lhs_;
+    unique_ptr<Expr> rhs_;
+
+    const char* GetSymbol() const {
+        switch (type_) {
+            case Type::Equal:
+                return "=";
+            case Type::NotEqual:
+                return "<>";
+            case Type::Less:
+                return "<";
+            case Type::LessOrEqual:
+                return "<=";
+            case Type::Greater:
+                return ">";
+            case Type::GreaterOrEqual:
+                return ">=";
+            default:
+                assert(false && "Unknown Comparison");
+                return "";
+        }
+    }
+};
+
 class CellExpr final : public Expr {
 public:
     explicit CellExpr(const Position* cell)
         : cell_(cell) {
     }
 
+    // a copy elsewhere is bound to its inputs anew
+    unique_ptr<Expr> Copy(const CopyContext& context) const override {
+        auto copy = make_unique<CellExpr>(context.cells.at(cell_));
+        if (context.in_place) {
+            copy->input_ = input_;
+        }
+        return copy;
+    }
+
     void Print(ostream& out) const override {
         if (!cell_->IsValid()) {
             out << FormulaError::Category::Ref;
@@ -255,39 +533,147 @@ public:
             throw FormulaError(FormulaError::Category::Ref);
         }
 
-        const CellInterface* cell_ptr = sheet.GetCell(*cell_);
+        // a bound reference reads its input directly, without a sheet lookup
+        auto value = input_ ? input_->GetNumericValue() : sheet.GetNumericValue(*cell_);
+        if (holds_alternative<double>(value)) {
+            return get<double>(value);
+        }
+        throw get<FormulaError>(value);
+    }
 
-        if (!cell_ptr) {
-            return 0.0;
-        } else {
-            auto result = cell_ptr->GetValue();
-            if (holds_alternative<string>(result)) {
-                string text = get<string>(result);
-                if (text.empty()) {
-                    return 0.0;
-                } else {
-                    try {
-                        size_t pos = 0;
-                        double answer = stod(text, &pos);
-                        if (pos == text.size()) {
-                            return answer;
-                        } else {
-                            throw FormulaError(FormulaError::Category::Value);
-                        }
-                    } catch (...) {}
-                }
-            } else if (holds_alternative<double>(result)) {
-                return get<double>(result);
-            } else {
-                throw get<FormulaError>(result);
-            }
+    bool Compile(Position origin, FormulaProgram& program) const override {
+        if (!cell_->IsValid()) {
+            return false;
         }
+        program.ops.push_back({FormulaProgram::OpCode::Cell, 0, cell_->row - origin.row,
+                               cell_->col - origin.col});
+        return true;
+    }
 
-        throw FormulaError(FormulaError::Category::Value);
+    void BindInputs(const FormulaInterface::InputResolver& resolve) override {
+        input_ = cell_->IsValid() ? resolve(*cell_) : nullptr;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    void AddLiveCells(vector<Position>& cells) const override {
+        if (cell_->IsValid()) {
+            cells.push_back(*cell_);
+        }
+    }
+
+    optional<Range> GetRange() const override {
+        return Range{*cell_, *cell_};
+    }
+
+    LookupKey EvaluateKey(const SheetInterface& sheet) const override {
+        if (!cell_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+
+        auto key = sheet.GetLookupKey(*cell_);
+        if (holds_alternative<double>(key)) {
+            return get<double>(key);
+        }
+        if (holds_alternative<string>(key)) {
+            return move(get<string>(key));
+        }
+        throw get<FormulaError>(key);
     }
 
 private:
     const Position* cell_;
+    const FormulaInput* input_ = nullptr;
+};
+
+// A1:C10: a range argument of a lookup function or an operand of an array
+// formula, which reads the cell at the offset of the element being evaluated
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(const Range* range, const Position* element)
+        : range_(range)
+        , element_(element) {
+    }
+
+    unique_ptr<Expr> Copy(const CopyContext& context) const override {
+        return make_unique<RangeExpr>(context.ranges.at(range_), context.element);
+    }
+
+    void Print(ostream& out) const override {
+        if (!range_->IsValid()) {
+            out << FormulaError::Category::Ref;
+        } else {
+            out << range_->ToString();
+        }
+    }
+
+    void DoPrintFormula(ostream& out, ExprPrecedence /* precedence */) const override {
+        Print(out);
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        auto value = sheet.GetNumericValue(GetElement());
+        if (holds_alternative<double>(value)) {
+            return get<double>(value);
+        }
+        throw get<FormulaError>(value);
+    }
+
+    // the element is at the same offset from range_->first as the result
+    // element from the formula (see FormulaProgram::OpCode::Range)
+    bool Compile(Position origin, FormulaProgram& program) const override {
+        if (!range_->IsValid()) {
+            return false;
+        }
+        program.ops.push_back({FormulaProgram::OpCode::Range, 0, range_->first.row - origin.row,
+                               range_->first.col - origin.col});
+        return true;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
+    optional<Range> GetRange() const override {
+        return *range_;
+    }
+
+    LookupKey EvaluateKey(const SheetInterface& sheet) const override {
+        auto key = sheet.GetLookupKey(GetElement());
+        if (holds_alternative<double>(key)) {
+            return get<double>(key);
+        }
+        if (holds_alternative<string>(key)) {
+            return move(get<string>(key));
+        }
+        throw get<FormulaError>(key);
+    }
+
+    void AddArrayOperands(vector<const Range*>& ranges) const override {
+        ranges.push_back(range_);
+    }
+
+private:
+    const Range* range_;
+    const Position* element_;
+
+    // a smaller range has no element where a larger one does: #N/A
+    Position GetElement() const {
+        if (!range_->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        Size size = range_->GetSize();
+        if (element_->row >= size.rows || element_->col >= size.cols) {
+            throw FormulaError(FormulaError::Category::NotAvailable);
+        }
+        return {range_->first.row + element_->row, range_->first.col + element_->col};
+    }
 };
 
 class NumberExpr final : public Expr {
@@ -296,6 +682,10 @@ public:
         : value_(value) {
     }
 
+    unique_ptr<Expr> Copy(const CopyContext& /* context */) const override {
+        return make_unique<NumberExpr>(value_);
+    }
+
     void Print(ostream& out) const override {
         out << value_;
     }
@@ -312,10 +702,322 @@ public:
         return value_;
     }
 
+    bool Compile(Position /* origin */, FormulaProgram& program) const override {
+        program.ops.push_back({FormulaProgram::OpCode::Number, value_});
+        return true;
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this);
+    }
+
 private:
     double value_;
 };
 
+enum class Function : char {
+    Match,
+    VLookup,
+    XLookup,
+    If,
+    And,
+    Or,
+};
+
+struct FunctionInfo {
+    const char* name;
+    Function function;
+    size_t min_args;
+    size_t max_args;
+};
+
+const FunctionInfo FUNCTIONS[] = {
+    {"MATCH", Function::Match, 2, 3},
+    {"VLOOKUP", Function::VLookup, 3, 4},
+    {"XLOOKUP", Function::XLookup, 3, 5},
+    {"IF", Function::If, 2, 3},
+    {"AND", Function::And, 1, 255},
+    {"OR", Function::Or, 1, 255},
+};
+
+bool IsCondition(Function function) {
+    return function == Function::If || function == Function::And || function == Function::Or;
+}
+
+const FunctionInfo* FindFunction(const string& name) {
+    for (const FunctionInfo& info : FUNCTIONS) {
+        if (name == info.name) {
+            return &info;
+        }
+    }
+    return nullptr;
+}
+
+// The lookup functions search a column through SheetInterface::Lookup,
+// which answers from an index instead of scanning the cells:
+// * MATCH(key, column[, type]) - the 1-based row of key in column; type 1
+//   (default) also accepts the nearest smaller key, -1 the nearest larger one,
+//   0 only an equal key
+// * VLOOKUP(key, table, index[, approximate]) - the value in column index of
+//   the table row whose first column holds key; approximate (default 1)
+//   accepts the nearest smaller key
+// * XLOOKUP(key, column, results[, if_not_found, mode]) - the value in results
+//   at the row of key in column; mode 0 (default) needs an equal key, -1
+//   accepts the nearest smaller one, 1 the nearest larger one
+// A key that is not found gives #N/A.
+//
+// The conditions evaluate only the arguments they need, so an error or a
+// cell in a skipped argument does not affect the result:
+// * IF(condition, then[, else]) - then if condition is not 0, else else
+//   (default 0)
+// * AND(a, b, ...), OR(a, b, ...) - 1 or 0; the arguments are evaluated
+//   from left to right until the result is known
+class CallExpr final : public Expr {
+public:
+    explicit CallExpr(const FunctionInfo* info, vector<unique_ptr<Expr>> args)
+        : info_(info)
+        , args_(move(args)) {
+    }
+
+    unique_ptr<Expr> Copy(const CopyContext& context) const override {
+        vector<unique_ptr<Expr>> args;
+        args.reserve(args_.size());
+        for (const auto& arg : args_) {
+            args.push_back(arg->Copy(context));
+        }
+        auto copy = make_unique<CallExpr>(info_, move(args));
+        if (context.in_place) {
+            copy->evaluated_ = evaluated_;
+        }
+        return copy;
+    }
+
+    void Print(ostream& out) const override {
+        out << '(' << info_->name;
+        for (const auto& arg : args_) {
+            out << ' ';
+            arg->Print(out);
+        }
+        out << ')';
+    }
+
+    void DoPrintFormula(ostream& out, ExprPrecedence /* precedence */) const override {
+        out << info_->name << '(';
+        bool first = true;
+        for (const auto& arg : args_) {
+            if (!first) {
+                out << ',';
+            }
+            arg->PrintFormula(out, EP_ATOM);
+            first = false;
+        }
+        out << ')';
+    }
+
+    ExprPrecedence GetPrecedence() const override {
+        return EP_ATOM;
+    }
+
+    double Evaluate(const SheetInterface& sheet) const override {
+        switch (info_->function) {
+            case Function::Match:
+                return EvaluateMatch(sheet);
+            case Function::VLookup:
+                return EvaluateVLookup(sheet);
+            case Function::XLookup:
+                return EvaluateXLookup(sheet);
+            case Function::If:
+                return EvaluateIf(sheet);
+            case Function::And:
+            case Function::Or:
+                return EvaluateLogical(sheet, info_->function == Function::And);
+            default:
+                assert(false && "Unknown Function");
+                return 0;
+        }
+    }
+
+    // a lookup reads whole columns and a condition skips arguments, so
+    // neither has a postfix form
+    bool Compile(Position /* origin */, FormulaProgram& /* program */) const override {
+        return false;
+    }
+
+    void BindInputs(const FormulaInterface::InputResolver& resolve) override {
+        for (auto& arg : args_) {
+            arg->BindInputs(resolve);
+        }
+    }
+
+    size_t GetMemoryUsage() const override {
+        size_t result = sizeof(*this) + args_.capacity() * sizeof(unique_ptr<Expr>);
+        for (const auto& arg : args_) {
+            result += arg->GetMemoryUsage();
+        }
+        return result;
+    }
+
+    void AddLiveCells(vector<Position>& cells) const override {
+        for (size_t i = 0; i < args_.size(); ++i) {
+            if (i >= EVALUATED_BITS || (evaluated_ >> i & 1)) {
+                args_[i]->AddLiveCells(cells);
+            }
+        }
+    }
+
+    // a range where a lookup expects a range is read as a whole; anywhere
+    // else (the key, IF(A1:A10>0,...)) it is evaluated element by element
+    void AddArrayOperands(vector<const Range*>& ranges) const override {
+        for (size_t i = 0; i < args_.size(); ++i) {
+            if (!IsRangeArg(i)) {
+                args_[i]->AddArrayOperands(ranges);
+            }
+        }
+    }
+
+private:
+    static constexpr size_t EVALUATED_BITS = 64;
+
+    const FunctionInfo* info_;
+    vector<unique_ptr<Expr>> args_;
+    // the arguments a condition evaluated last time, a bit per argument;
+    // the ones past the bits, and all arguments of the other functions,
+    // count as evaluated
+    mutable uint64_t evaluated_ = ~uint64_t{0};
+
+    double EvaluateArg(size_t index, const SheetInterface& sheet) const {
+        if (index < EVALUATED_BITS) {
+            evaluated_ |= uint64_t{1} << index;
+        }
+        return args_[index]->Evaluate(sheet);
+    }
+
+    double EvaluateIf(const SheetInterface& sheet) const {
+        evaluated_ = 0;
+        if (EvaluateArg(0, sheet) != 0) {
+            return EvaluateArg(1, sheet);
+        }
+        return args_.size() > 2 ? EvaluateArg(2, sheet) : 0;
+    }
+
+    double EvaluateLogical(const SheetInterface& sheet, bool all) const {
+        evaluated_ = 0;
+        for (size_t i = 0; i < args_.size(); ++i) {
+            bool value = EvaluateArg(i, sheet) != 0;
+            if (value != all) {
+                return value;
+            }
+        }
+        return all;
+    }
+
+    double EvaluateMatch(const SheetInterface& sheet) const {
+        LookupKey key = args_[0]->EvaluateKey(sheet);
+        Range column = GetColumn(*args_[1]);
+        double type = args_.size() > 2 ? args_[2]->Evaluate(sheet) : 1;
+
+        LookupMatch match = LookupMatch::Exact;
+        if (type > 0) {
+            match = LookupMatch::ExactOrSmaller;
+        } else if (type < 0) {
+            match = LookupMatch::ExactOrLarger;
+        }
+
+        auto row = sheet.Lookup(key, column, match);
+        if (!row) {
+            throw FormulaError(FormulaError::Category::NotAvailable);
+        }
+        return *row - column.first.row + 1;
+    }
+
+    double EvaluateVLookup(const SheetInterface& sheet) const {
+        LookupKey key = args_[0]->EvaluateKey(sheet);
+        Range table = GetRange(*args_[1]);
+        double index = args_[2]->Evaluate(sheet);
+        if (index < 1) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        if (index >= table.GetSize().cols + 1) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        bool approximate = args_.size() <= 3 || args_[3]->Evaluate(sheet) != 0;
+
+        Range column{table.first, {table.last.row, table.first.col}};
+        auto row = sheet.Lookup(key, column, approximate ? LookupMatch::ExactOrSmaller : LookupMatch::Exact);
+        if (!row) {
+            throw FormulaError(FormulaError::Category::NotAvailable);
+        }
+        return ReadNumber(sheet, {*row, table.first.col + static_cast<int>(index) - 1});
+    }
+
+    double EvaluateXLookup(const SheetInterface& sheet) const {
+        LookupKey key = args_[0]->EvaluateKey(sheet);
+        Range column = GetColumn(*args_[1]);
+        Range results = GetColumn(*args_[2]);
+        if (!(results.GetSize() == column.GetSize())) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        double mode = args_.size() > 4 ? args_[4]->Evaluate(sheet) : 0;
+
+        LookupMatch match = LookupMatch::Exact;
+        if (mode == -1) {
+            match = LookupMatch::ExactOrSmaller;
+        } else if (mode == 1) {
+            match = LookupMatch::ExactOrLarger;
+        } else if (mode != 0) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+
+        auto row = sheet.Lookup(key, column, match);
+        if (!row) {
+            if (args_.size() > 3) {
+                return args_[3]->Evaluate(sheet);
+            }
+            throw FormulaError(FormulaError::Category::NotAvailable);
+        }
+        return ReadNumber(sheet, {results.first.row + *row - column.first.row, results.first.col});
+    }
+
+    bool IsRangeArg(size_t index) const {
+        switch (info_->function) {
+            case Function::Match:
+            case Function::VLookup:
+                return index == 1;
+            case Function::XLookup:
+                return index == 1 || index == 2;
+            default:
+                return false;
+        }
+    }
+
+    static Range GetRange(const Expr& arg) {
+        auto range = arg.GetRange();
+        if (!range) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        if (!range->IsValid()) {
+            throw FormulaError(FormulaError::Category::Ref);
+        }
+        return *range;
+    }
+
+    static Range GetColumn(const Expr& arg) {
+        Range range = GetRange(arg);
+        if (range.GetSize().cols != 1) {
+            throw FormulaError(FormulaError::Category::Value);
+        }
+        return range;
+    }
+
+    static double ReadNumber(const SheetInterface& sheet, Position pos) {
+        auto value = sheet.GetNumericValue(pos);
+        if (holds_alternative<double>(value)) {
+            return get<double>(value);
+        }
+        throw get<FormulaError>(value);
+    }
+};
+
 class ParseASTListener final : public FormulaBaseListener {
 public:
     unique_ptr<Expr> MoveRoot() {
@@ -330,6 +1032,18 @@ public:
         return move(cells_);
     }
 
+    forward_list<Range> MoveRanges() {
+        return move(ranges_);
+    }
+
+    unique_ptr<Position> MoveElement() {
+        return move(element_);
+    }
+
+    bool HasConditions() const {
+        return has_conditions_;
+    }
+
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
@@ -362,10 +1076,14 @@ public:
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
-        auto value_str = ctx->CELL()->getSymbol()->getText();
-        auto value = Position::FromString(value_str);
-        if (!value.IsValid()) {
-            throw FormulaException("Invalid position: " + value_str);
+        // #REF! is kept as an invalid position, exactly as a deleted reference
+        Position value = Position::NONE;
+        if (ctx->CELL()) {
+            auto value_str = ctx->CELL()->getSymbol()->getText();
+            value = Position::FromString(value_str);
+            if (!value.IsValid()) {
+                throw FormulaException("Invalid position: " + value_str);
+            }
         }
 
         cells_.push_front(value);
@@ -373,6 +1091,75 @@ public:
         args_.push_back(move(node));
     }
 
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        auto first_str = ctx->CELL(0)->getSymbol()->getText();
+        auto last_str = ctx->CELL(1)->getSymbol()->getText();
+        Position first = Position::FromString(first_str);
+        Position last = Position::FromString(last_str);
+        if (!first.IsValid() || !last.IsValid()) {
+            throw FormulaException("Invalid range: " + first_str + ":" + last_str);
+        }
+
+        // B5:A1 is the same range as A1:B5
+        ranges_.push_front({{min(first.row, last.row), min(first.col, last.col)},
+                            {max(first.row, last.row), max(first.col, last.col)}});
+        if (!element_) {
+            element_ = make_unique<Position>();
+        }
+        auto node = make_unique<RangeExpr>(&ranges_.front(), element_.get());
+        args_.push_back(move(node));
+    }
+
+    void exitCall(FormulaParser::CallContext* ctx) override {
+        auto name = ctx->NAME()->getSymbol()->getText();
+        const FunctionInfo* info = FindFunction(name);
+        if (!info) {
+            throw ParsingError("Unknown function: " + name);
+        }
+
+        size_t count = ctx->expr().size();
+        if (count < info->min_args || count > info->max_args) {
+            throw ParsingError("Wrong number of arguments: " + name);
+        }
+        assert(args_.size() >= count);
+
+        vector<unique_ptr<Expr>> call_args(make_move_iterator(args_.end() - count),
+                                           make_move_iterator(args_.end()));
+        args_.resize(args_.size() - count);
+
+        has_conditions_ = has_conditions_ || IsCondition(info->function);
+        auto node = make_unique<CallExpr>(info, move(call_args));
+        args_.push_back(move(node));
+    }
+
+    void exitComparison(FormulaParser::ComparisonContext* ctx) override {
+        assert(args_.size() >= 2);
+
+        auto rhs = move(args_.back());
+        args_.pop_back();
+
+        auto lhs = move(args_.back());
+
+        ComparisonExpr::Type type;
+        if (ctx->EQ()) {
+            type = ComparisonExpr::Equal;
+        } else if (ctx->NE()) {
+            type = ComparisonExpr::NotEqual;
+        } else if (ctx->LT()) {
+            type = ComparisonExpr::Less;
+        } else if (ctx->LE()) {
+            type = ComparisonExpr::LessOrEqual;
+        } else if (ctx->GT()) {
+            type = ComparisonExpr::Greater;
+        } else {
+            assert(ctx->GE() != nullptr);
+            type = ComparisonExpr::GreaterOrEqual;
+        }
+
+        auto node = make_unique<ComparisonExpr>(type, move(lhs), move(rhs));
+        args_.back() = move(node);
+    }
+
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
@@ -404,6 +1191,10 @@ public:
 private:
     vector<unique_ptr<Expr>> args_;
     forward_list<Position> cells_;
+    forward_list<Range> ranges_;
+    // the element offset shared by all RangeExpr nodes (see FormulaAST::ExecuteElement)
+    unique_ptr<Position> element_;
+    bool has_conditions_ = false;
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -440,7 +1231,9 @@ FormulaAST ParseFormulaAST(istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    bool has_conditions = listener.HasConditions();
+    return FormulaAST(listener.MoveRoot(), listener.MoveCells(), listener.MoveRanges(), has_conditions,
+                      listener.MoveElement());
 }
 
 FormulaAST ParseFormulaAST(const string& in_str) {
@@ -462,14 +1255,143 @@ void FormulaAST::PrintFormula(ostream& out) const {
     root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
 }
 
+bool FormulaAST::Compile(Position origin, FormulaProgram& program) const {
+    // a program has no sizes, so the operands of an array formula must agree
+    if (array_size_ && !uniform_array_) {
+        return false;
+    }
+    return root_expr_->Compile(origin, program);
+}
+
+size_t FormulaAST::GetMemoryUsage() const {
+    // a node of forward_list holds the next pointer and the value
+    size_t cells_count = distance(cells_.begin(), cells_.end());
+    size_t ranges_count = distance(ranges_.begin(), ranges_.end());
+    return root_expr_->GetMemoryUsage() + cells_count * (sizeof(void*) + sizeof(Position))
+           + ranges_count * (sizeof(void*) + sizeof(Range)) + (element_ ? sizeof(Position) : 0);
+}
+
 double FormulaAST::Execute(const SheetInterface& sheet) const {
+    if (element_) {
+        *element_ = {0, 0};
+    }
     return root_expr_->Evaluate(sheet);
 }
 
-FormulaAST::FormulaAST(unique_ptr<ASTImpl::Expr> root_expr, forward_list<Position> cells)
+double FormulaAST::ExecuteElement(const SheetInterface& sheet, int row, int col) const {
+    if (element_) {
+        *element_ = {row, col};
+    }
+    return root_expr_->Evaluate(sheet);
+}
+
+void FormulaAST::GetLiveCells(vector<Position>& cells) const {
+    cells.clear();
+    root_expr_->AddLiveCells(cells);
+    sort(cells.begin(), cells.end());
+    cells.erase(unique(cells.begin(), cells.end()), cells.end());
+}
+
+void FormulaAST::BindInputs(const FormulaInterface::InputResolver& resolve) {
+    root_expr_->BindInputs(resolve);
+}
+
+void FormulaAST::MoveReferences(const CellShift& shift) {
+    // CellExpr and RangeExpr nodes point into cells_ and ranges_, so they see
+    // the new positions; sort() relinks the list nodes without moving the positions
+    for (Position& cell : cells_) {
+        if (cell.IsValid()) {
+            cell = shift.Move(cell);
+        }
+    }
+    cells_.sort();
+
+    for (Range& range : ranges_) {
+        if (range.IsValid()) {
+            range = shift.Move(range);
+        }
+    }
+    UpdateArraySize();
+}
+
+FormulaAST FormulaAST::Translate(int rows, int cols) const {
+    return Copy(rows, cols, false);
+}
+
+FormulaAST FormulaAST::Clone() const {
+    return Copy(0, 0, true);
+}
+
+FormulaAST FormulaAST::Copy(int rows, int cols, bool in_place) const {
+    auto move_cell = [rows, cols](Position cell) {
+        if (!cell.IsValid()) {
+            return cell;
+        }
+        Position moved{cell.row + rows, cell.col + cols};
+        return moved.IsValid() ? moved : Position::NONE;
+    };
+
+    // the lists are filled in the order of the original, and the nodes of
+    // the copy are mapped onto their elements
+    ASTImpl::CopyContext context;
+    context.in_place = in_place;
+    forward_list<Position> cells;
+    auto cell_it = cells.before_begin();
+    for (const Position& cell : cells_) {
+        cell_it = cells.insert_after(cell_it, move_cell(cell));
+        context.cells.emplace(&cell, &*cell_it);
+    }
+
+    forward_list<Range> ranges;
+    auto range_it = ranges.before_begin();
+    for (const Range& range : ranges_) {
+        Range moved{move_cell(range.first), move_cell(range.last)};
+        // a range pushed partly off the sheet is #REF! as a whole
+        if (!moved.first.IsValid() || !moved.last.IsValid()) {
+            moved = Range::NONE;
+        }
+        range_it = ranges.insert_after(range_it, moved);
+        context.ranges.emplace(&range, &*range_it);
+    }
+
+    auto element = element_ ? make_unique<Position>() : nullptr;
+    context.element = element.get();
+    return FormulaAST(root_expr_->Copy(context), move(cells), move(ranges), has_conditions_, move(element));
+}
+
+void FormulaAST::UpdateArraySize() {
+    vector<const Range*> operands;
+    root_expr_->AddArrayOperands(operands);
+
+    // the result is as large as the largest operand; a deleted operand is
+    // #REF! in every element and adds nothing
+    array_size_.reset();
+    uniform_array_ = true;
+    for (const Range* range : operands) {
+        if (!range->IsValid()) {
+            uniform_array_ = false;
+            continue;
+        }
+        Size size = range->GetSize();
+        if (array_size_ && !(size == *array_size_)) {
+            uniform_array_ = false;
+        }
+        Size largest = array_size_.value_or(size);
+        array_size_ = Size{max(largest.rows, size.rows), max(largest.cols, size.cols)};
+    }
+}
+
+FormulaAST::FormulaAST(unique_ptr<ASTImpl::Expr> root_expr, forward_list<Position> cells,
+                       forward_list<Range> ranges, bool has_conditions, unique_ptr<Position> element)
     : root_expr_(move(root_expr))
-    , cells_(move(cells)) {
+    , cells_(move(cells))
+    , ranges_(move(ranges))
+    , element_(move(element))
+    , has_conditions_(has_conditions) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    UpdateArraySize();
 }
 
+FormulaAST::FormulaAST(FormulaAST&&) = default;
+FormulaAST& FormulaAST::operator=(FormulaAST&&) = default;
 FormulaAST::~FormulaAST() = default;
@@ -2,10 +2,14 @@
 
 #include "FormulaLexer.h"
 #include "common.h"
+#include "formula.h"
 
 #include <forward_list>
 #include <functional>
+#include <memory>
+#include <optional>
 #include <stdexcept>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
@@ -17,15 +21,46 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells);
-    FormulaAST(FormulaAST&&) = default;
-    FormulaAST& operator=(FormulaAST&&) = default;
+    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells,
+                        std::forward_list<Range> ranges = {}, bool has_conditions = false,
+                        std::unique_ptr<Position> element = nullptr);
+    FormulaAST(FormulaAST&&);
+    FormulaAST& operator=(FormulaAST&&);
     ~FormulaAST();
 
     double Execute(const SheetInterface& sheet) const;
+    // the element (row, col) of an array formula: every range operand reads
+    // its cell at that offset (see FormulaInterface::EvaluateElement)
+    double ExecuteElement(const SheetInterface& sheet, int row, int col) const;
+    // the size of the result of an array formula, nullopt for a scalar one
+    std::optional<Size> GetArraySize() const {
+        return array_size_;
+    }
+    // true if IF, AND or OR may skip some of the referenced cells
+    bool HasConditions() const {
+        return has_conditions_;
+    }
+    // the valid cells read by the last Execute(), sorted and unique;
+    // every referenced cell before the first one
+    void GetLiveCells(std::vector<Position>& cells) const;
+    // binds cell references to their inputs (see FormulaInterface::BindInputs)
+    void BindInputs(const FormulaInterface::InputResolver& resolve);
+    // rewrites the referenced positions in place (see FormulaInterface::MoveReferences)
+    void MoveReferences(const CellShift& shift);
+    // a copy of the formula moved by (rows, cols) with every reference moved
+    // the same way; references pushed off the sheet become #REF!
+    FormulaAST Translate(int rows, int cols) const;
+    // a copy that replaces the formula in place (see FormulaInterface::Clone):
+    // it keeps the bound inputs and the arguments the conditions evaluated
+    FormulaAST Clone() const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
     void PrintFormula(std::ostream& out) const;
+    // appends the postfix form of the formula located at origin;
+    // returns false if some node has no such form
+    bool Compile(Position origin, FormulaProgram& program) const;
+    // bytes taken by the AST nodes and the cell and range lists (not the object itself)
+    size_t GetMemoryUsage() const;
 
     std::forward_list<Position>& GetCells() {
         return cells_;
@@ -35,6 +70,10 @@ public:
         return cells_;
     }
 
+    const std::forward_list<Range>& GetRanges() const {
+        return ranges_;
+    }
+
 private:
     std::unique_ptr<ASTImpl::Expr> root_expr_;
 
@@ -42,6 +81,18 @@ private:
     // efficiently traversed without going through
     // the whole AST
     std::forward_list<Position> cells_;
+    // function arguments and array operands like A1:C10, stored the same way
+    std::forward_list<Range> ranges_;
+    // the offset of the array element being evaluated, shared by the range
+    // nodes; on the heap, so that it survives moving the AST
+    std::unique_ptr<Position> element_;
+    std::optional<Size> array_size_;
+    // all operands are valid and of the same size
+    bool uniform_array_ = true;
+    bool has_conditions_ = false;
+
+    void UpdateArraySize();
+    FormulaAST Copy(int rows, int cols, bool in_place) const;
 };
 
 FormulaAST ParseFormulaAST(std::istream& in);
@@ -1,197 +1,1391 @@
 #include "cell.h"
+#include "sheet.h"
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <type_traits>
 
 using namespace std;
+using namespace literals;
 
 class Cell::Impl {
 public:
-    virtual Value GetValue() const = 0;
-    virtual string GetText() const = 0;
+    Value GetValue() const;
+    string GetText() const;
+    virtual ValueView GetValueView() const = 0;
+    virtual string_view GetTextView() const = 0;
+    // значение без побочных эффектов; реализация должна иметь кэш
+    virtual ValueView PeekValueView() const;
     virtual vector<Position> GetReferencedCells() const;
+    virtual vector<Range> GetReferencedRanges() const;
+    virtual bool IsEmpty() const;
+    // Совпадают ли значения двух реализаций; обе должны иметь кэш
+    virtual bool HasSameValue(const Impl& other) const;
     virtual bool HasCache() const;   
     virtual void InvalidateCache();
+    // Пересчитывает значение, возвращает true, если оно изменилось
+    virtual bool Recalculate() const;
+    // Подтверждает, что устаревшее значение по-прежнему верно
+    virtual void ConfirmCache() const;
+    // Запоминает значение, вычисленное снаружи, возвращает true, если оно изменилось
+    virtual bool StoreValue(FormulaInterface::Value value) const;
+    virtual bool Compile(Position origin, FormulaProgram& program) const;
+    virtual void MoveReferences(const CellShift& shift) const;
+    // Вход, который формула при последнем вычислении не читала (ячейка из
+    // невыбранной ветви IF): пока её значение верно, оно от входа не зависит
+    virtual bool IsDeadInput(const Cell* input) const;
+    // Есть ли в формуле условия (IF, AND, OR), читающие не все её входы
+    virtual bool HasConditions() const;
+    virtual void AddMemoryUsage(MemoryUsage& usage) const = 0;
+
+    // Подкачка (Sheet::SetMemoryBudget): сколько памяти занимает содержимое
+    // ячейки и замена содержимого заглушкой PagedImpl. PageOut() дописывает
+    // содержимое в payload и возвращает заглушку или nullptr, если
+    // вытеснять нечего.
+    virtual size_t GetPayloadSize() const;
+    virtual unique_ptr<Impl> PageOut(string& payload) const;
+    virtual bool IsPaged() const;
+    virtual bool IsShared() const;
+
+    // Формулы-массивы: размер результата формулы (Cell::GetArraySize) и
+    // элемент массива другой формулы (SpillImpl)
+    virtual optional<Size> GetArraySize() const;
+    virtual bool IsSpill() const;
+
+    // Кэш значений формул (Sheet::SetResultCacheCapacity): формула ли это,
+    // было ли её значение вытеснено (зависимые ячейки могут хранить
+    // значения, вычисленные из него) и забывание слота при вытеснении
+    virtual bool IsFormula() const;
+    virtual bool IsEvicted() const;
+    virtual void DropResult() const;
+    // Копия формулы в новой памяти (Cell::Relocate) или nullptr, если
+    // размещать заново нечего
+    virtual unique_ptr<Impl> Relocate(vector<uint32_t>& slots) const;
+    // Копия формулы со сдвинутыми ссылками (Cell::TranslateFormula)
+    virtual unique_ptr<FormulaInterface> Translate(int rows, int cols) const;
     virtual ~Impl() = default;
 };
 
 class Cell::EmptyImpl : public Cell::Impl {
 public:
-    Value GetValue() const override {
-        return "";
+    ValueView GetValueView() const override {
+        return ""sv;
+    }
+
+    string_view GetTextView() const override {
+        return ""sv;
+    }
+
+    bool IsEmpty() const override {
+        return true;
     }
 
-    string GetText() const override {
-        return "";
+    void AddMemoryUsage(MemoryUsage& usage) const override {
+        usage.cells += sizeof(*this);
     }
 };
 
 class Cell::TextImpl : public Cell::Impl {
 public:
-    explicit TextImpl(string text) : text_(text) {}
+    explicit TextImpl(PooledString text) : text_(move(text)) {}
 
-    Value GetValue() const override {
-        if (!text_.empty() && text_[0] == '\'') {
-            return text_.substr(1);
+    ValueView GetValueView() const override {
+        return GetUnescapedView();
+    }
+
+    string_view GetTextView() const override {
+        return text_.View();
+    }
+
+    bool HasSameValue(const Impl& other) const override {
+        const auto* other_text = dynamic_cast<const TextImpl*>(&other);
+        if (!other_text) {
+            return Impl::HasSameValue(other);
         }
-        return text_;
+
+        // строки одного пула равны тогда и только тогда, когда равны дескрипторы;
+        // разный текст даёт одно значение, только если экранирован ("'abc" и "abc")
+        if (text_ == other_text->text_) {
+            return true;
+        }
+        return (IsEscaped() || other_text->IsEscaped()) && GetUnescapedView() == other_text->GetUnescapedView();
     }
 
-    string GetText() const override {
-        return text_;
+    void AddMemoryUsage(MemoryUsage& usage) const override {
+        // сам текст учитывается один раз, в пуле строк таблицы
+        usage.cells += sizeof(*this);
+    }
+
+    size_t GetPayloadSize() const override {
+        return text_.IsInline() ? 0 : text_.View().size();
     }
+
+    unique_ptr<Impl> PageOut(string& payload) const override;
 private:
-    string text_;
+    PooledString text_;
+
+    bool IsEscaped() const {
+        string_view text = text_.View();
+        return !text.empty() && text[0] == ESCAPE_SIGN;
+    }
+
+    string_view GetUnescapedView() const {
+        string_view text = text_.View();
+        if (IsEscaped()) {
+            text.remove_prefix(1);
+        }
+        return text;
+    }
 };
 
 class Cell::FormulaImpl : public Cell::Impl {
 public:
-    explicit FormulaImpl(string formula, SheetInterface& sheet) : formula_(ParseFormula(formula)), formula_sheet_(sheet) {}
+    FormulaImpl(unique_ptr<FormulaInterface> formula, const Cell& cell)
+        : formula_(move(formula)), sheet_(cell.sheet_), cell_(cell) {}
+
+    // отложенный разбор: хранится только текст выражения
+    FormulaImpl(string expression, const Cell& cell) : expression_(move(expression)), sheet_(cell.sheet_), cell_(cell) {}
 
-    Value GetValue() const override {
-        if (!cache_.has_value()) {
-            cache_ = formula_->Evaluate(formula_sheet_);
+    FormulaImpl(const FormulaImpl&) = delete;
+    FormulaImpl& operator=(const FormulaImpl&) = delete;
+
+    ~FormulaImpl() {
+        if (slot_ != ResultCache::NO_SLOT) {
+            sheet_.results_.Release(slot_);
         }
-        
-        if (holds_alternative<double>(cache_.value())) {
-            return get<double>(cache_.value());
+    }
+
+    ValueView GetValueView() const override {
+        if (slot_ == ResultCache::NO_SLOT) {
+            Recalculate();
+        }
+
+        const FormulaInterface::Value& value = sheet_.results_.Get(slot_);
+        if (holds_alternative<double>(value)) {
+            return get<double>(value);
         } else {
-            return get<FormulaError>(cache_.value());
+            return get<FormulaError>(value);
         }
     }
 
-    string GetText() const override {
-        return FORMULA_SIGN + formula_->GetExpression();
+    ValueView PeekValueView() const override {
+        const FormulaInterface::Value& value = sheet_.results_.Peek(slot_);
+        if (holds_alternative<double>(value)) {
+            return get<double>(value);
+        }
+        return get<FormulaError>(value);
+    }
+
+    // выражение собирается из дерева один раз и хранится до замены формулы
+    string_view GetTextView() const override {
+        if (text_.empty()) {
+            const FormulaInterface* formula = GetFormula();
+            text_ = FORMULA_SIGN + (formula ? formula->GetExpression() : expression_);
+        }
+        return text_;
     }
 
     vector<Position> GetReferencedCells() const override {
-        return formula_->GetReferencedCells();
+        const FormulaInterface* formula = GetFormula();
+        return formula ? formula->GetReferencedCells() : ScanFormulaReferences(expression_);
+    }
+
+    vector<Range> GetReferencedRanges() const override {
+        const FormulaInterface* formula = GetFormula();
+        return formula ? formula->GetReferencedRanges() : vector<Range>{};
     }
         
     bool HasCache() const override {
-        return cache_.has_value();
+        return slot_ != ResultCache::NO_SLOT && !stale_;
     }  
 
+    // значение не сбрасывается: после пересчёта с ним сравнивается новое
+    void InvalidateCache() override {
+        stale_ = true;
+        evicted_ = false;
+    }
+
+    // формула-массив вычисляет все элементы сразу и считается изменившейся,
+    // если изменился любой из них: элементы сверяются с ней, как со ссылкой
+    bool Recalculate() const override {
+        // время вычисления нужно кэшу значений, только когда из него вытесняют
+        bool measure = sheet_.results_.IsBounded();
+        auto start = measure ? chrono::steady_clock::now() : chrono::steady_clock::time_point{};
+
+        const FormulaInterface* formula = GetFormula();
+        BindInputs();
+        FormulaInterface::Value value = FormulaError(FormulaError::Category::Value);
+        bool array_changed = false;
+        if (formula && formula->GetArraySize()) {
+            value = sheet_.EvaluateArray(cell_, *formula, array_changed);
+        } else if (formula) {
+            value = formula->Evaluate(sheet_);
+        }
+        UpdateDeadInputs(formula);
+
+        auto cost = measure ? chrono::steady_clock::now() - start : chrono::nanoseconds{0};
+        bool changed = Store(value, chrono::duration_cast<chrono::nanoseconds>(cost));
+        return changed || array_changed;
+    }
+
+    bool StoreValue(FormulaInterface::Value value) const override {
+        return Store(value, chrono::nanoseconds{0});
+    }
+
+    void ConfirmCache() const override {
+        stale_ = false;
+    }
+
+    bool Compile(Position origin, FormulaProgram& program) const override {
+        const FormulaInterface* formula = GetFormula();
+        return formula && formula->Compile(origin, program);
+    }
+
+    // Неразобранное выражение сначала разбирается; синтаксически
+    // некорректное остаётся как есть - оно всё равно вычисляется в #VALUE!
+    // Входы формулы меняются, поэтому все они снова считаются прочитанными
+    // до её следующего вычисления
+    void MoveReferences(const CellShift& shift) const override {
+        GetFormula();
+        if (formula_) {
+            formula_->MoveReferences(shift);
+            string().swap(text_);
+        }
+        vector<const Cell*>().swap(dead_inputs_);
+    }
+
+    bool IsDeadInput(const Cell* input) const override {
+        return !dead_inputs_.empty() && binary_search(dead_inputs_.begin(), dead_inputs_.end(), input);
+    }
+
+    // неразобранная формула считается безусловной: разбирать её ради этого незачем
+    bool HasConditions() const override {
+        return formula_ && formula_->HasConditions();
+    }
+
+    // формула без областей массивом не бывает, поэтому её не разбирают
+    optional<Size> GetArraySize() const override {
+        if (!formula_ && expression_.find(':') == string::npos) {
+            return nullopt;
+        }
+        const FormulaInterface* formula = GetFormula();
+        return formula ? formula->GetArraySize() : nullopt;
+    }
+
+    void AddMemoryUsage(MemoryUsage& usage) const override {
+        // само значение учитывается в кэше значений таблицы
+        usage.cells += sizeof(*this);
+        usage.formulas += GetHeapSize(expression_) + GetHeapSize(text_);
+        usage.dependencies += dead_inputs_.capacity() * sizeof(const Cell*);
+        if (formula_) {
+            usage.formulas += formula_->GetMemoryUsage();
+        }
+    }
+
+    size_t GetPayloadSize() const override {
+        size_t size = GetHeapSize(expression_) + GetHeapSize(text_);
+        return formula_ ? size + formula_->GetMemoryUsage() : size;
+    }
+
+    unique_ptr<Impl> PageOut(string& payload) const override;
+
+    bool IsFormula() const override {
+        return true;
+    }
+
+    bool IsEvicted() const override {
+        return evicted_;
+    }
+
+    void DropResult() const override {
+        slot_ = ResultCache::NO_SLOT;
+        stale_ = false;
+        evicted_ = true;
+    }
+
+    // Дерево копируется без разбора (FormulaInterface::Clone): узлы копии
+    // выделяются вслед за узлами предыдущей копии, а привязанные ссылки и
+    // ветви условий остаются прежними. Неразобранное выражение так и
+    // остаётся текстом.
+    unique_ptr<Impl> Relocate(vector<uint32_t>& slots) const override {
+        auto copy = formula_ ? make_unique<FormulaImpl>(formula_->Clone(), cell_)
+                             : make_unique<FormulaImpl>(expression_, cell_);
+        copy->bound_ = bound_;
+        copy->text_ = text_;
+        copy->stale_ = stale_;
+        copy->evicted_ = evicted_;
+        copy->dead_inputs_ = dead_inputs_;
+        if (slot_ != ResultCache::NO_SLOT) {
+            copy->slot_ = static_cast<uint32_t>(slots.size());
+            slots.push_back(exchange(slot_, ResultCache::NO_SLOT));
+        }
+        return copy;
+    }
+
+    // синтаксически некорректная формула (отложенный разбор) копируется текстом
+    unique_ptr<FormulaInterface> Translate(int rows, int cols) const override {
+        const FormulaInterface* formula = GetFormula();
+        return formula ? formula->Translate(rows, cols) : nullptr;
+    }
+
+    // значение формулы, которую заменила эта: пересчёт сравнит с ним свой
+    // результат, и при совпадении зависимые ячейки не будут пересчитаны
+    void SetPreviousValue(FormulaInterface::Value value) {
+        Store(value, chrono::nanoseconds{0});
+        stale_ = true;
+    }
+
+    // значение, сохранённое заглушкой на время вытеснения формулы
+    void RestoreCache(optional<FormulaInterface::Value> cache, bool stale, bool evicted) {
+        if (cache) {
+            Store(*cache, chrono::nanoseconds{0});
+        }
+        stale_ = stale;
+        evicted_ = evicted;
+    }
+private:
+    // текст выражения хранится до первого обращения к формуле, а если разобрать
+    // её не удалось - остаётся для GetText()
+    mutable string expression_;
+    mutable unique_ptr<FormulaInterface> formula_;
+    // разбор уже не удался: повторять его при каждом чтении незачем
+    mutable bool parse_failed_ = false;
+    mutable string text_;
+    Sheet& sheet_;
+    const Cell& cell_;
+    // слот значения в кэше значений таблицы (Sheet::results_)
+    mutable uint32_t slot_ = ResultCache::NO_SLOT;
+    mutable bool stale_ = false;
+    mutable bool evicted_ = false;
+    mutable bool bound_ = false;
+    // входы, не прочитанные последним вычислением, по возрастанию адресов;
+    // пусто у формул без условий
+    mutable vector<const Cell*> dead_inputs_;
+
+    void UpdateDeadInputs(const FormulaInterface* formula) const {
+        dead_inputs_.clear();
+        if (!formula || !formula->HasConditions()) {
+            return;
+        }
+
+        vector<Position> live = formula->GetLiveReferences();
+        for (Position pos : formula->GetReferencedCells()) {
+            if (binary_search(live.begin(), live.end(), pos)) {
+                continue;
+            }
+            if (const Cell* input = sheet_.FindCell(pos)) {
+                dead_inputs_.push_back(input);
+            }
+        }
+        sort(dead_inputs_.begin(), dead_inputs_.end());
+    }
+
+    // Ссылки привязываются к ячейкам перед первым вычислением: к этому
+    // времени Cell::UpdateDependencies создал все ячейки, на которые ссылается
+    // формула (хотя бы пустыми заглушками), а удаляются они, только когда
+    // ссылок на них не остаётся, - то есть вместе с этой формулой.
+    void BindInputs() const {
+        if (!bound_ && formula_) {
+            formula_->BindInputs([this](Position pos) -> const FormulaInput* {
+                return sheet_.FindCell(pos);
+            });
+            bound_ = true;
+        }
+    }
+
+    bool Store(const FormulaInterface::Value& value, chrono::nanoseconds cost) const {
+        bool changed = slot_ == ResultCache::NO_SLOT || !(sheet_.results_.Get(slot_) == value);
+        if (slot_ == ResultCache::NO_SLOT && evicted_) {
+            sheet_.results_.CountRecomputation(cost);
+        }
+        slot_ = sheet_.results_.Store(slot_, value, &cell_, cost);
+        stale_ = false;
+        evicted_ = false;
+        return changed;
+    }
+
+    const FormulaInterface* GetFormula() const {
+        if (!formula_ && !parse_failed_ && !expression_.empty()) {
+            try {
+                formula_ = ParseFormula(expression_);
+                string().swap(expression_);
+            } catch (const FormulaException&) {
+                parse_failed_ = true;
+            }
+        }
+        return formula_.get();
+    }
+};
+
+// Заглушка ячейки, содержимое которой вытеснено в файл подкачки. Значение
+// формулы остаётся в памяти: зависимые ячейки читают его и сбрасывают, не
+// загружая формулу. Всё остальное Cell делает только после загрузки
+// содержимого обратно (Cell::Resident).
+class Cell::PagedImpl : public Cell::Impl {
+public:
+    // text - вытеснен текст, иначе формула со значением cache
+    PagedImpl(bool text, optional<FormulaInterface::Value> cache, bool stale, bool evicted)
+        : text_(text), cache_(cache), stale_(stale), evicted_(evicted) {}
+
+    ValueView GetValueView() const override {
+        if (text_ || !cache_) {
+            return ""sv;
+        }
+        if (holds_alternative<double>(*cache_)) {
+            return get<double>(*cache_);
+        }
+        return get<FormulaError>(*cache_);
+    }
+
+    string_view GetTextView() const override {
+        return ""sv;
+    }
+
+    bool HasCache() const override {
+        return text_ || (cache_ && !stale_);
+    }
+
+    void InvalidateCache() override {
+        stale_ = !text_;
+        evicted_ = false;
+    }
+
+    void ConfirmCache() const override {
+        stale_ = false;
+    }
+
+    void AddMemoryUsage(MemoryUsage& usage) const override {
+        usage.cells += sizeof(*this) - sizeof(cache_);
+        usage.cached_values += sizeof(cache_);
+    }
+
+    bool IsPaged() const override {
+        return true;
+    }
+
+    bool IsFormula() const override {
+        return !text_;
+    }
+
+    bool IsEvicted() const override {
+        return evicted_;
+    }
+
+    // значение доступно без загрузки содержимого
+    bool HasValue() const {
+        return !text_ && cache_;
+    }
+
+    unique_ptr<Impl> Restore(string_view payload, const Cell& cell) const;
+private:
+    bool text_;
+    optional<FormulaInterface::Value> cache_;
+    mutable bool stale_;
+    bool evicted_;
+};
+
+// Ячейка ветки таблицы (Sheet::Fork), которая ещё совпадает с ячейкой
+// родителя: значение читается у ячейки родителя без вычислений, а текст и
+// ссылки - под блокировкой родителя, потому что формула родителя собирает
+// их при первом обращении. Родитель, пока у него есть ветки, не меняется,
+// поэтому значение представителя всегда верно.
+class Cell::SharedImpl : public Cell::Impl {
+public:
+    explicit SharedImpl(const Cell& source) : source_(source) {}
+
+    ValueView GetValueView() const override {
+        return source_.PeekValue();
+    }
+
+    string_view GetTextView() const override {
+        if (!text_) {
+            text_ = source_.sheet_.GetSharedText(source_);
+        }
+        return *text_;
+    }
+
+    vector<Position> GetReferencedCells() const override {
+        return source_.sheet_.GetSharedReferences(source_);
+    }
+
+    bool IsShared() const override {
+        return true;
+    }
+
+    void AddMemoryUsage(MemoryUsage& usage) const override {
+        usage.cells += sizeof(*this);
+        if (text_) {
+            usage.formulas += GetHeapSize(*text_);
+        }
+    }
+
+private:
+    const Cell& source_;
+    mutable optional<string> text_;
+};
+
+// Элемент результата формулы-массива (Sheet::UpdateArray) в ячейке, которая
+// без него была бы пустой. Своего текста и ссылок нет; значение читается из
+// результата формулы anchor, от которой ячейка зависит, как от ссылки.
+// Прочитанное значение верно, пока массив не вычислен заново: номер его
+// вычисления (epoch) сверяется при каждой проверке кэша.
+class Cell::SpillImpl : public Cell::Impl {
+public:
+    SpillImpl(const Cell& anchor, const Cell& cell) : anchor_(anchor), cell_(cell) {}
+
+    ValueView GetValueView() const override {
+        if (!value_) {
+            Recalculate();
+        }
+        if (holds_alternative<double>(*value_)) {
+            return get<double>(*value_);
+        }
+        return get<FormulaError>(*value_);
+    }
+
+    string_view GetTextView() const override {
+        return ""sv;
+    }
+
+    bool HasCache() const override {
+        return value_ && !stale_ && epoch_ == cell_.sheet_.GetArrayEpoch(anchor_);
+    }
+
     void InvalidateCache() override {
-        cache_.reset();
+        stale_ = true;
+    }
+
+    bool Recalculate() const override {
+        FormulaInterface::Value value = cell_.sheet_.GetArrayElement(anchor_, cell_.pos_);
+        bool changed = !value_ || !(*value_ == value);
+        value_ = value;
+        epoch_ = cell_.sheet_.GetArrayEpoch(anchor_);
+        stale_ = false;
+        return changed;
+    }
+
+    void ConfirmCache() const override {
+        // массив вычислен заново с теми же значениями
+        epoch_ = cell_.sheet_.GetArrayEpoch(anchor_);
+        stale_ = false;
+    }
+
+    bool IsSpill() const override {
+        return true;
     }
+
+    void AddMemoryUsage(MemoryUsage& usage) const override {
+        usage.cells += sizeof(*this) - sizeof(value_);
+        usage.cached_values += sizeof(value_);
+    }
+
 private:
-    unique_ptr<FormulaInterface> formula_;
-    const SheetInterface& formula_sheet_;
-    mutable optional<FormulaInterface::Value> cache_;
+    const Cell& anchor_;
+    const Cell& cell_;
+    mutable optional<FormulaInterface::Value> value_;
+    mutable uint64_t epoch_ = 0;
+    mutable bool stale_ = false;
 };
 
+// В payload первый байт - вид содержимого, дальше текст ячейки или выражение
+namespace {
+const char PAYLOAD_TEXT = 'T';
+const char PAYLOAD_FORMULA = 'F';
+}  // namespace
+
+unique_ptr<Cell::Impl> Cell::TextImpl::PageOut(string& payload) const {
+    payload += PAYLOAD_TEXT;
+    payload += text_.View();
+    return make_unique<PagedImpl>(true, nullopt, false, false);
+}
+
+unique_ptr<Cell::Impl> Cell::FormulaImpl::PageOut(string& payload) const {
+    // неразобранное (в том числе некорректное) выражение сохраняется как есть
+    payload += PAYLOAD_FORMULA;
+    payload += formula_ ? formula_->GetExpression() : expression_;
+    optional<FormulaInterface::Value> cache;
+    if (slot_ != ResultCache::NO_SLOT) {
+        cache = sheet_.results_.Get(slot_);
+    }
+    return make_unique<PagedImpl>(false, cache, stale_, evicted_);
+}
+
+unique_ptr<Cell::Impl> Cell::PagedImpl::Restore(string_view payload, const Cell& cell) const {
+    if (payload.empty() || (payload[0] != PAYLOAD_TEXT && payload[0] != PAYLOAD_FORMULA)) {
+        throw SpillFileException("Malformed spilled cell");
+    }
+
+    if (payload[0] == PAYLOAD_TEXT) {
+        return make_unique<TextImpl>(cell.sheet_.string_pool_.Intern(payload.substr(1)));
+    }
+    // формула разбирается заново, когда понадобится (как при отложенном разборе)
+    auto formula = make_unique<FormulaImpl>(string(payload.substr(1)), cell);
+    formula->RestoreCache(cache_, stale_, evicted_);
+    return formula;
+}
+
+Cell::Value Cell::Impl::GetValue() const {
+    return visit([](auto value) -> Value {
+        if constexpr (is_same_v<decltype(value), string_view>) {
+            return string(value);
+        } else {
+            return value;
+        }
+    }, GetValueView());
+}
+
+string Cell::Impl::GetText() const {
+    return string(GetTextView());
+}
+
+Cell::ValueView Cell::Impl::PeekValueView() const {
+    return GetValueView();
+}
+
 vector<Position> Cell::Impl::GetReferencedCells() const {
     return {};
 }
 
+vector<Range> Cell::Impl::GetReferencedRanges() const {
+    return {};
+}
+
+bool Cell::Impl::IsEmpty() const {
+    return false;
+}
+
+bool Cell::Impl::HasSameValue(const Impl& other) const {
+    return GetValueView() == other.GetValueView();
+}
+
 bool Cell::Impl::HasCache() const {
     return true;
 }
 
 void Cell::Impl::InvalidateCache() {}
 
-Cell::Cell(SheetInterface& sheet) : impl_(make_unique<EmptyImpl>()), sheet_(sheet) {}
+bool Cell::Impl::Recalculate() const {
+    return false;
+}
+
+void Cell::Impl::ConfirmCache() const {}
+
+bool Cell::Impl::StoreValue(FormulaInterface::Value) const {
+    return false;
+}
+
+bool Cell::Impl::Compile(Position, FormulaProgram&) const {
+    return false;
+}
+
+void Cell::Impl::MoveReferences(const CellShift&) const {}
+
+bool Cell::Impl::IsDeadInput(const Cell*) const {
+    return false;
+}
+
+bool Cell::Impl::HasConditions() const {
+    return false;
+}
+
+size_t Cell::Impl::GetPayloadSize() const {
+    return 0;
+}
+
+unique_ptr<Cell::Impl> Cell::Impl::PageOut(string&) const {
+    return nullptr;
+}
+
+bool Cell::Impl::IsPaged() const {
+    return false;
+}
+
+bool Cell::Impl::IsShared() const {
+    return false;
+}
+
+optional<Size> Cell::Impl::GetArraySize() const {
+    return nullopt;
+}
+
+bool Cell::Impl::IsSpill() const {
+    return false;
+}
+
+bool Cell::Impl::IsFormula() const {
+    return false;
+}
+
+bool Cell::Impl::IsEvicted() const {
+    return false;
+}
+
+void Cell::Impl::DropResult() const {}
+
+unique_ptr<Cell::Impl> Cell::Impl::Relocate(vector<uint32_t>&) const {
+    return nullptr;
+}
+
+unique_ptr<FormulaInterface> Cell::Impl::Translate(int, int) const {
+    return nullptr;
+}
+
+Cell::Cell(Sheet& sheet, Position pos)
+    : impl_(make_unique<EmptyImpl>())
+    , sheet_(sheet)
+    , pos_(pos)
+    , referenced_cells_(CellSet::allocator_type(&sheet.dependencies_memory_))
+    , dependent_cells_(CellSet::allocator_type(&sheet.dependencies_memory_)) {
+}
 
 Cell::~Cell() = default;
 
-void Cell::Set(string text) {
+void Cell::Set(string text, bool lazy_parsing) {
+    vector<Position> referensed_cells_pos;
+    vector<Range> ranges;
+    optional<Range> area;
+    Resident();
+
+    auto impl = MakeImpl(move(text), lazy_parsing, referensed_cells_pos, ranges, area);
+    Install(move(impl), referensed_cells_pos, move(ranges), area);
+}
+
+void Cell::Load(string text, vector<Position>& referenced_cells_pos, vector<Range>& ranges) {
+    optional<Range> area;
+    impl_ = MakeImpl(move(text), true, referenced_cells_pos, ranges, area);
+
+    if (!impl_->IsFormula()) {
+        changed_at_ = sheet_.NextRevision();
+        sheet_.StoreNumericValue(pos_, impl_->GetValueView());
+    } else {
+        sheet_.MarkStale(pos_);
+    }
+    if (sheet_.memory_budget_) {
+        sheet_.UpdatePayloadSize(pos_, 0, impl_->GetPayloadSize());
+    }
+}
+
+void Cell::Link(vector<Position>& referenced_cells_pos, vector<Range> ranges) {
+    UpdateDependencies(referenced_cells_pos);
+    sheet_.range_dependencies_.Set(this, move(ranges));
+}
+
+unique_ptr<Cell::Impl> Cell::MakeImpl(string text, bool lazy_parsing, vector<Position>& referensed_cells_pos,
+                                      vector<Range>& ranges, optional<Range>& area) {
     if (text.empty()) {
-        impl_ = make_unique<EmptyImpl>();
-    } else if (text[0] == ESCAPE_SIGN) {
-        impl_ = make_unique<TextImpl>(text);
-    } else if (text[0] == FORMULA_SIGN && text.size() > 1) {
-        const Impl& formula = FormulaImpl(text.substr(1), sheet_);
-        auto referensed_cells_pos = formula.GetReferencedCells();
-
-        if (!referensed_cells_pos.empty()) {
-            if (CheckCircularDependencies(referensed_cells_pos)) {
+        return make_unique<EmptyImpl>();
+    }
+    // экранированный текст тоже просто текст
+    if (text[0] != FORMULA_SIGN || text.size() == 1) {
+        return make_unique<TextImpl>(sheet_.string_pool_.Intern(text));
+    }
+    string expression = text.substr(1);
+
+    // области (A1:C10) из текста без разбора не извлечь, поэтому
+    // формула с ними разбирается сразу
+    if (lazy_parsing && expression.find(':') == string::npos) {
+        referensed_cells_pos = ScanFormulaReferences(expression);
+        return make_unique<FormulaImpl>(move(expression), *this);
+    }
+    auto formula = ParseFormula(expression);
+    referensed_cells_pos = formula->GetReferencedCells();
+    ranges = formula->GetReferencedRanges();
+    if (auto size = formula->GetArraySize()) {
+        area = Sheet::GetArrayArea(pos_, *size);
+    }
+    return make_unique<FormulaImpl>(move(formula), *this);
+}
+
+void Cell::SetFormula(unique_ptr<FormulaInterface> formula) {
+    Resident();
+    vector<Position> referenced_cells_pos = formula->GetReferencedCells();
+    vector<Range> ranges = formula->GetReferencedRanges();
+    optional<Range> area;
+    if (auto size = formula->GetArraySize()) {
+        area = Sheet::GetArrayArea(pos_, *size);
+    }
+    Install(make_unique<FormulaImpl>(move(formula), *this), referenced_cells_pos, move(ranges), area);
+}
+
+void Cell::Install(unique_ptr<Impl> impl, vector<Position>& referensed_cells_pos, vector<Range> ranges,
+                   const optional<Range>& area, bool invalidate) {
+    bool had_value = impl_->HasCache();
+    size_t old_payload_size = sheet_.memory_budget_ ? impl_->GetPayloadSize() : 0;
+    bool is_formula = impl->IsFormula();
+
+    if (is_formula) {
+        // при восстановлении из журнала формулы уже были проверены
+        if (!sheet_.replaying_ && (!referensed_cells_pos.empty() || !ranges.empty())) {
+            if (CheckCircularDependencies(referensed_cells_pos, ranges, area)) {
                 throw CircularDependencyException("Circular dependency detected");
             }
         }
 
+        if (had_value) {
+            auto& formula_impl = static_cast<FormulaImpl&>(*impl);
+            Value old_value = impl_->GetValue();
+            if (holds_alternative<double>(old_value)) {
+                formula_impl.SetPreviousValue(get<double>(old_value));
+            } else if (holds_alternative<FormulaError>(old_value)) {
+                formula_impl.SetPreviousValue(get<FormulaError>(old_value));
+            }
+        }
+    }
+
+    // Ранняя отсечка: если текст заменён на равное значение, зависимым ячейкам
+    // пересчитываться незачем. Новая формула помечается устаревшей, а решение
+    // о смене значения принимается при её первом вычислении.
+    bool value_changed = is_formula || !had_value || !impl->HasSameValue(*impl_);
+    if (value_changed && invalidate) {
         InvalidateCache();
-        UpdateDependencies(referensed_cells_pos);
+    }
+    UpdateDependencies(referensed_cells_pos);
+    sheet_.range_dependencies_.Set(this, move(ranges));
 
-        impl_ = make_unique<FormulaImpl>(text.substr(1), sheet_);
+    impl_ = move(impl);
+
+    if (is_formula) {
+        verified_at_ = 0;
+        sheet_.ResetNumericValue(pos_);
+        sheet_.MarkStale(pos_);
     } else {
-        impl_ = make_unique<TextImpl>(text);
+        if (value_changed) {
+            changed_at_ = sheet_.NextRevision();
+        }
+        sheet_.StoreNumericValue(pos_, impl_->GetValueView());
+    }
+
+    if (sheet_.memory_budget_) {
+        sheet_.UpdatePayloadSize(pos_, old_payload_size, impl_->GetPayloadSize());
     }
 }
 
-void Cell::Clear() {
-    Set("");
+void Cell::Clear(bool invalidate) {
+    Resident();
+    vector<Position> no_references;
+    Install(make_unique<EmptyImpl>(), no_references, {}, nullopt, invalidate);
 }
 
 Cell::Value Cell::GetValue() const {
+    sheet_.RecordOperation(TraceOp::GetValue, pos_);
+    ReadValue();
     return impl_->GetValue();
 }
 
 string Cell::GetText() const {
-    return impl_->GetText();
+    return Resident().GetText();
+}
+
+Cell::ValueView Cell::GetValueView() const {
+    sheet_.RecordOperation(TraceOp::GetValue, pos_);
+    return ReadValue();
+}
+
+Cell::ValueView Cell::ReadValue() const {
+    bool hit = impl_->HasCache();
+    if (!hit) {
+        Refresh();
+    }
+    const Impl& impl = Resident(true);
+    if (impl.IsFormula()) {
+        sheet_.results_.CountRead(hit);
+    }
+    return impl.GetValueView();
+}
+
+string_view Cell::GetTextView() const {
+    return Resident().GetTextView();
 }
 
 vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    return Resident().GetReferencedCells();
+}
+
+bool Cell::Compile(FormulaProgram& program) const {
+    return Resident().Compile(pos_, program);
+}
+
+void Cell::SetComputedValue(FormulaInterface::Value value) const {
+    if (impl_->StoreValue(value)) {
+        changed_at_ = sheet_.NextRevision();
+    }
+    verified_at_ = sheet_.GetRevision();
+    sheet_.StoreNumericValue(pos_, impl_->GetValueView());
+}
+
+size_t Cell::GetPayloadSize() const {
+    return impl_->GetPayloadSize();
+}
+
+bool Cell::PageOut(string& payload) {
+    if (impl_->IsPaged()) {
+        return false;
+    }
+    if (auto paged = impl_->PageOut(payload)) {
+        impl_ = move(paged);
+        return true;
+    }
+    return false;
+}
+
+void Cell::PageIn(string_view payload) {
+    const auto& paged = dynamic_cast<const PagedImpl&>(*impl_);
+    impl_ = paged.Restore(payload, *this);
+}
+
+bool Cell::IsPagedOut() const {
+    return impl_->IsPaged();
+}
+
+variant<double, FormulaError> Cell::GetNumericValue() const {
+    return sheet_.ReadNumericValue(pos_, this);
+}
+
+Cell::ValueView Cell::PeekValue() const {
+    return impl_->PeekValueView();
+}
+
+void Cell::ShareFrom(const Cell& source) {
+    impl_ = make_unique<SharedImpl>(source);
+    sheet_.StoreNumericValue(pos_, impl_->GetValueView());
+}
+
+bool Cell::IsShared() const {
+    return impl_->IsShared();
+}
+
+optional<Size> Cell::GetArraySize() const {
+    return Resident().GetArraySize();
+}
+
+bool Cell::CanSpill(const Range& area) {
+    const Impl& impl = Resident();
+    return !CheckCircularDependencies(impl.GetReferencedCells(), impl.GetReferencedRanges(), area);
+}
+
+void Cell::SpillFrom(Cell* anchor) {
+    // формулы, читавшие пустую ячейку, увидят элемент массива
+    InvalidateCache();
+    impl_ = make_unique<SpillImpl>(*anchor, *this);
+    referenced_cells_.insert(anchor);
+    anchor->dependent_cells_.insert(this);
+    verified_at_ = 0;
+    sheet_.ResetNumericValue(pos_);
+}
+
+void Cell::ReleaseSpill() {
+    InvalidateCache();
+    for (Cell* anchor : referenced_cells_) {
+        anchor->dependent_cells_.erase(this);
+    }
+    referenced_cells_.clear();
+    impl_ = make_unique<EmptyImpl>();
+    changed_at_ = sheet_.NextRevision();
+    sheet_.StoreNumericValue(pos_, ""sv);
+}
+
+bool Cell::IsSpill() const {
+    return impl_->IsSpill();
+}
+
+unique_ptr<FormulaInterface> Cell::TranslateFormula(int rows, int cols) const {
+    return Resident().Translate(rows, cols);
+}
+
+void Cell::Relocate(vector<uint32_t>& slots) {
+    if (auto impl = impl_->Relocate(slots)) {
+        impl_ = move(impl);
+    }
+}
+
+void Cell::EvictResult() const {
+    // прежнее значение нужно отслеживанию изменений, чтобы сравнить его с пересчитанным
+    sheet_.RecordValueChange(pos_, impl_->GetValue());
+    impl_->DropResult();
+    verified_at_ = 0;
+    // значение не изменилось, поэтому индексы функций поиска (Sheet::Lookup)
+    // его не забывают
+    sheet_.numeric_columns_.Reset(pos_);
+    sheet_.MarkStale(pos_);
+}
+
+const Cell::Impl& Cell::Resident(bool value_only) const {
+    if (impl_->IsPaged() && !(value_only && static_cast<const PagedImpl&>(*impl_).HasValue())) {
+        sheet_.FaultIn(pos_);
+    }
+    return *impl_;
+}
+
+void Cell::AddMemoryUsage(MemoryUsage& usage) const {
+    usage.cells += sizeof(*this);
+    impl_->AddMemoryUsage(usage);
+}
+
+Position Cell::GetPosition() const {
+    return pos_;
+}
+
+void Cell::MoveTo(Position pos) {
+    // прежнюю позицию в хранилище чисел освобождает таблица: её может уже
+    // занимать другая перенесённая ячейка
+    pos_ = pos;
+    if (impl_->HasCache()) {
+        sheet_.StoreNumericValue(pos_, impl_->GetValueView());
+    } else {
+        sheet_.MarkStale(pos_);
+    }
+}
+
+bool Cell::MoveReferences(const CellShift& shift) {
+    const Impl& impl = Resident();
+    impl.MoveReferences(shift);
+
+    const vector<Range>& old_ranges = sheet_.range_dependencies_.Get(this);
+    if (old_ranges.empty()) {
+        return false;
+    }
+    vector<Range> ranges = impl.GetReferencedRanges();
+    bool changed = ranges != old_ranges;
+    sheet_.range_dependencies_.Set(this, move(ranges));
+    return changed;
+}
+
+void Cell::ForceRecalculation() {
+    InvalidateCache();
+    verified_at_ = 0;
+}
+
+vector<Cell*> Cell::Detach() {
+    InvalidateCache();
+    sheet_.range_dependencies_.Set(this, {});
+    // ссылка формулы на удалённую ячейку становится #REF!: такие формулы
+    // вычисляются заново, даже если остальные их входы не менялись
+    for (Cell* dependent : dependent_cells_) {
+        dependent->referenced_cells_.erase(this);
+        dependent->verified_at_ = 0;
+    }
+    dependent_cells_.clear();
+
+    vector<Cell*> referenced(referenced_cells_.begin(), referenced_cells_.end());
+    for (Cell* ref_cell : referenced) {
+        ref_cell->dependent_cells_.erase(this);
+    }
+    referenced_cells_.clear();
+    return referenced;
+}
+
+void Cell::AddDependentsTo(unordered_set<Cell*>& cells) const {
+    cells.insert(dependent_cells_.begin(), dependent_cells_.end());
 }
 
 bool Cell::IsReferenced() const {
     return !dependent_cells_.empty();
 }
 
+bool Cell::IsPlaceholder() const {
+    return !IsReferenced() && IsEmpty();
+}
+
+bool Cell::IsEmpty() const {
+    return impl_->IsEmpty();
+}
+
+void Cell::CompactDependencies() {
+    referenced_cells_.rehash(0);
+    dependent_cells_.rehash(0);
+}
+
 bool Cell::HasCache() const {
     return impl_->HasCache();
 }
 
 void Cell::InvalidateCache() {
-    if (impl_->HasCache()) {
-        impl_->InvalidateCache();
-
-        for (auto cell : dependent_cells_) {
-            cell->InvalidateCache();
-        }
-    } 
+    InvalidateCaches({ this });
 }
 
-bool Cell::CheckCircularDependencies(const vector<Position>& refs) {
-    for (auto& pos : refs) {
-        const Cell* cell_ptr = dynamic_cast<const Cell*>(sheet_.GetCell(pos));
+void Cell::InvalidateCaches(vector<Cell*> cells) {
+    if (cells.empty()) {
+        return;
+    }
+    Sheet& sheet = cells.front()->sheet_;
+    // обход зависимых ячеек идёт по явному стеку: цепочки зависимостей бывают
+    // глубиной в сотни тысяч ячеек, и рекурсия переполнила бы стек потока
+    vector<Cell*> stack = move(cells);
 
-        if (!cell_ptr) {
+    while (!stack.empty()) {
+        Cell* cell = stack.back();
+        stack.pop_back();
+
+        // у формулы с вытесненным значением зависимые могут хранить значения,
+        // вычисленные из него; её прежнее значение уже записано при вытеснении
+        bool evicted = cell->impl_->IsEvicted();
+        if (!cell->impl_->HasCache() && !evicted) {
             continue;
         }
 
-        vector<const Cell*> stack;
-        stack.push_back(cell_ptr);
+        if (!evicted) {
+            sheet.RecordValueChange(cell->pos_, cell->impl_->GetValue());
+        }
+        cell->impl_->InvalidateCache();
+        if (!cell->impl_->HasCache()) {
+            sheet.ResetNumericValue(cell->pos_);
+            sheet.MarkStale(cell->pos_);
+        }
+
+        // формуле, которая при последнем вычислении ячейку не читала,
+        // её изменение безразлично
+        for (Cell* dependent : cell->dependent_cells_) {
+            if (!dependent->impl_->IsDeadInput(cell)) {
+                stack.push_back(dependent);
+            }
+        }
+
+        // формулы, области которых содержат ячейку (или элементы её
+        // массива), вычисляются заново безусловно: ранняя отсечка сверяет
+        // только прямые ссылки
+        size_t size = stack.size();
+        sheet.range_dependencies_.AddDependents(cell->pos_, stack);
+        sheet.InvalidateArrayArea(cell, stack);
+        for (size_t i = size; i < stack.size(); ++i) {
+            stack[i]->verified_at_ = 0;
+        }
+    }
+}
+
+namespace {
+// вход без значения, прочитанный формулой во время Cell::Discover
+struct PendingInput {
+    const Cell* cell;
+};
+}  // namespace
+
+void Cell::Refresh() const {
+    if (sheet_.discovering_inputs_) {
+        throw PendingInput{ this };
+    }
 
-        unordered_set<const Cell*> visited;
+    // Сначала проверяются все устаревшие входы, потом сама ячейка. Порядок
+    // строится явным стеком, а не рекурсией, поэтому глубина цепочки
+    // зависимостей не ограничена стеком потока. Когда формула вычисляется,
+    // все её входы уже актуальны, и вычисление AST не уходит вглубь таблицы.
+    // Ячейка проверяется, когда к ней возвращаются после её входов. Входы к
+    // этому времени могли снова потерять значение из-за вытеснения (кэш
+    // значений меньше числа входов) - тогда формула прочитает их сама.
+    struct Step {
+        const Cell* cell;
+        bool inputs_visited;
+        // сколько раз вычисление формулы с условиями прерывалось ради входа
+        size_t attempts;
+    };
+    vector<Step> stack{ { this, false, 0 } };
 
+    // Профилировщик учитывает обновление входов формулы в её inclusive:
+    // кадр открывается, когда начинают обновляться входы ячейки, и
+    // закрывается, когда ячейку снимают со стека
+    Profiler* profiler = sheet_.profiling_ ? &sheet_.profiler_ : nullptr;
+    const size_t profiler_depth = profiler ? profiler->GetDepth() : 0;
+    auto finish = [&stack, profiler]() {
+        if (profiler && stack.back().inputs_visited) {
+            profiler->EndRefresh();
+        }
+        stack.pop_back();
+    };
+
+    try {
         while (!stack.empty()) {
-            const Cell* current = stack.back();
-            stack.pop_back();
+            auto [cell, inputs_visited, attempts] = stack.back();
 
-            if (current == this) {
-                return true;
+            if (cell->impl_->HasCache()) {
+                finish();
+                continue;
             }
 
-            visited.insert(current);
+            // Входы, нужные формуле с условиями, заранее известны не все:
+            // она может выбрать другую ветвь или вычисляться впервые. Каждый
+            // вход без значения прерывает её вычисление и вычисляется первым,
+            // после чего формула вычисляется снова. Если входы вытесняются из
+            // кэша значений быстрее, чем формула успевает их прочитать, она
+            // читает их сама.
+            bool discover = cell->impl_->HasConditions();
+            if (inputs_visited) {
+                if (discover && attempts <= cell->referenced_cells_.size()) {
+                    if (const Cell* input = cell->Discover()) {
+                        stack.back().attempts += 1;
+                        stack.push_back({ input, false, 0 });
+                        continue;
+                    }
+                } else {
+                    cell->Verify();
+                }
+                finish();
+                continue;
+            }
 
-            for (auto& ref_cell : current->referenced_cells_) {
-                if (!ref_cell) {
-                    continue;
+            // Входы из невыбранных ветвей условий не вычисляются, пока новое
+            // вычисление не выберет другую ветвь; у формулы с условиями,
+            // которая вычисляется безусловно (впервые), выбранных ветвей ещё нет
+            stack.back().inputs_visited = true;
+            if (profiler) {
+                profiler->BeginRefresh(cell->pos_);
+            }
+            if (cell->verified_at_ == 0 && discover) {
+                continue;
+            }
+            for (const Cell* ref_cell : cell->referenced_cells_) {
+                if (!ref_cell->impl_->HasCache() && !cell->impl_->IsDeadInput(ref_cell)) {
+                    stack.push_back({ ref_cell, false, 0 });
                 }
+            }
+        }
+    } catch (...) {
+        if (profiler) {
+            profiler->Unwind(profiler_depth);
+        }
+        throw;
+    }
+}
+
+const Cell* Cell::Discover() const {
+    sheet_.discovering_inputs_ = true;
+    try {
+        Verify();
+    } catch (const PendingInput& pending) {
+        sheet_.discovering_inputs_ = false;
+        return pending.cell;
+    } catch (...) {
+        sheet_.discovering_inputs_ = false;
+        throw;
+    }
+    sheet_.discovering_inputs_ = false;
+    return nullptr;
+}
 
-                stack.push_back(ref_cell);
+void Cell::Verify() const {
+    // формула пересчитывается, только если после её последней проверки
+    // действительно изменилось значение хотя бы одной из ячеек, которые
+    // она прочитала при последнем вычислении; иначе устаревший кэш просто
+    // подтверждается
+    bool inputs_changed = verified_at_ == 0;
+
+    for (const Cell* ref_cell : referenced_cells_) {
+        if (ref_cell->changed_at_ > verified_at_ && !impl_->IsDeadInput(ref_cell)) {
+            inputs_changed = true;
+            break;
+        }
+    }
+
+    if (!inputs_changed) {
+        impl_->ConfirmCache();
+    } else {
+        if (sheet_.profiling_) {
+            sheet_.profiler_.BeginEvaluation(pos_);
+        }
+        bool changed = false;
+        try {
+            changed = Resident().Recalculate();
+        } catch (const PendingInput&) {
+            if (sheet_.profiling_) {
+                sheet_.profiler_.AbortEvaluation();
             }
+            throw;
+        }
+        if (sheet_.profiling_) {
+            sheet_.profiler_.EndEvaluation();
+        }
+
+        if (changed) {
+            changed_at_ = sheet_.NextRevision();
         }
     }
-    return false;
+
+    verified_at_ = sheet_.GetRevision();
+    sheet_.StoreNumericValue(pos_, impl_->GetValueView());
 }
 
+bool Cell::CheckCircularDependencies(const vector<Position>& refs, const vector<Range>& ranges,
+                                     const optional<Range>& area) {
+    // Цикл замыкается, если новая формула ссылается на ячейку, которая сама
+    // от этой зависит (через ссылки или области), или содержит её в своей
+    // области; сама ячейка тоже в их числе. Поэтому обходятся ячейки,
+    // зависящие от этой: их обычно меньше, чем ячеек внутри областей.
+    // Формула-массив к тому же зависит от ячеек своей области area: формулы,
+    // читающие их, станут зависимыми от неё.
+    auto is_used = [&refs, &ranges](Position pos) {
+        return binary_search(refs.begin(), refs.end(), pos)
+            || any_of(ranges.begin(), ranges.end(), [pos](const Range& range) {
+                   return range.Contains(pos);
+               });
+    };
+    auto reads_area = [&refs, &ranges](const Range& area) {
+        return any_of(refs.begin(), refs.end(), [&area](Position pos) {
+                   return area.Contains(pos);
+               })
+            || any_of(ranges.begin(), ranges.end(), [&area](const Range& range) {
+                   return range.first.row <= area.last.row && range.last.row >= area.first.row
+                       && range.first.col <= area.last.col && range.last.col >= area.first.col;
+               });
+    };
+
+    if (is_used(pos_) || (area && reads_area(*area))) {
+        return true;
+    }
+    if (dependent_cells_.empty() && !sheet_.range_dependencies_.HasDependents(pos_) && !area) {
+        return false;
+    }
+
+    vector<Cell*> stack{ this };
+    unordered_set<const Cell*> visited{ this };
+
+    while (!stack.empty()) {
+        const Cell* current = stack.back();
+        stack.pop_back();
+
+        size_t size = stack.size();
+        if (current != this) {
+            stack.insert(stack.end(), current->dependent_cells_.begin(), current->dependent_cells_.end());
+            if (const Range* current_area = sheet_.FindActiveArea(current)) {
+                sheet_.range_dependencies_.AddDependents(*current_area, stack);
+            }
+        } else {
+            // элементы прежнего массива ячейки от новой формулы не зависят
+            for (Cell* dependent : dependent_cells_) {
+                if (!dependent->IsSpill()) {
+                    stack.push_back(dependent);
+                }
+            }
+            if (area) {
+                sheet_.ForEachCell(*area, [&](Cell* cell) {
+                    stack.push_back(cell);
+                });
+                sheet_.range_dependencies_.AddDependents(*area, stack);
+            }
+        }
+        sheet_.range_dependencies_.AddDependents(current->pos_, stack);
+
+        for (size_t i = size; i < stack.size();) {
+            if (!visited.insert(stack[i]).second) {
+                stack[i] = stack.back();
+                stack.pop_back();
+                continue;
+            }
+            // элементы выведенного массива читаются без ссылок на его ячейку
+            const Range* used_area = sheet_.FindActiveArea(stack[i]);
+            if (is_used(stack[i]->pos_) || (used_area && reads_area(*used_area))) {
+                return true;
+            }
+            ++i;
+        }
+    }
+    return false;
+}
 
 void Cell::UpdateDependencies(vector<Position>& referenced_cells_pos) {
+    vector<Cell*> old_referenced_cells(referenced_cells_.begin(), referenced_cells_.end());
+
     for (auto& ref_cell : referenced_cells_) {
         ref_cell->dependent_cells_.erase(this);
     }
@@ -199,14 +1393,20 @@ void Cell::UpdateDependencies(vector<Position>& referenced_cells_pos) {
     referenced_cells_.clear();
 
     for (auto& pos : referenced_cells_pos) {
-        Cell* cell_ptr = dynamic_cast<Cell*>(sheet_.GetCell(pos));
+        Cell* cell_ptr = sheet_.FindCell(pos);
 
         if (!cell_ptr) {
-            sheet_.SetCell(pos, "");
-            cell_ptr = dynamic_cast<Cell*>(sheet_.GetCell(pos));
+            cell_ptr = sheet_.CreatePlaceholder(pos);
         }
 
         referenced_cells_.insert(cell_ptr);
         cell_ptr->dependent_cells_.insert(this);
     }
+
+    // заглушки, созданные для прежних ссылок, больше никому не нужны
+    for (Cell* ref_cell : old_referenced_cells) {
+        if (ref_cell->IsPlaceholder()) {
+            sheet_.ReleaseCell(ref_cell->pos_);
+        }
+    }
 }
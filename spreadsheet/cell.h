@@ -2,40 +2,176 @@
 
 #include "common.h"
 #include "formula.h"
+#include "memory_usage.h"
 
+#include <cstdint>
+#include <optional>
 #include <unordered_set>
 
-class Cell : public CellInterface {
+class Sheet;
+
+class Cell : public CellInterface, public FormulaInput {
 public:
-    Cell(SheetInterface& sheet);
+    Cell(Sheet& sheet, Position pos);
     ~Cell();
 
-    void Set(std::string text);
-    void Clear();
+    // При lazy_parsing формула не разбирается до первого обращения к ней:
+    // зависимости извлекаются ScanFormulaReferences, а синтаксические ошибки
+    // проявятся только при вычислении (значение #VALUE!).
+    void Set(std::string text, bool lazy_parsing = false);
+    // Копирование областей (Sheet::CopyRange): копия формулы ячейки со
+    // ссылками, сдвинутыми на (rows, cols), - nullptr, если в ячейке не
+    // формула или её не удалось разобрать, - и запись такой копии в ячейку
+    // без разбора текста
+    std::unique_ptr<FormulaInterface> TranslateFormula(int rows, int cols) const;
+    void SetFormula(std::unique_ptr<FormulaInterface> formula);
+    // invalidate = false - кэш зависимых уже сброшен (InvalidateCaches)
+    void Clear(bool invalidate = true);
+    // Массовая загрузка (Sheet::OpenJournal): Load() записывает текст в
+    // новую ячейку с отложенным разбором, без проверки циклов, сброса кэша
+    // зависимых и связывания, и возвращает ссылки формулы; Link() связывает
+    // их, когда загружены все ячейки
+    void Load(std::string text, std::vector<Position>& referenced_cells_pos, std::vector<Range>& ranges);
+    void Link(std::vector<Position>& referenced_cells_pos, std::vector<Range> ranges);
 
     Value GetValue() const override;
     std::string GetText() const override;
+    ValueView GetValueView() const override;
+    std::string_view GetTextView() const override;
     std::vector<Position> GetReferencedCells() const override;
 
+    // Значение для собственных нужд таблицы: в журнал операций
+    // (Sheet::StartRecording) такое чтение не попадает
+    ValueView ReadValue() const;
+
+    // Значение для формул, чьи ссылки привязаны к этой ячейке
+    // (FormulaInterface::BindInputs): без поиска ячейки в таблице
+    std::variant<double, FormulaError> GetNumericValue() const override;
+
+    // Для вычисления формул целым столбцом (Sheet::Recalculate): программа
+    // формулы относительно позиции ячейки и запись значения, вычисленного
+    // снаружи, как если бы формула была пересчитана сама.
+    bool Compile(FormulaProgram& program) const;
+    void SetComputedValue(FormulaInterface::Value value) const;
+
+    void AddMemoryUsage(MemoryUsage& usage) const;
+
+    // Подкачка (Sheet::SetMemoryBudget): объём содержимого ячейки (текст,
+    // выражение и дерево формулы), его вытеснение - содержимое дописывается
+    // в payload и заменяется заглушкой (false - вытеснять нечего) - и загрузка
+    // обратно. Зависимости и значение формулы остаются в памяти.
+    size_t GetPayloadSize() const;
+    bool PageOut(std::string& payload);
+    void PageIn(std::string_view payload);
+    bool IsPagedOut() const;
+
+    // Ветки таблицы (Sheet::Fork). PeekValue() - значение без вычисления и
+    // других побочных эффектов, ячейка должна иметь кэш: ветки читают
+    // значения родителя из своих потоков. ShareFrom() делает новую ячейку
+    // ветки представителем ячейки родителя source - значение и текст берутся
+    // у неё, своих ссылок у представителя нет; IsShared() - ячейка всё ещё
+    // представитель, а не своё содержимое ветки.
+    ValueView PeekValue() const;
+    void ShareFrom(const Cell& source);
+    bool IsShared() const;
+
+    // Формулы-массивы (Sheet::UpdateArray). GetArraySize() - размер
+    // результата формулы ячейки, nullopt - это не формула-массив.
+    // CanSpill() - можно ли вывести результат в area, не замкнув цикл.
+    // SpillFrom() делает пустую ячейку элементом массива формулы anchor:
+    // своего текста у неё нет, значение берётся из результата формулы, и
+    // ячейка зависит от неё, как от ссылки. Такие ячейки есть только у
+    // элементов, к которым обращались (см. Sheet::ActivateArea).
+    // ReleaseSpill() снова делает ячейку просто пустой.
+    std::optional<Size> GetArraySize() const;
+    bool CanSpill(const Range& area);
+    void SpillFrom(Cell* anchor);
+    void ReleaseSpill();
+    bool IsSpill() const;
+
+    // Кэш значений формул (result_cache.h) вытеснил значение этой формулы:
+    // оно будет вычислено заново при следующем чтении
+    void EvictResult() const;
+
+    // Размещает формулу ячейки в новой памяти (Sheet::OptimizeLayout): её
+    // значение получает следующий по порядку слот кэша значений формул,
+    // прежний номер слота дописывается в slots
+    void Relocate(std::vector<uint32_t>& slots);
+
+    // Вставка и удаление строк и столбцов (Sheet::InsertRows и др.): перенос
+    // ячейки на новую позицию, перезапись ссылок её формулы и удаление
+    // ячейки из графа зависимостей. Detach() сбрасывает кэш формул, которые
+    // ссылались на ячейку, и возвращает ячейки, на которые ссылалась она.
+    // MoveReferences() возвращает true, если изменились области формулы
+    // (A1:C10) - тогда её нужно вычислить заново (ForceRecalculation).
+    Position GetPosition() const;
+    void MoveTo(Position pos);
+    bool MoveReferences(const CellShift& shift);
+    void ForceRecalculation();
+    std::vector<Cell*> Detach();
+    void AddDependentsTo(std::unordered_set<Cell*>& cells) const;
+
+    bool IsEmpty() const;
     bool IsReferenced() const;
+    // пустая ячейка, на которую никто не ссылается, - её можно удалить
+    bool IsPlaceholder() const;
+    void CompactDependencies();
     bool HasCache() const;
     
     void InvalidateCache();
+    // Сброс кэша ячеек cells и всех зависящих от них за один обход: общие
+    // зависимые нескольких ячеек (Sheet::ClearArea) проходятся один раз
+    static void InvalidateCaches(std::vector<Cell*> cells);
 private:
     class Impl;
     class EmptyImpl;
     class TextImpl;
     class FormulaImpl;
+    class PagedImpl;
+    class SharedImpl;
+    class SpillImpl;
 
     std::unique_ptr<Impl> impl_;
-    SheetInterface& sheet_;
+    Sheet& sheet_;
+    Position pos_;
 
     // на кого ссылается ячейка / кто ссылается на ячейку, 
     // 1) при добавлении ячейки смотрю циклические зависимости,
     // 2) при изменении одной из ячеек, нужно смотреть кто использует
     // измененную ячейку, чтобы инвалидировать кэш
-    std::unordered_set<Cell*> referenced_cells_, dependent_cells_;
+    // 3) формула с условиями (IF) может часть входов не читать - их
+    // изменения её не инвалидируют (см. Impl::IsDeadInput)
+    using CellSet = std::unordered_set<Cell*, std::hash<Cell*>, std::equal_to<Cell*>, CountingAllocator<Cell*>>;
+    CellSet referenced_cells_, dependent_cells_;
+
+    // Ревизии таблицы (Sheet::NextRevision): когда значение ячейки последний
+    // раз изменилось и когда формула последний раз сверялась со своими
+    // входами. verified_at_ == 0 - формулу нужно вычислить безусловно.
+    mutable uint64_t changed_at_ = 0;
+    mutable uint64_t verified_at_ = 0;
+
+    // Содержимое ячейки, при необходимости загруженное из файла подкачки.
+    // value_only - нужно только значение: формуле загрузка для этого не нужна.
+    const Impl& Resident(bool value_only = false) const;
+
+    void Refresh() const;
+    void Verify() const;
+    // Проверка формулы, входы которой ещё неизвестны (см. Refresh): вход без
+    // значения не вычисляется вложенно, а прерывает вычисление и
+    // возвращается. nullptr - формула проверена.
+    const Cell* Discover() const;
+
+    // Содержимое по тексту ячейки: ссылки и области формулы и куда
+    // выведет результат формула-массив
+    std::unique_ptr<Impl> MakeImpl(std::string text, bool lazy_parsing, std::vector<Position>& referenced_cells_pos,
+                                   std::vector<Range>& ranges, std::optional<Range>& area);
+    // Замена содержимого новым: проверка циклов для формулы, сброс кэша
+    // зависимых и обновление зависимостей
+    void Install(std::unique_ptr<Impl> impl, std::vector<Position>& referenced_cells_pos,
+                 std::vector<Range> ranges, const std::optional<Range>& area, bool invalidate = true);
 
-    bool CheckCircularDependencies(const std::vector<Position>& referenced_cells_pos);
+    // area - куда новая формула-массив выведет результат
+    bool CheckCircularDependencies(const std::vector<Position>& referenced_cells_pos,
+                                   const std::vector<Range>& ranges, const std::optional<Range>& area);
     void UpdateDependencies(std::vector<Position>& referenced_cells_pos);
 };
\ No newline at end of file
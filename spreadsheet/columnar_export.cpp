@@ -0,0 +1,382 @@
+#include "columnar_export.h"
+
+#include <algorithm>
+#include <limits>
+
+using namespace std;
+
+namespace {
+const char ARROW_MAGIC[] = "ARROW1";
+const uint32_t CONTINUATION = 0xFFFFFFFF;
+
+// значения из схемы Arrow (format/Schema.fbs, format/Message.fbs)
+const uint16_t METADATA_V5 = 4;
+const uint8_t HEADER_SCHEMA = 1;
+const uint8_t HEADER_RECORD_BATCH = 3;
+const uint8_t TYPE_FLOATING_POINT = 3;
+const uint8_t TYPE_UTF8 = 5;
+const uint16_t PRECISION_DOUBLE = 2;
+const uint16_t ENDIANNESS_LITTLE = 0;
+
+// буферы тела сообщения и сами сообщения выравниваются на 8 байт
+const size_t ALIGNMENT = 8;
+
+size_t PaddingFor(size_t size) {
+    return (ALIGNMENT - size % ALIGNMENT) % ALIGNMENT;
+}
+
+// Построитель буфера FlatBuffers. В отличие от библиотечного пишет вперёд:
+// сначала таблица, потом то, на что она ссылается, - ссылки (uoffset)
+// заполняются методом Link, когда цель уже записана, и всегда указывают
+// вперёд, как того требует формат. Первые 4 байта - ссылка на корневую таблицу.
+class FlatBufferBuilder {
+public:
+    // Скалярное поле таблицы: номер в схеме, размер в байтах и значение.
+    // Поле-ссылка - поле размера 4, которое заполняется через Link.
+    struct Field {
+        uint16_t id;
+        uint8_t size;
+        uint64_t value = 0;
+    };
+
+    struct Table {
+        size_t pos;
+        vector<size_t> fields;  // номер поля -> позиция в буфере
+
+        size_t operator[](uint16_t id) const {
+            return fields.at(id);
+        }
+    };
+
+    FlatBufferBuilder() : buffer_(4, '\0') {}
+
+    // Таблица кладётся так, чтобы её 8-байтовые поля были выровнены: перед
+    // ней - её vtable, поля идут по убыванию размера сразу за смещением vtable
+    Table AddTable(vector<Field> fields) {
+        stable_sort(fields.begin(), fields.end(), [](const Field& lhs, const Field& rhs) {
+            return lhs.size > rhs.size;
+        });
+        size_t field_count = 0;
+        for (const Field& field : fields) {
+            field_count = max<size_t>(field_count, field.id + 1);
+        }
+
+        size_t vtable_pos = Align(2, 0);
+        size_t vtable_size = 4 + 2 * field_count;
+        size_t table_pos = vtable_pos + vtable_size;
+        table_pos += (ALIGNMENT + 4 - table_pos % ALIGNMENT) % ALIGNMENT;
+
+        Table table{ table_pos, vector<size_t>(field_count, 0) };
+        size_t end = table_pos + 4;
+        for (const Field& field : fields) {
+            end += (field.size - end % field.size) % field.size;
+            table.fields[field.id] = end;
+            end += field.size;
+        }
+
+        buffer_.resize(end, '\0');
+        Put(vtable_pos, 2, vtable_size);
+        Put(vtable_pos + 2, 2, end - table_pos);
+        for (size_t id = 0; id < field_count; ++id) {
+            Put(vtable_pos + 4 + 2 * id, 2, table.fields[id] ? table.fields[id] - table_pos : 0);
+        }
+        Put(table_pos, 4, table_pos - vtable_pos);
+        for (const Field& field : fields) {
+            Put(table.fields[field.id], field.size, field.value);
+        }
+        return table;
+    }
+
+    // Вектор из count элементов по elem_size байт; возвращает позицию его
+    // длины, элементы (заполненные нулями) идут следом
+    size_t AddVector(size_t count, size_t elem_size, size_t elem_align = 4) {
+        size_t pos = Align(max<size_t>(elem_align, 4), 4);
+        buffer_.resize(pos + 4 + count * elem_size, '\0');
+        Put(pos, 4, count);
+        return pos;
+    }
+
+    size_t AddString(string_view text) {
+        size_t pos = Align(4, 0);
+        buffer_.resize(pos + 4);
+        Put(pos, 4, text.size());
+        buffer_.append(text);
+        buffer_.push_back('\0');
+        return pos;
+    }
+
+    // записывает в поле-ссылку at смещение до target
+    void Link(size_t at, size_t target) {
+        Put(at, 4, target - at);
+    }
+
+    void Put(size_t at, size_t size, uint64_t value) {
+        for (size_t i = 0; i < size; ++i) {
+            buffer_[at + i] = static_cast<char>(value >> (8 * i));
+        }
+    }
+
+    // готовый буфер с корнем root, дополненный до кратной 8 длины
+    string Finish(size_t root) {
+        Link(0, root);
+        buffer_.resize(buffer_.size() + PaddingFor(buffer_.size()), '\0');
+        return move(buffer_);
+    }
+
+private:
+    string buffer_;
+
+    // дополняет буфер нулями, пока позиция + shift не станет кратной alignment
+    size_t Align(size_t alignment, size_t shift) {
+        while ((buffer_.size() + shift) % alignment != 0) {
+            buffer_.push_back('\0');
+        }
+        return buffer_.size();
+    }
+};
+
+size_t AddSchema(FlatBufferBuilder& builder, const vector<ColumnSpec>& columns) {
+    auto schema = builder.AddTable({ { 0, 2, ENDIANNESS_LITTLE }, { 1, 4 } });
+    size_t fields = builder.AddVector(columns.size(), 4);
+    builder.Link(schema[1], fields);
+
+    for (size_t i = 0; i < columns.size(); ++i) {
+        const bool is_double = columns[i].type == ColumnType::Float64;
+        auto field = builder.AddTable({
+            { 0, 4 },                                               // name
+            { 1, 1, 1 },                                            // nullable
+            { 2, 1, is_double ? TYPE_FLOATING_POINT : TYPE_UTF8 },  // type_type
+            { 3, 4 },                                               // type
+            { 5, 4 },                                               // children
+        });
+        builder.Link(fields + 4 + 4 * i, field.pos);
+        builder.Link(field[0], builder.AddString(columns[i].name));
+        if (is_double) {
+            builder.Link(field[3], builder.AddTable({ { 0, 2, PRECISION_DOUBLE } }).pos);
+        } else {
+            builder.Link(field[3], builder.AddTable({}).pos);
+        }
+        builder.Link(field[5], builder.AddVector(0, 4));
+    }
+    return schema.pos;
+}
+
+// Сообщение IPC: версия, вид заголовка, сам заголовок и длина тела
+FlatBufferBuilder::Table AddMessage(FlatBufferBuilder& builder, uint8_t header_type, uint64_t body_length) {
+    return builder.AddTable({
+        { 0, 2, METADATA_V5 },
+        { 1, 1, header_type },
+        { 2, 4 },
+        { 3, 8, body_length },
+    });
+}
+
+size_t BitmapSize(size_t length) {
+    return (length + 7) / 8;
+}
+}  // namespace
+
+ColumnBuilder::ColumnBuilder(ColumnType type) : type_(type) {
+    Clear();
+}
+
+void ColumnBuilder::AppendNull() {
+    AppendValidity(false);
+    ++null_count_;
+    if (type_ == ColumnType::Float64) {
+        values_.push_back(0);
+    } else {
+        offsets_.push_back(static_cast<int32_t>(data_.size()));
+    }
+}
+
+void ColumnBuilder::AppendDouble(double value) {
+    AppendValidity(true);
+    values_.push_back(value);
+}
+
+void ColumnBuilder::AppendString(string_view value) {
+    if (data_.size() + value.size() > static_cast<size_t>(numeric_limits<int32_t>::max())) {
+        throw ColumnarExportException("Text column of a record batch exceeds 2 GiB");
+    }
+    AppendValidity(true);
+    data_.append(value);
+    offsets_.push_back(static_cast<int32_t>(data_.size()));
+}
+
+void ColumnBuilder::Clear() {
+    length_ = 0;
+    null_count_ = 0;
+    validity_.clear();
+    values_.clear();
+    offsets_.assign(type_ == ColumnType::Utf8 ? 1 : 0, 0);
+    data_.clear();
+}
+
+ColumnType ColumnBuilder::GetType() const {
+    return type_;
+}
+
+size_t ColumnBuilder::GetLength() const {
+    return length_;
+}
+
+size_t ColumnBuilder::GetNullCount() const {
+    return null_count_;
+}
+
+size_t ColumnBuilder::GetByteSize() const {
+    return validity_.size() + values_.size() * sizeof(double) + offsets_.size() * sizeof(int32_t) + data_.size();
+}
+
+void ColumnBuilder::AppendValidity(bool valid) {
+    if (length_ % 8 == 0) {
+        validity_.push_back(0);
+    }
+    if (valid) {
+        validity_.back() |= static_cast<uint8_t>(1u << (length_ % 8));
+    }
+    ++length_;
+}
+
+ArrowFileWriter::ArrowFileWriter(const string& path, vector<ColumnSpec> columns)
+    : path_(path)
+    , file_(path, ios::out | ios::binary | ios::trunc)
+    , columns_(move(columns)) {
+    if (!file_) {
+        throw ColumnarExportException("Cannot open export file " + path_);
+    }
+
+    WriteBytes(ARROW_MAGIC, sizeof(ARROW_MAGIC) - 1);
+    WritePadding(PaddingFor(position_));
+
+    FlatBufferBuilder builder;
+    auto message = AddMessage(builder, HEADER_SCHEMA, 0);
+    builder.Link(message[2], AddSchema(builder, columns_));
+    WriteMessage(builder.Finish(message.pos));
+}
+
+void ArrowFileWriter::WriteBatch(const vector<ColumnBuilder>& columns) {
+    if (columns.size() != columns_.size()) {
+        throw invalid_argument("Record batch does not match the schema");
+    }
+    const size_t length = columns.empty() ? 0 : columns.front().GetLength();
+
+    // буферы столбца: битовая карта (пустая, если пропусков нет), затем
+    // числа или смещения и байты строк
+    struct Buffer {
+        const void* data;
+        size_t size;
+    };
+    vector<Buffer> buffers;
+    for (size_t i = 0; i < columns.size(); ++i) {
+        const ColumnBuilder& column = columns[i];
+        if (column.GetLength() != length || column.GetType() != columns_[i].type) {
+            throw invalid_argument("Record batch does not match the schema");
+        }
+        buffers.push_back({ column.validity_.data(), column.null_count_ ? BitmapSize(length) : 0 });
+        if (column.type_ == ColumnType::Float64) {
+            buffers.push_back({ column.values_.data(), column.values_.size() * sizeof(double) });
+        } else {
+            buffers.push_back({ column.offsets_.data(), column.offsets_.size() * sizeof(int32_t) });
+            buffers.push_back({ column.data_.data(), column.data_.size() });
+        }
+    }
+
+    uint64_t body_length = 0;
+    for (const Buffer& buffer : buffers) {
+        body_length += buffer.size + PaddingFor(buffer.size);
+    }
+
+    FlatBufferBuilder builder;
+    auto message = AddMessage(builder, HEADER_RECORD_BATCH, body_length);
+    auto batch = builder.AddTable({ { 0, 8, length }, { 1, 4 }, { 2, 4 } });
+    builder.Link(message[2], batch.pos);
+
+    // FieldNode { length, null_count } и Buffer { offset, length } - по 16 байт
+    size_t nodes = builder.AddVector(columns.size(), 16, 8);
+    builder.Link(batch[1], nodes);
+    for (size_t i = 0; i < columns.size(); ++i) {
+        builder.Put(nodes + 4 + 16 * i, 8, length);
+        builder.Put(nodes + 4 + 16 * i + 8, 8, columns[i].null_count_);
+    }
+
+    size_t buffer_table = builder.AddVector(buffers.size(), 16, 8);
+    builder.Link(batch[2], buffer_table);
+    uint64_t offset = 0;
+    for (size_t i = 0; i < buffers.size(); ++i) {
+        builder.Put(buffer_table + 4 + 16 * i, 8, offset);
+        builder.Put(buffer_table + 4 + 16 * i + 8, 8, buffers[i].size);
+        offset += buffers[i].size + PaddingFor(buffers[i].size);
+    }
+
+    Block block{ position_, 0, body_length };
+    block.metadata_length = WriteMessage(builder.Finish(message.pos));
+    for (const Buffer& buffer : buffers) {
+        WriteBytes(buffer.data, buffer.size);
+        WritePadding(PaddingFor(buffer.size));
+    }
+    blocks_.push_back(block);
+}
+
+void ArrowFileWriter::Finish() {
+    // конец потока сообщений
+    const uint8_t end_of_stream[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0 };
+    WriteBytes(end_of_stream, sizeof(end_of_stream));
+
+    FlatBufferBuilder builder;
+    auto footer = builder.AddTable({ { 0, 2, METADATA_V5 }, { 1, 4 }, { 2, 4 }, { 3, 4 } });
+    builder.Link(footer[1], AddSchema(builder, columns_));
+    builder.Link(footer[2], builder.AddVector(0, 24, 8));
+
+    // Block { offset, metaDataLength, (выравнивание), bodyLength } - 24 байта
+    size_t blocks = builder.AddVector(blocks_.size(), 24, 8);
+    builder.Link(footer[3], blocks);
+    for (size_t i = 0; i < blocks_.size(); ++i) {
+        builder.Put(blocks + 4 + 24 * i, 8, blocks_[i].offset);
+        builder.Put(blocks + 4 + 24 * i + 8, 4, blocks_[i].metadata_length);
+        builder.Put(blocks + 4 + 24 * i + 16, 8, blocks_[i].body_length);
+    }
+
+    string metadata = builder.Finish(footer.pos);
+    WriteBytes(metadata.data(), metadata.size());
+    uint8_t size[4];
+    for (int i = 0; i < 4; ++i) {
+        size[i] = static_cast<uint8_t>(metadata.size() >> (8 * i));
+    }
+    WriteBytes(size, sizeof(size));
+    WriteBytes(ARROW_MAGIC, sizeof(ARROW_MAGIC) - 1);
+
+    file_.close();
+    Check("close");
+}
+
+void ArrowFileWriter::WriteBytes(const void* data, size_t size) {
+    file_.write(static_cast<const char*>(data), size);
+    Check("write");
+    position_ += size;
+}
+
+void ArrowFileWriter::WritePadding(size_t size) {
+    static const char zeros[ALIGNMENT] = {};
+    WriteBytes(zeros, size);
+}
+
+uint32_t ArrowFileWriter::WriteMessage(const string& metadata) {
+    // метаданные уже дополнены до кратной 8 длины (FlatBufferBuilder::Finish)
+    const uint32_t length = static_cast<uint32_t>(metadata.size());
+    uint8_t prefix[8];
+    for (int i = 0; i < 4; ++i) {
+        prefix[i] = static_cast<uint8_t>(CONTINUATION >> (8 * i));
+        prefix[4 + i] = static_cast<uint8_t>(length >> (8 * i));
+    }
+    WriteBytes(prefix, sizeof(prefix));
+    WriteBytes(metadata.data(), metadata.size());
+    return length + sizeof(prefix);
+}
+
+void ArrowFileWriter::Check(const char* operation) {
+    if (!file_) {
+        throw ColumnarExportException("Cannot "s + operation + " export file " + path_);
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Исключение, выбрасываемое при ошибке записи файла выгрузки
+class ColumnarExportException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+enum class ColumnType {
+    Float64,
+    Utf8,
+};
+
+struct ColumnSpec {
+    std::string name;
+    ColumnType type = ColumnType::Float64;
+};
+
+// Значения одного столбца пакета записей в раскладке Arrow: битовая карта
+// заполненности (младший бит - первая строка), для Float64 - массив чисел,
+// для Utf8 - смещения строк (int32) и их байты подряд.
+class ColumnBuilder {
+public:
+    explicit ColumnBuilder(ColumnType type);
+
+    void AppendNull();
+    void AppendDouble(double value);
+    void AppendString(std::string_view value);
+    // очищает значения, сохраняя выделенную память для следующего пакета
+    void Clear();
+
+    ColumnType GetType() const;
+    size_t GetLength() const;
+    size_t GetNullCount() const;
+    // объём буферов для записи
+    size_t GetByteSize() const;
+
+private:
+    friend class ArrowFileWriter;
+
+    ColumnType type_;
+    size_t length_ = 0;
+    size_t null_count_ = 0;
+    std::vector<uint8_t> validity_;
+    std::vector<double> values_;
+    std::vector<int32_t> offsets_;
+    std::string data_;
+
+    void AppendValidity(bool valid);
+};
+
+// Пишет файл в формате Arrow IPC (https://arrow.apache.org/docs/format/Columnar.html):
+// магическое слово, схема, пакеты записей по мере их готовности и в конце -
+// оглавление (footer) со схемой и расположением пакетов. Метаданные в
+// формате FlatBuffers собираются вручную, внешние библиотеки не нужны.
+// Поддерживаются только столбцы без словарей и сжатия. Схема объявляет
+// порядок байтов little-endian, а буферы значений пишутся как есть, поэтому
+// машина тоже должна быть little-endian.
+class ArrowFileWriter {
+public:
+    // Создаёт файл и пишет в него схему
+    ArrowFileWriter(const std::string& path, std::vector<ColumnSpec> columns);
+    ArrowFileWriter(const ArrowFileWriter&) = delete;
+    ArrowFileWriter& operator=(const ArrowFileWriter&) = delete;
+
+    // Столбцы пакета - в порядке схемы и одинаковой длины
+    void WriteBatch(const std::vector<ColumnBuilder>& columns);
+    // Пишет оглавление и закрывает файл; без вызова файл останется неполным
+    void Finish();
+
+private:
+    struct Block {
+        uint64_t offset;
+        uint32_t metadata_length;
+        uint64_t body_length;
+    };
+
+    std::string path_;
+    std::ofstream file_;
+    std::vector<ColumnSpec> columns_;
+    std::vector<Block> blocks_;
+    uint64_t position_ = 0;
+
+    void WriteBytes(const void* data, size_t size);
+    void WritePadding(size_t size);
+    // метаданные сообщения с префиксом; возвращает их длину вместе с префиксом
+    uint32_t WriteMessage(const std::string& metadata);
+    void Check(const char* operation);
+};
@@ -1,13 +1,24 @@
 #pragma once
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
 #include <variant>
 #include <vector>
 
+// Размеры сетки задаются при сборке: -DSPREADSHEET_MAX_ROWS=... -DSPREADSHEET_MAX_COLS=...
+#ifndef SPREADSHEET_MAX_ROWS
+#define SPREADSHEET_MAX_ROWS 1048576
+#endif
+
+#ifndef SPREADSHEET_MAX_COLS
+#define SPREADSHEET_MAX_COLS 16384
+#endif
+
 struct Position {
     int row = 0;
     int col = 0;
@@ -18,13 +29,25 @@ struct Position {
     bool IsValid() const;
     std::string ToString() const;
 
+    // Строка и столбец, упакованные в одно 64-битное число. Порядок ключей
+    // совпадает с operator< (построчный), в том числе для отрицательных значений
+    uint64_t Pack() const {
+        return (uint64_t{static_cast<uint32_t>(row) ^ SIGN_BIT} << 32)
+               | (static_cast<uint32_t>(col) ^ SIGN_BIT);
+    }
+
     static Position FromString(std::string_view str);
 
-    static const int MAX_ROWS = 16384;
-    static const int MAX_COLS = 16384;
+    static constexpr int MAX_ROWS = SPREADSHEET_MAX_ROWS;
+    static constexpr int MAX_COLS = SPREADSHEET_MAX_COLS;
     static const Position NONE;
+
+private:
+    static constexpr uint32_t SIGN_BIT = 0x8000'0000u;
 };
 
+static_assert(Position::MAX_ROWS > 0 && Position::MAX_COLS > 0, "grid must not be empty");
+
 struct Size {
     int rows = 0;
     int cols = 0;
@@ -32,6 +55,22 @@ struct Size {
     bool operator==(Size rhs) const;
 };
 
+// Прямоугольная область ячеек от first до last включительно (A1:C10)
+struct Range {
+    Position first;
+    Position last;
+
+    bool operator==(const Range& rhs) const;
+    bool operator<(const Range& rhs) const;
+
+    bool IsValid() const;
+    bool Contains(Position pos) const;
+    Size GetSize() const;
+    std::string ToString() const;
+
+    static const Range NONE;
+};
+
 // Описывает ошибки, которые могут возникнуть при вычислении формулы.
 class FormulaError {
 public:
@@ -39,6 +78,8 @@ public:
         Ref,    // ссылка на ячейку с некорректной позицией
         Value,  // ячейка не может быть трактована как число
         Arithmetic,  // в результате вычисления возникло деление на ноль
+        NotAvailable,  // функция поиска не нашла значение
+        Spill,  // результат формулы-массива некуда вывести: область занята
     };
 
     FormulaError(Category category) : category_(category) {}
@@ -59,6 +100,10 @@ public:
                 return "#VALUE!";
             case Category::Arithmetic:
                 return "#ARITHM!"; 
+            case Category::NotAvailable:
+                return "#N/A";
+            case Category::Spill:
+                return "#SPILL!";
             default:
                 return "";
         }
@@ -107,12 +152,30 @@ public:
     // содержащий экранирующие символы). В случае формулы - её выражение.
     virtual std::string GetText() const = 0;
 
+    // То же, что GetValue() и GetText(), но без копирования: строки указывают
+    // в память, которой владеет ячейка, и действительны до следующего
+    // изменения таблицы.
+    using ValueView = std::variant<std::string_view, double, FormulaError>;
+    virtual ValueView GetValueView() const = 0;
+    virtual std::string_view GetTextView() const = 0;
+
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
 };
 
+// Значение, которое ищут функции MATCH, VLOOKUP и XLOOKUP: число или текст
+using LookupKey = std::variant<double, std::string>;
+
+// Какая строка подходит для поиска: только с равным ключом или, если такой
+// нет, с ближайшим меньшим (большим) ключом
+enum class LookupMatch {
+    Exact,
+    ExactOrSmaller,
+    ExactOrLarger,
+};
+
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
@@ -157,6 +220,22 @@ public:
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Возвращает значение ячейки так, как его видит формула: пустая или
+    // отсутствующая ячейка - ноль, текст - число, если он целиком является
+    // записью числа, иначе ошибка #VALUE!, значение формулы - как есть.
+    virtual std::variant<double, FormulaError> GetNumericValue(Position pos) const = 0;
+
+    // Возвращает значение ячейки как ключ поиска: текст, который целиком
+    // является записью числа, и значение формулы - число, остальной текст -
+    // строка, пустая или отсутствующая ячейка - ноль.
+    virtual std::variant<double, std::string, FormulaError> GetLookupKey(Position pos) const = 0;
+
+    // Ищет в столбце column (область шириной в один столбец) ключ key и
+    // возвращает номер строки. Текст сравнивается без учёта регистра, число
+    // никогда не равно тексту. Из нескольких строк с равным ключом выбирается
+    // верхняя. nullopt - подходящей строки нет.
+    virtual std::optional<int> Lookup(const LookupKey& key, Range column, LookupMatch match) const = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
@@ -11,7 +11,7 @@ using namespace std;
 using namespace literals;
 
 ostream& operator<<(ostream& output, FormulaError fe) {
-    return output << "#ARITHM!";
+    return output << fe.ToString();
 }
 
 namespace {
@@ -22,6 +22,10 @@ public:
     } catch (const exception& e) {
         throw FormulaException(e.what());
     }
+
+    explicit Formula(FormulaAST ast)
+        : ast_(move(ast)) {
+    }
     
     // new const SheetInterface& sheet
     Value Evaluate(const SheetInterface& sheet) const override {
@@ -33,6 +37,34 @@ public:
         }
     }
 
+    optional<Size> GetArraySize() const override {
+        return ast_.GetArraySize();
+    }
+
+    Value EvaluateElement(const SheetInterface& sheet, int row, int col) const override {
+        try {
+            return ast_.ExecuteElement(sheet, row, col);
+        } catch (const FormulaError& err) {
+            return err;
+        }
+    }
+
+    void BindInputs(const InputResolver& resolve) override {
+        ast_.BindInputs(resolve);
+    }
+
+    void MoveReferences(const CellShift& shift) override {
+        ast_.MoveReferences(shift);
+    }
+
+    unique_ptr<FormulaInterface> Translate(int rows, int cols) const override {
+        return make_unique<Formula>(ast_.Translate(rows, cols));
+    }
+
+    unique_ptr<FormulaInterface> Clone() const override {
+        return make_unique<Formula>(ast_.Clone());
+    }
+
     string GetExpression() const override {
         ostringstream oss;
         ast_.PrintFormula(oss);
@@ -55,11 +87,140 @@ public:
         
         return cells;
     }
+
+    vector<Range> GetReferencedRanges() const override {
+        vector<Range> ranges;
+
+        for (auto& range : ast_.GetRanges()) {
+            if (range.IsValid()) {
+                ranges.push_back(range);
+            }
+        }
+
+        sort(ranges.begin(), ranges.end());
+        ranges.erase(unique(ranges.begin(), ranges.end()), ranges.end());
+
+        return ranges;
+    }
+
+    bool HasConditions() const override {
+        return ast_.HasConditions();
+    }
+
+    vector<Position> GetLiveReferences() const override {
+        vector<Position> cells;
+        ast_.GetLiveCells(cells);
+        return cells;
+    }
+
+    bool Compile(Position origin, FormulaProgram& program) const override {
+        program.ops.clear();
+        return ast_.Compile(origin, program);
+    }
+
+    size_t GetMemoryUsage() const override {
+        return sizeof(*this) + ast_.GetMemoryUsage();
+    }
 private:
     FormulaAST ast_;
 };
 }  // namespace
 
+Position CellShift::Move(Position pos) const {
+    const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    int& coord = rows ? pos.row : pos.col;
+    if (coord < first) {
+        return pos;
+    }
+    if (coord < first - delta || coord + delta >= limit) {
+        return Position::NONE;
+    }
+    coord += delta;
+    return pos;
+}
+
+Range CellShift::Move(Range range) const {
+    const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    int& begin = rows ? range.first.row : range.first.col;
+    int& end = rows ? range.last.row : range.last.col;
+
+    if (delta > 0) {
+        // вставка внутри области её расширяет; вытолкнутое за край отрезается
+        if (begin >= first) {
+            begin += delta;
+        }
+        if (end >= first) {
+            end = min(end + delta, limit - 1);
+        }
+    } else {
+        // границы, попавшие в удалённую полосу, переходят на ближайшие
+        // уцелевшие ячейки области
+        const int removed_end = first - delta;
+        if (begin >= removed_end) {
+            begin += delta;
+        } else if (begin >= first) {
+            begin = first;
+        }
+        if (end >= removed_end) {
+            end += delta;
+        } else if (end >= first) {
+            end = first - 1;
+        }
+    }
+
+    return begin <= end && begin < limit ? range : Range::NONE;
+}
+
 unique_ptr<FormulaInterface> ParseFormula(string expression) {
     return make_unique<Formula>(move(expression));
-}
\ No newline at end of file
+}
+
+vector<Position> ScanFormulaReferences(string_view expression) {
+    vector<Position> cells;
+    size_t i = 0;
+
+    while (i < expression.size()) {
+        // байты вне ASCII отрицательны как char: в isdigit/isupper их передают
+        // только как unsigned char
+        unsigned char c = expression[i];
+
+        if (isdigit(c) || c == '.') {
+            // число пропускается вместе с экспонентой, иначе в 1E5 нашлась бы ячейка E5
+            while (i < expression.size()
+                   && (isdigit(static_cast<unsigned char>(expression[i])) || expression[i] == '.')) {
+                ++i;
+            }
+            if (i < expression.size() && (expression[i] == 'e' || expression[i] == 'E')) {
+                ++i;
+                if (i < expression.size() && (expression[i] == '+' || expression[i] == '-')) {
+                    ++i;
+                }
+            }
+        } else if (isupper(c)) {
+            size_t start = i;
+            while (i < expression.size() && isupper(static_cast<unsigned char>(expression[i]))) {
+                ++i;
+            }
+            size_t letters_end = i;
+            while (i < expression.size() && isdigit(static_cast<unsigned char>(expression[i]))) {
+                ++i;
+            }
+            if (i == letters_end) {
+                continue;
+            }
+
+            auto cell = Position::FromString(expression.substr(start, i - start));
+            if (!cell.IsValid()) {
+                throw FormulaException("Invalid position: "s + string(expression.substr(start, i - start)));
+            }
+            cells.push_back(cell);
+        } else {
+            ++i;
+        }
+    }
+
+    sort(cells.begin(), cells.end());
+    cells.erase(unique(cells.begin(), cells.end()), cells.end());
+
+    return cells;
+}
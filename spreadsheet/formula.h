@@ -2,13 +2,86 @@
 
 #include "common.h"
 
+#include <functional>
 #include <memory>
+#include <optional>
 #include <vector>
 
+// Формула в виде стековой программы, в которой ссылки на ячейки заданы
+// смещением относительно ячейки самой формулы. Формулы одной формы в соседних
+// строках (=A1*B1+C1, =A2*B2+C2, ...) дают равные программы, поэтому их можно
+// вычислять целым столбцом (см. vectorized.h).
+// Формула-массив (=A1:A10*B1:B10) записывается так же: область-операнд
+// (OpCode::Range) задана смещением своей первой ячейки, а для каждого
+// элемента результата читается её ячейка с тем же смещением от первой, что
+// и у элемента от ячейки формулы. OpCode::Cell в такой программе - одна и
+// та же ячейка для всех элементов.
+struct FormulaProgram {
+    enum class OpCode : char {
+        Number,
+        Cell,
+        Range,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+    };
+
+    struct Op {
+        OpCode code;
+        double number = 0;
+        int row_offset = 0;
+        int col_offset = 0;
+
+        bool operator==(const Op& rhs) const {
+            return code == rhs.code && number == rhs.number
+                && row_offset == rhs.row_offset && col_offset == rhs.col_offset;
+        }
+    };
+
+    std::vector<Op> ops;
+
+    bool operator==(const FormulaProgram& rhs) const {
+        return ops == rhs.ops;
+    }
+};
+
+// Ячейка, на которую ссылается формула, с точки зрения её вычисления:
+// значение так, как его видит формула (см. SheetInterface::GetNumericValue)
+class FormulaInput {
+public:
+    virtual std::variant<double, FormulaError> GetNumericValue() const = 0;
+
+protected:
+    ~FormulaInput() = default;
+};
+
+// Сдвиг ячеек при вставке (delta > 0) и удалении (delta < 0) строк (rows)
+// или столбцов начиная с first (см. Sheet::InsertRows)
+struct CellShift {
+    bool rows = true;
+    int first = 0;
+    int delta = 0;
+
+    // Новая позиция ячейки или Position::NONE, если ячейка удалена или
+    // вытолкнута за край таблицы
+    Position Move(Position pos) const;
+    // Новые границы области без удалённых ячеек или Range::NONE, если
+    // удалены все
+    Range Move(Range range) const;
+};
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Функции поиска MATCH, VLOOKUP и XLOOKUP с областями в аргументах:
+//   VLOOKUP(A1,D1:F100,3,0)
+// * Сравнения (=, <>, <, <=, >, >=) и условия IF, AND, OR; условие вычисляет
+//   только нужные ему аргументы: IF(A1>0,B1,C1)
+// * Формулы-массивы: области в роли операндов вычисляются поэлементно,
+//   A1:A10*B1:B10 (см. GetArraySize)
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -26,6 +99,38 @@ public:
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    // Формула-массив: области, стоящие на месте чисел (=A1:A10*B1:B10,
+    // =-C1:D5, =IF(A1:A10>0,B1:B10,0)), дают по значению на каждый элемент
+    // результата. GetArraySize() возвращает размер результата - наибольший
+    // из размеров таких областей - или nullopt, если формула обычная. В
+    // элементе (row, col) каждая область читает свою ячейку с тем же
+    // смещением, а если область меньше, - #N/A; ячейки и числа формулы общие
+    // для всех элементов. Evaluate() формулы-массива возвращает элемент (0, 0).
+    virtual std::optional<Size> GetArraySize() const = 0;
+    virtual Value EvaluateElement(const SheetInterface& sheet, int row, int col) const = 0;
+
+    // Привязывает ссылки формулы к ячейкам: resolve возвращает ячейку по
+    // позиции или nullptr, если её значение нужно искать в таблице.
+    // Привязанная ссылка вычисляется без поиска ячейки. Ячейки должны жить,
+    // пока формула к ним привязана; повторный вызов перепривязывает ссылки.
+    using InputResolver = std::function<const FormulaInput*(Position)>;
+    virtual void BindInputs(const InputResolver& resolve) = 0;
+
+    // Переписывает ссылки формулы при вставке и удалении строк и столбцов.
+    // Ссылка на удалённую ячейку и область, удалённая целиком, вычисляются
+    // в #REF!, область, удалённая частично, сужается.
+    virtual void MoveReferences(const CellShift& shift) = 0;
+
+    // Копия формулы для ячейки, сдвинутой на rows строк и cols столбцов:
+    // ссылки сдвигаются так же, без повторного разбора. Ссылка, ушедшая за
+    // край таблицы, и область, вышедшая за него хотя бы частично,
+    // вычисляются в #REF!. Копия ни к чему не привязана (BindInputs).
+    virtual std::unique_ptr<FormulaInterface> Translate(int rows, int cols) const = 0;
+    // Копия на замену формуле в той же ячейке той же таблицы: в отличие от
+    // Translate(0, 0), она сохраняет привязку ссылок и аргументы, которые
+    // условия вычислили в последний раз.
+    virtual std::unique_ptr<FormulaInterface> Clone() const = 0;
+
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
@@ -34,8 +139,39 @@ public:
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает области (A1:C10), которые формула передаёт функциям или
+    // вычисляет поэлементно, в том же порядке. Ячейки областей в
+    // GetReferencedCells() не входят.
+    virtual std::vector<Range> GetReferencedRanges() const = 0;
+
+    // Есть ли в формуле условия, которые могут не прочитать часть ячеек
+    // из GetReferencedCells() (невыбранная ветвь IF)
+    virtual bool HasConditions() const = 0;
+
+    // Возвращает ячейки, прочитанные последним вызовом Evaluate(), - от
+    // остальных значение формулы не зависит, пока не изменятся эти. До
+    // первого вычисления - все ячейки. Список отсортирован по возрастанию и
+    // не содержит повторяющихся ячеек.
+    virtual std::vector<Position> GetLiveReferences() const = 0;
+
+    // Записывает формулу, находящуюся в ячейке origin, в виде программы.
+    // Возвращает false, если формулу так записать нельзя.
+    virtual bool Compile(Position origin, FormulaProgram& program) const = 0;
+
+    // Возвращает число байт, занимаемых формулой: объект, узлы AST и список
+    // ячеек
+    virtual size_t GetMemoryUsage() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Извлекает из текста формулы позиции ячеек, не строя AST. Используется при
+// отложенном разборе формул: зависимости нужны сразу, а сама формула может
+// так и не понадобиться. Список отсортирован по возрастанию и не содержит
+// повторяющихся ячеек, как и FormulaInterface::GetReferencedCells().
+// Бросает FormulaException, если встретилась ссылка на некорректную позицию.
+// Синтаксис остальной части выражения не проверяется.
+std::vector<Position> ScanFormulaReferences(std::string_view expression);
@@ -0,0 +1,597 @@
+#include "journal.h"
+
+#include <array>
+#include <cerrno>
+#include <filesystem>
+#include <fstream>
+#include <utility>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+// длиннее текст ячейки быть не может - значит, запись повреждена
+const uint64_t MAX_TEXT_SIZE = uint64_t{1} << 30;
+const uint64_t MAX_RECORD_SIZE = MAX_TEXT_SIZE + 64;
+// контрольная точка пишется в файл крупными порциями
+const size_t CHECKPOINT_FLUSH_THRESHOLD = 1 << 20;
+const size_t JOURNAL_HEADER_SIZE = JOURNAL_MAGIC.size() + 1;
+
+// CRC-32 (IEEE 802.3, как в zlib); crc - значение для предыдущих байтов
+uint32_t Crc32(string_view data, uint32_t crc = 0) {
+    static const auto table = [] {
+        array<uint32_t, 256> result{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = value & 1 ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+            }
+            result[i] = value;
+        }
+        return result;
+    }();
+
+    crc = ~crc;
+    for (char c : data) {
+        crc = table[(crc ^ static_cast<unsigned char>(c)) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void AppendVarint(string& buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer += static_cast<char>(value);
+}
+
+void AppendUint32(string& buffer, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        buffer += static_cast<char>(value >> (8 * i));
+    }
+}
+
+uint32_t ParseUint32(const char* data) {
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i) {
+        value |= uint32_t{static_cast<unsigned char>(data[i])} << (8 * i);
+    }
+    return value;
+}
+
+bool ParseVarint(string_view data, size_t& offset, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64 && offset < data.size(); shift += 7) {
+        unsigned char byte = static_cast<unsigned char>(data[offset++]);
+        value |= uint64_t{byte & 0x7Fu} << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// полезная часть записи журнала; false - запись повреждена
+bool ParseRecord(string_view data, uint64_t& lsn, TraceRecord& record) {
+    size_t offset = 0;
+    if (!ParseVarint(data, offset, lsn) || offset >= data.size()) {
+        return false;
+    }
+    record = TraceRecord{};
+    record.op = static_cast<TraceOp>(data[offset++]);
+
+    uint64_t a = 0;
+    uint64_t b = 0;
+    switch (record.op) {
+        case TraceOp::SetCell:
+        case TraceOp::ClearCell:
+            if (!ParseVarint(data, offset, a) || !ParseVarint(data, offset, b)) {
+                return false;
+            }
+            record.pos = { static_cast<int>(a), static_cast<int>(b) };
+            if (record.op == TraceOp::SetCell) {
+                if (!ParseVarint(data, offset, a) || a != data.size() - offset) {
+                    return false;
+                }
+                record.text = data.substr(offset);
+                offset = data.size();
+            }
+            break;
+        case TraceOp::InsertRows:
+        case TraceOp::DeleteRows:
+        case TraceOp::InsertColumns:
+        case TraceOp::DeleteColumns:
+            if (!ParseVarint(data, offset, a) || !ParseVarint(data, offset, b)) {
+                return false;
+            }
+            record.first = static_cast<int>(a);
+            record.count = static_cast<int>(b);
+            break;
+        case TraceOp::ClearRange:
+        case TraceOp::CopyRange:
+        case TraceOp::MoveRange: {
+            uint64_t c = 0;
+            uint64_t d = 0;
+            if (!ParseVarint(data, offset, a) || !ParseVarint(data, offset, b) || !ParseVarint(data, offset, c)
+                || !ParseVarint(data, offset, d)) {
+                return false;
+            }
+            record.range = { { static_cast<int>(a), static_cast<int>(b) }, { static_cast<int>(c), static_cast<int>(d) } };
+            if (record.op != TraceOp::ClearRange) {
+                if (!ParseVarint(data, offset, a) || !ParseVarint(data, offset, b)) {
+                    return false;
+                }
+                record.pos = { static_cast<int>(a), static_cast<int>(b) };
+            }
+            break;
+        }
+        default:
+            return false;
+    }
+    return offset == data.size();
+}
+
+// Файлы журнала и контрольной точки открываются и пишутся напрямую, без
+// буферов потоков: группа записей должна дойти до диска к концу fsync
+int OpenFile(const string& path, bool truncate) {
+#ifdef _WIN32
+    int fd = _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_BINARY | (truncate ? _O_TRUNC : 0),
+                   _S_IREAD | _S_IWRITE);
+#else
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (truncate ? O_TRUNC : 0), 0644);
+#endif
+    if (fd < 0) {
+        throw JournalException("Cannot open " + path);
+    }
+    return fd;
+}
+
+void CloseFile(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    close(fd);
+#endif
+}
+
+void WriteFile(int fd, string_view data, const string& path) {
+    while (!data.empty()) {
+#ifdef _WIN32
+        auto written = _write(fd, data.data(), static_cast<unsigned>(min<size_t>(data.size(), 1 << 30)));
+#else
+        auto written = write(fd, data.data(), data.size());
+#endif
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw JournalException("Cannot write " + path);
+        }
+        data.remove_prefix(static_cast<size_t>(written));
+    }
+}
+
+void SyncFile(int fd, const string& path) {
+#ifdef _WIN32
+    int result = _commit(fd);
+#else
+    int result = fsync(fd);
+#endif
+    if (result != 0) {
+        throw JournalException("Cannot sync " + path);
+    }
+}
+
+// отрезает файл до size байт и ставит позицию записи в конец
+void TruncateFile(int fd, uint64_t size, const string& path) {
+#ifdef _WIN32
+    bool ok = _chsize_s(fd, size) == 0 && _lseeki64(fd, size, SEEK_SET) >= 0;
+#else
+    bool ok = ftruncate(fd, static_cast<off_t>(size)) == 0 && lseek(fd, static_cast<off_t>(size), SEEK_SET) >= 0;
+#endif
+    if (!ok) {
+        throw JournalException("Cannot truncate " + path);
+    }
+}
+
+// переименование файла надёжно, только когда записан и каталог
+void SyncDirectory(const string& path) {
+#ifndef _WIN32
+    string directory = filesystem::path(path).parent_path().string();
+    int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+#endif
+}
+
+// Чтение контрольной точки с подсчётом CRC-32 прочитанного
+class CheckedReader {
+public:
+    explicit CheckedReader(istream& input) : input_(input) {}
+
+    string Read(size_t size) {
+        string data(size, '\0');
+        if (!input_.read(data.data(), data.size())) {
+            throw JournalException("Truncated checkpoint");
+        }
+        crc_ = Crc32(data, crc_);
+        return data;
+    }
+
+    uint64_t ReadVarint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char byte = static_cast<unsigned char>(Read(1)[0]);
+            value |= uint64_t{byte & 0x7Fu} << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        throw JournalException("Malformed varint in checkpoint");
+    }
+
+    uint32_t GetCrc() const {
+        return crc_;
+    }
+
+private:
+    istream& input_;
+    uint32_t crc_ = 0;
+};
+}  // namespace
+
+JournalWriter::JournalWriter(string path, uint64_t valid_size, uint64_t next_lsn, JournalOptions options)
+    : path_(move(path))
+    , fd_(OpenFile(path_, false))
+    , options_(options)
+    , next_lsn_(next_lsn) {
+    try {
+        if (valid_size < JOURNAL_HEADER_SIZE) {
+            string header(JOURNAL_MAGIC);
+            header += static_cast<char>(JOURNAL_VERSION);
+            TruncateFile(fd_, 0, path_);
+            WriteFile(fd_, header, path_);
+        } else {
+            TruncateFile(fd_, valid_size, path_);
+        }
+        SyncFile(fd_, path_);
+        // без срока группы каждая запись и так уходит на диск сразу
+        if (options_.group_size > 1 && options_.group_delay.count() > 0) {
+            flusher_ = thread(&JournalWriter::RunFlusher, this);
+        }
+    } catch (...) {
+        CloseFile(fd_);
+        throw;
+    }
+}
+
+JournalWriter::~JournalWriter() {
+    {
+        lock_guard lock(mutex_);
+        stopping_ = true;
+    }
+    wake_.notify_one();
+    if (flusher_.joinable()) {
+        flusher_.join();
+    }
+    try {
+        Sync();
+    } catch (const JournalException&) {
+    }
+    CloseFile(fd_);
+}
+
+void JournalWriter::Write(TraceOp op, Position pos, string_view text) {
+    BeginRecord(op);
+    AppendVarint(payload_, pos.row);
+    AppendVarint(payload_, pos.col);
+    if (op == TraceOp::SetCell) {
+        AppendVarint(payload_, text.size());
+        payload_ += text;
+    }
+    EndRecord();
+}
+
+void JournalWriter::WriteShift(TraceOp op, int first, int count) {
+    BeginRecord(op);
+    AppendVarint(payload_, first);
+    AppendVarint(payload_, count);
+    EndRecord();
+}
+
+void JournalWriter::WriteRange(TraceOp op, const Range& range, Position target) {
+    BeginRecord(op);
+    AppendVarint(payload_, range.first.row);
+    AppendVarint(payload_, range.first.col);
+    AppendVarint(payload_, range.last.row);
+    AppendVarint(payload_, range.last.col);
+    if (op != TraceOp::ClearRange) {
+        AppendVarint(payload_, target.row);
+        AppendVarint(payload_, target.col);
+    }
+    EndRecord();
+}
+
+void JournalWriter::Sync() {
+    unique_lock lock(mutex_);
+    if (error_) {
+        wake_.notify_one();
+        rethrow_exception(exchange(error_, nullptr));
+    }
+    Flush(lock);
+}
+
+void JournalWriter::Reset() {
+    Sync();
+    {
+        lock_guard io_lock(io_mutex_);
+        TruncateFile(fd_, JOURNAL_HEADER_SIZE, path_);
+        SyncFile(fd_, path_);
+    }
+    lock_guard lock(mutex_);
+    ++stats_.checkpoints;
+}
+
+const string& JournalWriter::GetPath() const {
+    return path_;
+}
+
+uint64_t JournalWriter::GetLastLsn() const {
+    return next_lsn_ - 1;
+}
+
+JournalStats JournalWriter::GetStats() const {
+    lock_guard lock(mutex_);
+    return stats_;
+}
+
+void JournalWriter::SetRecoveryStats(const JournalStats& stats) {
+    lock_guard lock(mutex_);
+    stats_.checkpoint_cells = stats.checkpoint_cells;
+    stats_.replayed_records = stats.replayed_records;
+    stats_.discarded_bytes = stats.discarded_bytes;
+    stats_.recovery_time = stats.recovery_time;
+}
+
+void JournalWriter::BeginRecord(TraceOp op) {
+    payload_.clear();
+    AppendVarint(payload_, next_lsn_);
+    payload_ += static_cast<char>(op);
+}
+
+void JournalWriter::EndRecord() {
+    uint32_t crc = Crc32(payload_);
+    unique_lock lock(mutex_);
+    AppendUint32(buffer_, static_cast<uint32_t>(payload_.size()));
+    AppendUint32(buffer_, crc);
+    buffer_ += payload_;
+    ++next_lsn_;
+    ++stats_.records;
+    stats_.bytes += payload_.size() + 8;
+
+    auto now = chrono::steady_clock::now();
+    if (pending_++ == 0) {
+        group_start_ = now;
+        wake_.notify_one();
+    }
+    // запись уже в группе: её сбросит следующая попытка фонового потока
+    if (error_) {
+        wake_.notify_one();
+        rethrow_exception(exchange(error_, nullptr));
+    }
+    if (pending_ >= options_.group_size || now - group_start_ >= options_.group_delay) {
+        Flush(lock);
+    }
+}
+
+void JournalWriter::Flush(unique_lock<mutex>& lock) {
+    lock.unlock();
+    lock_guard io_lock(io_mutex_);
+    lock.lock();
+    if (buffer_.empty()) {
+        return;
+    }
+    // буферы меняются местами, чтобы не выделять память заново
+    flushing_.swap(buffer_);
+    size_t records = exchange(pending_, 0);
+    lock.unlock();
+
+    auto start = chrono::steady_clock::now();
+    try {
+        WriteFile(fd_, flushing_, path_);
+        SyncFile(fd_, path_);
+    } catch (...) {
+        // группа встаёт перед записями, накопленными за это время
+        lock.lock();
+        buffer_.insert(0, flushing_);
+        flushing_.clear();
+        if (pending_ == 0) {
+            group_start_ = start;
+        }
+        pending_ += records;
+        throw;
+    }
+    auto time = chrono::steady_clock::now() - start;
+    flushing_.clear();
+
+    lock.lock();
+    stats_.sync_time += time;
+    ++stats_.syncs;
+}
+
+void JournalWriter::RunFlusher() {
+    unique_lock lock(mutex_);
+    while (!stopping_) {
+        // после ошибки записи поток ждёт, пока её не получит поток правок
+        if (pending_ == 0 || error_) {
+            wake_.wait(lock);
+            continue;
+        }
+        auto deadline = group_start_ + options_.group_delay;
+        if (chrono::steady_clock::now() < deadline) {
+            wake_.wait_until(lock, deadline);
+            continue;
+        }
+        try {
+            Flush(lock);
+        } catch (const JournalException&) {
+            error_ = current_exception();
+        }
+    }
+}
+
+JournalReadResult ReadJournal(const string& path, uint64_t after_lsn, const function<void(TraceRecord&)>& apply) {
+    JournalReadResult result;
+    ifstream input(path, ios::binary | ios::ate);
+    if (!input) {
+        return result;
+    }
+    result.file_size = static_cast<uint64_t>(input.tellg());
+    input.seekg(0);
+
+    // файл, оборванный при создании, пишется заново
+    string header(JOURNAL_HEADER_SIZE, '\0');
+    if (!input.read(header.data(), header.size())) {
+        return result;
+    }
+    if (string_view(header).substr(0, JOURNAL_MAGIC.size()) != JOURNAL_MAGIC) {
+        throw JournalException("Not a spreadsheet journal: " + path);
+    }
+    if (static_cast<uint8_t>(header.back()) != JOURNAL_VERSION) {
+        throw JournalException("Unsupported journal version " + to_string(static_cast<uint8_t>(header.back())));
+    }
+    result.valid_size = JOURNAL_HEADER_SIZE;
+
+    char prefix[8];
+    string payload;
+    TraceRecord record;
+    while (input.read(prefix, sizeof(prefix))) {
+        uint32_t size = ParseUint32(prefix);
+        if (size > MAX_RECORD_SIZE || size > result.file_size - result.valid_size - sizeof(prefix)) {
+            break;
+        }
+        payload.resize(size);
+        uint64_t lsn = 0;
+        if (!input.read(payload.data(), payload.size()) || Crc32(payload) != ParseUint32(prefix + 4)
+            || !ParseRecord(payload, lsn, record)) {
+            break;
+        }
+
+        if (lsn > after_lsn) {
+            apply(record);
+        }
+        result.last_lsn = lsn;
+        result.valid_size += sizeof(prefix) + size;
+    }
+    return result;
+}
+
+CheckpointWriter::CheckpointWriter(string path, uint64_t lsn)
+    : path_(move(path))
+    , temp_path_(path_ + ".tmp")
+    , fd_(OpenFile(temp_path_, true)) {
+    string header(CHECKPOINT_MAGIC);
+    header += static_cast<char>(JOURNAL_VERSION);
+    WriteFile(fd_, header, temp_path_);
+    AppendVarint(buffer_, lsn);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    if (fd_ >= 0) {
+        CloseFile(fd_);
+    }
+    if (!temp_path_.empty()) {
+        error_code ignored;
+        filesystem::remove(temp_path_, ignored);
+    }
+}
+
+void CheckpointWriter::Add(Position pos, string_view text) {
+    buffer_ += '\1';
+    AppendVarint(buffer_, pos.row);
+    AppendVarint(buffer_, pos.col);
+    AppendVarint(buffer_, text.size());
+    buffer_ += text;
+    if (buffer_.size() >= CHECKPOINT_FLUSH_THRESHOLD) {
+        Flush();
+    }
+}
+
+void CheckpointWriter::Commit() {
+    buffer_ += '\0';
+    Flush();
+    AppendUint32(buffer_, crc_);
+    WriteFile(fd_, buffer_, temp_path_);
+    buffer_.clear();
+    SyncFile(fd_, temp_path_);
+    CloseFile(fd_);
+    fd_ = -1;
+
+    error_code error;
+    filesystem::rename(temp_path_, path_, error);
+    if (error) {
+        throw JournalException("Cannot replace checkpoint " + path_ + ": " + error.message());
+    }
+    temp_path_.clear();
+    SyncDirectory(path_);
+}
+
+void CheckpointWriter::Flush() {
+    crc_ = Crc32(buffer_, crc_);
+    WriteFile(fd_, buffer_, temp_path_);
+    buffer_.clear();
+}
+
+optional<uint64_t> ReadCheckpoint(const string& path, const function<void(Position, string)>& apply) {
+    ifstream input(path, ios::binary);
+    if (!input) {
+        return nullopt;
+    }
+
+    string header(CHECKPOINT_MAGIC.size() + 1, '\0');
+    if (!input.read(header.data(), header.size())
+        || string_view(header).substr(0, CHECKPOINT_MAGIC.size()) != CHECKPOINT_MAGIC) {
+        throw JournalException("Not a spreadsheet checkpoint: " + path);
+    }
+    if (static_cast<uint8_t>(header.back()) != JOURNAL_VERSION) {
+        throw JournalException("Unsupported checkpoint version " + to_string(static_cast<uint8_t>(header.back())));
+    }
+
+    CheckedReader reader(input);
+    uint64_t lsn = reader.ReadVarint();
+    for (;;) {
+        char marker = reader.Read(1)[0];
+        if (marker == '\0') {
+            break;
+        }
+        if (marker != '\1') {
+            throw JournalException("Malformed checkpoint " + path);
+        }
+        Position pos;
+        pos.row = static_cast<int>(reader.ReadVarint());
+        pos.col = static_cast<int>(reader.ReadVarint());
+        uint64_t size = reader.ReadVarint();
+        if (size > MAX_TEXT_SIZE) {
+            throw JournalException("Malformed checkpoint " + path);
+        }
+        apply(pos, reader.Read(size));
+    }
+
+    uint32_t crc = reader.GetCrc();
+    char stored[4];
+    if (!input.read(stored, sizeof(stored)) || ParseUint32(stored) != crc) {
+        throw JournalException("Checkpoint checksum mismatch: " + path);
+    }
+    return lsn;
+}
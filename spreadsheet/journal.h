@@ -0,0 +1,167 @@
+#pragma once
+
+#include "common.h"
+#include "trace.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+
+// Журнал предзаписи и контрольные точки (Sheet::OpenJournal).
+//
+// Журнал: JOURNAL_MAGIC, байт версии, затем записи. Запись - длина полезной
+// части и её CRC-32 (по 4 байта, little-endian), полезная часть - номер
+// записи, байт TraceOp и поля операции в том же виде, что и в журнале
+// операций (trace.h), без отметки времени. Номера записей растут и не
+// начинаются заново после контрольной точки.
+//
+// Контрольная точка: CHECKPOINT_MAGIC, байт версии, номер последней
+// вошедшей в неё записи журнала, затем ячейки - байт 1, строка, столбец,
+// длина текста и текст, - байт 0 и CRC-32 всего, что после заголовка.
+// Целые числа, кроме длин и CRC-32 записей журнала, - varint (LEB128).
+inline constexpr std::string_view JOURNAL_MAGIC = "SSJRNL";
+inline constexpr std::string_view CHECKPOINT_MAGIC = "SSCHKPT";
+inline constexpr uint8_t JOURNAL_VERSION = 1;
+
+// Исключение, выбрасываемое при ошибке записи журнала или контрольной точки
+// и при чтении повреждённой контрольной точки
+class JournalException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+struct JournalOptions {
+    // Записи копятся в памяти и уходят на диск группой с одним fsync: когда
+    // их набралось group_size или первая из них ждёт group_delay. Группу,
+    // которая не набралась к сроку, сбрасывает фоновый поток журнала, и
+    // правка оказывается на диске не позже чем через group_delay плюс время
+    // fsync после того, как она вернула управление. При сбое процесса или
+    // системы теряются только правки за этот срок; Sheet::SyncJournal()
+    // сразу дожидается записи всех. Ошибку записи из фонового потока
+    // бросает следующая запись или Sync().
+    size_t group_size = 64;
+    std::chrono::microseconds group_delay{ 2000 };
+};
+
+struct JournalStats {
+    // запись с открытия журнала
+    uint64_t records = 0;
+    uint64_t bytes = 0;
+    uint64_t syncs = 0;
+    std::chrono::nanoseconds sync_time{ 0 };
+    uint64_t checkpoints = 0;
+
+    // восстановление при открытии: ячейки из контрольной точки, применённые
+    // записи журнала и отброшенный оборванный или повреждённый хвост
+    uint64_t checkpoint_cells = 0;
+    uint64_t replayed_records = 0;
+    uint64_t discarded_bytes = 0;
+    std::chrono::nanoseconds recovery_time{ 0 };
+};
+
+// Дописывает записи в журнал с групповой фиксацией
+class JournalWriter {
+public:
+    // Открывает журнал path (создаёт, если его нет) и отрезает всё после
+    // valid_size байт - оборванный при сбое хвост. next_lsn - номер
+    // следующей записи.
+    JournalWriter(std::string path, uint64_t valid_size, uint64_t next_lsn, JournalOptions options);
+    JournalWriter(const JournalWriter&) = delete;
+    JournalWriter& operator=(const JournalWriter&) = delete;
+    // Фиксирует оставшиеся записи
+    ~JournalWriter();
+
+    void Write(TraceOp op, Position pos = Position::NONE, std::string_view text = {});
+    void WriteShift(TraceOp op, int first, int count);
+    void WriteRange(TraceOp op, const Range& range, Position target = Position::NONE);
+    // сбрасывает накопленные записи на диск и ждёт fsync
+    void Sync();
+    // Очищает журнал - всё в нём уже вошло в контрольную точку
+    void Reset();
+
+    const std::string& GetPath() const;
+    // номер последней записанной записи (0 - записей не было)
+    uint64_t GetLastLsn() const;
+    JournalStats GetStats() const;
+    // счётчики восстановления, которое прошло до открытия журнала
+    void SetRecoveryStats(const JournalStats& stats);
+
+private:
+    std::string path_;
+    int fd_ = -1;
+    JournalOptions options_;
+    uint64_t next_lsn_;
+    std::string payload_;
+
+    // Группу пишут и поток правок, и фоновый поток: mutex_ защищает
+    // накопленные записи и счётчики, а io_mutex_ - файл, чтобы группы
+    // ложились в него по порядку. fsync идёт без mutex_, и правки тем
+    // временем копятся в следующую группу.
+    mutable std::mutex mutex_;
+    std::mutex io_mutex_;
+    std::condition_variable wake_;
+    std::string buffer_;
+    // группа, которая пишется сейчас (под io_mutex_)
+    std::string flushing_;
+    size_t pending_ = 0;
+    std::chrono::steady_clock::time_point group_start_;
+    JournalStats stats_;
+    std::exception_ptr error_;
+    bool stopping_ = false;
+    std::thread flusher_;
+
+    void BeginRecord(TraceOp op);
+    void EndRecord();
+    // сбрасывает группу; lock - захваченный mutex_, на время записи он
+    // отпускается
+    void Flush(std::unique_lock<std::mutex>& lock);
+    // фоновый поток: сбрасывает группы, дождавшиеся group_delay
+    void RunFlusher();
+};
+
+// Читает журнал path и передаёт apply записи с номером больше after_lsn.
+// Чтение останавливается на первой оборванной или повреждённой записи.
+struct JournalReadResult {
+    uint64_t valid_size = 0;  // длина корректного начала файла; 0 - файла нет
+    uint64_t file_size = 0;
+    uint64_t last_lsn = 0;
+};
+JournalReadResult ReadJournal(const std::string& path, uint64_t after_lsn,
+                              const std::function<void(TraceRecord&)>& apply);
+
+// Пишет контрольную точку во временный файл рядом с path; Commit()
+// атомарно заменяет им прежнюю контрольную точку. Без Commit() временный
+// файл удаляется, а прежняя контрольная точка остаётся.
+class CheckpointWriter {
+public:
+    CheckpointWriter(std::string path, uint64_t lsn);
+    CheckpointWriter(const CheckpointWriter&) = delete;
+    CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+    ~CheckpointWriter();
+
+    void Add(Position pos, std::string_view text);
+    void Commit();
+
+private:
+    std::string path_;
+    std::string temp_path_;
+    int fd_ = -1;
+    std::string buffer_;
+    uint32_t crc_ = 0;
+
+    void Flush();
+};
+
+// Передаёт apply ячейки контрольной точки path и возвращает её номер
+// записи; nullopt - контрольной точки нет. Несовпадение CRC-32 или обрыв
+// бросают JournalException - ячейки, переданные до этого, остаются.
+std::optional<uint64_t> ReadCheckpoint(const std::string& path,
+                                       const std::function<void(Position, std::string)>& apply);
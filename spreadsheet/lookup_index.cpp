@@ -0,0 +1,225 @@
+#include "lookup_index.h"
+
+#include "memory_usage.h"
+#include "numeric_columns.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <functional>
+#include <string>
+
+using namespace std;
+
+namespace {
+string ToLower(string_view text) {
+    string result(text);
+    for (char& c : result) {
+        c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return result;
+}
+
+LookupKey Normalize(const LookupKey& key) {
+    if (holds_alternative<string>(key)) {
+        return ToLower(get<string>(key));
+    }
+    // -0 и 0 - один ключ
+    double number = get<double>(key);
+    return number == 0 ? 0.0 : number;
+}
+
+size_t GetKeyHeapSize(const LookupKey& key) {
+    return holds_alternative<string>(key) ? GetHeapSize(get<string>(key)) : 0;
+}
+
+// узел контейнера на основе списка или дерева: значение и служебные указатели
+template <typename T>
+size_t NodeSize(size_t pointers) {
+    return sizeof(T) + pointers * sizeof(void*);
+}
+}  // namespace
+
+optional<LookupKey> MakeLookupKey(const CellInterface::ValueView& value) {
+    if (holds_alternative<double>(value)) {
+        return Normalize(get<double>(value));
+    }
+    if (holds_alternative<FormulaError>(value)) {
+        return nullopt;
+    }
+
+    string_view text = get<string_view>(value);
+    if (text.empty()) {
+        return nullopt;
+    }
+    if (auto number = ParseNumber(text)) {
+        // nan не равно ничему, в том числе себе, и сломало бы порядок ключей
+        if (isnan(*number)) {
+            return nullopt;
+        }
+        return Normalize(*number);
+    }
+    return ToLower(text);
+}
+
+size_t LookupKeyHash::operator()(const LookupKey& key) const {
+    if (holds_alternative<double>(key)) {
+        return hash<double>()(get<double>(key));
+    }
+    return hash<string>()(get<string>(key));
+}
+
+void ColumnIndex::Set(int row, optional<LookupKey> key) {
+    stale_.erase(row);
+
+    auto it = keys_.find(row);
+    if (it != keys_.end()) {
+        if (key && it->second == *key) {
+            return;
+        }
+        Erase(row, it->second);
+        keys_.erase(it);
+    }
+
+    if (key) {
+        Insert(row, *key);
+        keys_.emplace(row, move(*key));
+    }
+}
+
+void ColumnIndex::MarkStale(int row) {
+    auto it = keys_.find(row);
+    if (it != keys_.end()) {
+        Erase(row, it->second);
+        keys_.erase(it);
+    }
+    stale_.insert(row);
+}
+
+vector<int> ColumnIndex::TakeStale(int first_row, int last_row) {
+    auto begin = stale_.lower_bound(first_row);
+    auto end = stale_.upper_bound(last_row);
+    vector<int> result(begin, end);
+    stale_.erase(begin, end);
+    return result;
+}
+
+optional<int> ColumnIndex::Find(const LookupKey& key, int first_row, int last_row, LookupMatch match) {
+    LookupKey normalized = Normalize(key);
+
+    switch (match) {
+        case LookupMatch::Exact:
+            return FindExact(normalized, first_row, last_row);
+        case LookupMatch::ExactOrSmaller:
+            return FindNearest(normalized, first_row, last_row, true);
+        case LookupMatch::ExactOrLarger:
+            return FindNearest(normalized, first_row, last_row, false);
+    }
+    return nullopt;
+}
+
+size_t ColumnIndex::GetMemoryUsage() const {
+    size_t result = keys_.bucket_count() * sizeof(void*) + keys_.size() * NodeSize<pair<const int, LookupKey>>(2);
+    for (auto& [row, key] : keys_) {
+        result += GetKeyHeapSize(key);
+    }
+
+    if (rows_by_key_) {
+        result += rows_by_key_->bucket_count() * sizeof(void*);
+        for (auto& [key, rows] : *rows_by_key_) {
+            result += NodeSize<pair<const LookupKey, vector<int>>>(2) + GetKeyHeapSize(key)
+                      + rows.capacity() * sizeof(int);
+        }
+    }
+    if (ordered_) {
+        for (const Entry& entry : *ordered_) {
+            result += NodeSize<Entry>(3) + sizeof(int) + GetKeyHeapSize(entry.first);
+        }
+    }
+    return result + stale_.size() * NodeSize<int>(3);
+}
+
+void ColumnIndex::Insert(int row, const LookupKey& key) {
+    if (rows_by_key_) {
+        vector<int>& rows = (*rows_by_key_)[key];
+        rows.insert(lower_bound(rows.begin(), rows.end(), row), row);
+    }
+    if (ordered_) {
+        ordered_->emplace(key, row);
+    }
+}
+
+void ColumnIndex::Erase(int row, const LookupKey& key) {
+    if (rows_by_key_) {
+        auto it = rows_by_key_->find(key);
+        vector<int>& rows = it->second;
+        rows.erase(lower_bound(rows.begin(), rows.end(), row));
+        if (rows.empty()) {
+            rows_by_key_->erase(it);
+        }
+    }
+    if (ordered_) {
+        ordered_->erase({key, row});
+    }
+}
+
+optional<int> ColumnIndex::FindExact(const LookupKey& key, int first_row, int last_row) {
+    if (!rows_by_key_) {
+        rows_by_key_.emplace();
+        for (auto& [row, row_key] : keys_) {
+            (*rows_by_key_)[row_key].push_back(row);
+        }
+        for (auto& [row_key, rows] : *rows_by_key_) {
+            sort(rows.begin(), rows.end());
+        }
+    }
+
+    auto it = rows_by_key_->find(key);
+    if (it == rows_by_key_->end()) {
+        return nullopt;
+    }
+    auto row = lower_bound(it->second.begin(), it->second.end(), first_row);
+    if (row == it->second.end() || *row > last_row) {
+        return nullopt;
+    }
+    return *row;
+}
+
+optional<int> ColumnIndex::FindNearest(const LookupKey& key, int first_row, int last_row, bool smaller) {
+    if (!ordered_) {
+        ordered_.emplace();
+        for (auto& [row, row_key] : keys_) {
+            ordered_->emplace(row_key, row);
+        }
+    }
+
+    auto in_range = [first_row, last_row](const Entry& entry) {
+        return entry.second >= first_row && entry.second <= last_row;
+    };
+
+    if (smaller) {
+        auto it = ordered_->upper_bound({key, INT_MAX});
+        while (it != ordered_->begin()) {
+            --it;
+            // число никогда не подходит для текста и наоборот
+            if (it->first.index() != key.index()) {
+                return nullopt;
+            }
+            if (in_range(*it)) {
+                // из строк с найденным ключом нужна верхняя
+                return ordered_->lower_bound({it->first, first_row})->second;
+            }
+        }
+        return nullopt;
+    }
+
+    for (auto it = ordered_->lower_bound({key, INT_MIN}); it != ordered_->end(); ++it) {
+        if (it->first.index() != key.index()) {
+            return nullopt;
+        }
+        if (in_range(*it)) {
+            return it->second;
+        }
+    }
+    return nullopt;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "common.h"
+
+#include <climits>
+#include <cstddef>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Ключ, под которым значение ячейки попадает в индекс: число или текст в
+// нижнем регистре - поиск не различает регистр. Текст, который целиком
+// является записью числа, - число. У пустой ячейки и ошибки ключа нет.
+std::optional<LookupKey> MakeLookupKey(const CellInterface::ValueView& value);
+
+struct LookupKeyHash {
+    size_t operator()(const LookupKey& key) const;
+};
+
+// Индекс значений одного столбца таблицы для функций поиска (см.
+// Sheet::Lookup). Таблица сообщает индексу каждое изменение значения ячейки
+// столбца, поэтому он обновляется по одной строке, а не перестраивается.
+// Точный поиск идёт по хеш-таблице ключ -> строки за O(1), приближённый - по
+// упорядоченному множеству (ключ, строка) за O(log n); каждая из структур
+// строится при первом поиске своего вида. Значения устаревших формул
+// неизвестны до их вычисления: такие строки индекс помнит отдельно, и перед
+// поиском таблица их вычисляет.
+class ColumnIndex {
+public:
+    // строка получила значение (nullopt - значение без ключа)
+    void Set(int row, std::optional<LookupKey> key);
+    // значение строки больше неизвестно
+    void MarkStale(int row);
+    // устаревшие строки из [first_row, last_row]; после вызова они не числятся устаревшими
+    std::vector<int> TakeStale(int first_row, int last_row);
+
+    // Верхняя строка из [first_row, last_row] с ключом key, а при неточном
+    // поиске - с ближайшим меньшим (большим) ключом того же типа. Строки
+    // вне области, ключи которых лежат между искомым и найденным, поиск
+    // перебирает; когда область покрывает весь заполненный столбец, их нет.
+    std::optional<int> Find(const LookupKey& key, int first_row, int last_row, LookupMatch match);
+
+    // оценка: узлы и корзины контейнеров и текст ключей
+    size_t GetMemoryUsage() const;
+
+private:
+    using Entry = std::pair<LookupKey, int>;
+
+    std::unordered_map<int, LookupKey> keys_;
+    std::optional<std::unordered_map<LookupKey, std::vector<int>, LookupKeyHash>> rows_by_key_;
+    std::optional<std::set<Entry>> ordered_;
+    std::set<int> stale_;
+
+    void Insert(int row, const LookupKey& key);
+    void Erase(int row, const LookupKey& key);
+    std::optional<int> FindExact(const LookupKey& key, int first_row, int last_row);
+    std::optional<int> FindNearest(const LookupKey& key, int first_row, int last_row, bool smaller);
+};
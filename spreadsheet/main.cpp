@@ -1,7 +1,12 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <limits>
+#include <thread>
 
 #include "common.h"
 #include "formula.h"
+#include "sheet.h"
 #include "test_runner_p.h"
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
@@ -50,7 +55,7 @@ void TestPositionAndStringConversion() {
     testSingle(Position{0, 701}, "ZZ1");
     testSingle(Position{0, 702}, "AAA1");
     testSingle(Position{136, 2}, "C137");
-    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD16384");
+    testSingle(Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1}, "XFD1048576");
 }
 
 void TestPositionToStringInvalid() {
@@ -69,7 +74,8 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("A+1").IsValid());
     ASSERT(!Position::FromString("R2D2").IsValid());
     ASSERT(!Position::FromString("C3PO").IsValid());
-    ASSERT(!Position::FromString("XFD16385").IsValid());
+    ASSERT(!Position::FromString("XFD1048577").IsValid());
+    ASSERT(!Position::FromString("A99999999999").IsValid());
     ASSERT(!Position::FromString("XFE16384").IsValid());
     ASSERT(!Position::FromString("A1234567890123456789").IsValid());
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
@@ -265,9 +271,9 @@ void TestFormulaInvalidPosition() {
 
     try_formula("=X0");
     try_formula("=ABCD1");
-    try_formula("=A123456");
+    try_formula("=A1234567");
     try_formula("=ABCDEFGHIJKLMNOPQRS1234567890");
-    try_formula("=XFD16385");
+    try_formula("=XFD1048577");
     try_formula("=XFE16384");
     try_formula("=R2D2");
 }
@@ -303,9 +309,10 @@ void TestCellReferences() {
     ASSERT(sheet->GetCell("B1"_pos)->GetReferencedCells().empty());
     ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{"B1"_pos});
 
+    // пустая ячейка, на которую никто не ссылается, удаляется
     sheet->SetCell("A2"_pos, "");
     ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
-    ASSERT(sheet->GetCell("A2"_pos)->GetReferencedCells().empty());
+    ASSERT(sheet->GetCell("A2"_pos) == nullptr);
 
     // Ссылка на ячейку за пределами таблицы
     sheet->SetCell("B1"_pos, "=C3");
@@ -346,6 +353,2038 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestLazyFormulaParsing() {
+    Sheet sheet;
+    sheet.SetLazyFormulaParsing(true);
+
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A2"_pos, "=A1 * 1E1 + C3");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetReferencedCells(), (std::vector{"A1"_pos, "C3"_pos}));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "=A1*10+C3");
+
+    sheet.SetCell("A1"_pos, "=5");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(50.0));
+
+    bool caught = false;
+    try {
+        sheet.SetCell("C3"_pos, "=A2");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    caught = false;
+    try {
+        sheet.SetCell("B1"_pos, "=A0+1");
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    sheet.SetCell("B2"_pos, "=1+");
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetText(), "=1+");
+
+    // буква не из ASCII (Ä в UTF-8) не считается ни ссылкой, ни числом
+    sheet.SetCell("B3"_pos, "=C3+\xC3\x84" "1");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetReferencedCells(), std::vector{ "C3"_pos });
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+
+    // неудачный разбор запоминается: после смены входа формула остаётся
+    // ошибкой с прежним текстом и ссылками
+    sheet.SetCell("C3"_pos, "7");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetText(), "=C3+\xC3\x84" "1");
+    ASSERT_EQUAL(sheet.GetCell("B3"_pos)->GetReferencedCells(), std::vector{ "C3"_pos });
+}
+
+void TestChangeTracking() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "=A1+1");
+    sheet.SetCell("A3"_pos, "=A2*0");
+    sheet.SetCell("B1"_pos, "text");
+    sheet.EnableChangeTracking();
+    ASSERT(sheet.DrainChangedCells().empty());
+
+    sheet.SetCell("A1"_pos, "2");
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet.DrainChangedCells(), (std::vector{"A1"_pos, "A2"_pos}));
+
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("B1"_pos, "text");
+    ASSERT(sheet.DrainChangedCells().empty());
+
+    sheet.SetCell("A1"_pos, "4");
+    sheet.SetCell("A1"_pos, "3");
+    ASSERT(sheet.DrainChangedCells().empty());
+
+    sheet.ClearCell("A1"_pos);
+    sheet.ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet.DrainChangedCells(), (std::vector{"A1"_pos, "B1"_pos, "A2"_pos}));
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value(1.0));
+
+    sheet.SetCell("C5"_pos, "=A2");
+    ASSERT_EQUAL(sheet.DrainChangedCells(), (std::vector{"C5"_pos}));
+}
+
+void TestEarlyCutoff() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "5");
+    sheet->SetCell("B1"_pos, "=A1*0");
+    sheet->SetCell("C1"_pos, "=B1+A2");
+    sheet->SetCell("D1"_pos, "=A1");
+    sheet->SetCell("E1"_pos, "=D1*2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(5.0));
+    sheet->SetCell("A2"_pos, "6");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    sheet->SetCell("B1"_pos, "=0");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(6.0));
+    sheet->SetCell("B1"_pos, "=1");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(7.0));
+
+    // промежуточное значение так и не было прочитано
+    sheet->SetCell("A1"_pos, "3");
+    sheet->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(4.0));
+    sheet->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(6.0));
+
+    sheet->SetCell("D1"_pos, "'3");
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(6.0));
+    sheet->SetCell("D1"_pos, "x");
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Value));
+}
+
+void TestVectorizedRecalculation() {
+    Sheet sheet;
+    const int rows = 103;
+
+    for (int row = 0; row < rows; ++row) {
+        std::string r = std::to_string(row + 1);
+        sheet.SetCell({row, 0}, std::to_string(row * 1.5));
+        sheet.SetCell({row, 1}, row % 17 == 0 ? "0" : std::to_string(row - 50));
+        if (row % 23 == 5) {
+            sheet.SetCell({row, 2}, "text");
+        } else if (row % 29 != 7) {
+            sheet.SetCell({row, 2}, "=" + std::to_string(row) + "/4");
+        }
+        sheet.SetCell({row, 3}, "=-A" + r + "*B" + r + "+C" + r + "/B" + r + "-2.5");
+    }
+    sheet.SetCell({40, 0}, "=1/0");
+    sheet.SetCell({41, 0}, "1e300");
+    sheet.SetCell({41, 1}, "1e300");
+
+    sheet.Recalculate();
+
+    for (int row = 0; row < rows; ++row) {
+        Position pos{row, 3};
+        auto expected = ParseFormula(sheet.GetCell(pos)->GetText().substr(1))->Evaluate(sheet);
+        auto actual = sheet.GetCell(pos)->GetValue();
+        if (std::holds_alternative<double>(expected)) {
+            ASSERT_EQUAL(actual, CellInterface::Value(std::get<double>(expected)));
+        } else {
+            ASSERT_EQUAL(actual, CellInterface::Value(std::get<FormulaError>(expected)));
+        }
+    }
+    ASSERT_EQUAL(sheet.GetCell({41, 3})->GetValue(),
+                 CellInterface::Value(FormulaError::Category::Arithmetic));
+
+    sheet.SetCell({10, 1}, "2");
+    sheet.Recalculate();
+    ASSERT_EQUAL(sheet.GetCell({10, 3})->GetValue(), CellInterface::Value(-15 * 2 + 2.5 / 2 - 2.5));
+
+    // устаревшие формулы, сдвинутые вставкой строк, пересчитываются на новых местах
+    for (int row = 60; row < 80; ++row) {
+        sheet.SetCell({row, 1}, "1");
+    }
+    sheet.InsertRows(0, 2);
+    sheet.Recalculate();
+    for (int row = 60; row < 80; ++row) {
+        if (row % 23 == 5 || row % 29 == 7) {
+            continue;
+        }
+        ASSERT_EQUAL(sheet.GetCell({row + 2, 3})->GetValue(), CellInterface::Value(-row * 1.5 + row / 4.0 - 2.5));
+    }
+}
+
+void TestNumericColumns() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("A2"_pos, "abc");
+    sheet.SetCell("A3"_pos, "=1/0");
+    sheet.SetCell("A4"_pos, "=A1*2");
+    sheet.SetCell("B1"_pos, "");
+
+    ASSERT(sheet.GetNumericValue("A1"_pos) == (std::variant<double, FormulaError>(3.0)));
+    ASSERT(sheet.GetNumericValue("A2"_pos) == (std::variant<double, FormulaError>(FormulaError::Category::Value)));
+    ASSERT(sheet.GetNumericValue("A3"_pos) == (std::variant<double, FormulaError>(FormulaError::Category::Arithmetic)));
+    ASSERT(sheet.GetNumericValue("A4"_pos) == (std::variant<double, FormulaError>(6.0)));
+    ASSERT(sheet.GetNumericValue("B1"_pos) == (std::variant<double, FormulaError>(0.0)));
+    ASSERT(sheet.GetNumericValue("Z9"_pos) == (std::variant<double, FormulaError>(0.0)));
+
+    sheet.SetCell("A1"_pos, "4");
+    ASSERT(sheet.GetNumericValue("A4"_pos) == (std::variant<double, FormulaError>(8.0)));
+    sheet.ClearCell("A1"_pos);
+    ASSERT(sheet.GetNumericValue("A4"_pos) == (std::variant<double, FormulaError>(0.0)));
+
+    NumericColumns columns;
+    columns.Store({70, 2}, CellInterface::ValueView("1.5"));
+    columns.Store({3, 2}, CellInterface::ValueView("x"));
+    const NumericColumns::Column* column = columns.GetColumn(2);
+    ASSERT(column != nullptr && columns.GetColumn(3) == nullptr);
+    ASSERT(column->IsPresent(70) && column->IsNumeric(70) && column->GetValue(70) == 1.5);
+    ASSERT(column->IsPresent(3) && !column->IsNumeric(3) && !column->IsError(3));
+    ASSERT(!column->IsPresent(4));
+    columns.Reset({70, 2});
+    ASSERT(!columns.Get({70, 2}).has_value());
+
+    // далёкая строка стоит один блок, а опустевший блок освобождается
+    size_t usage = columns.GetMemoryUsage();
+    columns.Store({Position::MAX_ROWS - 1, 2}, CellInterface::ValueView(2.0));
+    ASSERT(columns.Get({Position::MAX_ROWS - 1, 2}) == std::optional<NumericColumns::Value>(2.0));
+    ASSERT(columns.GetMemoryUsage() - usage < 2 * sizeof(NumericColumns::Block));
+    columns.Reset({Position::MAX_ROWS - 1, 2});
+    columns.Reset({3, 2});
+
+    // область стирается словами масок, с неполными словами по краям
+    for (int row = 60; row < 5000; ++row) {
+        columns.Store({row, 1}, CellInterface::ValueView(1.0));
+    }
+    columns.ResetArea({{63, 0}, {4100, 5}});
+    ASSERT(columns.Get({62, 1}).has_value() && columns.Get({4101, 1}).has_value());
+    ASSERT(!columns.Get({63, 1}).has_value() && !columns.Get({130, 1}).has_value());
+    ASSERT(!columns.Get({4095, 1}).has_value() && !columns.Get({4100, 1}).has_value());
+    columns.ResetArea({{0, 1}, {Position::MAX_ROWS - 1, 1}});
+    ASSERT(!columns.Get({62, 1}).has_value());
+    columns.Compact();
+    ASSERT(columns.GetColumn(2) == nullptr);
+    ASSERT_EQUAL(columns.GetMemoryUsage(), 0u);
+}
+
+void TestDeepDependencyChain() {
+    // цепочка A1, A2=A1+1, ... длиной в миллион ячеек, уложенная змейкой по
+    // столбцам; вычисление и сброс кэша не должны переполнять стек
+    const int length = 1'000'000;
+    auto position = [](int index) {
+        return Position{index % Position::MAX_ROWS, index / Position::MAX_ROWS};
+    };
+
+    Sheet sheet;
+    sheet.SetLazyFormulaParsing(true);
+    sheet.SetCell(position(0), "1");
+    for (int i = 1; i < length; ++i) {
+        sheet.SetCell(position(i), "=" + position(i - 1).ToString() + "+1");
+    }
+
+    ASSERT_EQUAL(sheet.GetCell(position(length - 1))->GetValue(),
+                 CellInterface::Value(static_cast<double>(length)));
+
+    sheet.SetCell(position(0), "2");
+    ASSERT_EQUAL(sheet.GetCell(position(length - 1))->GetValue(),
+                 CellInterface::Value(static_cast<double>(length + 1)));
+    ASSERT_EQUAL(sheet.GetCell(position(length / 2))->GetValue(),
+                 CellInterface::Value(static_cast<double>(length / 2 + 2)));
+}
+
+void TestDeepConditionalChain() {
+    // то же для формул с условиями: какие входы им понадобятся, заранее
+    // неизвестно (формула вычисляется впервые или выбирает другую ветвь),
+    // но вычисляться рекурсивно они не должны
+    const int length = 200'000;
+    auto position = [](int index) {
+        return Position{index % Position::MAX_ROWS, 1 + index / Position::MAX_ROWS};
+    };
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell(position(0), "1");
+    for (int i = 1; i < length; ++i) {
+        const std::string previous = position(i - 1).ToString();
+        sheet.SetCell(position(i), "=IF(A1>0," + previous + "+1,0)");
+    }
+
+    ASSERT_EQUAL(sheet.GetCell(position(length - 1))->GetValue(),
+                 CellInterface::Value(static_cast<double>(length)));
+
+    sheet.SetCell(position(0), "5");
+    ASSERT_EQUAL(sheet.GetCell(position(length - 1))->GetValue(),
+                 CellInterface::Value(static_cast<double>(length + 4)));
+    sheet.SetCell("A1"_pos, "-1");
+    ASSERT_EQUAL(sheet.GetCell(position(length - 1))->GetValue(), CellInterface::Value(0.0));
+    sheet.SetCell(position(0), "2");
+    sheet.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet.GetCell(position(length - 1))->GetValue(),
+                 CellInterface::Value(static_cast<double>(length + 1)));
+}
+
+void TestMemoryUsage() {
+    Sheet sheet;
+    ASSERT_EQUAL(sheet.GetMemoryUsage().cells, 0u);
+    ASSERT_EQUAL(sheet.GetMemoryUsage().dependencies, 0u);
+
+    const std::string long_text(100, 'x');
+    for (int row = 0; row < 100; ++row) {
+        sheet.SetCell({row, 0}, long_text + std::to_string(row));
+        sheet.SetCell({row, 1}, "=C" + std::to_string(row + 1) + "+1");
+    }
+    // значения формул занимают память, только когда вычислены
+    std::ostringstream values;
+    sheet.PrintValues(values);
+
+    MemoryUsage usage = sheet.GetMemoryUsage();
+    ASSERT(usage.cell_table > 0);
+    ASSERT(usage.cells > 300 * sizeof(Cell));
+    ASSERT(usage.text >= 100 * long_text.size());
+    ASSERT(usage.formulas > 0);
+    ASSERT(usage.cached_values > 0);
+    ASSERT(usage.dependencies > 0);
+    ASSERT_EQUAL(usage.Total(), usage.cell_table + usage.cells + usage.text + usage.formulas
+                                    + usage.cached_values + usage.dependencies + usage.numeric_columns
+                                    + usage.lookup_indexes);
+
+    for (int row = 0; row < 100; ++row) {
+        sheet.ClearCell({row, 0});
+        sheet.ClearCell({row, 1});
+        sheet.ClearCell({row, 2});
+    }
+
+    usage = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(usage.cells, 0u);
+    ASSERT_EQUAL(usage.text, Sheet().GetMemoryUsage().text);
+    ASSERT_EQUAL(usage.formulas, 0u);
+    ASSERT_EQUAL(usage.cached_values, 0u);
+    ASSERT_EQUAL(usage.dependencies, 0u);
+}
+
+void TestPlaceholderCollection() {
+    Sheet sheet;
+    MemoryUsage warmed_up;
+
+    for (int i = 0; i < 2000; ++i) {
+        sheet.SetCell("A1"_pos, "=B" + std::to_string(i + 1) + "+C" + std::to_string(i % 7 + 1));
+        if (i == 100) {
+            warmed_up = sheet.GetMemoryUsage();
+        }
+    }
+
+    MemoryUsage usage = sheet.GetMemoryUsage();
+    ASSERT_EQUAL(usage.cells, warmed_up.cells);
+    ASSERT_EQUAL(usage.dependencies, warmed_up.dependencies);
+    ASSERT(sheet.GetCell("B1"_pos) == nullptr);
+    ASSERT(sheet.GetCell("B2000"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{1, 1}));
+
+    sheet.SetCell("A1"_pos, "=1");
+    ASSERT(sheet.GetCell("B2000"_pos) == nullptr);
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+
+    // очищенная ячейка, на которую ссылались, удаляется вместе с последней ссылкой
+    sheet.SetCell("D1"_pos, "5");
+    sheet.SetCell("E1"_pos, "=D1");
+    sheet.ClearCell("D1"_pos);
+    ASSERT(sheet.GetCell("D1"_pos) != nullptr);
+    sheet.ClearCell("E1"_pos);
+    ASSERT(sheet.GetCell("D1"_pos) == nullptr);
+    MemoryUsage usage_before_empty = sheet.GetMemoryUsage();
+
+    // пустой текст ячейки не создаёт и удаляет ячейку, на которую никто не
+    // ссылается; та, на которую ссылаются, остаётся пустой заглушкой
+    for (int row = 0; row < 1000; ++row) {
+        sheet.SetCell({row, 5}, "");
+    }
+    ASSERT(sheet.GetCell({10, 5}) == nullptr);
+    ASSERT_EQUAL(sheet.GetMemoryUsage().cells, usage_before_empty.cells);
+    sheet.SetCell("G1"_pos, "text");
+    sheet.SetCell("G1"_pos, "");
+    ASSERT(sheet.GetCell("G1"_pos) == nullptr);
+    sheet.SetCell("G2"_pos, "7");
+    sheet.SetCell("H2"_pos, "=G2");
+    sheet.SetCell("G2"_pos, "");
+    ASSERT(sheet.GetCell("G2"_pos) != nullptr);
+    ASSERT_EQUAL(sheet.GetCell("H2"_pos)->GetValue(), CellInterface::Value(0.0));
+    sheet.ClearCell("H2"_pos);
+    ASSERT(sheet.GetCell("G2"_pos) == nullptr);
+
+    // Compact() ужимает таблицу после массовых удалений
+    for (int row = 0; row < 1000; ++row) {
+        sheet.SetCell({row, 5}, "1");
+    }
+    for (int row = 0; row < 1000; ++row) {
+        sheet.ClearCell({row, 5});
+    }
+    MemoryUsage before_compact = sheet.GetMemoryUsage();
+    sheet.Compact();
+    ASSERT(sheet.GetMemoryUsage().cell_table < before_compact.cell_table);
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+
+void TestMillionRowGrid() {
+    ASSERT_EQUAL(Position::MAX_ROWS, 1048576);
+    ASSERT(Position::FromString("A1048576").IsValid());
+
+    // упакованный ключ упорядочен так же, как сами позиции
+    std::vector<Position> positions = {
+        {1048575, 0}, {0, 16383}, {5, 3}, {5, 2}, {0, 0}, Position::NONE, {-1, 7}};
+    for (Position lhs : positions) {
+        for (Position rhs : positions) {
+            ASSERT_EQUAL(lhs < rhs, lhs.Pack() < rhs.Pack());
+            ASSERT_EQUAL(lhs == rhs, lhs.Pack() == rhs.Pack());
+        }
+    }
+
+    auto sheet = CreateSheet();
+    sheet->SetCell("XFD1048576"_pos, "2");
+    sheet->SetCell("A1048576"_pos, "=XFD1048576*3");
+    sheet->SetCell("A1"_pos, "=A1048576+A1000000");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet->GetCell("A1048576"_pos)->GetText(), "=XFD1048576*3");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1048576, 16384}));
+
+    sheet->ClearCell("XFD1048576"_pos);
+    sheet->ClearCell("A1048576"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 1}));
+}
+
+void TestStringPool() {
+    StringPool pool;
+    PooledString short_text = pool.Intern("meow");
+    ASSERT(short_text.IsInline());
+    ASSERT_EQUAL(pool.GetSize(), 0u);
+
+    const std::string label = "Category with a long label";
+    PooledString first = pool.Intern(label);
+    PooledString second = pool.Intern(std::string(label));
+    ASSERT(!first.IsInline());
+    ASSERT(first == second);
+    ASSERT(first != pool.Intern(label + "!"));
+    ASSERT(short_text == pool.Intern("meow"));
+    ASSERT(short_text != pool.Intern("meow!"));
+    ASSERT_EQUAL(first.View(), label);
+    ASSERT_EQUAL(pool.GetSize(), 1u);
+
+    {
+        PooledString copy = first;
+        PooledString moved = std::move(second);
+        ASSERT(copy == moved);
+    }
+    first = pool.Intern("");
+    ASSERT_EQUAL(pool.GetSize(), 0u);
+    ASSERT_EQUAL(pool.GetMemoryUsage(), StringPool().GetMemoryUsage());
+
+    // повторяющиеся метки хранятся в таблице один раз
+    Sheet sheet;
+    for (int row = 0; row < 1000; ++row) {
+        sheet.SetCell({row, 0}, "Long category label #" + std::to_string(row % 10));
+    }
+    ASSERT(sheet.GetMemoryUsage().text < 100 * label.size());
+    ASSERT_EQUAL(sheet.GetCell("A12"_pos)->GetValue(), CellInterface::Value("Long category label #1"));
+
+    sheet.SetCell("B1"_pos, "=A1");
+    sheet.SetCell("A2"_pos, "'Long category label #1");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetText(), "'Long category label #1");
+    ASSERT_EQUAL(sheet.GetCell("A2"_pos)->GetValue(), CellInterface::Value("Long category label #1"));
+
+    // та же метка с экранированием - то же значение, зависимые не пересчитываются
+    sheet.EnableChangeTracking();
+    sheet.SetCell("A1"_pos, "'Long category label #0");
+    ASSERT(sheet.DrainChangedCells().empty());
+    sheet.SetCell("A1"_pos, "Long category label #2");
+    ASSERT_EQUAL(sheet.DrainChangedCells(), (std::vector<Position>{"A1"_pos}));
+}
+
+void TestValueViews() {
+    using namespace std::literals;
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "'=escaped text that does not fit inline");
+    sheet->SetCell("A2"_pos, "=A3 + 1");
+    sheet->SetCell("A4"_pos, "=1/0");
+
+    const CellInterface* text = sheet->GetCell("A1"_pos);
+    ASSERT(text->GetValueView() == CellInterface::ValueView("=escaped text that does not fit inline"sv));
+    ASSERT_EQUAL(text->GetTextView(), "'=escaped text that does not fit inline"sv);
+
+    const CellInterface* formula = sheet->GetCell("A2"_pos);
+    std::string_view formula_text = formula->GetTextView();
+    ASSERT_EQUAL(formula_text, "=A3+1"sv);
+    // выражение не пересобирается при каждом чтении
+    ASSERT(formula->GetTextView().data() == formula_text.data());
+    ASSERT(formula->GetValueView() == CellInterface::ValueView(1.0));
+
+    sheet->SetCell("A3"_pos, "2");
+    ASSERT(formula->GetValueView() == CellInterface::ValueView(3.0));
+    ASSERT(sheet->GetCell("A4"_pos)->GetValueView()
+           == CellInterface::ValueView(FormulaError(FormulaError::Category::Arithmetic)));
+
+    // пустая ячейка, на которую ссылаются, остаётся
+    sheet->SetCell("A6"_pos, "=A5");
+    sheet->SetCell("A5"_pos, "");
+    ASSERT(sheet->GetCell("A5"_pos)->GetValueView() == CellInterface::ValueView(""sv));
+    ASSERT_EQUAL(sheet->GetCell("A5"_pos)->GetTextView(), ""sv);
+}
+
+void TestTraceRecording() {
+    std::ostringstream trace;
+    Sheet sheet;
+    sheet.StartRecording(trace);
+    sheet.SetCell("A1"_pos, "Revenue");
+    sheet.SetCell("B1"_pos, "=C1*1.5");
+    try {
+        sheet.SetCell("C1"_pos, "=B1");
+    } catch (const CircularDependencyException&) {
+    }
+    sheet.GetCell("B1"_pos)->GetValue();
+    sheet.ClearCell("A1"_pos);
+    std::ostringstream output;
+    sheet.PrintValues(output);
+    sheet.StopRecording();
+    // после остановки ничего не пишется
+    sheet.SetCell("A2"_pos, "1");
+
+    std::istringstream input(trace.str());
+    TraceReader reader(input);
+    ASSERT(!reader.IsAnonymized());
+
+    std::vector<TraceRecord> records;
+    for (TraceRecord record; reader.Read(record);) {
+        records.push_back(record);
+    }
+    ASSERT_EQUAL(records.size(), 6u);
+    ASSERT(records[0].op == TraceOp::SetCell);
+    ASSERT_EQUAL(records[0].pos, "A1"_pos);
+    ASSERT_EQUAL(records[0].text, "Revenue");
+    ASSERT_EQUAL(records[2].text, "=B1");
+    ASSERT(records[3].op == TraceOp::GetValue);
+    ASSERT_EQUAL(records[3].pos, "B1"_pos);
+    ASSERT(records[4].op == TraceOp::ClearCell);
+    ASSERT(records[5].op == TraceOp::PrintValues);
+    for (size_t i = 1; i < records.size(); ++i) {
+        ASSERT(records[i - 1].time <= records[i].time);
+    }
+
+    // обезличивание сохраняет ссылки, операции и числовой характер текста
+    ASSERT_EQUAL(AnonymizeText("=(A1+B22)/1e3-0"), AnonymizeText("=(A1+B22)/1e3-0"));
+    std::string formula = AnonymizeText("=(A1+B22)/1e3-0");
+    ASSERT_EQUAL(formula.substr(0, 10), "=(A1+B22)/");
+    ASSERT_EQUAL(formula.substr(formula.size() - 2), "-0");
+    ASSERT(formula.find("1e3") == std::string::npos);
+    ASSERT(ParseNumber(AnonymizeText("42")).has_value());
+    ASSERT_EQUAL(AnonymizeText("Revenue"), AnonymizeText("Revenue"));
+    ASSERT(AnonymizeText("Revenue") != AnonymizeText("Costs"));
+    ASSERT(AnonymizeText("Revenue").find("Revenue") == std::string::npos);
+    ASSERT_EQUAL(AnonymizeText("'=text")[0], '\'');
+
+    std::ostringstream anonymized;
+    sheet.StartRecording(anonymized, true);
+    sheet.SetCell("A3"_pos, "Secret label");
+    sheet.StopRecording();
+    ASSERT(anonymized.str().find("Secret") == std::string::npos);
+
+    std::istringstream garbage("not a trace");
+    try {
+        TraceReader bad_reader(garbage);
+        ASSERT(false);
+    } catch (const TraceFormatException&) {
+    }
+}
+
+void TestProfiler() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+A1");
+    sheet.SetCell("D1"_pos, "=C1+B1+C1");
+    sheet.GetCell("D1"_pos)->GetValue();
+
+    // без профилирования ничего не собирается
+    ASSERT(sheet.ProfileReport(10).empty());
+
+    sheet.SetProfiling(true);
+    for (int i = 2; i < 5; ++i) {
+        sheet.SetCell("A1"_pos, std::to_string(i));
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetValue(), CellInterface::Value(8.0 * i));
+    }
+    sheet.SetProfiling(false);
+    sheet.SetCell("A1"_pos, "10");
+    sheet.GetCell("D1"_pos)->GetValue();
+
+    auto report = sheet.ProfileReport(10);
+    ASSERT_EQUAL(report.size(), 3u);
+    for (size_t i = 0; i < report.size(); ++i) {
+        const CellProfile& profile = report[i].profile;
+        ASSERT_EQUAL(profile.evaluations, 3u);
+        ASSERT(profile.exclusive <= profile.inclusive);
+        ASSERT_EQUAL(report[i].path.front(), profile.pos);
+        // цепочка входов заканчивается на B1: A1 - данные, а не формула
+        ASSERT_EQUAL(report[i].path.back(), "B1"_pos);
+        if (i > 0) {
+            ASSERT(report[i - 1].profile.exclusive >= profile.exclusive);
+        }
+
+        if (profile.pos == "B1"_pos) {
+            ASSERT_EQUAL(profile.inputs_read, 3u);
+        } else if (profile.pos == "D1"_pos) {
+            ASSERT_EQUAL(profile.inputs_read, 9u);
+            ASSERT(report[i].path.size() >= 2u);
+        }
+    }
+    ASSERT_EQUAL(sheet.ProfileReport(1).size(), 1u);
+
+    // входы формулы обновляются до её вычисления, и их время входит только
+    // в её inclusive; B1 обновляет та формула, которая дойдёт до неё первой
+    auto find = [&report](Position pos) {
+        return std::find_if(report.begin(), report.end(), [pos](const Sheet::ProfileEntry& entry) {
+                   return entry.profile.pos == pos;
+               })->profile;
+    };
+    ASSERT(find("D1"_pos).inclusive > find("D1"_pos).exclusive);
+    ASSERT(find("D1"_pos).inclusive >= find("D1"_pos).exclusive + find("C1"_pos).inclusive);
+
+    sheet.ClearProfile();
+    ASSERT(sheet.ProfileReport(10).empty());
+}
+
+void TestPaging() {
+    Sheet paged;
+    Sheet reference;
+    paged.SetMemoryBudget(4096);
+
+    auto set = [&](Position pos, const std::string& text) {
+        paged.SetCell(pos, text);
+        reference.SetCell(pos, text);
+    };
+    auto same_output = [&]() {
+        std::ostringstream paged_values, reference_values, paged_texts, reference_texts;
+        paged.PrintValues(paged_values);
+        reference.PrintValues(reference_values);
+        paged.PrintTexts(paged_texts);
+        reference.PrintTexts(reference_texts);
+        return paged_values.str() == reference_values.str() && paged_texts.str() == reference_texts.str();
+    };
+
+    // текст, числа и цепочка формул в разных областях
+    const int rows = 2000;
+    for (int row = 0; row < rows; ++row) {
+        set({ row, 0 }, "Long label number " + std::to_string(row % 37) + " in the first column");
+        set({ row, 20 }, std::to_string(row));
+        set({ row, 40 }, "=" + Position{ row, 20 }.ToString() + "*2+"
+                             + (row ? Position{ row - 1, 40 }.ToString() : "0"));
+    }
+
+    Sheet::PagingStats stats = paged.GetPagingStats();
+    ASSERT(stats.page_outs > 0);
+    ASSERT(stats.paged_out_regions > 0);
+    ASSERT(stats.spill_file_size > 0);
+    ASSERT(paged.GetMemoryUsage().formulas < reference.GetMemoryUsage().formulas);
+
+    const Position last{ rows - 1, 40 };
+    ASSERT_EQUAL(paged.GetCell(last)->GetValue(), reference.GetCell(last)->GetValue());
+
+    // чтение всех областей ничего не вытесняет: строка первой из них
+    // остаётся действительной до следующей правки
+    {
+        const Sheet& view = paged;
+        size_t page_outs = paged.GetPagingStats().page_outs;
+        std::string_view label = view.GetCell({ 3, 0 })->GetTextView();
+        for (int row = 0; row < rows; row += 50) {
+            ASSERT_EQUAL(view.GetCell({ row, 0 })->GetText(), reference.GetCell({ row, 0 })->GetText());
+            ASSERT_EQUAL(view.GetCell({ row, 40 })->GetValue(), reference.GetCell({ row, 40 })->GetValue());
+        }
+        ASSERT_EQUAL(paged.GetPagingStats().page_outs, page_outs);
+        ASSERT_EQUAL(std::string(label), reference.GetCell({ 3, 0 })->GetText());
+    }
+
+    // правка в вытесненной области сбрасывает вытесненные зависимые формулы
+    set({ 0, 20 }, "1000");
+    ASSERT_EQUAL(paged.GetCell(last)->GetValue(), reference.GetCell(last)->GetValue());
+    ASSERT_EQUAL(paged.GetCell({ 3, 0 })->GetText(), reference.GetCell({ 3, 0 })->GetText());
+    ASSERT_EQUAL(paged.GetCell({ 5, 40 })->GetText(), "=U6*2+AO5");
+
+    // цикл через вытесненные ячейки находится без их загрузки
+    try {
+        paged.SetCell({ 0, 20 }, "=" + last.ToString());
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    set({ 10, 0 }, "");
+    paged.ClearCell({ 11, 40 });
+    reference.ClearCell({ 11, 40 });
+    ASSERT_EQUAL(paged.GetCell(last)->GetValue(), reference.GetCell(last)->GetValue());
+    ASSERT(same_output());
+    ASSERT(paged.GetPagingStats().page_ins > 0);
+
+    paged.SetMemoryBudget(0);
+    ASSERT_EQUAL(paged.GetPagingStats().paged_out_regions, 0u);
+    ASSERT_EQUAL(paged.GetPagingStats().spill_file_size, 0u);
+    ASSERT(same_output());
+}
+
+void TestResultCache() {
+    Sheet bounded;
+    Sheet reference;
+    bounded.SetResultCacheCapacity(3);
+
+    auto set = [&](Position pos, const std::string& text) {
+        bounded.SetCell(pos, text);
+        reference.SetCell(pos, text);
+    };
+    auto same_values = [&]() {
+        std::ostringstream bounded_values, reference_values;
+        bounded.PrintValues(bounded_values);
+        reference.PrintValues(reference_values);
+        return bounded_values.str() == reference_values.str();
+    };
+
+    // цепочка и формула, у которой входов-формул больше ёмкости кэша
+    const int rows = 50;
+    for (int row = 0; row < rows; ++row) {
+        set({ row, 0 }, std::to_string(row));
+        set({ row, 1 }, "=A" + std::to_string(row + 1) + "+" + (row ? "B" + std::to_string(row) : "0"));
+    }
+    set({ 0, 2 }, "=B1+B2+B3+B4+B5+B6");
+
+    ASSERT_EQUAL(bounded.GetCell("B50"_pos)->GetValue(), reference.GetCell("B50"_pos)->GetValue());
+    ASSERT_EQUAL(bounded.GetCell("C1"_pos)->GetValue(), reference.GetCell("C1"_pos)->GetValue());
+
+    ResultCacheStats stats = bounded.GetResultCacheStats();
+    ASSERT_EQUAL(stats.capacity, 3u);
+    ASSERT(stats.size <= 3u);
+    ASSERT(stats.evictions > 0);
+
+    // вытесненные значения вычисляются заново при чтении
+    ASSERT_EQUAL(bounded.GetCell("B2"_pos)->GetValue(), reference.GetCell("B2"_pos)->GetValue());
+    ASSERT(bounded.GetResultCacheStats().recomputations > 0);
+    ASSERT(bounded.GetResultCacheStats().misses > 0);
+
+    // повторное чтение - попадание
+    uint64_t hits = bounded.GetResultCacheStats().hits;
+    bounded.GetCell("B2"_pos)->GetValue();
+    ASSERT_EQUAL(bounded.GetResultCacheStats().hits, hits + 1);
+
+    // правка входа сбрасывает и формулы, вычисленные из вытесненных значений
+    bounded.EnableChangeTracking();
+    set({ 0, 0 }, "100");
+    ASSERT_EQUAL(bounded.GetCell("C1"_pos)->GetValue(), reference.GetCell("C1"_pos)->GetValue());
+    std::vector<Position> changed = bounded.DrainChangedCells();
+    ASSERT(std::find(changed.begin(), changed.end(), "B50"_pos) != changed.end());
+    ASSERT(std::find(changed.begin(), changed.end(), "A50"_pos) == changed.end());
+    ASSERT(same_values());
+
+    // снятие ограничения оставляет значения, уменьшение - вытесняет лишние
+    bounded.SetResultCacheCapacity(0);
+    ASSERT(same_values());
+    ASSERT_EQUAL(bounded.GetResultCacheStats().size, static_cast<size_t>(rows + 1));
+    bounded.SetResultCacheCapacity(10);
+    ASSERT_EQUAL(bounded.GetResultCacheStats().size, 10u);
+    ASSERT(same_values());
+
+    double hit_rate = bounded.GetResultCacheStats().GetHitRate();
+    ASSERT(hit_rate > 0.0 && hit_rate < 1.0);
+}
+
+void TestBoundReferences() {
+    // привязанная ссылка читает ячейку-вход, а не таблицу
+    struct Input : FormulaInput {
+        std::variant<double, FormulaError> GetNumericValue() const override {
+            return 5.0;
+        }
+    } input;
+
+    auto formula = ParseFormula("A1*2+B1+A1");
+    formula->BindInputs([&](Position pos) -> const FormulaInput* {
+        return pos == "A1"_pos ? &input : nullptr;
+    });
+    auto sheet = CreateSheet();
+    sheet->SetCell("B1"_pos, "1");
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 16.0);
+
+    // ячейки таблицы привязываются к заглушкам и переживают правки входов
+    Sheet bound;
+    bound.SetCell("B1"_pos, "=A1*2");
+    bound.SetCell("C1"_pos, "=B1+D1");
+    ASSERT_EQUAL(bound.GetCell("C1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    bound.SetCell("A1"_pos, "5");
+    bound.SetCell("D1"_pos, "3");
+    ASSERT_EQUAL(bound.GetCell("C1"_pos)->GetValue(), CellInterface::Value(13.0));
+
+    bound.ClearCell("D1"_pos);
+    ASSERT_EQUAL(bound.GetCell("C1"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    bound.SetCell("A1"_pos, "=D1+1");
+    bound.SetCell("D1"_pos, "text");
+    ASSERT_EQUAL(bound.GetCell("C1"_pos)->GetValue(),
+                 CellInterface::Value(FormulaError(FormulaError::Category::Value)));
+
+    bound.SetCell("C1"_pos, "=B1+E1");
+    bound.SetCell("D1"_pos, "'1");
+    ASSERT_EQUAL(bound.GetCell("C1"_pos)->GetValue(), CellInterface::Value(4.0));
+}
+
+void TestInsertDeleteRowsColumns() {
+    Sheet sheet;
+    auto text = [&](const char* pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetText();
+    };
+    auto value = [&](const char* pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("A3"_pos, "=A1+A2");
+    sheet.SetCell("B1"_pos, "=A3*10");
+    sheet.SetCell("D4"_pos, "=C1+A2");
+    ASSERT_EQUAL(value("B1"), CellInterface::Value(30.0));
+
+    sheet.InsertRows(1, 2);
+    ASSERT(sheet.GetCell("A2"_pos) == nullptr);
+    ASSERT_EQUAL(text("A4"), "2");
+    ASSERT_EQUAL(text("A5"), "=A1+A4");
+    ASSERT_EQUAL(text("B1"), "=A5*10");
+    ASSERT_EQUAL(text("D6"), "=C1+A4");
+    ASSERT_EQUAL(value("B1"), CellInterface::Value(30.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 6, 4 }));
+
+    // сдвинутые ячейки по-прежнему связаны с зависимыми формулами
+    sheet.SetCell("A4"_pos, "5");
+    ASSERT_EQUAL(value("B1"), CellInterface::Value(60.0));
+    ASSERT_EQUAL(value("D6"), CellInterface::Value(5.0));
+
+    // удалённые ячейки дают #REF!, в том числе пустая C1, на которую ссылалась D6
+    sheet.DeleteRows(0);
+    ASSERT_EQUAL(text("A4"), "=#REF!+A3");
+    ASSERT_EQUAL(text("D5"), "=#REF!+A3");
+    ASSERT_EQUAL(value("A4"), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    ASSERT_EQUAL(sheet.GetCell("A4"_pos)->GetReferencedCells(), std::vector<Position>{ "A3"_pos });
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 4 }));
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "\t\t\t\n\t\t\t\n5\t\t\t\n#REF!\t\t\t\n\t\t\t#REF!\n");
+
+    // столбцы
+    sheet.SetCell("E1"_pos, "=A3+D5");
+    sheet.InsertColumns(0);
+    ASSERT_EQUAL(text("F1"), "=B3+E5");
+    ASSERT_EQUAL(text("E5"), "=#REF!+B3");
+    sheet.SetCell("A1"_pos, "=B3*2");
+    sheet.DeleteColumns(1, 2);
+    ASSERT_EQUAL(text("A1"), "=#REF!*2");
+    ASSERT_EQUAL(text("D1"), "=#REF!+C5");
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 5, 4 }));
+
+    // сохранённый текст с #REF! разбирается обратно
+    sheet.SetCell("A2"_pos, "=#REF!+1");
+    ASSERT_EQUAL(text("A2"), "=#REF!+1");
+    ASSERT(sheet.GetCell("A2"_pos)->GetReferencedCells().empty());
+
+    // непустая ячейка не выталкивается за край таблицы, пустая заглушка - можно
+    Sheet edge;
+    edge.SetCell({ Position::MAX_ROWS - 1, 0 }, "last");
+    try {
+        edge.InsertRows(0);
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+    ASSERT_EQUAL(edge.GetCell({ Position::MAX_ROWS - 1, 0 })->GetText(), "last");
+    edge.ClearCell({ Position::MAX_ROWS - 1, 0 });
+    edge.SetCell("A1"_pos, "=B" + std::to_string(Position::MAX_ROWS));
+    edge.InsertRows(0);
+    ASSERT_EQUAL(edge.GetCell("A2"_pos)->GetText(), "=#REF!");
+
+    // с подкачкой и отслеживанием изменений результат тот же
+    Sheet paged;
+    Sheet reference;
+    paged.SetMemoryBudget(4096);
+    paged.EnableChangeTracking();
+    for (int row = 0; row < 600; ++row) {
+        for (Sheet* target : { &paged, &reference }) {
+            target->SetCell({ row, 0 }, std::to_string(row));
+            target->SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2+" + (row ? "B" + std::to_string(row) : "0"));
+            target->SetCell({ row, 20 }, "Label of row " + std::to_string(row) + " in a column far away");
+        }
+    }
+    paged.DrainChangedCells();
+    for (Sheet* target : { &paged, &reference }) {
+        target->DeleteRows(100, 50);
+        target->InsertColumns(1, 3);
+        target->InsertRows(0);
+    }
+    std::ostringstream paged_output, reference_output;
+    paged.PrintValues(paged_output);
+    paged.PrintTexts(paged_output);
+    reference.PrintValues(reference_output);
+    reference.PrintTexts(reference_output);
+    ASSERT(paged_output.str() == reference_output.str());
+    std::vector<Position> changed = paged.DrainChangedCells();
+    ASSERT(std::find(changed.begin(), changed.end(), "E101"_pos) != changed.end());
+    ASSERT(std::find(changed.begin(), changed.end(), "A1"_pos) != changed.end());
+
+    // загружаются только области сдвигаемой полосы
+    size_t page_ins = paged.GetPagingStats().page_ins;
+    for (Sheet* target : { &paged, &reference }) {
+        target->DeleteRows(540, 2);
+        target->InsertRows(545);
+    }
+    ASSERT(paged.GetPagingStats().page_ins - page_ins <= 4u);
+    paged_output.str({});
+    reference_output.str({});
+    paged.PrintTexts(paged_output);
+    reference.PrintTexts(reference_output);
+    ASSERT(paged_output.str() == reference_output.str());
+
+    // индексы функций поиска сдвигаются вместе со столбцами и строками
+    Sheet lookup;
+    auto lookup_value = [&lookup](const char* pos) {
+        return lookup.GetCell(Position::FromString(pos))->GetValue();
+    };
+    for (int row = 0; row < 10; ++row) {
+        lookup.SetCell({ row, 1 }, std::to_string(row * 10));
+        lookup.SetCell({ row, 2 }, std::to_string(row * 100));
+    }
+    lookup.SetCell("F21"_pos, "=MATCH(40,B1:B10,0)");
+    lookup.SetCell("F22"_pos, "=XLOOKUP(70,B1:B10,C1:C10)");
+    ASSERT_EQUAL(lookup_value("F21"), CellInterface::Value(5.0));
+    lookup.InsertColumns(0, 2);
+    ASSERT_EQUAL(lookup.GetCell("H21"_pos)->GetText(), "=MATCH(40,D1:D10,0)");
+    ASSERT_EQUAL(lookup_value("H21"), CellInterface::Value(5.0));
+    ASSERT_EQUAL(lookup_value("H22"), CellInterface::Value(700.0));
+    lookup.InsertRows(2, 3);
+    lookup.SetCell("D3"_pos, "40");
+    ASSERT_EQUAL(lookup.GetCell("H24"_pos)->GetText(), "=MATCH(40,D1:D13,0)");
+    ASSERT_EQUAL(lookup_value("H24"), CellInterface::Value(3.0));
+    lookup.DeleteRows(0, 3);
+    ASSERT_EQUAL(lookup.GetCell("H21"_pos)->GetText(), "=MATCH(40,D1:D10,0)");
+    ASSERT_EQUAL(lookup_value("H21"), CellInterface::Value(5.0));
+    ASSERT_EQUAL(lookup_value("H22"), CellInterface::Value(700.0));
+}
+
+void TestLookupFunctions() {
+    auto value = [](Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    auto error = [](FormulaError::Category category) {
+        return CellInterface::Value(FormulaError(category));
+    };
+
+    // прайс: код, название, цена; код и цена последней строки - формулы
+    Sheet sheet;
+    const char* table[][3] = {{"10", "Apple", "1.5"}, {"20", "pear", "2.5"}, {"30", "Plum", "4"},
+                              {"=A3+10", "Fig", "=C3*2"}};
+    for (int row = 0; row < 4; ++row) {
+        for (int col = 0; col < 3; ++col) {
+            sheet.SetCell({ row, col }, table[row][col]);
+        }
+    }
+    sheet.SetCell("F1"_pos, "PEAR");
+
+    sheet.SetCell("E1"_pos, "=VLOOKUP(20,A1:C4,3,0)");
+    sheet.SetCell("E2"_pos, "=MATCH(25, A1:A4)");
+    sheet.SetCell("E3"_pos, "=MATCH(25,A1:A4,0)");
+    sheet.SetCell("E4"_pos, "=XLOOKUP(F1,B1:B4,C1:C4)");
+    sheet.SetCell("E5"_pos, "=XLOOKUP(35,A1:A4,C1:C4,-1,1)");
+    sheet.SetCell("E6"_pos, "=VLOOKUP(40,A1:C4,3,0)*2");
+    sheet.SetCell("E7"_pos, "=XLOOKUP(99,A1:A4,C1:C4,-1)");
+    sheet.SetCell("E8"_pos, "=VLOOKUP(20,A1:C4,4,0)");
+    sheet.SetCell("E9"_pos, "=VLOOKUP(20,A1:C4,0,0)");
+    sheet.SetCell("E10"_pos, "=MATCH(1,A1:B4,0)");
+
+    ASSERT_EQUAL(value(sheet, "E1"), CellInterface::Value(2.5));
+    ASSERT_EQUAL(value(sheet, "E2"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value(sheet, "E3"), error(FormulaError::Category::NotAvailable));
+    ASSERT_EQUAL(value(sheet, "E4"), CellInterface::Value(2.5));
+    ASSERT_EQUAL(value(sheet, "E5"), CellInterface::Value(8.0));
+    ASSERT_EQUAL(value(sheet, "E6"), CellInterface::Value(16.0));
+    ASSERT_EQUAL(value(sheet, "E7"), CellInterface::Value(-1.0));
+    ASSERT_EQUAL(value(sheet, "E8"), error(FormulaError::Category::Ref));
+    ASSERT_EQUAL(value(sheet, "E9"), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(value(sheet, "E10"), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetText(), "=MATCH(25,A1:A4)");
+    ASSERT_EQUAL(sheet.GetCell("E3"_pos)->GetText(), "=MATCH(25,A1:A4,0)");
+    ASSERT(sheet.GetCell("E4"_pos)->GetReferencedCells() == std::vector<Position>{"F1"_pos});
+
+    std::ostringstream texts;
+    texts << FormulaError(FormulaError::Category::NotAvailable);
+    ASSERT_EQUAL(texts.str(), "#N/A");
+
+    // индексы следят за правками столбца и за значениями формул в нём
+    sheet.SetCell("A2"_pos, "25");
+    ASSERT_EQUAL(value(sheet, "E1"), error(FormulaError::Category::NotAvailable));
+    ASSERT_EQUAL(value(sheet, "E3"), CellInterface::Value(2.0));
+    sheet.SetCell("A3"_pos, "35");
+    ASSERT_EQUAL(value(sheet, "E6"), error(FormulaError::Category::NotAvailable));
+    ASSERT_EQUAL(value(sheet, "E5"), CellInterface::Value(4.0));
+    sheet.SetCell("A3"_pos, "30");
+    ASSERT_EQUAL(value(sheet, "E6"), CellInterface::Value(16.0));
+    sheet.SetCell("C3"_pos, "5");
+    ASSERT_EQUAL(value(sheet, "E6"), CellInterface::Value(20.0));
+    sheet.ClearCell("A2"_pos);
+    ASSERT_EQUAL(value(sheet, "E3"), error(FormulaError::Category::NotAvailable));
+    sheet.SetCell("F1"_pos, "fig");
+    ASSERT_EQUAL(value(sheet, "E4"), CellInterface::Value(10.0));
+
+    // некорректные вызовы
+    for (const char* text : {"=FOO(1)", "=MATCH(1)", "=MATCH(1,A1:A2,0,1)"}) {
+        try {
+            sheet.SetCell("G1"_pos, text);
+            ASSERT(false);
+        } catch (const FormulaException&) {
+        }
+    }
+
+    // ячейка в своей области и цикл через область другой формулы
+    for (auto [pos, text] : {std::pair{"A5"_pos, "=MATCH(1,A1:A10,0)"}, std::pair{"A4"_pos, "=E3"}}) {
+        try {
+            sheet.SetCell(pos, text);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+    try {
+        sheet.SetCell("G1"_pos, "=MATCH(1,E1:E3,0)");
+        sheet.SetCell("A1"_pos, "=G1");
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(sheet.GetCell("A1"_pos)->GetText(), "10");
+    sheet.ClearCell("G1"_pos);
+
+    // вставка строки внутри области её расширяет, удаление - сужает
+    sheet.InsertRows(1);
+    ASSERT_EQUAL(sheet.GetCell("E1"_pos)->GetText(), "=VLOOKUP(20,A1:C5,3,0)");
+    ASSERT_EQUAL(sheet.GetCell("E4"_pos)->GetText(), "=MATCH(25,A1:A5,0)");
+    ASSERT_EQUAL(value(sheet, "E4"), error(FormulaError::Category::NotAvailable));
+    sheet.SetCell("A2"_pos, "25");
+    ASSERT_EQUAL(value(sheet, "E4"), CellInterface::Value(2.0));
+    sheet.DeleteRows(0, 2);
+    ASSERT_EQUAL(sheet.GetCell("E2"_pos)->GetText(), "=MATCH(25,A1:A3,0)");
+    ASSERT_EQUAL(value(sheet, "E2"), error(FormulaError::Category::NotAvailable));
+    sheet.SetCell("A2"_pos, "25");
+    ASSERT_EQUAL(value(sheet, "E2"), CellInterface::Value(2.0));
+    sheet.DeleteColumns(0);
+    ASSERT_EQUAL(sheet.GetCell("D2"_pos)->GetText(), "=MATCH(25,#REF!,0)");
+    ASSERT_EQUAL(value(sheet, "D2"), error(FormulaError::Category::Ref));
+
+    // поиск по индексу совпадает с перебором строк
+    Sheet large;
+    large.SetLazyFormulaParsing(true);
+    const int rows = 2000;
+    std::vector<int> keys(rows);
+    for (int row = 0; row < rows; ++row) {
+        keys[row] = row * 7919 % 1000;
+        large.SetCell({ row, 0 }, std::to_string(keys[row]));
+    }
+    large.SetCell("B1"_pos, "=A1");
+    for (int key = -5; key < 1005; key += 3) {
+        const int first = key < 500 ? 0 : 1000;
+        const std::string range = "A" + std::to_string(first + 1) + ":A" + std::to_string(rows);
+        large.SetCell("C1"_pos, "=MATCH(" + std::to_string(key) + "," + range + ",0)");
+        large.SetCell("C2"_pos, "=MATCH(" + std::to_string(key) + "," + range + ")");
+        large.SetCell("C3"_pos, "=MATCH(" + std::to_string(key) + "," + range + ",-1)");
+
+        std::optional<int> exact, smaller, larger;
+        for (int row = first; row < rows; ++row) {
+            auto better = [&](std::optional<int>& best, bool fits, bool closer) {
+                if (fits && (!best || closer)) {
+                    best = row;
+                }
+            };
+            better(exact, keys[row] == key, false);
+            better(smaller, keys[row] <= key, smaller && keys[row] > keys[*smaller]);
+            better(larger, keys[row] >= key, larger && keys[row] < keys[*larger]);
+        }
+        auto expected = [&](std::optional<int> row) {
+            return row ? CellInterface::Value(static_cast<double>(*row - first + 1))
+                       : CellInterface::Value(FormulaError(FormulaError::Category::NotAvailable));
+        };
+        ASSERT_EQUAL(value(large, "C1"), expected(exact));
+        ASSERT_EQUAL(value(large, "C2"), expected(smaller));
+        ASSERT_EQUAL(value(large, "C3"), expected(larger));
+    }
+    ASSERT(large.GetMemoryUsage().lookup_indexes > 0);
+}
+
+void TestConditions() {
+    auto value = [](Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    auto error = [](FormulaError::Category category) {
+        return CellInterface::Value(FormulaError(category));
+    };
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "3");
+    sheet.SetCell("A2"_pos, "abc");
+    sheet.SetCell("A3"_pos, "ABC");
+    sheet.SetCell("B1"_pos, "=A1>2");
+    sheet.SetCell("B2"_pos, "=A2=A3");
+    sheet.SetCell("B3"_pos, "=A2>100");
+    sheet.SetCell("B4"_pos, "=A9=0");
+    sheet.SetCell("B5"_pos, "=1+2<>3");
+    sheet.SetCell("B6"_pos, "=IF(A1<=2,1,2)");
+    sheet.SetCell("B7"_pos, "=IF(A1>=5,1)");
+    sheet.SetCell("B8"_pos, "=IF(A1,10,1/0)");
+    sheet.SetCell("B9"_pos, "=AND(A1,0,1/0)+OR(0,A1,A2)*10");
+    sheet.SetCell("B10"_pos, "=AND(1,1/0)");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value(sheet, "B2"), CellInterface::Value(1.0));
+    // текст больше любого числа, пустая ячейка равна нулю
+    ASSERT_EQUAL(value(sheet, "B3"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value(sheet, "B4"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value(sheet, "B5"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value(sheet, "B6"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value(sheet, "B7"), CellInterface::Value(0.0));
+    // ошибка в невычисленном аргументе ни на что не влияет
+    ASSERT_EQUAL(value(sheet, "B8"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(value(sheet, "B9"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(value(sheet, "B10"), error(FormulaError::Category::Arithmetic));
+
+    ASSERT_EQUAL(sheet.GetCell("B5"_pos)->GetText(), "=1+2<>3");
+    sheet.SetCell("C1"_pos, "=(A1=1)+(A2<A3)*2");
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=(A1=1)+(A2<A3)*2");
+    sheet.SetCell("C2"_pos, "=(A1=1)=(A2=A3)");
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=A1=1=(A2=A3)");
+    ASSERT_EQUAL(value(sheet, "C2"), CellInterface::Value(0.0));
+
+    try {
+        sheet.SetCell("C3"_pos, "=IF(1)");
+        ASSERT(false);
+    } catch (const FormulaException&) {
+    }
+
+    // формулы из невыбранной ветви не вычисляются, а изменения их входов
+    // не заставляют пересчитывать условие
+    Sheet lazy;
+    lazy.SetCell("A1"_pos, "1");
+    lazy.SetCell("B1"_pos, "=C1*2");
+    lazy.SetCell("C1"_pos, "5");
+    lazy.SetCell("D1"_pos, "=E1*2");
+    lazy.SetCell("E1"_pos, "7");
+    lazy.SetCell("F1"_pos, "=IF(A1>0,B1,D1)");
+    lazy.SetProfiling(true);
+    auto evaluations = [&lazy](Position pos) -> uint64_t {
+        for (const auto& entry : lazy.ProfileReport(100)) {
+            if (entry.profile.pos == pos) {
+                return entry.profile.evaluations;
+            }
+        }
+        return 0;
+    };
+
+    ASSERT_EQUAL(value(lazy, "F1"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(evaluations("D1"_pos), 0u);
+    lazy.SetCell("E1"_pos, "8");
+    ASSERT_EQUAL(value(lazy, "F1"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(evaluations("F1"_pos), 1u);
+    ASSERT_EQUAL(evaluations("D1"_pos), 0u);
+
+    lazy.SetCell("A1"_pos, "-1");
+    ASSERT_EQUAL(value(lazy, "F1"), CellInterface::Value(16.0));
+    ASSERT_EQUAL(evaluations("F1"_pos), 2u);
+    lazy.SetCell("C1"_pos, "6");
+    ASSERT_EQUAL(value(lazy, "F1"), CellInterface::Value(16.0));
+    ASSERT_EQUAL(evaluations("F1"_pos), 2u);
+    ASSERT_EQUAL(evaluations("B1"_pos), 1u);
+
+    lazy.SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(value(lazy, "F1"), CellInterface::Value(12.0));
+    ASSERT_EQUAL(evaluations("B1"_pos), 2u);
+
+    // AND и OR: аргументы после известного результата тоже не читаются
+    lazy.SetCell("G1"_pos, "=OR(A1,E1*2)");
+    ASSERT_EQUAL(value(lazy, "G1"), CellInterface::Value(1.0));
+    lazy.SetCell("E1"_pos, "9");
+    ASSERT_EQUAL(value(lazy, "G1"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(evaluations("G1"_pos), 1u);
+
+    // вставка строки меняет входы: все они снова считаются прочитанными
+    lazy.InsertRows(0);
+    ASSERT_EQUAL(lazy.GetCell("F2"_pos)->GetText(), "=IF(A2>0,B2,D2)");
+    lazy.SetCell("E2"_pos, "10");
+    ASSERT_EQUAL(value(lazy, "F2"), CellInterface::Value(12.0));
+    lazy.SetCell("A2"_pos, "0");
+    ASSERT_EQUAL(value(lazy, "F2"), CellInterface::Value(20.0));
+}
+
+void TestForks() {
+    auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    auto number = [](double x) {
+        return CellInterface::Value(x);
+    };
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("C1"_pos, "=B1+10");
+    sheet.SetCell("D1"_pos, "text");
+    sheet.SetCell("A2"_pos, "20");
+    sheet.SetCell("A3"_pos, "30");
+    sheet.SetCell("E1"_pos, "=MATCH(30,A1:A3,0)");
+    sheet.SetCell("E2"_pos, "=A2+1");
+
+    {
+        auto fork = sheet.Fork();
+        ASSERT_EQUAL(value(*fork, "C1"), number(12));
+        ASSERT_EQUAL(fork->GetCell("B1"_pos)->GetText(), "=A1*2");
+        ASSERT_EQUAL(fork->GetPrintableSize(), (Size{3, 5}));
+
+        // изменение видно только в ветке
+        fork->SetCell("A1"_pos, "5");
+        ASSERT_EQUAL(value(*fork, "C1"), number(20));
+        ASSERT_EQUAL(value(sheet, "C1"), number(12));
+        ASSERT_EQUAL(value(*fork, "E2"), number(21));
+
+        try {
+            sheet.SetCell("A1"_pos, "2");
+            ASSERT(false);
+        } catch (const std::logic_error&) {
+        }
+        try {
+            fork->Fork();
+            ASSERT(false);
+        } catch (const std::logic_error&) {
+        }
+        try {
+            fork->InsertRows(0, 1);
+            ASSERT(false);
+        } catch (const std::logic_error&) {
+        }
+        try {
+            fork->SetCell("A1"_pos, "=C1");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(value(*fork, "C1"), number(20));
+
+        // очищенная в ветке ячейка закрывает ячейку родителя
+        fork->ClearCell("D1"_pos);
+        ASSERT_EQUAL(fork->GetCell("D1"_pos)->GetText(), "");
+        ASSERT_EQUAL(sheet.GetCell("D1"_pos)->GetText(), "text");
+
+        // поиск в изменённом столбце видит значения ветки
+        ASSERT_EQUAL(value(*fork, "E1"), number(3));
+        fork->SetCell("A2"_pos, "30");
+        ASSERT_EQUAL(value(*fork, "E1"), number(2));
+        ASSERT_EQUAL(value(*fork, "E2"), number(31));
+        ASSERT_EQUAL(value(sheet, "E1"), number(3));
+
+        std::ostringstream texts;
+        fork->PrintTexts(texts);
+        ASSERT_EQUAL(texts.str(), "5\t=A1*2\t=B1+10\t\t=MATCH(30,A1:A3,0)\n30\t\t\t\t=A2+1\n30\t\t\t\t\n");
+        std::ostringstream values;
+        fork->PrintValues(values);
+        ASSERT_EQUAL(values.str(), "5\t10\t20\t\t2\n30\t\t\t\t31\n30\t\t\t\t\n");
+    }
+
+    {
+        Sheet large;
+        for (int row = 0; row < 5000; ++row) {
+            large.SetCell({ row, 0 }, std::to_string(row));
+        }
+        large.SetCell({ 6000, 3 }, "edge");
+        large.SetCell("C1"_pos, "=MATCH(4000,A1:A5000,0)");
+        auto fork = large.Fork();
+        ASSERT_EQUAL(fork->GetPrintableSize(), (Size{6001, 4}));
+
+        // индекс ветки заводится один раз и дальше следует её правкам
+        ASSERT_EQUAL(value(*fork, "C1"), number(4001));
+        fork->SetCell("A10"_pos, "4000");
+        ASSERT_EQUAL(value(*fork, "C1"), number(10));
+        fork->SetCell("A10"_pos, "9");
+        ASSERT_EQUAL(value(*fork, "C1"), number(4001));
+        fork->ClearCell({ 4000, 0 });
+        ASSERT_EQUAL(value(*fork, "C1"), CellInterface::Value(FormulaError::Category::NotAvailable));
+        fork->SetCell("A4000"_pos, "=3999+1");
+        ASSERT_EQUAL(value(*fork, "C1"), number(4000));
+        ASSERT_EQUAL(value(large, "C1"), number(4001));
+
+        // граница ветки сужается до ячеек родителя, которые она не закрыла
+        fork->ClearCell({ 6000, 3 });
+        ASSERT_EQUAL(fork->GetPrintableSize(), (Size{5000, 3}));
+        fork->ClearCell({ 4999, 0 });
+        ASSERT_EQUAL(fork->GetPrintableSize(), (Size{4999, 3}));
+        fork->ClearCell("C1"_pos);
+        ASSERT_EQUAL(fork->GetPrintableSize(), (Size{4999, 1}));
+        fork->SetCell({ 7000, 1 }, "own");
+        ASSERT_EQUAL(fork->GetPrintableSize(), (Size{7001, 2}));
+        ASSERT_EQUAL(large.GetPrintableSize(), (Size{6001, 4}));
+    }
+
+    std::vector<Sheet::ScenarioInputs> scenarios;
+    for (int i = 0; i < 100; ++i) {
+        scenarios.push_back({ { "A1"_pos, std::to_string(i) } });
+    }
+    auto results = sheet.RunScenarios(scenarios, { "C1"_pos, "E1"_pos, "F9"_pos }, 4);
+    ASSERT_EQUAL(results.size(), 100u);
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_EQUAL(results[i][0], number(2 * i + 10));
+        ASSERT_EQUAL(results[i][1], number(i == 30 ? 1 : 3));
+        ASSERT_EQUAL(results[i][2], CellInterface::Value(std::string()));
+    }
+
+    try {
+        sheet.RunScenarios({ { { "A1"_pos, "=B1" } } }, { "C1"_pos }, 2);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+
+    // без веток таблица снова меняется
+    sheet.SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(value(sheet, "C1"), number(14));
+}
+
+// Разбор файла Arrow IPC для проверки выгрузки: таблицы FlatBuffers
+// читаются через vtable, как их читает любая реализация формата
+uint64_t ReadLittleEndian(std::string_view data, size_t pos, size_t size) {
+    ASSERT(pos + size <= data.size());
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value |= uint64_t{ static_cast<uint8_t>(data[pos + i]) } << (8 * i);
+    }
+    return value;
+}
+
+struct FlatTable {
+    std::string_view data;
+    size_t pos;
+
+    static FlatTable Root(std::string_view data) {
+        return { data, ReadLittleEndian(data, 0, 4) };
+    }
+
+    // позиция поля id; 0 - поля нет
+    size_t Field(size_t id) const {
+        size_t vtable = pos - static_cast<int32_t>(ReadLittleEndian(data, pos, 4));
+        if (4 + 2 * id >= ReadLittleEndian(data, vtable, 2)) {
+            return 0;
+        }
+        size_t offset = ReadLittleEndian(data, vtable + 4 + 2 * id, 2);
+        return offset ? pos + offset : 0;
+    }
+    uint64_t Scalar(size_t id, size_t size) const {
+        size_t at = Field(id);
+        return at ? ReadLittleEndian(data, at, size) : 0;
+    }
+    size_t Follow(size_t id) const {
+        size_t at = Field(id);
+        ASSERT(at != 0);
+        return at + ReadLittleEndian(data, at, 4);
+    }
+    FlatTable Table(size_t id) const {
+        return { data, Follow(id) };
+    }
+    size_t VectorSize(size_t id) const {
+        return ReadLittleEndian(data, Follow(id), 4);
+    }
+    // позиция i-го элемента вектора структур по elem_size байт
+    size_t VectorElement(size_t id, size_t i, size_t elem_size) const {
+        return Follow(id) + 4 + i * elem_size;
+    }
+    FlatTable VectorTable(size_t id, size_t i) const {
+        size_t at = VectorElement(id, i, 4);
+        return { data, at + ReadLittleEndian(data, at, 4) };
+    }
+    std::string_view String(size_t id) const {
+        size_t at = Follow(id);
+        return data.substr(at + 4, ReadLittleEndian(data, at, 4));
+    }
+};
+
+struct ArrowColumn {
+    std::string name;
+    uint8_t type = 0;
+    uint16_t precision = 0;
+    size_t null_count = 0;
+    std::vector<bool> valid;
+    std::vector<double> numbers;
+    std::vector<std::string> texts;
+};
+
+// Столбцы файла со значениями всех пакетов подряд; batches - число пакетов
+std::vector<ArrowColumn> ReadArrowFile(const std::string& path, size_t& batches) {
+    std::ifstream input(path, std::ios::binary);
+    const std::string file((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
+    const std::string_view data = file;
+    ASSERT(data.size() > 16);
+    ASSERT_EQUAL(data.substr(0, 6), "ARROW1");
+    ASSERT_EQUAL(data.substr(data.size() - 6), "ARROW1");
+
+    const size_t footer_size = ReadLittleEndian(data, data.size() - 10, 4);
+    const FlatTable footer = FlatTable::Root(data.substr(data.size() - 10 - footer_size, footer_size));
+    ASSERT_EQUAL(footer.Scalar(0, 2), 4u);  // V5
+
+    const FlatTable schema = footer.Table(1);
+    ASSERT_EQUAL(schema.Scalar(0, 2), 0u);  // little-endian
+    std::vector<ArrowColumn> columns(schema.VectorSize(1));
+    for (size_t i = 0; i < columns.size(); ++i) {
+        const FlatTable field = schema.VectorTable(1, i);
+        columns[i].name = field.String(0);
+        ASSERT_EQUAL(field.Scalar(1, 1), 1u);  // nullable
+        columns[i].type = static_cast<uint8_t>(field.Scalar(2, 1));
+        columns[i].precision = static_cast<uint16_t>(field.Table(3).Scalar(0, 2));
+    }
+
+    batches = footer.VectorSize(3);
+    for (size_t b = 0; b < batches; ++b) {
+        // Block { offset, metaDataLength, (выравнивание), bodyLength }
+        const size_t block = footer.VectorElement(3, b, 24);
+        const size_t offset = ReadLittleEndian(footer.data, block, 8);
+        const size_t metadata_length = ReadLittleEndian(footer.data, block + 8, 4);
+        const size_t body_length = ReadLittleEndian(footer.data, block + 16, 8);
+        ASSERT_EQUAL(offset % 8, 0u);
+        ASSERT_EQUAL(ReadLittleEndian(data, offset, 4), 0xFFFFFFFFu);
+        ASSERT_EQUAL(ReadLittleEndian(data, offset + 4, 4) + 8, metadata_length);
+        ASSERT(offset + metadata_length + body_length <= data.size());
+
+        const FlatTable message = FlatTable::Root(data.substr(offset + 8, metadata_length - 8));
+        ASSERT_EQUAL(message.Scalar(0, 2), 4u);
+        ASSERT_EQUAL(message.Scalar(1, 1), 3u);  // RecordBatch
+        ASSERT_EQUAL(message.Scalar(3, 8), body_length);
+        const std::string_view body = data.substr(offset + metadata_length, body_length);
+
+        const FlatTable batch = message.Table(2);
+        const size_t length = batch.Scalar(0, 8);
+        ASSERT_EQUAL(batch.VectorSize(1), columns.size());
+        size_t buffer = 0;
+        auto next_buffer = [&] {
+            const size_t at = batch.VectorElement(2, buffer++, 16);
+            const size_t buffer_offset = ReadLittleEndian(batch.data, at, 8);
+            const size_t buffer_length = ReadLittleEndian(batch.data, at + 8, 8);
+            ASSERT_EQUAL(buffer_offset % 8, 0u);
+            ASSERT(buffer_offset + buffer_length <= body.size());
+            return body.substr(buffer_offset, buffer_length);
+        };
+
+        for (size_t i = 0; i < columns.size(); ++i) {
+            ArrowColumn& column = columns[i];
+            // FieldNode { length, null_count }
+            const size_t node = batch.VectorElement(1, i, 16);
+            ASSERT_EQUAL(ReadLittleEndian(batch.data, node, 8), length);
+            const size_t null_count = ReadLittleEndian(batch.data, node + 8, 8);
+            column.null_count += null_count;
+
+            // пустая битовая карта - пропусков нет
+            const std::string_view validity = next_buffer();
+            ASSERT(validity.empty() ? null_count == 0 : validity.size() == (length + 7) / 8);
+            size_t nulls = 0;
+            for (size_t row = 0; row < length; ++row) {
+                const bool valid = validity.empty() || (static_cast<uint8_t>(validity[row / 8]) >> (row % 8) & 1);
+                column.valid.push_back(valid);
+                nulls += !valid;
+            }
+            ASSERT_EQUAL(nulls, null_count);
+
+            if (column.type == 3) {
+                const std::string_view values = next_buffer();
+                ASSERT_EQUAL(values.size(), length * sizeof(double));
+                for (size_t row = 0; row < length; ++row) {
+                    double value;
+                    std::memcpy(&value, values.data() + row * sizeof(double), sizeof(double));
+                    column.numbers.push_back(value);
+                }
+            } else {
+                const std::string_view offsets = next_buffer();
+                const std::string_view bytes = next_buffer();
+                ASSERT_EQUAL(offsets.size(), (length + 1) * 4);
+                for (size_t row = 0; row < length; ++row) {
+                    const size_t from = ReadLittleEndian(offsets, row * 4, 4);
+                    const size_t to = ReadLittleEndian(offsets, row * 4 + 4, 4);
+                    ASSERT(from <= to && to <= bytes.size());
+                    column.texts.emplace_back(bytes.substr(from, to - from));
+                }
+            }
+        }
+        ASSERT_EQUAL(buffer, batch.VectorSize(2));
+    }
+    return columns;
+}
+
+void TestColumnarExport() {
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1.5");
+    sheet.SetCell("A2"_pos, "=A1*2");
+    sheet.SetCell("A3"_pos, "=1/0");
+    sheet.SetCell("B1"_pos, "label");
+    sheet.SetCell("B2"_pos, "=A1+1");
+    sheet.SetCell("B4"_pos, "=1/0");
+    sheet.SetCell("C1"_pos, "2");
+    sheet.SetCell("C2"_pos, "=C1*2");
+    sheet.SetCell("D1"_pos, "'");
+    sheet.SetCell("D3"_pos, "=C2+1");
+
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet-export-test.arrow").string();
+    sheet.ExportColumnar(path);
+    size_t batches = 0;
+    auto columns = ReadArrowFile(path, batches);
+    ASSERT_EQUAL(std::filesystem::file_size(path) % 8, 2u);
+    std::filesystem::remove(path);
+
+    // столбец C - числа; A с ошибкой формулы и B с текстом - текст, чтобы
+    // ошибку можно было отличить от пустой ячейки
+    ASSERT_EQUAL(batches, 1u);
+    ASSERT_EQUAL(columns.size(), 4u);
+    ASSERT_EQUAL(columns[0].name, "A");
+    ASSERT_EQUAL(columns[0].type, 5);  // Utf8
+    ASSERT_EQUAL(columns[0].null_count, 1u);
+    ASSERT(columns[0].valid == (std::vector<bool>{ true, true, true, false }));
+    ASSERT(columns[0].texts == (std::vector<std::string>{ "1.5", "3", "#ARITHM!", "" }));
+    ASSERT_EQUAL(columns[2].name, "C");
+    ASSERT_EQUAL(columns[2].type, 3);  // FloatingPoint
+    ASSERT_EQUAL(columns[2].precision, 2u);  // DOUBLE
+    ASSERT_EQUAL(columns[2].null_count, 2u);
+    ASSERT(columns[2].valid == (std::vector<bool>{ true, true, false, false }));
+    ASSERT_EQUAL(columns[2].numbers[0], 2.0);
+    ASSERT_EQUAL(columns[2].numbers[1], 4.0);
+    // текст, который печатается пустым, - null и в числовом столбце
+    ASSERT_EQUAL(columns[3].type, 3);
+    ASSERT(columns[3].valid == (std::vector<bool>{ false, false, true, false }));
+    ASSERT_EQUAL(columns[3].numbers[2], 5.0);
+    ASSERT_EQUAL(columns[1].name, "B");
+    ASSERT_EQUAL(columns[1].type, 5);  // Utf8
+    ASSERT_EQUAL(columns[1].null_count, 1u);
+    ASSERT(columns[1].valid == (std::vector<bool>{ true, true, false, true }));
+    ASSERT(columns[1].texts == (std::vector<std::string>{ "label", "2.5", "", "#ARITHM!" }));
+
+    // элементы массива без ячеек, далёкая строка и у ветки - значения родителя
+    Sheet arrays;
+    for (int row = 0; row < 3; ++row) {
+        arrays.SetCell({ row, 0 }, std::to_string(row + 1));
+    }
+    arrays.SetCell("B1"_pos, "=A1:A3*2");
+    arrays.SetCell("A10000"_pos, "9");
+    {
+        auto fork = arrays.Fork();
+        fork->SetCell("C2"_pos, "=B3+1");
+        fork->ExportColumnar(path);
+        columns = ReadArrowFile(path, batches);
+        std::filesystem::remove(path);
+
+        ASSERT_EQUAL(columns.size(), 3u);
+        ASSERT_EQUAL(columns[0].valid.size(), 10000u);
+        ASSERT_EQUAL(columns[0].null_count, 10000u - 4);
+        ASSERT_EQUAL(columns[0].numbers[2], 3.0);
+        ASSERT_EQUAL(columns[0].numbers[9999], 9.0);
+        ASSERT_EQUAL(columns[1].null_count, 10000u - 3);
+        ASSERT_EQUAL(columns[1].numbers[1], 4.0);
+        ASSERT_EQUAL(columns[1].numbers[2], 6.0);
+        ASSERT_EQUAL(columns[2].null_count, 10000u - 1);
+        ASSERT(columns[2].valid[1]);
+        ASSERT_EQUAL(columns[2].numbers[1], 7.0);
+    }
+
+    // пустая таблица - файл со схемой без столбцов и без пакетов
+    Sheet empty;
+    empty.ExportColumnar(path);
+    columns = ReadArrowFile(path, batches);
+    ASSERT(columns.empty());
+    ASSERT_EQUAL(batches, 0u);
+    std::filesystem::remove(path);
+
+    try {
+        sheet.ExportColumnar((std::filesystem::path(path) / "missing" / "file.arrow").string());
+        ASSERT(false);
+    } catch (const ColumnarExportException&) {
+    }
+}
+
+void TestJournal() {
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet-journal-test.log").string();
+    const std::string checkpoint = path + ".checkpoint";
+    std::filesystem::remove(path);
+    std::filesystem::remove(checkpoint);
+
+    auto texts = [](const Sheet& sheet) {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        return output.str();
+    };
+
+    std::string expected;
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path, { 4, std::chrono::seconds(1) });
+        sheet.SetCell("A1"_pos, "1");
+        sheet.SetCell("A2"_pos, "=A1+1");
+        sheet.SetCell("B1"_pos, "=A1+A2");
+        sheet.SetCell("C3"_pos, "temporary");
+        sheet.ClearCell("C3"_pos);
+        sheet.InsertRows(0);
+        // неудачные правки в журнал не попадают
+        try {
+            sheet.SetCell("A2"_pos, "=B2");
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+        ASSERT_EQUAL(sheet.GetJournalStats().records, 6u);
+        ASSERT_EQUAL(sheet.GetJournalStats().syncs, 1u);
+        expected = texts(sheet);
+    }
+
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path);
+        ASSERT_EQUAL(texts(sheet), expected);
+        ASSERT_EQUAL(sheet.GetJournalStats().replayed_records, 6u);
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(3.0));
+
+        sheet.Checkpoint();
+        ASSERT_EQUAL(std::filesystem::file_size(path), JOURNAL_MAGIC.size() + 1);
+        sheet.SetCell("A2"_pos, "10");
+        sheet.SyncJournal();
+        expected = texts(sheet);
+    }
+
+    // оборванная при сбое запись отбрасывается
+    {
+        std::ofstream output(path, std::ios::binary | std::ios::app);
+        output.write("\x20\0\0\0\1\2", 6);
+    }
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path);
+        JournalStats stats = sheet.GetJournalStats();
+        ASSERT_EQUAL(stats.checkpoint_cells, 3u);
+        ASSERT_EQUAL(stats.replayed_records, 1u);
+        ASSERT_EQUAL(stats.discarded_bytes, 6u);
+        ASSERT_EQUAL(texts(sheet), expected);
+        ASSERT_EQUAL(sheet.GetCell("B2"_pos)->GetValue(), CellInterface::Value(21.0));
+
+        try {
+            sheet.OpenJournal(path);
+            ASSERT(false);
+        } catch (const std::logic_error&) {
+        }
+        sheet.SetCell("D1"_pos, "after recovery");
+        expected = texts(sheet);
+    }
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path);
+        ASSERT_EQUAL(texts(sheet), expected);
+        sheet.CloseJournal();
+    }
+
+    // ячейки ложатся в таблицу пачками между сдвигами: формула с областью
+    // из первой пачки видит ячейку, которую добавила вторая
+    std::filesystem::remove(path);
+    std::filesystem::remove(checkpoint);
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path);
+        sheet.SetCell("C1"_pos, "=MATCH(7,D1:D3,0)");
+        sheet.SetCell("C2"_pos, "=D3*2");
+        sheet.InsertRows(0);
+        sheet.SetCell("D4"_pos, "7");
+        sheet.SetCell("D3"_pos, "1");
+        sheet.SetCell("D3"_pos, "7");
+        sheet.SetCell("E1"_pos, "gone");
+        sheet.ClearCell("E1"_pos);
+        expected = texts(sheet);
+    }
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path);
+        ASSERT_EQUAL(sheet.GetJournalStats().replayed_records, 8u);
+        ASSERT_EQUAL(texts(sheet), expected);
+        ASSERT(sheet.GetCell("E1"_pos) == nullptr);
+        ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetValue(), CellInterface::Value(2.0));
+        ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetValue(), CellInterface::Value(14.0));
+    }
+
+    // группу, которая не набралась, по сроку сбрасывает фоновый поток
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path, { 1000, std::chrono::milliseconds(1) });
+        const auto size = std::filesystem::file_size(path);
+        sheet.SetCell("F1"_pos, "idle");
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+        while (sheet.GetJournalStats().syncs == 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        ASSERT_EQUAL(sheet.GetJournalStats().syncs, 1u);
+        ASSERT(std::filesystem::file_size(path) > size);
+    }
+
+    std::filesystem::remove(path);
+    std::filesystem::remove(checkpoint);
+}
+
+void TestArrayFormulas() {
+    auto value = [](Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    auto error = [](FormulaError::Category category) {
+        return CellInterface::Value(FormulaError(category));
+    };
+
+    Sheet sheet;
+    for (int row = 0; row < 3; ++row) {
+        sheet.SetCell({ row, 0 }, std::to_string(row + 1));
+        sheet.SetCell({ row, 1 }, std::to_string(row + 4));
+    }
+    sheet.SetCell("C1"_pos, "=A1:A3*B1:B3");
+    ASSERT_EQUAL(value(sheet, "C1"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(value(sheet, "C2"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(value(sheet, "C3"), CellInterface::Value(18.0));
+    ASSERT_EQUAL(sheet.GetCell("C1"_pos)->GetText(), "=A1:A3*B1:B3");
+    ASSERT_EQUAL(sheet.GetCell("C3"_pos)->GetText(), "");
+    ASSERT(sheet.GetPrintableSize() == (Size{ 3, 3 }));
+
+    // элементы читаются ссылками и областями и меняются вместе со входами
+    sheet.SetCell("D1"_pos, "=C2+1");
+    sheet.SetCell("D2"_pos, "=MATCH(18,C1:C3,0)");
+    sheet.SetCell("D3"_pos, "=-C1:C2");
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(11.0));
+    ASSERT_EQUAL(value(sheet, "D2"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value(sheet, "D4"), CellInterface::Value(-10.0));
+    sheet.SetCell("A2"_pos, "3");
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(16.0));
+    sheet.SetCell("A3"_pos, "abc");
+    ASSERT_EQUAL(value(sheet, "C3"), error(FormulaError::Category::Value));
+    ASSERT_EQUAL(value(sheet, "D2"), error(FormulaError::Category::NotAvailable));
+    sheet.SetCell("A3"_pos, "3");
+
+    std::ostringstream values;
+    sheet.PrintValues(values);
+    ASSERT_EQUAL(values.str(), "1\t4\t4\t16\n3\t5\t15\t3\n3\t6\t18\t-4\n\t\t\t-15\n");
+
+    // занятая область: #SPILL!, пока её не освободят
+    sheet.SetCell("C2"_pos, "x");
+    ASSERT_EQUAL(value(sheet, "C1"), error(FormulaError::Category::Spill));
+    ASSERT_EQUAL(value(sheet, "D2"), error(FormulaError::Category::NotAvailable));
+    ASSERT(sheet.GetCell("C3"_pos) == nullptr);
+    sheet.ClearCell("C2"_pos);
+    ASSERT_EQUAL(value(sheet, "C1"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(value(sheet, "C3"), CellInterface::Value(18.0));
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(16.0));
+
+    // формула в ячейке области закрывает массив
+    sheet.SetCell("E1"_pos, "=A1:A3*2");
+    ASSERT_EQUAL(value(sheet, "E2"), CellInterface::Value(6.0));
+    sheet.SetCell("E3"_pos, "=B1:B2");
+    ASSERT_EQUAL(value(sheet, "E1"), error(FormulaError::Category::Spill));
+    ASSERT_EQUAL(value(sheet, "E4"), CellInterface::Value(5.0));
+    ASSERT(sheet.GetCell("E2"_pos) == nullptr);
+
+    // перекрывающиеся массивы: область достаётся тому, что выведен раньше
+    sheet.SetCell("F2"_pos, "=A1:B1");
+    sheet.SetCell("G1"_pos, "=A1:A2");
+    ASSERT_EQUAL(value(sheet, "G2"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(value(sheet, "G1"), error(FormulaError::Category::Spill));
+    sheet.ClearCell("F2"_pos);
+    ASSERT_EQUAL(value(sheet, "G1"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value(sheet, "G2"), CellInterface::Value(3.0));
+
+    // области разных размеров, условия и край таблицы
+    sheet.SetCell("J1"_pos, "=A1:A3+B1:B2");
+    ASSERT_EQUAL(value(sheet, "J2"), CellInterface::Value(8.0));
+    ASSERT_EQUAL(value(sheet, "J3"), error(FormulaError::Category::NotAvailable));
+    sheet.SetCell("K1"_pos, "=IF(A1:A3>1,B1:B3,0)");
+    ASSERT_EQUAL(value(sheet, "K1"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value(sheet, "K3"), CellInterface::Value(6.0));
+    Position last{ Position::MAX_ROWS - 1, 0 };
+    sheet.SetCell(last, "=A1:A2");
+    ASSERT_EQUAL(sheet.GetCell(last)->GetValue(), error(FormulaError::Category::Spill));
+    sheet.ClearCell(last);
+
+    // формула не может читать свою область ни прямо, ни через другие формулы
+    sheet.SetCell("H2"_pos, "=I1");
+    for (const char* text : {"=H1:H3*2", "=A1:A3+H2"}) {
+        try {
+            sheet.SetCell("H1"_pos, text);
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        }
+    }
+
+    // массивы выводятся заново после вставки строк
+    sheet.InsertRows(0);
+    ASSERT_EQUAL(sheet.GetCell("C2"_pos)->GetText(), "=A2:A4*B2:B4");
+    ASSERT_EQUAL(value(sheet, "C4"), CellInterface::Value(18.0));
+    ASSERT(sheet.GetCell("C1"_pos) == nullptr);
+
+    // сброс массива не трогает значения его элементов: чтение областью,
+    // поиском и формулой-массивом сначала вычисляет массив заново
+    Sheet large;
+    for (int row = 0; row < 50000; ++row) {
+        large.SetCell({ row, 0 }, std::to_string(row));
+    }
+    large.SetCell("Z1"_pos, "1");
+    large.SetCell("B1"_pos, "=A1:A50000+Z1");
+    large.SetCell("C1"_pos, "=MATCH(40001,B4:B50000,0)");
+    large.SetCell("D1"_pos, "=B3");
+    large.SetCell("E1"_pos, "=B100:B101*2");
+    ASSERT_EQUAL(value(large, "C1"), CellInterface::Value(39998.0));
+    ASSERT_EQUAL(value(large, "D1"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value(large, "E2"), CellInterface::Value(202.0));
+    auto element = [&large](int row) {
+        return large.GetNumericValue({ row, 1 });
+    };
+    for (int z = 2; z <= 4; ++z) {
+        large.SetCell("Z1"_pos, std::to_string(z));
+        // первым массив читает каждый раз другой читатель
+        if (z == 2) {
+            ASSERT(element(30000) == (std::variant<double, FormulaError>(30000.0 + z)));
+        } else if (z == 3) {
+            ASSERT_EQUAL(value(large, "C1"), CellInterface::Value(39999.0 - z));
+        } else {
+            ASSERT_EQUAL(value(large, "E2"), CellInterface::Value(2.0 * (100 + z)));
+        }
+        ASSERT_EQUAL(value(large, "C1"), CellInterface::Value(39999.0 - z));
+        ASSERT_EQUAL(value(large, "D1"), CellInterface::Value(2.0 + z));
+        ASSERT_EQUAL(value(large, "E2"), CellInterface::Value(2.0 * (100 + z)));
+        ASSERT(element(30000) == (std::variant<double, FormulaError>(30000.0 + z)));
+    }
+
+    // закрытый массив: его элементы пусты для всех читателей
+    large.SetCell("B2"_pos, "x");
+    ASSERT_EQUAL(value(large, "C1"), error(FormulaError::Category::NotAvailable));
+    ASSERT_EQUAL(value(large, "D1"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value(large, "E2"), CellInterface::Value(0.0));
+    ASSERT(element(30000) == (std::variant<double, FormulaError>(0.0)));
+    ASSERT(element(1) == (std::variant<double, FormulaError>(FormulaError::Category::Value)));
+    large.ClearCell("B2"_pos);
+    ASSERT_EQUAL(value(large, "C1"), CellInterface::Value(39995.0));
+    ASSERT_EQUAL(value(large, "E2"), CellInterface::Value(208.0));
+}
+
+void TestOptimizeLayout() {
+    auto value = [](Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+
+    // формулы заводятся в порядке, обратном порядку вычисления
+    Sheet sheet;
+    for (int row = 9; row >= 1; --row) {
+        sheet.SetCell({ row, 1 }, "=B" + std::to_string(row) + "+A" + std::to_string(row + 1));
+    }
+    sheet.SetCell("B1"_pos, "=A1");
+    for (int row = 0; row < 10; ++row) {
+        sheet.SetCell({ row, 0 }, std::to_string(row + 1));
+    }
+    sheet.SetCell("C1"_pos, "=MATCH(55,B1:B10,0)");
+    ASSERT_EQUAL(value(sheet, "B10"), CellInterface::Value(55.0));
+
+    // значения переезжают вместе с формулами, пересчёт идёт по новому порядку
+    sheet.OptimizeLayout();
+    ASSERT_EQUAL(value(sheet, "B10"), CellInterface::Value(55.0));
+    ASSERT_EQUAL(value(sheet, "C1"), CellInterface::Value(10.0));
+    sheet.SetCell("A1"_pos, "2");
+    sheet.Recalculate();
+    ASSERT_EQUAL(value(sheet, "B10"), CellInterface::Value(56.0));
+    ASSERT_EQUAL(value(sheet, "C1"), CellInterface::Value(FormulaError(FormulaError::Category::NotAvailable)));
+
+    // новые ячейки дополняют порядок, удалённые из него выпадают, а сам
+    // порядок остаётся, в том числе когда адрес удалённой ячейки достаётся
+    // новой и когда удалённых набирается столько, что порядок сжимается
+    sheet.SetCell("D1"_pos, "=B10*2");
+    sheet.Recalculate();
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(112.0));
+    sheet.ClearCell("D1"_pos);
+    sheet.SetCell("A1"_pos, "1");
+    sheet.Recalculate();
+    ASSERT_EQUAL(value(sheet, "C1"), CellInterface::Value(10.0));
+    for (int i = 0; i < 20; ++i) {
+        sheet.SetCell("D1"_pos, "=B10*" + std::to_string(i));
+        sheet.SetCell("E1"_pos, "=D1+1");
+        sheet.ClearCell("E1"_pos);
+        sheet.ClearCell("D1"_pos);
+    }
+    sheet.SetCell("D1"_pos, "=B10*3");
+    sheet.SetCell("A1"_pos, "2");
+    sheet.Recalculate();
+    ASSERT_EQUAL(value(sheet, "D1"), CellInterface::Value(168.0));
+    sheet.ClearRange({ { 0, 2 }, { 0, 3 } });
+    sheet.SetCell("A1"_pos, "1");
+    sheet.Recalculate();
+    ASSERT_EQUAL(value(sheet, "B10"), CellInterface::Value(55.0));
+
+    // с ограниченным кэшем значений вытесненные значения вычисляются заново
+    sheet.SetResultCacheCapacity(3);
+    sheet.OptimizeLayout();
+    sheet.SetCell("A2"_pos, "3");
+    ASSERT_EQUAL(value(sheet, "B10"), CellInterface::Value(56.0));
+    ASSERT_EQUAL(value(sheet, "B2"), CellInterface::Value(4.0));
+
+    // Перенесённая формула с условием помнит выбранную ветвь: изменение
+    // невыбранного входа её не пересчитывает. Неразобранная формула
+    // переносится текстом.
+    Sheet branches;
+    branches.SetLazyFormulaParsing(true);
+    branches.SetCell("A1"_pos, "1");
+    branches.SetCell("B1"_pos, "10");
+    branches.SetCell("C1"_pos, "20");
+    branches.SetCell("D1"_pos, "=IF(A1>0,B1,C1)");
+    branches.SetCell("E1"_pos, "=1+");
+    ASSERT_EQUAL(value(branches, "D1"), CellInterface::Value(10.0));
+    branches.OptimizeLayout();
+    branches.SetProfiling(true);
+    branches.SetCell("C1"_pos, "30");
+    ASSERT_EQUAL(value(branches, "D1"), CellInterface::Value(10.0));
+    ASSERT(branches.ProfileReport(10).empty());
+    branches.SetCell("A1"_pos, "0");
+    ASSERT_EQUAL(value(branches, "D1"), CellInterface::Value(30.0));
+    ASSERT_EQUAL(branches.ProfileReport(10).size(), 1u);
+    ASSERT_EQUAL(branches.GetCell("E1"_pos)->GetText(), "=1+");
+}
+
+void TestRangeOperations() {
+    auto text = [](const Sheet& sheet, std::string_view pos) {
+        const CellInterface* cell = sheet.GetCell(Position::FromString(pos));
+        return cell ? cell->GetText() : std::string();
+    };
+    auto value = [](const Sheet& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+
+    Sheet sheet;
+    sheet.SetCell("A1"_pos, "1");
+    sheet.SetCell("A2"_pos, "2");
+    sheet.SetCell("B1"_pos, "=A1*2");
+    sheet.SetCell("B2"_pos, "=A2+B1");
+    sheet.SetCell("C1"_pos, "=A1+A2");
+    sheet.SetCell("C2"_pos, "=MATCH(2,A1:A2,0)");
+
+    // ссылки копий сдвигаются вместе с ними, в том числе области
+    sheet.CopyRange({ "A1"_pos, "C2"_pos }, "D3"_pos);
+    ASSERT_EQUAL(text(sheet, "E3"), "=D3*2");
+    ASSERT_EQUAL(text(sheet, "E4"), "=D4+E3");
+    ASSERT_EQUAL(text(sheet, "F3"), "=D3+D4");
+    ASSERT_EQUAL(text(sheet, "F4"), "=MATCH(2,D3:D4,0)");
+    ASSERT_EQUAL(value(sheet, "E4"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(value(sheet, "F3"), CellInterface::Value(3.0));
+    ASSERT_EQUAL(value(sheet, "F4"), CellInterface::Value(2.0));
+    sheet.SetCell("D3"_pos, "10");
+    ASSERT_EQUAL(value(sheet, "E4"), CellInterface::Value(22.0));
+    ASSERT_EQUAL(value(sheet, "F4"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value(sheet, "B2"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 4, 6 }));
+
+    // ссылка, ушедшая за край таблицы, - #REF!
+    sheet.CopyRange({ "B1"_pos, "B1"_pos }, "A7"_pos);
+    ASSERT_EQUAL(text(sheet, "A7"), "=#REF!*2");
+    ASSERT_EQUAL(value(sheet, "A7"), CellInterface::Value(FormulaError(FormulaError::Category::Ref)));
+    try {
+        sheet.CopyRange({ "A1"_pos, "B2"_pos }, Position{ Position::MAX_ROWS - 1, 0 });
+        ASSERT(false);
+    } catch (const InvalidPositionException&) {
+    }
+
+    // очистка области у края сужает границу печати
+    sheet.ClearRange({ "A7"_pos, "A7"_pos });
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 4, 6 }));
+    sheet.ClearRange({ "D3"_pos, "F4"_pos });
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 2, 3 }));
+    ASSERT(sheet.GetCell("E4"_pos) == nullptr);
+
+    // перенос с пересечением; ссылки на перенесённые ячейки не меняются
+    sheet.SetCell("A3"_pos, "3");
+    sheet.MoveRange({ "A1"_pos, "A3"_pos }, "A2"_pos);
+    ASSERT_EQUAL(text(sheet, "A1"), "");
+    ASSERT_EQUAL(text(sheet, "A2"), "1");
+    ASSERT_EQUAL(text(sheet, "A4"), "3");
+    ASSERT_EQUAL(value(sheet, "B1"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value(sheet, "C1"), CellInterface::Value(1.0));
+
+    // копия, замыкающая цикл, ничего не меняет
+    sheet.SetCell("E1"_pos, "=F1");
+    sheet.SetCell("F1"_pos, "=D1");
+    sheet.SetCell("D1"_pos, "5");
+    sheet.SetCell("D2"_pos, "6");
+    try {
+        sheet.CopyRange({ "E1"_pos, "E2"_pos }, "D1"_pos);
+        ASSERT(false);
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT_EQUAL(text(sheet, "D1"), "5");
+    ASSERT_EQUAL(text(sheet, "D2"), "6");
+    ASSERT_EQUAL(value(sheet, "E1"), CellInterface::Value(5.0));
+
+    // скопированная формула-массив выводит результат на новом месте
+    for (int row = 0; row < 4; ++row) {
+        sheet.SetCell({ row, 9 }, std::to_string(row + 1));
+    }
+    sheet.SetCell("G1"_pos, "=J1:J2*2");
+    sheet.CopyRange({ "G1"_pos, "G1"_pos }, "G3"_pos);
+    ASSERT_EQUAL(text(sheet, "G3"), "=J3:J4*2");
+    ASSERT_EQUAL(value(sheet, "G4"), CellInterface::Value(8.0));
+    sheet.ClearRange({ "G1"_pos, "G4"_pos });
+    ASSERT(sheet.GetCell("G4"_pos) == nullptr);
+    ASSERT_EQUAL(sheet.GetPrintableSize(), (Size{ 4, 10 }));
+
+    // очистка последних строк большой таблицы сужает границу печати и
+    // сбрасывает кэш формул, которые читают очищенные ячейки прямо или через
+    // область
+    {
+        Sheet large;
+        const int rows = 50000;
+        const std::string last = std::to_string(rows);
+        for (int row = 0; row < rows; ++row) {
+            large.SetCell({ row, 0 }, std::to_string(row));
+            large.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+        }
+        large.SetCell("C1"_pos, "=A" + last + "+B" + last);
+        large.SetCell("C2"_pos, "=MATCH(" + std::to_string(rows - 1) + ",A1:A" + last + ",0)");
+        ASSERT_EQUAL(value(large, "C1"), CellInterface::Value(3.0 * (rows - 1)));
+        ASSERT_EQUAL(value(large, "C2"), CellInterface::Value(static_cast<double>(rows)));
+        ASSERT_EQUAL(large.GetPrintableSize(), (Size{ rows, 3 }));
+
+        large.ClearRange({ { rows - 1, 0 }, { rows - 1, 1 } });
+        ASSERT_EQUAL(large.GetPrintableSize(), (Size{ rows - 1, 3 }));
+        ASSERT_EQUAL(value(large, "C1"), CellInterface::Value(0.0));
+        ASSERT_EQUAL(value(large, "C2"),
+                     CellInterface::Value(FormulaError(FormulaError::Category::NotAvailable)));
+
+        large.ClearRange({ { rows - 3, 0 }, { rows - 2, 1 } });
+        ASSERT_EQUAL(large.GetPrintableSize(), (Size{ rows - 3, 3 }));
+        large.ClearRange({ { 0, 2 }, { 1, 2 } });
+        ASSERT_EQUAL(large.GetPrintableSize(), (Size{ rows - 3, 2 }));
+    }
+
+    // операция с областью - одна запись журнала
+    const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet-range-test.log").string();
+    std::filesystem::remove(path);
+    std::filesystem::remove(path + ".checkpoint");
+    std::string expected;
+    {
+        Sheet journaled;
+        journaled.OpenJournal(path);
+        journaled.SetCell("A1"_pos, "1");
+        journaled.SetCell("B1"_pos, "=A1+1");
+        journaled.CopyRange({ "A1"_pos, "B1"_pos }, "A2"_pos);
+        journaled.MoveRange({ "A2"_pos, "B2"_pos }, "C3"_pos);
+        journaled.ClearRange({ "A1"_pos, "A1"_pos });
+        ASSERT_EQUAL(journaled.GetJournalStats().records, 5u);
+        std::ostringstream output;
+        journaled.PrintTexts(output);
+        expected = output.str();
+    }
+    {
+        Sheet recovered;
+        recovered.OpenJournal(path);
+        std::ostringstream output;
+        recovered.PrintTexts(output);
+        ASSERT_EQUAL(output.str(), expected);
+        ASSERT_EQUAL(text(recovered, "D3"), "=C3+1");
+    }
+    std::filesystem::remove(path);
+}
 }  // namespace
 
 int main() {
@@ -369,4 +2408,30 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestLazyFormulaParsing);
+    RUN_TEST(tr, TestChangeTracking);
+    RUN_TEST(tr, TestEarlyCutoff);
+    RUN_TEST(tr, TestVectorizedRecalculation);
+    RUN_TEST(tr, TestNumericColumns);
+    RUN_TEST(tr, TestDeepDependencyChain);
+    RUN_TEST(tr, TestDeepConditionalChain);
+    RUN_TEST(tr, TestMemoryUsage);
+    RUN_TEST(tr, TestPlaceholderCollection);
+    RUN_TEST(tr, TestMillionRowGrid);
+    RUN_TEST(tr, TestStringPool);
+    RUN_TEST(tr, TestValueViews);
+    RUN_TEST(tr, TestTraceRecording);
+    RUN_TEST(tr, TestProfiler);
+    RUN_TEST(tr, TestPaging);
+    RUN_TEST(tr, TestResultCache);
+    RUN_TEST(tr, TestBoundReferences);
+    RUN_TEST(tr, TestInsertDeleteRowsColumns);
+    RUN_TEST(tr, TestLookupFunctions);
+    RUN_TEST(tr, TestConditions);
+    RUN_TEST(tr, TestForks);
+    RUN_TEST(tr, TestColumnarExport);
+    RUN_TEST(tr, TestJournal);
+    RUN_TEST(tr, TestArrayFormulas);
+    RUN_TEST(tr, TestOptimizeLayout);
+    RUN_TEST(tr, TestRangeOperations);
 }
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Память, занимаемая таблицей, в байтах - по подсистемам
+struct MemoryUsage {
+    size_t cell_table = 0;       // хеш-таблица ячеек Sheet::sheet_ (корзины и узлы) и индекс их позиций
+    size_t cells = 0;            // объекты Cell и их реализации (Impl)
+    size_t text = 0;             // пул строк: текст ячеек, не уместившийся в дескриптор
+    size_t formulas = 0;         // узлы FormulaAST, списки позиций и неразобранные выражения
+    size_t cached_values = 0;    // кэшированные значения формул
+    size_t dependencies = 0;     // множества referenced_cells_ и dependent_cells_
+    size_t numeric_columns = 0;  // столбцовое хранилище чисел
+    size_t lookup_indexes = 0;   // индексы функций поиска и области формул (оценка)
+
+    size_t Total() const {
+        return cell_table + cells + text + formulas + cached_values + dependencies + numeric_columns
+               + lookup_indexes;
+    }
+};
+
+// Аллокатор, который ведёт точный счёт выделенных байт в общем счётчике.
+// Им пользуются контейнеры, размер узлов которых иначе пришлось бы угадывать.
+template <typename T>
+class CountingAllocator {
+public:
+    using value_type = T;
+
+    explicit CountingAllocator(size_t* counter) noexcept : counter_(counter) {}
+
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U>& other) noexcept : counter_(other.counter_) {}
+
+    T* allocate(size_t n) {
+        T* result = std::allocator<T>().allocate(n);
+        *counter_ += n * sizeof(T);
+        return result;
+    }
+
+    void deallocate(T* ptr, size_t n) noexcept {
+        *counter_ -= n * sizeof(T);
+        std::allocator<T>().deallocate(ptr, n);
+    }
+
+    template <typename U>
+    bool operator==(const CountingAllocator<U>& rhs) const noexcept {
+        return counter_ == rhs.counter_;
+    }
+
+    template <typename U>
+    bool operator!=(const CountingAllocator<U>& rhs) const noexcept {
+        return counter_ != rhs.counter_;
+    }
+
+private:
+    template <typename U>
+    friend class CountingAllocator;
+
+    size_t* counter_;
+};
+
+// Сколько байт строка держит в куче (ноль, если текст уместился в сам объект)
+inline size_t GetHeapSize(const std::string& str) {
+    const char* data = str.data();
+    const char* object = reinterpret_cast<const char*>(&str);
+    bool is_inline = data >= object && data < object + sizeof(str);
+    return is_inline ? 0 : str.capacity() + 1;
+}
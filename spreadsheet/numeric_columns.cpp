@@ -0,0 +1,209 @@
+#include "numeric_columns.h"
+
+#include <algorithm>
+#include <bitset>
+
+using namespace std;
+using namespace literals;
+
+namespace {
+const int WORD_BITS = 64;
+
+template <size_t N>
+bool TestBit(const array<uint64_t, N>& bits, int bit) {
+    return bits[bit / WORD_BITS] >> (bit % WORD_BITS) & 1;
+}
+
+template <size_t N>
+void AssignBit(array<uint64_t, N>& bits, int bit, bool value) {
+    uint64_t mask = uint64_t{1} << (bit % WORD_BITS);
+    if (value) {
+        bits[bit / WORD_BITS] |= mask;
+    } else {
+        bits[bit / WORD_BITS] &= ~mask;
+    }
+}
+}  // namespace
+
+const NumericColumns::Block* NumericColumns::Column::FindBlock(int row) const {
+    size_t index = row / BLOCK_ROWS;
+    return index < blocks.size() ? blocks[index].get() : nullptr;
+}
+
+bool NumericColumns::Column::IsPresent(int row) const {
+    const Block* block = FindBlock(row);
+    return block && TestBit(block->present, row % BLOCK_ROWS);
+}
+
+bool NumericColumns::Column::IsNumeric(int row) const {
+    const Block* block = FindBlock(row);
+    return block && TestBit(block->numeric, row % BLOCK_ROWS);
+}
+
+bool NumericColumns::Column::IsError(int row) const {
+    const Block* block = FindBlock(row);
+    return block && TestBit(block->error, row % BLOCK_ROWS);
+}
+
+double NumericColumns::Column::GetValue(int row) const {
+    return blocks[row / BLOCK_ROWS]->values[row % BLOCK_ROWS];
+}
+
+void NumericColumns::Store(Position pos, const CellInterface::ValueView& value) {
+    Block& block = Prepare(pos);
+    bool is_numeric = false;
+    bool is_error = false;
+    double number = 0;
+
+    if (holds_alternative<double>(value)) {
+        is_numeric = true;
+        number = get<double>(value);
+    } else if (holds_alternative<FormulaError>(value)) {
+        is_error = true;
+        number = static_cast<double>(get<FormulaError>(value).GetCategory());
+    } else if (auto parsed = ParseNumber(get<string_view>(value))) {
+        is_numeric = true;
+        number = *parsed;
+    }
+
+    const int bit = pos.row % BLOCK_ROWS;
+    if (!TestBit(block.present, bit)) {
+        AssignBit(block.present, bit, true);
+        ++block.count;
+    }
+    block.values[bit] = number;
+    AssignBit(block.numeric, bit, is_numeric);
+    AssignBit(block.error, bit, is_error);
+}
+
+void NumericColumns::Reset(Position pos) {
+    if (static_cast<size_t>(pos.col) >= columns_.size()) {
+        return;
+    }
+    Column& column = columns_[pos.col];
+    size_t index = pos.row / BLOCK_ROWS;
+    if (index >= column.blocks.size() || !column.blocks[index]) {
+        return;
+    }
+
+    Block& block = *column.blocks[index];
+    const int bit = pos.row % BLOCK_ROWS;
+    if (TestBit(block.present, bit)) {
+        AssignBit(block.present, bit, false);
+        if (--block.count == 0) {
+            column.blocks[index].reset();
+        }
+    }
+}
+
+void NumericColumns::ResetArea(const Range& range) {
+    const int last_col = min(range.last.col, static_cast<int>(columns_.size()) - 1);
+    for (int col = range.first.col; col <= last_col; ++col) {
+        Column& column = columns_[col];
+        const size_t last_index = min(static_cast<size_t>(range.last.row / BLOCK_ROWS) + 1, column.blocks.size());
+        for (size_t index = range.first.row / BLOCK_ROWS; index < last_index; ++index) {
+            if (!column.blocks[index]) {
+                continue;
+            }
+            // строки области в блоке
+            const int first = max(range.first.row - static_cast<int>(index) * BLOCK_ROWS, 0);
+            const int last = min(range.last.row - static_cast<int>(index) * BLOCK_ROWS, BLOCK_ROWS - 1);
+            Block& block = *column.blocks[index];
+            for (int word = first / WORD_BITS; word <= last / WORD_BITS; ++word) {
+                uint64_t mask = ~uint64_t{0};
+                if (word == first / WORD_BITS) {
+                    mask &= ~uint64_t{0} << (first % WORD_BITS);
+                }
+                if (word == last / WORD_BITS) {
+                    mask &= ~uint64_t{0} >> (WORD_BITS - 1 - last % WORD_BITS);
+                }
+                block.count -= static_cast<int>(bitset<WORD_BITS>(block.present[word] & mask).count());
+                block.present[word] &= ~mask;
+            }
+            if (block.count == 0) {
+                column.blocks[index].reset();
+            }
+        }
+    }
+}
+
+optional<NumericColumns::Value> NumericColumns::Get(Position pos) const {
+    const Column* column = GetColumn(pos.col);
+    if (!column || !column->IsPresent(pos.row)) {
+        return nullopt;
+    }
+
+    if (column->IsNumeric(pos.row)) {
+        return column->GetValue(pos.row);
+    }
+    if (column->IsError(pos.row)) {
+        return FormulaError(static_cast<FormulaError::Category>(column->GetValue(pos.row)));
+    }
+    return FormulaError(FormulaError::Category::Value);
+}
+
+const NumericColumns::Column* NumericColumns::GetColumn(int col) const {
+    return static_cast<size_t>(col) < columns_.size() ? &columns_[col] : nullptr;
+}
+
+size_t NumericColumns::GetMemoryUsage() const {
+    size_t result = columns_.capacity() * sizeof(Column);
+    for (const Column& column : columns_) {
+        result += column.blocks.capacity() * sizeof(unique_ptr<Block>);
+        for (const auto& block : column.blocks) {
+            result += block ? sizeof(Block) : 0;
+        }
+    }
+    return result;
+}
+
+void NumericColumns::Compact() {
+    for (Column& column : columns_) {
+        while (!column.blocks.empty() && !column.blocks.back()) {
+            column.blocks.pop_back();
+        }
+        column.blocks.shrink_to_fit();
+    }
+
+    while (!columns_.empty() && columns_.back().blocks.empty()) {
+        columns_.pop_back();
+    }
+    columns_.shrink_to_fit();
+}
+
+NumericColumns::Block& NumericColumns::Prepare(Position pos) {
+    if (static_cast<size_t>(pos.col) >= columns_.size()) {
+        columns_.resize(pos.col + 1);
+    }
+
+    Column& column = columns_[pos.col];
+    size_t index = pos.row / BLOCK_ROWS;
+    if (index >= column.blocks.size()) {
+        column.blocks.resize(index + 1);
+    }
+    if (!column.blocks[index]) {
+        column.blocks[index] = make_unique<Block>();
+    }
+    return *column.blocks[index];
+}
+
+optional<double> ParseNumber(string_view text) {
+    if (text.empty()) {
+        return 0.0;
+    }
+
+    // обычная подпись не может быть числом - её незачем копировать для stod
+    size_t first = text.find_first_not_of(" \t\n\v\f\r");
+    if (first == string_view::npos || "0123456789+-.iInN"sv.find(text[first]) == string_view::npos) {
+        return nullopt;
+    }
+
+    try {
+        size_t end = 0;
+        double number = stod(string(text), &end);
+        if (end == text.size()) {
+            return number;
+        }
+    } catch (...) {}
+    return nullopt;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+// Столбцовое хранилище числовых значений ячеек - в том виде, в каком их видят
+// формулы. Значения каждого столбца лежат подряд в блоках по BLOCK_ROWS
+// строк, а битовые маски блока отмечают, для каких строк значение известно
+// (present), является числом (numeric) или ошибкой формулы (error).
+// Известное значение без обеих отметок - текст, не являющийся числом. Блок
+// выделяется при первом значении в нём и освобождается, когда в нём не
+// остаётся известных значений, поэтому ячейка в далёкой строке стоит один
+// блок, а не весь столбец до неё.
+// Хранилище дополняет ячейки, а не заменяет их: значение устаревшей формулы
+// сбрасывается и при чтении берётся из самой ячейки.
+class NumericColumns {
+public:
+    using Value = std::variant<double, FormulaError>;
+
+    static constexpr int BLOCK_ROWS = 4096;
+
+    struct Block {
+        static constexpr int WORDS = BLOCK_ROWS / 64;
+
+        std::array<double, BLOCK_ROWS> values;
+        std::array<uint64_t, WORDS> present{};
+        std::array<uint64_t, WORDS> numeric{};
+        std::array<uint64_t, WORDS> error{};
+        // строк с известным значением
+        int count = 0;
+
+        // offset - строка внутри блока
+        bool IsNumeric(int offset) const {
+            return numeric[offset / 64] >> (offset % 64) & 1;
+        }
+    };
+
+    struct Column {
+        // блок строк [i * BLOCK_ROWS, (i + 1) * BLOCK_ROWS) или nullptr
+        std::vector<std::unique_ptr<Block>> blocks;
+
+        bool IsPresent(int row) const;
+        bool IsNumeric(int row) const;
+        bool IsError(int row) const;
+        // число известной строки (у ошибки - её категория)
+        double GetValue(int row) const;
+
+        const Block* FindBlock(int row) const;
+    };
+
+    // Запоминает значение ячейки; текст разбирается как число один раз здесь,
+    // а не при каждом чтении формулой
+    void Store(Position pos, const CellInterface::ValueView& value);
+    void Reset(Position pos);
+    // забывает значения всех позиций range: маски блоков сбрасываются словами
+    void ResetArea(const Range& range);
+
+    // Значение для формулы или nullopt, если оно неизвестно
+    std::optional<Value> Get(Position pos) const;
+
+    // Столбец для последовательного чтения, nullptr - если в нём ничего нет
+    const Column* GetColumn(int col) const;
+
+    size_t GetMemoryUsage() const;
+    // отбрасывает хвосты столбцов без блоков
+    void Compact();
+
+private:
+    std::vector<Column> columns_;
+
+    Block& Prepare(Position pos);
+};
+
+// Число, которым формула считает текст ячейки: пустой текст - ноль, иначе
+// текст должен целиком быть записью числа
+std::optional<double> ParseNumber(std::string_view text);
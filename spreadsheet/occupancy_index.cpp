@@ -0,0 +1,109 @@
+#include "occupancy_index.h"
+
+using namespace std;
+
+void OccupancyIndex::Add(Position pos) {
+    Block& block = columns_[pos.col][pos.row / BLOCK_ROWS];
+    int bit = pos.row % BLOCK_ROWS;
+    uint64_t mask = uint64_t{1} << (bit % WORD_BITS);
+    uint64_t& word = block.bits[bit / WORD_BITS];
+    if (!(word & mask)) {
+        word |= mask;
+        ++block.count;
+    }
+}
+
+void OccupancyIndex::Remove(Position pos) {
+    auto column = columns_.find(pos.col);
+    if (column == columns_.end()) {
+        return;
+    }
+    auto block = column->second.find(pos.row / BLOCK_ROWS);
+    if (block == column->second.end()) {
+        return;
+    }
+
+    int bit = pos.row % BLOCK_ROWS;
+    uint64_t mask = uint64_t{1} << (bit % WORD_BITS);
+    uint64_t& word = block->second.bits[bit / WORD_BITS];
+    if (!(word & mask)) {
+        return;
+    }
+    word &= ~mask;
+    if (--block->second.count == 0) {
+        column->second.erase(block);
+        if (column->second.empty()) {
+            columns_.erase(column);
+        }
+    }
+}
+
+vector<Position> OccupancyIndex::CollectFrom(bool rows, int first) const {
+    vector<Position> result;
+    vector<int> column_rows;
+    auto column = rows ? columns_.begin() : columns_.lower_bound(first);
+    for (; column != columns_.end(); ++column) {
+        column_rows.clear();
+        AddRows(column->second, rows ? first : 0, Position::MAX_ROWS - 1, column_rows);
+        for (int row : column_rows) {
+            result.push_back({ row, column->first });
+        }
+    }
+    return result;
+}
+
+vector<int> OccupancyIndex::GetRows(int col, int first_row, int last_row) const {
+    vector<int> result;
+    auto column = columns_.find(col);
+    if (column != columns_.end()) {
+        AddRows(column->second, first_row, last_row, result);
+    }
+    return result;
+}
+
+vector<int> OccupancyIndex::GetColumns() const {
+    vector<int> result;
+    result.reserve(columns_.size());
+    for (auto& [col, column] : columns_) {
+        result.push_back(col);
+    }
+    return result;
+}
+
+void OccupancyIndex::Shift(const CellShift& shift) {
+    vector<Position> positions = CollectFrom(shift.rows, shift.first);
+    for (Position pos : positions) {
+        Remove(pos);
+    }
+    for (Position pos : positions) {
+        Position target = shift.Move(pos);
+        if (target.IsValid()) {
+            Add(target);
+        }
+    }
+}
+
+size_t OccupancyIndex::GetMemoryUsage() const {
+    // узел красно-чёрного дерева: значение, три указателя и цвет
+    const size_t node = 4 * sizeof(void*);
+    size_t result = columns_.size() * (node + sizeof(pair<const int, Column>));
+    for (auto& [col, column] : columns_) {
+        result += column.size() * (node + sizeof(pair<const int, Block>));
+    }
+    return result;
+}
+
+void OccupancyIndex::AddRows(const Column& column, int first_row, int last_row, vector<int>& rows) {
+    for (auto it = column.lower_bound(first_row / BLOCK_ROWS);
+         it != column.end() && it->first * BLOCK_ROWS <= last_row; ++it) {
+        const int base = it->first * BLOCK_ROWS;
+        for (size_t i = 0; i < it->second.bits.size(); ++i) {
+            int row = base + static_cast<int>(i) * WORD_BITS;
+            for (uint64_t word = it->second.bits[i]; word != 0; word >>= 1, ++row) {
+                if ((word & 1) && row >= first_row && row <= last_row) {
+                    rows.push_back(row);
+                }
+            }
+        }
+    }
+}
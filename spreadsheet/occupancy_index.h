@@ -0,0 +1,53 @@
+#pragma once
+
+#include "common.h"
+#include "formula.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Позиции таблицы, занятые ячейками, по столбцам: у каждого столбца -
+// битовые карты строк блоками по BLOCK_ROWS строк. Блок создаётся с первой
+// ячейкой в нём и освобождается вместе с последней, поэтому одинокая ячейка
+// в далёкой строке стоит один блок, а не столбец до этой строки. Индекс
+// дополняет хеш-таблицу ячеек: он перечисляет ячейки столбца по порядку
+// строк и ячейки за строкой или столбцом, не обходя всю таблицу.
+class OccupancyIndex {
+public:
+    static constexpr int BLOCK_ROWS = 4096;
+
+    void Add(Position pos);
+    void Remove(Position pos);
+
+    // занятые позиции в строках (rows) или столбцах начиная с first - по
+    // столбцам, в столбце по возрастанию строк
+    std::vector<Position> CollectFrom(bool rows, int first) const;
+    // занятые строки столбца col из [first_row, last_row] по возрастанию
+    std::vector<int> GetRows(int col, int first_row = 0, int last_row = Position::MAX_ROWS - 1) const;
+    // столбцы, в которых есть ячейки, по возрастанию
+    std::vector<int> GetColumns() const;
+
+    // Переносит позиции вслед за ячейками (см. CellShift); позиции удалённых
+    // и вытолкнутых за край ячеек исчезают
+    void Shift(const CellShift& shift);
+
+    // оценка: узлы деревьев и блоки
+    size_t GetMemoryUsage() const;
+
+private:
+    static constexpr int WORD_BITS = 64;
+
+    struct Block {
+        std::array<uint64_t, BLOCK_ROWS / WORD_BITS> bits{};
+        int count = 0;
+    };
+    // номер блока -> блок
+    using Column = std::map<int, Block>;
+
+    std::map<int, Column> columns_;
+
+    static void AddRows(const Column& column, int first_row, int last_row, std::vector<int>& rows);
+};
@@ -0,0 +1,122 @@
+#include "profiler.h"
+
+#include <algorithm>
+
+using namespace std;
+
+void Profiler::BeginRefresh(Position pos) {
+    Frame& frame = stack_.emplace_back();
+    frame.profile = &GetProfile(pos);
+    frame.start = chrono::steady_clock::now();
+    frame.refresh = true;
+}
+
+void Profiler::EndRefresh() {
+    Frame& frame = stack_.back();
+    auto time = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - frame.start);
+    // формула, которая обновила входы, но не вычислялась, времени не получает
+    if (frame.evaluated) {
+        frame.profile->inclusive += time;
+    }
+    Pop(time);
+}
+
+void Profiler::BeginEvaluation(Position pos) {
+    auto now = chrono::steady_clock::now();
+    CellProfile* profile = &GetProfile(pos);
+    if (stack_.empty() || !stack_.back().refresh || stack_.back().evaluating || stack_.back().profile != profile) {
+        Frame& frame = stack_.emplace_back();
+        frame.profile = profile;
+        frame.start = now;
+    }
+    Frame& frame = stack_.back();
+    frame.evaluating = true;
+    frame.evaluated = true;
+    frame.evaluation_start = now;
+    frame.nested = chrono::nanoseconds{0};
+}
+
+void Profiler::EndEvaluation() {
+    auto now = chrono::steady_clock::now();
+    stack_.back().profile->evaluations += 1;
+    StopEvaluation(now);
+}
+
+void Profiler::AbortEvaluation() {
+    StopEvaluation(chrono::steady_clock::now());
+}
+
+size_t Profiler::GetDepth() const {
+    return stack_.size();
+}
+
+void Profiler::Unwind(size_t depth) {
+    stack_.resize(min(depth, stack_.size()));
+}
+
+void Profiler::StopEvaluation(chrono::steady_clock::time_point now) {
+    Frame& frame = stack_.back();
+    frame.evaluating = false;
+    frame.profile->exclusive += chrono::duration_cast<chrono::nanoseconds>(now - frame.evaluation_start) - frame.nested;
+    if (!frame.refresh) {
+        auto time = chrono::duration_cast<chrono::nanoseconds>(now - frame.start);
+        frame.profile->inclusive += time;
+        Pop(time);
+    }
+}
+
+void Profiler::Pop(chrono::nanoseconds time) {
+    stack_.pop_back();
+    if (!stack_.empty() && stack_.back().evaluating) {
+        stack_.back().nested += time;
+    }
+}
+
+void Profiler::CountInput() {
+    if (!stack_.empty()) {
+        stack_.back().profile->inputs_read += 1;
+    }
+}
+
+void Profiler::AddEvaluation(Position pos, chrono::nanoseconds time, uint64_t inputs_read) {
+    CellProfile& profile = GetProfile(pos);
+    profile.evaluations += 1;
+    profile.inclusive += time;
+    profile.exclusive += time;
+    profile.inputs_read += inputs_read;
+}
+
+const CellProfile* Profiler::Find(Position pos) const {
+    auto it = profiles_.find(pos.Pack());
+    return it == profiles_.end() ? nullptr : &it->second;
+}
+
+vector<CellProfile> Profiler::GetTop(size_t n) const {
+    vector<CellProfile> result;
+    result.reserve(profiles_.size());
+    for (auto& [key, profile] : profiles_) {
+        result.push_back(profile);
+    }
+
+    auto by_cost = [](const CellProfile& lhs, const CellProfile& rhs) {
+        if (lhs.exclusive != rhs.exclusive) {
+            return lhs.exclusive > rhs.exclusive;
+        }
+        return lhs.pos < rhs.pos;
+    };
+
+    n = min(n, result.size());
+    partial_sort(result.begin(), result.begin() + n, result.end(), by_cost);
+    result.resize(n);
+    return result;
+}
+
+void Profiler::Clear() {
+    profiles_.clear();
+}
+
+CellProfile& Profiler::GetProfile(Position pos) {
+    CellProfile& profile = profiles_[pos.Pack()];
+    profile.pos = pos;
+    return profile;
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Статистика вычислений одной формулы
+struct CellProfile {
+    Position pos;
+    uint64_t evaluations = 0;
+    // время вычисления вместе с обновлением входов и вложенными вычислениями
+    // других формул и без них
+    std::chrono::nanoseconds inclusive{0};
+    std::chrono::nanoseconds exclusive{0};
+    // сколько раз формула прочитала значение ячейки
+    uint64_t inputs_read = 0;
+};
+
+// Собирает CellProfile по ячейкам (см. Sheet::SetProfiling). Перед
+// вычислением формулы таблица обновляет её входы (BeginRefresh): время
+// обновления входит в inclusive формулы, но не в её exclusive. Вложенные
+// вычисления учитываются стеком: время вычисления, начатого во время
+// вычисления другой формулы, тоже входит только в inclusive внешней.
+class Profiler {
+public:
+    // начало обновления входов формулы; после него формула вычисляется
+    // (Begin/EndEvaluation) или нет, а обновление заканчивает EndRefresh
+    void BeginRefresh(Position pos);
+    void EndRefresh();
+    void BeginEvaluation(Position pos);
+    void EndEvaluation();
+    // Прерванное вычисление: его время учитывается, а само оно - нет.
+    // Формула, входы которой обновляются, вычисляется потом снова.
+    void AbortEvaluation();
+    // глубина стека и сброс вычислений, прерванных исключением
+    size_t GetDepth() const;
+    void Unwind(size_t depth);
+    // чтение входа засчитывается формуле, которая вычисляется сейчас
+    void CountInput();
+    // вычисление, измеренное снаружи (формулы, вычисленные целым столбцом)
+    void AddEvaluation(Position pos, std::chrono::nanoseconds time, uint64_t inputs_read);
+
+    // профиль ячейки или nullptr, если она не вычислялась
+    const CellProfile* Find(Position pos) const;
+    // n самых дорогих ячеек по собственному (exclusive) времени
+    std::vector<CellProfile> GetTop(size_t n) const;
+    void Clear();
+
+private:
+    struct Frame {
+        CellProfile* profile;
+        std::chrono::steady_clock::time_point start;
+        // кадр BeginRefresh: вычисление начинается после обновления входов
+        bool refresh = false;
+        bool evaluating = false;
+        // было ли вычисление (хотя бы прерванное)
+        bool evaluated = false;
+        std::chrono::steady_clock::time_point evaluation_start;
+        // время вложенных вычислений внутри текущего вычисления
+        std::chrono::nanoseconds nested{0};
+    };
+
+    std::unordered_map<uint64_t, CellProfile> profiles_;  // ключ - Position::Pack()
+    std::vector<Frame> stack_;
+
+    CellProfile& GetProfile(Position pos);
+    // учитывает собственное время текущего вычисления верхнего кадра
+    void StopEvaluation(std::chrono::steady_clock::time_point now);
+    // снимает верхний кадр, время которого - time
+    void Pop(std::chrono::nanoseconds time);
+};
@@ -0,0 +1,133 @@
+#include "range_dependencies.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+const vector<Range> NO_RANGES;
+}  // namespace
+
+void RangeDependencies::Set(Cell* cell, vector<Range> ranges) {
+    auto it = ranges_.find(cell);
+    if (it == ranges_.end() && ranges.empty()) {
+        return;
+    }
+
+    if (it != ranges_.end()) {
+        if (it->second == ranges) {
+            return;
+        }
+        for (const Range& range : it->second) {
+            Remove(cell, range);
+        }
+        ranges_.erase(it);
+    }
+
+    if (!ranges.empty()) {
+        for (const Range& range : ranges) {
+            Add(cell, range);
+        }
+        ranges_.emplace(cell, move(ranges));
+    }
+}
+
+const vector<Range>& RangeDependencies::Get(const Cell* cell) const {
+    auto it = ranges_.find(cell);
+    return it != ranges_.end() ? it->second : NO_RANGES;
+}
+
+void RangeDependencies::AddDependents(Position pos, vector<Cell*>& cells) const {
+    auto it = columns_.find(pos.col);
+    if (it == columns_.end()) {
+        return;
+    }
+    for (const Group& group : it->second) {
+        if (pos.row >= group.first_row && pos.row <= group.last_row) {
+            cells.insert(cells.end(), group.cells.begin(), group.cells.end());
+        }
+    }
+}
+
+void RangeDependencies::AddDependents(const Range& area, vector<Cell*>& cells) const {
+    for (int col = area.first.col; col <= area.last.col; ++col) {
+        auto it = columns_.find(col);
+        if (it == columns_.end()) {
+            continue;
+        }
+        for (const Group& group : it->second) {
+            if (group.first_row <= area.last.row && group.last_row >= area.first.row) {
+                cells.insert(cells.end(), group.cells.begin(), group.cells.end());
+            }
+        }
+    }
+}
+
+bool RangeDependencies::HasDependents(Position pos) const {
+    auto it = columns_.find(pos.col);
+    if (it == columns_.end()) {
+        return false;
+    }
+    return any_of(it->second.begin(), it->second.end(), [pos](const Group& group) {
+        return pos.row >= group.first_row && pos.row <= group.last_row;
+    });
+}
+
+vector<Cell*> RangeDependencies::GetCells() const {
+    vector<Cell*> cells;
+    cells.reserve(ranges_.size());
+    for (auto& [cell, ranges] : ranges_) {
+        cells.push_back(const_cast<Cell*>(cell));
+    }
+    return cells;
+}
+
+bool RangeDependencies::IsEmpty() const {
+    return ranges_.empty();
+}
+
+size_t RangeDependencies::GetMemoryUsage() const {
+    const size_t node = 2 * sizeof(void*);
+    size_t result = ranges_.bucket_count() * sizeof(void*) + columns_.bucket_count() * sizeof(void*);
+
+    for (auto& [cell, ranges] : ranges_) {
+        result += node + sizeof(*ranges_.begin()) + ranges.capacity() * sizeof(Range);
+    }
+    for (auto& [col, groups] : columns_) {
+        result += node + sizeof(*columns_.begin()) + groups.capacity() * sizeof(Group);
+        for (const Group& group : groups) {
+            result += group.cells.bucket_count() * sizeof(void*) + group.cells.size() * (node + sizeof(Cell*));
+        }
+    }
+    return result;
+}
+
+void RangeDependencies::Add(Cell* cell, const Range& range) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        auto& groups = columns_[col];
+        auto it = find_if(groups.begin(), groups.end(), [&range](const Group& group) {
+            return group.first_row == range.first.row && group.last_row == range.last.row;
+        });
+        if (it == groups.end()) {
+            it = groups.insert(groups.end(), Group{range.first.row, range.last.row, {}});
+        }
+        it->cells.insert(cell);
+    }
+}
+
+void RangeDependencies::Remove(Cell* cell, const Range& range) {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        auto column = columns_.find(col);
+        auto& groups = column->second;
+        auto it = find_if(groups.begin(), groups.end(), [&range](const Group& group) {
+            return group.first_row == range.first.row && group.last_row == range.last.row;
+        });
+        it->cells.erase(it->cells.find(cell));
+        if (it->cells.empty()) {
+            groups.erase(it);
+            if (groups.empty()) {
+                columns_.erase(column);
+            }
+        }
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+class Cell;
+
+// Формулы, зависящие от областей таблицы (аргументы функций поиска вроде
+// D1:F100000). Ячейки областей не получают связей в графе зависимостей -
+// их было бы слишком много; вместо этого изменившаяся ячейка находит здесь
+// формулы, области которых её содержат. Области хранятся по столбцам, а
+// формулы с одинаковыми областями - вместе, поэтому поиск перебирает только
+// разные области, пересекающие столбец ячейки.
+class RangeDependencies {
+public:
+    // задаёт области формулы cell; пустой список - формула ни от каких
+    // областей не зависит
+    void Set(Cell* cell, std::vector<Range> ranges);
+    // области формулы cell (пустой список, если их нет)
+    const std::vector<Range>& Get(const Cell* cell) const;
+
+    // формулы, области которых содержат pos
+    void AddDependents(Position pos, std::vector<Cell*>& cells) const;
+    // формулы, области которых пересекают area; формула, пересекающая
+    // несколько столбцов area, добавляется по разу на каждый
+    void AddDependents(const Range& area, std::vector<Cell*>& cells) const;
+    bool HasDependents(Position pos) const;
+    // все формулы, у которых есть области
+    std::vector<Cell*> GetCells() const;
+
+    bool IsEmpty() const;
+    // оценка: узлы и корзины контейнеров
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Group {
+        int first_row;
+        int last_row;
+        // формула с несколькими областями на одних строках входит сюда по разу на каждую
+        std::unordered_multiset<Cell*> cells;
+    };
+
+    std::unordered_map<const Cell*, std::vector<Range>> ranges_;
+    std::unordered_map<int, std::vector<Group>> columns_;
+
+    void Add(Cell* cell, const Range& range);
+    void Remove(Cell* cell, const Range& range);
+};
@@ -0,0 +1,138 @@
+#include "result_cache.h"
+
+#include "cell.h"
+
+#include <algorithm>
+
+using namespace std;
+
+namespace {
+// сколько случайных слотов сравнивается при выборе вытесняемого значения
+const int EVICTION_SAMPLES = 5;
+}  // namespace
+
+double ResultCacheStats::GetHitRate() const {
+    uint64_t reads = hits + misses;
+    return reads == 0 ? 0.0 : static_cast<double>(hits) / reads;
+}
+
+void ResultCache::SetCapacity(size_t capacity) {
+    capacity_ = capacity;
+    while (capacity_ != 0 && size_ > capacity_) {
+        EvictOne();
+    }
+}
+
+bool ResultCache::IsBounded() const {
+    return capacity_ != 0;
+}
+
+uint32_t ResultCache::Store(uint32_t slot, const Value& value, const Cell* owner, chrono::nanoseconds cost) {
+    if (slot == NO_SLOT) {
+        if (capacity_ != 0 && size_ >= capacity_) {
+            EvictOne();
+        }
+        if (free_.empty()) {
+            slot = static_cast<uint32_t>(entries_.size());
+            entries_.emplace_back();
+        } else {
+            slot = free_.back();
+            free_.pop_back();
+        }
+        ++size_;
+    }
+
+    Entry& entry = entries_[slot];
+    entry.value = value;
+    entry.owner = owner;
+    entry.cost = static_cast<float>(cost.count());
+    entry.priority = clock_ + entry.cost;
+    return slot;
+}
+
+const ResultCache::Value& ResultCache::Get(uint32_t slot) {
+    Entry& entry = entries_[slot];
+    entry.priority = clock_ + entry.cost;
+    return entry.value;
+}
+
+const ResultCache::Value& ResultCache::Peek(uint32_t slot) const {
+    return entries_[slot].value;
+}
+
+void ResultCache::Release(uint32_t slot) {
+    entries_[slot].owner = nullptr;
+    --size_;
+    if (size_ == 0) {
+        // таблица очищена - память слотов возвращается целиком
+        vector<Entry>().swap(entries_);
+        vector<uint32_t>().swap(free_);
+        clock_ = 0;
+    } else {
+        free_.push_back(slot);
+    }
+}
+
+void ResultCache::Reorder(const vector<uint32_t>& slots) {
+    vector<Entry> entries;
+    entries.reserve(slots.size());
+    for (uint32_t slot : slots) {
+        entries.push_back(move(entries_[slot]));
+    }
+    entries_ = move(entries);
+    vector<uint32_t>().swap(free_);
+}
+
+void ResultCache::CountRead(bool hit) {
+    ++(hit ? stats_.hits : stats_.misses);
+}
+
+void ResultCache::CountRecomputation(chrono::nanoseconds cost) {
+    ++stats_.recomputations;
+    stats_.recompute_time += cost;
+}
+
+ResultCacheStats ResultCache::GetStats() const {
+    ResultCacheStats stats = stats_;
+    stats.size = size_;
+    stats.capacity = capacity_;
+    return stats;
+}
+
+size_t ResultCache::GetMemoryUsage() const {
+    return entries_.capacity() * sizeof(Entry) + free_.capacity() * sizeof(uint32_t);
+}
+
+void ResultCache::EvictOne() {
+    // свободные слоты в выборку не идут; если их слишком много, выборка
+    // может остаться пустой - тогда берётся первый занятый слот
+    uint32_t victim = NO_SLOT;
+    for (int sampled = 0, attempts = 0; sampled < EVICTION_SAMPLES && attempts < 4 * EVICTION_SAMPLES; ++attempts) {
+        uint32_t slot = NextRandom() % entries_.size();
+        if (!entries_[slot].owner) {
+            continue;
+        }
+        ++sampled;
+        if (victim == NO_SLOT || entries_[slot].priority < entries_[victim].priority) {
+            victim = slot;
+        }
+    }
+    for (uint32_t slot = 0; victim == NO_SLOT; ++slot) {
+        if (entries_[slot].owner) {
+            victim = slot;
+        }
+    }
+
+    clock_ = max(clock_, entries_[victim].priority);
+    ++stats_.evictions;
+    entries_[victim].owner->EvictResult();
+    Release(victim);
+}
+
+uint32_t ResultCache::NextRandom() {
+    // xorshift64
+    random_state_ ^= random_state_ << 13;
+    random_state_ ^= random_state_ >> 7;
+    random_state_ ^= random_state_ << 17;
+    return static_cast<uint32_t>(random_state_ >> 32);
+}
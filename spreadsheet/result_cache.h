@@ -0,0 +1,82 @@
+#pragma once
+
+#include "formula.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+class Cell;
+
+// Статистика кэша значений формул (см. Sheet::SetResultCacheCapacity)
+struct ResultCacheStats {
+    size_t size = 0;      // значений в кэше сейчас
+    size_t capacity = 0;  // 0 - без ограничения
+    // чтения значения формулы через ячейку: значение было готово / его
+    // пришлось вычислять (впервые, после изменения входов или после вытеснения)
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    // вычисления значений, которые были вытеснены, и их суммарное время
+    uint64_t recomputations = 0;
+    std::chrono::nanoseconds recompute_time{0};
+
+    double GetHitRate() const;
+};
+
+// Значения формул таблицы. Каждое вычисленное значение занимает слот, номер
+// которого хранит формула. При ограниченной ёмкости новое значение вытесняет
+// одно из хранящихся: из нескольких случайных слотов выбирается тот, у
+// которого меньше приоритет. Приоритет (как в алгоритме GreedyDual) - время
+// вычисления значения плюс "часы" кэша, которые при каждом вытеснении
+// переводятся на приоритет вытесненного; обращение к значению обновляет его
+// приоритет по текущим часам. Так дольше живут значения, которые дорого
+// пересчитывать, и те, к которым недавно обращались.
+class ResultCache {
+public:
+    using Value = FormulaInterface::Value;
+    static constexpr uint32_t NO_SLOT = std::numeric_limits<uint32_t>::max();
+
+    // 0 - без ограничения; лишние значения вытесняются сразу
+    void SetCapacity(size_t capacity);
+    bool IsBounded() const;
+
+    // Записывает значение формулы ячейки owner в слот slot и возвращает его
+    // номер; при NO_SLOT занимает новый слот. cost - время вычисления.
+    uint32_t Store(uint32_t slot, const Value& value, const Cell* owner, std::chrono::nanoseconds cost);
+    const Value& Get(uint32_t slot);
+    // значение без обновления приоритета: ветки таблицы (Sheet::Fork) читают
+    // значения родителя из нескольких потоков
+    const Value& Peek(uint32_t slot) const;
+    void Release(uint32_t slot);
+    // Перекладывает значения так, что значение слота slots[i] оказывается в
+    // слоте i (см. Sheet::OptimizeLayout). slots перечисляет все занятые слоты.
+    void Reorder(const std::vector<uint32_t>& slots);
+
+    void CountRead(bool hit);
+    void CountRecomputation(std::chrono::nanoseconds cost);
+
+    ResultCacheStats GetStats() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Entry {
+        Value value;
+        const Cell* owner = nullptr;  // nullptr - слот свободен
+        double priority = 0;
+        float cost = 0;  // в наносекундах
+    };
+
+    std::vector<Entry> entries_;
+    std::vector<uint32_t> free_;
+    size_t size_ = 0;
+    size_t capacity_ = 0;
+    double clock_ = 0;
+    uint64_t random_state_ = 0x9E3779B97F4A7C15ull;
+    ResultCacheStats stats_;
+
+    void EvictOne();
+    uint32_t NextRandom();
+};
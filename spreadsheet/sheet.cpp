@@ -2,36 +2,169 @@
 
 #include "cell.h"
 #include "common.h"
+#include "vectorized.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <exception>
 #include <functional>
 #include <iostream>
+#include <map>
 #include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <unordered_set>
 
 using namespace std;
 using namespace literals;
 
 size_t SheetHash::operator()(Position pos) const {
-    size_t h1 = hasher_(pos.row);
-    size_t h2 = hasher_(pos.col);
-    return h1 * 16'387 + h2;
+    return hasher_(pos.Pack());
 }
 
-Sheet::~Sheet() {}
+Sheet::Sheet() : sheet_(CellTable::allocator_type(&cell_table_memory_)) {}
+
+Sheet::~Sheet() {
+    if (parent_) {
+        --parent_->forks_;
+    }
+}
+
+unique_ptr<Sheet> Sheet::Fork() const {
+    if (parent_) {
+        throw logic_error("A fork of a sheet cannot be forked");
+    }
+    if (memory_budget_) {
+        throw logic_error("A sheet with a memory budget cannot be forked");
+    }
+
+    Size size;
+    {
+        lock_guard lock(fork_mutex_);
+        // ветки читают значения таблицы, не вычисляя их
+        if (forks_ == 0) {
+            Recalculate();
+        }
+        ++forks_;
+        // устаревшая граница печати пересчитывается один раз, до веток
+        size = GetPrintableSize();
+    }
+
+    auto fork = make_unique<Sheet>();
+    fork->parent_ = this;
+    fork->printable_size_ = size;
+    fork->lazy_formula_parsing_ = lazy_formula_parsing_;
+    return fork;
+}
+
+vector<vector<CellInterface::Value>> Sheet::RunScenarios(const vector<ScenarioInputs>& scenarios,
+                                                         const vector<Position>& outputs, size_t threads) const {
+    for (Position pos : outputs) {
+        EnsureValidPosition(pos);
+    }
+
+    // пустая ветка на время расчёта: потокам не приходится вычислять таблицу
+    // в Fork(), и её нельзя изменить, пока расчёт не закончен
+    auto guard = Fork();
+
+    if (threads == 0) {
+        threads = max(1u, thread::hardware_concurrency());
+    }
+    threads = max<size_t>(1, min(threads, scenarios.size()));
+
+    vector<vector<CellInterface::Value>> results(scenarios.size());
+    atomic<size_t> next{0};
+    atomic<bool> failed{false};
+    exception_ptr error;
+    mutex error_mutex;
+
+    auto worker = [&] {
+        for (size_t i = next++; i < scenarios.size() && !failed; i = next++) {
+            try {
+                auto fork = Fork();
+                for (auto& [pos, text] : scenarios[i]) {
+                    fork->SetCell(pos, text);
+                }
+
+                auto& values = results[i];
+                values.reserve(outputs.size());
+                for (Position pos : outputs) {
+                    const CellInterface* cell = fork->GetCell(pos);
+                    values.push_back(cell ? cell->GetValue() : CellInterface::Value{});
+                }
+            } catch (...) {
+                lock_guard lock(error_mutex);
+                if (!error) {
+                    error = current_exception();
+                }
+                failed = true;
+            }
+        }
+    };
+
+    vector<thread> pool;
+    pool.reserve(threads - 1);
+    for (size_t i = 1; i < threads; ++i) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (thread& t : pool) {
+        t.join();
+    }
+
+    if (error) {
+        rethrow_exception(error);
+    }
+    return results;
+}
 
 void Sheet::SetCell(Position pos, string text) {
     EnsureValidPosition(pos);
-    
+    EnsureNoForks();
+    RecordOperation(TraceOp::SetCell, pos, text);
+
+    if (parent_) {
+        ForkDependents(pos);
+        MarkForked(pos);
+    }
+
     auto it = sheet_.find(pos);
 
     if (it != sheet_.end()) {
-        it->second.get()->Set(text);
+        it->second.get()->Set(text, lazy_formula_parsing_);
     } else {
-        auto [key, value] = sheet_.emplace(pos, make_unique<Cell>(*this));
-        key->second.get()->Set(text);
+        Cell* cell = AddCell(pos);
+        try {
+            cell->Set(text, lazy_formula_parsing_);
+        } catch (...) {
+            // некорректная формула не должна оставлять после себя пустую ячейку
+            EraseCell(sheet_.find(pos));
+            throw;
+        }
+        AddToLayout(cell);
+    }
+    UpdateArrays(pos);
+
+    // пустая ячейка, на которую никто не ссылается, удаляется, как в
+    // ClearCell(); у ветки она закрывает собой ячейку родителя и остаётся
+    if (text.empty() && !(parent_ && FindParentCell(pos))) {
+        it = sheet_.find(pos);
+        if (it != sheet_.end() && it->second->IsPlaceholder()) {
+            EraseCell(it);
+        }
     }
 
-    UpdatePrintableSize(pos);
+    // пустые ячейки (в том числе заглушки для ссылок) в печать не попадают
+    if (text.empty()) {
+        ShrinkPrintableSize(pos);
+    } else {
+        UpdatePrintableSize(pos);
+    }
+    JournalOperation(TraceOp::SetCell, pos, text);
+    EnforceMemoryBudget();
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -44,62 +177,2555 @@ CellInterface* Sheet::GetCell(Position pos) {
 
 void Sheet::ClearCell(Position pos) {
     EnsureValidPosition(pos);
+    EnsureNoForks();
+    RecordOperation(TraceOp::ClearCell, pos);
+
+    // пустая ячейка ветки закрывает собой ячейку родителя и поэтому остаётся
+    if (parent_ && FindParentCell(pos)) {
+        ForkDependents(pos);
+        MarkForked(pos);
+        Cell* cell = FindCell(pos);
+        (cell ? cell : ForkCell(pos))->Clear();
+        UpdateArrays(pos);
+        ShrinkPrintableSize(pos);
+        return;
+    }
 
     auto it = sheet_.find(pos);
 
     if (it != sheet_.end()) {
-        if (pos.row + 1 == printable_size_.rows || pos.col + 1 == printable_size_.cols) {
-            sheet_.erase(pos);
-            printable_size_ = { 0, 0 };
+        // сначала ячейка очищается как обычная правка: зависимые сбрасывают
+        // кэш, а ячейки, на которые она ссылалась, забывают о ней
+        it->second->Clear();
+        // вывод массивов может добавить ячейки, поэтому ячейка ищется заново
+        UpdateArrays(pos);
+        it = sheet_.find(pos);
 
-            for (auto& cell : sheet_) {
-                UpdatePrintableSize(cell.first);
-            }
-            return;
+        // на ячейку ссылаются формулы - объект остаётся пустым, иначе
+        // в их referenced_cells_ остались бы висячие указатели; элемент
+        // массива остаётся тоже
+        if (it->second->IsPlaceholder()) {
+            EraseCell(it);
         }
-        sheet_.erase(pos);
+
+        ShrinkPrintableSize(pos);
     }
+    JournalOperation(TraceOp::ClearCell, pos);
+    EnforceMemoryBudget();
 }
 
 Size Sheet::GetPrintableSize() const {
+    if (printable_size_stale_) {
+        RecomputePrintableSize();
+    }
     return printable_size_;
 }
 
 void Sheet::PrintValues(ostream& output) const {
+    RecordOperation(TraceOp::PrintValues);
+    Recalculate();
     return PrintContext(output, "Values"s);
 }
 
 void Sheet::PrintTexts(ostream& output) const {
+    RecordOperation(TraceOp::PrintTexts);
     return PrintContext(output, "Texts"s);
 }
 
-void Sheet::UpdatePrintableSize(Position pos) {
-    printable_size_.rows = max(pos.row + 1, printable_size_.rows);
-    printable_size_.cols = max(pos.col + 1, printable_size_.cols);
+namespace {
+// сравнение без копирования текста
+bool IsSameValue(const CellInterface::ValueView& view, const CellInterface::Value& value) {
+    if (holds_alternative<string_view>(view)) {
+        return holds_alternative<string>(value) && get<string_view>(view) == get<string>(value);
+    }
+    if (holds_alternative<double>(view)) {
+        return holds_alternative<double>(value) && get<double>(view) == get<double>(value);
+    }
+    return holds_alternative<FormulaError>(value) && get<FormulaError>(view) == get<FormulaError>(value);
 }
 
-const CellInterface* Sheet::FindCellInterfacePtr(Position pos) const {
+CellInterface::Value ToValue(const CellInterface::ValueView& view) {
+    if (holds_alternative<string_view>(view)) {
+        return string(get<string_view>(view));
+    }
+    if (holds_alternative<double>(view)) {
+        return get<double>(view);
+    }
+    return get<FormulaError>(view);
+}
+
+// элемент формулы-массива
+CellInterface::ValueView ToValueView(const FormulaInterface::Value& value) {
+    if (holds_alternative<double>(value)) {
+        return get<double>(value);
+    }
+    return get<FormulaError>(value);
+}
+}  // namespace
+
+void Sheet::InsertRows(int before, int count) {
+    EnsureValidPosition({ before, 0 });
+    if (count <= 0) {
+        throw InvalidPositionException("Row count must be positive");
+    }
+    RecordShift(TraceOp::InsertRows, before, count);
+    ShiftCells(true, before, min(count, Position::MAX_ROWS - before));
+    JournalShift(TraceOp::InsertRows, before, count);
+}
+
+void Sheet::DeleteRows(int first, int count) {
+    EnsureValidPosition({ first, 0 });
+    if (count <= 0) {
+        throw InvalidPositionException("Row count must be positive");
+    }
+    RecordShift(TraceOp::DeleteRows, first, count);
+    ShiftCells(true, first, -min(count, Position::MAX_ROWS - first));
+    JournalShift(TraceOp::DeleteRows, first, count);
+}
+
+void Sheet::InsertColumns(int before, int count) {
+    EnsureValidPosition({ 0, before });
+    if (count <= 0) {
+        throw InvalidPositionException("Column count must be positive");
+    }
+    RecordShift(TraceOp::InsertColumns, before, count);
+    ShiftCells(false, before, min(count, Position::MAX_COLS - before));
+    JournalShift(TraceOp::InsertColumns, before, count);
+}
+
+void Sheet::DeleteColumns(int first, int count) {
+    EnsureValidPosition({ 0, first });
+    if (count <= 0) {
+        throw InvalidPositionException("Column count must be positive");
+    }
+    RecordShift(TraceOp::DeleteColumns, first, count);
+    ShiftCells(false, first, -min(count, Position::MAX_COLS - first));
+    JournalShift(TraceOp::DeleteColumns, first, count);
+}
+
+void Sheet::ClearRange(Range area) {
+    if (!area.IsValid()) {
+        throw InvalidPositionException("Range is out of range");
+    }
+    EnsureNoForks();
+    RecordRange(TraceOp::ClearRange, area);
+    ClearArea(area);
+    JournalRange(TraceOp::ClearRange, area);
+    EnforceMemoryBudget();
+}
+
+void Sheet::CopyRange(Range source, Position target) {
+    Range area = GetTargetArea(source, target);
+    EnsureNoForks();
+    RecordRange(TraceOp::CopyRange, source, target);
+    TransferRange(source, area, false);
+    JournalRange(TraceOp::CopyRange, source, target);
+    EnforceMemoryBudget();
+}
+
+void Sheet::MoveRange(Range source, Position target) {
+    Range area = GetTargetArea(source, target);
+    EnsureNoForks();
+    RecordRange(TraceOp::MoveRange, source, target);
+    TransferRange(source, area, true);
+    JournalRange(TraceOp::MoveRange, source, target);
+    EnforceMemoryBudget();
+}
+
+Range Sheet::GetTargetArea(const Range& source, Position target) const {
+    if (!source.IsValid()) {
+        throw InvalidPositionException("Range is out of range");
+    }
+    EnsureValidPosition(target);
+    Size size = source.GetSize();
+    Range area{ target, { target.row + size.rows - 1, target.col + size.cols - 1 } };
+    if (!area.last.IsValid()) {
+        throw InvalidPositionException("Cannot copy a range off the sheet");
+    }
+    return area;
+}
+
+void Sheet::TransferRange(const Range& source, const Range& area, bool clear_source) {
+    const int rows = area.first.row - source.first.row;
+    const int cols = area.first.col - source.first.col;
+    vector<CellContent> contents = CopyArea(source, rows, cols);
+
+    // Цикл замыкает только формула, поэтому прежнее содержимое запоминается,
+    // лишь когда формулы есть. Оно циклов не замыкало - и любая его часть
+    // тоже, - так что возвращается без ошибок.
+    vector<CellContent> previous;
+    vector<CellContent> previous_source;
+    if (any_of(contents.begin(), contents.end(), [](const CellContent& content) {
+            return content.formula != nullptr;
+        })) {
+        previous = CopyArea(area, 0, 0);
+        if (clear_source) {
+            previous_source = CopyArea(source, 0, 0);
+        }
+    }
+
+    ClearArea(area);
+    if (clear_source) {
+        ClearArea(source);
+    }
+    try {
+        PasteArea(area, contents);
+    } catch (...) {
+        ClearArea(area);
+        PasteArea(area, previous);
+        if (clear_source) {
+            PasteArea(source, previous_source);
+        }
+        throw;
+    }
+}
+
+vector<Sheet::CellContent> Sheet::CopyArea(const Range& area, int rows, int cols) const {
+    vector<CellContent> contents;
+    auto copy = [&](const Cell& cell, bool shared) {
+        Position pos = cell.GetPosition();
+        CellContent content{ { pos.row + rows, pos.col + cols }, {}, nullptr };
+        content.formula = shared ? parent_->TranslateShared(cell, rows, cols) : cell.TranslateFormula(rows, cols);
+        if (!content.formula) {
+            content.text = shared ? parent_->GetSharedText(cell) : cell.GetText();
+        }
+        contents.push_back(move(content));
+    };
+
+    ForEachCell(area, [&](Cell* cell) {
+        if (cell->IsEmpty() || cell->IsSpill()) {
+            return;
+        }
+        // представитель ячейки родителя своего содержимого не хранит
+        if (cell->IsShared()) {
+            copy(*FindParentCell(cell->GetPosition()), true);
+        } else {
+            copy(*cell, false);
+        }
+    });
+    if (parent_) {
+        parent_->ForEachCell(area, [&](Cell* cell) {
+            if (!cell->IsEmpty() && !cell->IsSpill() && !FindCell(cell->GetPosition())) {
+                copy(*cell, true);
+            }
+        });
+    }
+    return contents;
+}
+
+void Sheet::ClearArea(const Range& area) {
+    vector<Position> positions;
+    ForEachCell(area, [&](Cell* cell) {
+        if (!cell->IsEmpty() && !cell->IsSpill()) {
+            positions.push_back(cell->GetPosition());
+        }
+    });
+    if (parent_) {
+        parent_->ForEachCell(area, [&](Cell* cell) {
+            if (!cell->IsEmpty() && !cell->IsSpill() && !FindCell(cell->GetPosition())) {
+                positions.push_back(cell->GetPosition());
+            }
+        });
+    }
+
+    // Кэш всех очищаемых ячеек и их зависимых сбрасывается одним обходом,
+    // затем ячейки очищаются по одной, как в ClearCell(), а массивы, которым
+    // они мешали, выводятся заново один раз в конце. Массив очищенной
+    // формулы убирается сразу: её ячейку может удалить очистка следующей.
+    vector<Cell*> cells;
+    vector<bool> inherited;
+    cells.reserve(positions.size());
+    inherited.reserve(positions.size());
+    for (Position pos : positions) {
+        Cell* cell = FindCell(pos);
+        // пустая ячейка ветки закрывает собой ячейку родителя и поэтому остаётся
+        inherited.push_back(parent_ && FindParentCell(pos));
+        if (inherited.back()) {
+            ForkDependents(pos);
+            MarkForked(pos);
+            if (!cell) {
+                cell = ForkCell(pos);
+            }
+        }
+        if (cell) {
+            cells.push_back(cell);
+        }
+    }
+    Cell::InvalidateCaches(move(cells));
+
+    for (size_t i = 0; i < positions.size(); ++i) {
+        const Position pos = positions[i];
+        Cell* cell = FindCell(pos);
+        if (!cell) {
+            continue;
+        }
+
+        const bool anchor = arrays_.count(cell) > 0;
+        cell->Clear(false);
+        if (anchor) {
+            UpdateArrays(vector<Cell*>{ cell });
+        }
+
+        auto it = sheet_.find(pos);
+        if (!inherited[i] && it != sheet_.end() && it->second->IsPlaceholder()) {
+            EraseCell(it);
+        }
+    }
+
+    vector<Cell*> anchors;
+    array_areas_.AddDependents(area, anchors);
+    if (!anchors.empty()) {
+        UpdateArrays(move(anchors));
+    }
+    // очистка у края границы печати может её сузить
+    if (!positions.empty()) {
+        ShrinkPrintableSize({ min(area.last.row, printable_size_.rows - 1),
+                              min(area.last.col, printable_size_.cols - 1) });
+    }
+}
+
+void Sheet::PasteArea(const Range& area, vector<CellContent>& contents) {
+    vector<Cell*> anchors;
+    for (CellContent& content : contents) {
+        const Position pos = content.pos;
+        if (parent_) {
+            ForkDependents(pos);
+            MarkForked(pos);
+        }
+
+        Cell* cell = FindCell(pos);
+        const bool created = !cell;
+        if (created) {
+            cell = AddCell(pos);
+        }
+        try {
+            if (content.formula) {
+                cell->SetFormula(move(content.formula));
+            } else {
+                // некорректная формула при отложенном разборе копируется как есть
+                cell->Set(move(content.text), true);
+            }
+        } catch (...) {
+            if (created) {
+                EraseCell(sheet_.find(pos));
+            }
+            throw;
+        }
+        if (created) {
+            AddToLayout(cell);
+        }
+
+        if (cell->GetArraySize()) {
+            anchors.push_back(cell);
+        }
+        UpdatePrintableSize(pos);
+    }
+
+    array_areas_.AddDependents(area, anchors);
+    if (!anchors.empty()) {
+        UpdateArrays(move(anchors));
+    }
+}
+
+void Sheet::ShiftCells(bool rows, int first, int delta) {
+    EnsureNoForks();
+    // ячейки ветки сдвигались бы отдельно от ячеек родителя, которые она видит
+    if (parent_) {
+        throw logic_error("Rows and columns cannot be inserted or deleted in a fork");
+    }
+
+    const int limit = rows ? Position::MAX_ROWS : Position::MAX_COLS;
+    const CellShift shift{ rows, first, delta };
+    // полоса, ячейки которой сдвигаются или удаляются
+    const Range band = rows ? Range{ { first, 0 }, { Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } }
+                            : Range{ { 0, first }, { Position::MAX_ROWS - 1, Position::MAX_COLS - 1 } };
+    auto in_band = [rows, first](const Range& area) {
+        return (rows ? area.last.row : area.last.col) >= first;
+    };
+
+    // Вытесненная область хранит позиции своих ячеек, поэтому области,
+    // задетые сдвигом, загружаются, а их содержимое после сдвига
+    // учитывается заново по новым позициям. Области перед полосой остаются
+    // в файле подкачки.
+    const int region_size = rows ? REGION_ROWS : REGION_COLS;
+    const int region_first = first / region_size * region_size;
+    vector<uint64_t> band_regions;
+    if (memory_budget_) {
+        for (auto& [key, region] : regions_) {
+            if ((rows ? region.origin.row : region.origin.col) >= region_first) {
+                band_regions.push_back(key);
+            }
+        }
+        for (uint64_t key : band_regions) {
+            FaultIn(regions_.at(key).origin);
+        }
+    }
+
+    // элементы массивов выводятся заново по сдвинутым областям, поэтому
+    // вытолкнуть за край их можно
+    if (delta > 0) {
+        for (Position pos : occupancy_.CollectFrom(rows, limit - delta)) {
+            const Cell* cell = FindCell(pos);
+            if (!cell->IsEmpty() && !cell->IsSpill()) {
+                throw InvalidPositionException("Cannot shift a non-empty cell off the sheet");
+            }
+        }
+    }
+
+    for (uint64_t key : band_regions) {
+        Region& region = regions_.at(key);
+        paging_stats_.resident_bytes -= min(region.bytes, paging_stats_.resident_bytes);
+        if (region.in_lru) {
+            lru_.erase(region.lru);
+        }
+        regions_.erase(key);
+    }
+
+    // Массивы, области которых задевают полосу, выводятся заново; невыведенные -
+    // тоже: сдвиг мог освободить их области
+    vector<Cell*> anchors;
+    for (auto& [anchor, array] : arrays_) {
+        if (array.active && in_band(array.area)) {
+            DeactivateArea(array);
+            array.active = false;
+            anchors.push_back(const_cast<Cell*>(anchor));
+        } else if (!array.active) {
+            anchors.push_back(const_cast<Cell*>(anchor));
+        }
+    }
+
+    vector<pair<Position, Cell*>> moved;
+    vector<pair<Position, Cell*>> deleted;
+    for (Position pos : occupancy_.CollectFrom(rows, first)) {
+        Cell* cell = FindCell(pos);
+        if (shift.Move(pos).IsValid()) {
+            moved.emplace_back(pos, cell);
+        } else {
+            deleted.emplace_back(pos, cell);
+        }
+    }
+
+    if (track_changes_) {
+        // значение может смениться в каждой позиции, которую ячейки покидают
+        // или занимают
+        auto record = [this](Position pos) {
+            const Cell* cell = FindCell(pos);
+            RecordValueChange(pos, cell ? ToValue(cell->ReadValue()) : CellInterface::Value(""s));
+        };
+        for (auto& [pos, cell] : moved) {
+            record(pos);
+            record(shift.Move(pos));
+        }
+        for (auto& [pos, cell] : deleted) {
+            record(pos);
+        }
+    }
+
+    // формулы, ссылки которых нужно переписать: зависящие от сдвинутых и
+    // удалённых ячеек и от областей, задевающих полосу
+    vector<Cell*> with_ranges;
+    range_dependencies_.AddDependents(band, with_ranges);
+    unordered_set<Cell*> affected(with_ranges.begin(), with_ranges.end());
+    for (auto& [pos, cell] : moved) {
+        cell->AddDependentsTo(affected);
+    }
+    for (auto& [pos, cell] : deleted) {
+        cell->AddDependentsTo(affected);
+    }
+
+    // Индексы функций поиска для столбцов полосы переносятся вместе со
+    // столбцами; при сдвиге строк перестраиваются при следующем поиске
+    // индексы только тех столбцов, в полосе которых есть ячейки или массивы
+    if (rows) {
+        for (auto& [pos, cell] : moved) {
+            lookup_indexes_.erase(pos.col);
+        }
+        for (auto& [pos, cell] : deleted) {
+            lookup_indexes_.erase(pos.col);
+        }
+        for (Cell* anchor : anchors) {
+            const Range& area = arrays_.at(anchor).area;
+            for (int col = area.first.col; col <= area.last.col; ++col) {
+                lookup_indexes_.erase(col);
+            }
+        }
+    } else {
+        vector<pair<int, ColumnIndex>> shifted;
+        for (auto it = lookup_indexes_.begin(); it != lookup_indexes_.end();) {
+            if (it->first < first) {
+                ++it;
+                continue;
+            }
+            if (shift.Move(Position{ 0, it->first }).IsValid()) {
+                shifted.emplace_back(it->first + delta, move(it->second));
+            }
+            it = lookup_indexes_.erase(it);
+        }
+        for (auto& [col, index] : shifted) {
+            lookup_indexes_.emplace(col, move(index));
+        }
+    }
+
+    unordered_set<Cell*> deleted_cells;
+    for (auto& [pos, cell] : deleted) {
+        deleted_cells.insert(cell);
+    }
+    unordered_set<Cell*> released;
+    for (auto& [pos, cell] : deleted) {
+        for (Cell* ref_cell : cell->Detach()) {
+            if (!deleted_cells.count(ref_cell)) {
+                released.insert(ref_cell);
+            }
+        }
+        affected.erase(cell);
+        if (auto it = arrays_.find(cell); it != arrays_.end()) {
+            MarkArrayFresh(it->second);
+            arrays_.erase(it);
+            array_areas_.Set(cell, {});
+            anchors.erase(find(anchors.begin(), anchors.end(), cell));
+        }
+    }
+    for (auto& [pos, cell] : deleted) {
+        EraseCell(sheet_.find(pos));
+    }
+
+    // узлы хеш-таблицы переносятся под новые ключи вместе с объектами ячеек,
+    // поэтому указатели зависимостей и привязанные ссылки формул остаются верными
+    vector<CellTable::node_type> nodes;
+    nodes.reserve(moved.size());
+    for (auto& [pos, cell] : moved) {
+        numeric_columns_.Reset(pos);
+        UnmarkStale(pos);
+        nodes.push_back(sheet_.extract(pos));
+    }
+    occupancy_.Shift(shift);
+    for (auto& node : nodes) {
+        node.key() = shift.Move(node.key());
+        node.mapped()->MoveTo(node.key());
+        sheet_.insert(std::move(node));
+    }
+
+    // формулы с изменившимися областями сбрасываются, когда области
+    // всех формул уже переписаны: сброс находит зависимых по ним
+    vector<Cell*> rescoped;
+    for (Cell* cell : affected) {
+        if (cell->MoveReferences(shift)) {
+            rescoped.push_back(cell);
+        }
+    }
+    for (Cell* cell : rescoped) {
+        cell->ForceRecalculation();
+    }
+
+    // заглушки, на которые ссылались только удалённые формулы
+    for (Cell* cell : released) {
+        if (cell->IsPlaceholder()) {
+            ReleaseCell(cell->GetPosition());
+        }
+    }
+
+    // при вставке граница печати сдвигается вместе с последней строкой
+    // (столбцом); удаление может сузить таблицу и по другому измерению
+    int& bound = rows ? printable_size_.rows : printable_size_.cols;
+    if (delta < 0) {
+        printable_size_stale_ = true;
+    } else if (bound > first) {
+        bound = min(bound + delta, limit);
+    }
+
+    UpdateArrays(move(anchors));
+
+    if (memory_budget_) {
+        for (Position pos : occupancy_.CollectFrom(rows, region_first)) {
+            UpdatePayloadSize(pos, 0, FindCell(pos)->GetPayloadSize());
+        }
+        EnforceMemoryBudget();
+    }
+}
+
+void Sheet::SetLazyFormulaParsing(bool enabled) {
+    lazy_formula_parsing_ = enabled;
+}
+
+void Sheet::EnableChangeTracking() {
+    // значения, вытесненные из кэша значений формул уже при включении,
+    // запоминаются как возможно изменившиеся (см. Cell::EvictResult)
+    changed_cells_.clear();
+    track_changes_ = true;
+    ReadAllValues();
+}
+
+vector<Position> Sheet::DrainChangedCells() {
+    vector<Position> result;
+    // чтение значений может вытеснить из кэша значений формул другие
+    // значения, и они запишутся в очередь уже следующего вызова
+    auto changed_cells = move(changed_cells_);
+    changed_cells_.clear();
+
+    for (auto& [pos, old_value] : changed_cells) {
+        auto it = sheet_.find(pos);
+        CellInterface::ValueView value = it != sheet_.end() ? it->second->ReadValue()
+                                                            : ReadVacantValue(pos).value_or(""sv);
+
+        if (!IsSameValue(value, old_value)) {
+            result.push_back(pos);
+        }
+    }
+
+    sort(result.begin(), result.end());
+    return result;
+}
+
+void Sheet::StoreNumericValue(Position pos, const CellInterface::ValueView& value) {
+    numeric_columns_.Store(pos, value);
+    if (!lookup_indexes_.empty()) {
+        auto it = lookup_indexes_.find(pos.col);
+        if (it != lookup_indexes_.end()) {
+            it->second.Set(pos.row, MakeLookupKey(value));
+        }
+    }
+}
+
+void Sheet::ResetNumericValue(Position pos) {
+    numeric_columns_.Reset(pos);
+    if (!lookup_indexes_.empty()) {
+        auto it = lookup_indexes_.find(pos.col);
+        if (it != lookup_indexes_.end()) {
+            it->second.MarkStale(pos.row);
+        }
+    }
+}
+
+void Sheet::MarkStale(Position pos) const {
+    stale_formulas_[pos.col].insert(pos.row);
+}
+
+void Sheet::UnmarkStale(Position pos) {
+    auto it = stale_formulas_.find(pos.col);
+    if (it != stale_formulas_.end()) {
+        it->second.erase(pos.row);
+        if (it->second.empty()) {
+            stale_formulas_.erase(it);
+        }
+    }
+}
+
+variant<double, string, FormulaError> Sheet::GetLookupKey(Position pos) const {
     EnsureValidPosition(pos);
+    if (profiling_) {
+        profiler_.CountInput();
+    }
 
-    auto it = sheet_.find(pos);
-    return it != sheet_.end() ? it->second.get() : nullptr;
+    optional<CellInterface::ValueView> value;
+    if (const Cell* cell = FindCell(pos)) {
+        value = cell->ReadValue();
+    } else {
+        value = ReadVacantValue(pos);
+    }
+    if (!value) {
+        return 0.0;
+    }
+
+    if (holds_alternative<double>(*value)) {
+        return get<double>(*value);
+    }
+    if (holds_alternative<FormulaError>(*value)) {
+        return get<FormulaError>(*value);
+    }
+    string_view text = get<string_view>(*value);
+    if (auto number = ParseNumber(text)) {
+        return *number;
+    }
+    return string(text);
 }
 
-void Sheet::PrintContext(ostream& output, string context) const {
-    Size size = GetPrintableSize();
+optional<int> Sheet::Lookup(const LookupKey& key, Range column, LookupMatch match) const {
+    if (!column.IsValid() || column.first.col != column.last.col) {
+        throw InvalidPositionException("Lookup range must be a single column");
+    }
 
-    for (int row = 0; row < size.rows; ++ row) {
-        for(int col = 0; col < size.cols; ++col) {
-            auto* cell = GetCell({ row, col });
-            
-            if (cell) {
-                if (context == "Values"s) {
-                    auto value = cell->GetValue();
-                    visit([&](auto&& v) {
-                        output << v;
-                    }, value);
+    const int col = column.first.col;
+    if (parent_ && !lookup_indexes_.count(col)) {
+        // Ветка не меняла строки области - годится индекс родителя.
+        // Ограниченный кэш значений формул родителя заставил бы его
+        // вычислять вытесненные значения, поэтому тогда, как и после
+        // изменений, ветка заводит свой индекс (GetLookupIndex).
+        auto forked = forked_rows_.find(col);
+        auto row = forked != forked_rows_.end() ? forked->second.lower_bound(column.first.row) : set<int>::iterator{};
+        if ((forked == forked_rows_.end() || row == forked->second.end() || *row > column.last.row)
+            && !parent_->results_.IsBounded()) {
+            lock_guard lock(parent_->fork_mutex_);
+            return parent_->Lookup(key, column, match);
+        }
+    }
+
+    ColumnIndex& index = GetLookupIndex(col);
+    // Вычисленная формула сообщает своё значение индексу сама
+    // (StoreNumericValue). Прерывать чтение столбца на середине нельзя,
+    // поэтому входы формулы, вычисляемой впервые (Cell::Discover), здесь
+    // вычисляются вложенно.
+    bool discovering = exchange(discovering_inputs_, false);
+    if (stale_arrays_) {
+        RefreshArrays(column);
+    }
+    for (int row : index.TakeStale(column.first.row, column.last.row)) {
+        if (const Cell* cell = FindCell({ row, col })) {
+            cell->ReadValue();
+        } else if (auto value = ReadVacantValue({ row, col })) {
+            index.Set(row, MakeLookupKey(*value));
+        } else {
+            index.Set(row, nullopt);
+        }
+    }
+    discovering_inputs_ = discovering;
+    return index.Find(key, column.first.row, column.last.row, match);
+}
+
+ColumnIndex& Sheet::GetLookupIndex(int col) const {
+    // узлы unordered_map не переезжают при вставке, поэтому ссылка на индекс
+    // переживает поиски в других столбцах, начатые вычислением формул
+    auto [it, inserted] = lookup_indexes_.try_emplace(col);
+    ColumnIndex& index = it->second;
+    if (inserted && parent_) {
+        BuildForkedLookupIndex(col, index);
+    } else if (inserted) {
+        for (auto& [pos, cell] : sheet_) {
+            if (pos.col != col) {
+                continue;
+            }
+            if (cell->HasCache()) {
+                index.Set(pos.row, MakeLookupKey(cell->ReadValue()));
+            } else {
+                index.MarkStale(pos.row);
+            }
+        }
+        // элементы массивов без своих ячеек
+        for (auto& [anchor, array] : arrays_) {
+            if (!array.active || col < array.area.first.col || col > array.area.last.col) {
+                continue;
+            }
+            for (int row = array.area.first.row; row <= array.area.last.row; ++row) {
+                Position pos{ row, col };
+                if (pos == array.area.first || sheet_.count(pos)) {
+                    continue;
+                }
+                if (anchor->HasCache() && !array.values.empty()) {
+                    index.Set(row, MakeLookupKey(ToValueView(PeekArrayElement(array, pos))));
                 } else {
-                    output << cell->GetText();
+                    index.MarkStale(row);
+                }
+            }
+        }
+    }
+    return index;
+}
+
+void Sheet::BuildForkedLookupIndex(int col, ColumnIndex& index) const {
+    // Индекс ветки - копия индекса родителя, в которой устарели строки,
+    // где ветка может расходиться с родителем: заменённые ею ячейки и
+    // области массивов, выведенных веткой или не унаследованных ею. Дальше
+    // его, как и индекс таблицы, обновляют правки ветки (StoreNumericValue,
+    // MarkForked), и поиск вычисляет только эти строки.
+    {
+        lock_guard lock(parent_->fork_mutex_);
+        index = parent_->GetLookupIndex(col);
+    }
+    if (auto forked = forked_rows_.find(col); forked != forked_rows_.end()) {
+        for (int row : forked->second) {
+            const Cell* cell = FindCell({ row, col });
+            if (cell && cell->HasCache()) {
+                index.Set(row, MakeLookupKey(cell->ReadValue()));
+            } else {
+                index.MarkStale(row);
+            }
+        }
+    }
+    auto mark_area = [&](const Range& area) {
+        if (col >= area.first.col && col <= area.last.col) {
+            for (int row = area.first.row; row <= area.last.row; ++row) {
+                index.MarkStale(row);
+            }
+        }
+    };
+    for (auto& [anchor, array] : arrays_) {
+        mark_area(array.area);
+    }
+    for (auto& [anchor, array] : parent_->arrays_) {
+        if (array.active && !IsInherited(*anchor)) {
+            mark_area(array.area);
+        }
+    }
+}
+
+void Sheet::RecordValueChange(Position pos, CellInterface::Value old_value) {
+    if (track_changes_) {
+        changed_cells_.emplace(pos, move(old_value));
+    }
+}
+
+namespace {
+// более короткие серии выгоднее вычислять по одной
+const size_t MIN_VECTORIZED_RUN = 8;
+
+// формулы, ссылающиеся на свой же столбец (=A1+1 в A2), могут зависеть друг
+// от друга внутри серии; формулы-массивы вычисляются каждая своей серией
+// (EvaluateArray)
+bool IsVectorizable(const FormulaProgram& program) {
+    for (const auto& op : program.ops) {
+        if ((op.code == FormulaProgram::OpCode::Cell && op.col_offset == 0)
+            || op.code == FormulaProgram::OpCode::Range) {
+            return false;
+        }
+    }
+    return true;
+}
+}  // namespace
+
+variant<double, FormulaError> Sheet::GetNumericValue(Position pos) const {
+    EnsureValidPosition(pos);
+    return ReadNumericValue(pos, nullptr);
+}
+
+variant<double, FormulaError> Sheet::ReadNumericValue(Position pos, const Cell* cell) const {
+    if (profiling_) {
+        profiler_.CountInput();
+    }
+
+    if (stale_arrays_) {
+        RefreshArrays({ pos, pos });
+    }
+    if (auto value = numeric_columns_.Get(pos)) {
+        return *value;
+    }
+
+    optional<CellInterface::ValueView> value;
+    if (!cell) {
+        cell = FindCell(pos);
+    }
+    if (cell) {
+        value = cell->ReadValue();
+    } else {
+        value = ReadVacantValue(pos);
+    }
+    if (!value) {
+        return 0.0;
+    }
+
+    if (holds_alternative<double>(*value)) {
+        return get<double>(*value);
+    }
+    if (holds_alternative<FormulaError>(*value)) {
+        return get<FormulaError>(*value);
+    }
+    if (auto number = ParseNumber(get<string_view>(*value))) {
+        return *number;
+    }
+    return FormulaError(FormulaError::Category::Value);
+}
+
+void Sheet::Recalculate() const {
+    // Серии собираются из stale_formulas_, а не обходом таблицы. Список
+    // забирается целиком до вычисления: формулы, чьи значения вытеснят во
+    // время пересчёта, попадут уже в новый. Ячейки запоминаются вместе со
+    // строкой: серия компилируется и получает значения без поиска ячеек.
+    map<int, set<int>> stale_formulas = move(stale_formulas_);
+    stale_formulas_.clear();
+
+    vector<pair<int, const Cell*>> rows;
+    vector<const Cell*> run;
+    for (auto& [col, stale_rows] : stale_formulas) {
+        rows.clear();
+        for (int row : stale_rows) {
+            auto it = sheet_.find({ row, col });
+            // формулу могли уже вычислить при чтении
+            if (it != sheet_.end() && !it->second->HasCache()) {
+                rows.emplace_back(row, it->second.get());
+            }
+        }
+
+        size_t begin = 0;
+        while (begin < rows.size()) {
+            FormulaProgram program;
+            if (!rows[begin].second->Compile(program) || !IsVectorizable(program)) {
+                ++begin;
+                continue;
+            }
+
+            size_t end = begin + 1;
+            FormulaProgram next;
+            while (end < rows.size() && rows[end].first == rows[end - 1].first + 1
+                   && rows[end].second->Compile(next) && next == program) {
+                ++end;
+            }
+
+            if (end - begin >= MIN_VECTORIZED_RUN) {
+                run.clear();
+                for (size_t i = begin; i < end; ++i) {
+                    run.push_back(rows[i].second);
+                }
+                EvaluateRun(program, col, rows[begin].first, run);
+            }
+            begin = end;
+        }
+    }
+
+    ReadAllValues();
+    // формулы всех массивов вычислены: значения в хранилище верны и у тех,
+    // что не вычисляли массив заново
+    if (stale_arrays_) {
+        for (auto& [anchor, array] : arrays_) {
+            MarkArrayFresh(array);
+        }
+    }
+}
+
+void Sheet::ReadAllValues() const {
+    // у ветки чтение значения может добавить в таблицу ячейку (ForkCell),
+    // поэтому она обходит копию списка ячеек
+    if (parent_) {
+        vector<const Cell*> cells;
+        cells.reserve(sheet_.size());
+        for (auto& [pos, cell] : sheet_) {
+            cells.push_back(cell.get());
+        }
+        for (const Cell* cell : cells) {
+            cell->ReadValue();
+        }
+        return;
+    }
+
+    if (!layout_.empty()) {
+        for (const Cell* cell : layout_) {
+            if (layout_erased_.empty() || !layout_erased_.count(cell)) {
+                cell->ReadValue();
+            }
+        }
+        return;
+    }
+    for (auto& [pos, cell] : sheet_) {
+        cell->ReadValue();
+    }
+}
+
+void Sheet::OptimizeLayout() {
+    EnsureNoForks();
+    if (parent_) {
+        return;
+    }
+    // вытесненные формулы загружаются, чтобы разместить их заново
+    if (memory_budget_) {
+        PageInAll();
+    }
+
+    // Порядок Кана: ячейка попадает в него, когда в нём уже все её входы -
+    // ячейки, на которые она ссылается, ячейки её областей и массивы,
+    // элементы которых она читает. Ячейки без входов идут по позициям.
+    unordered_map<const Cell*, vector<Cell*>> dependents;
+    unordered_map<const Cell*, size_t> inputs;
+    dependents.reserve(sheet_.size());
+    inputs.reserve(sheet_.size());
+    for (auto& [pos, cell] : sheet_) {
+        unordered_set<Cell*> targets;
+        cell->AddDependentsTo(targets);
+        vector<Cell*> ranged;
+        range_dependencies_.AddDependents(pos, ranged);
+        if (const Range* area = FindActiveArea(cell.get())) {
+            range_dependencies_.AddDependents(*area, ranged);
+        }
+        targets.insert(ranged.begin(), ranged.end());
+        targets.erase(cell.get());
+        for (Cell* target : targets) {
+            ++inputs[target];
+        }
+        dependents[cell.get()].assign(targets.begin(), targets.end());
+    }
+
+    vector<Cell*> order;
+    order.reserve(sheet_.size());
+    for (auto& [pos, cell] : sheet_) {
+        if (!inputs.count(cell.get())) {
+            order.push_back(cell.get());
+        }
+    }
+    sort(order.begin(), order.end(), [](const Cell* lhs, const Cell* rhs) {
+        return lhs->GetPosition() < rhs->GetPosition();
+    });
+    for (size_t i = 0; i < order.size(); ++i) {
+        for (Cell* dependent : dependents[order[i]]) {
+            if (--inputs[dependent] == 0) {
+                order.push_back(dependent);
+            }
+        }
+    }
+
+    // формулы размещаются заново подряд, а их значения переезжают в слоты
+    // с номерами по тому же порядку
+    vector<uint32_t> slots;
+    for (Cell* cell : order) {
+        cell->Relocate(slots);
+    }
+    results_.Reorder(slots);
+    layout_ = move(order);
+    layout_erased_.clear();
+
+    if (memory_budget_) {
+        CountPayloads();
+        EnforceMemoryBudget();
+    }
+}
+
+namespace {
+// Пакет записей выгрузки - не больше EXPORT_BATCH_CELLS ячеек; пакет
+// заканчивается раньше, если текст в нём занял EXPORT_BATCH_BYTES байт
+const size_t EXPORT_BATCH_CELLS = 1 << 20;
+const size_t EXPORT_BATCH_BYTES = 64 << 20;
+
+string ColumnName(int col) {
+    string name = Position{ 0, col }.ToString();
+    name.pop_back();  // номер строки
+    return name;
+}
+}  // namespace
+
+void Sheet::ExportColumnar(const string& path) const {
+    Recalculate();
+    const Size size = GetPrintableSize();
+    const int batch_rows = static_cast<int>(max<size_t>(1, EXPORT_BATCH_CELLS / max(1, size.cols)));
+
+    // Оба прохода идут по строкам окнами по batch_rows строк. Значения
+    // читаются только в позициях окна, где они есть (CollectPrintedRows), -
+    // остальные пустые без поиска в хеш-таблице. Числа столбцов с
+    // from_store берутся прямо из блоков хранилища чисел, без поиска ячеек и
+    // загрузки вытесненных; прочее - из ячеек. Блок ищется при каждом
+    // чтении: вычисление формулы при чтении ячейки может выделить или
+    // освободить блоки.
+    vector<optional<CellInterface::ValueView>> values(size.cols);
+    vector<bool> from_store(size.cols, false);
+    auto for_each_row = [&](const auto& visit) {
+        for (int first = 0; first < size.rows; first += batch_rows) {
+            const int last = min(size.rows - 1, first + batch_rows - 1);
+            vector<vector<int>> rows = CollectPrintedRows(first, last, size.cols);
+            vector<size_t> next(size.cols, 0);
+            for (int row = first; row <= last; ++row) {
+                const int offset = row % NumericColumns::BLOCK_ROWS;
+                for (int col = 0; col < size.cols; ++col) {
+                    const vector<int>& column_rows = rows[col];
+                    if (next[col] < column_rows.size() && column_rows[next[col]] == row) {
+                        ++next[col];
+                        const NumericColumns::Column* source = from_store[col] ? numeric_columns_.GetColumn(col)
+                                                                               : nullptr;
+                        const NumericColumns::Block* block = source ? source->FindBlock(row) : nullptr;
+                        if (block && block->IsNumeric(offset)) {
+                            values[col] = block->values[offset];
+                        } else {
+                            values[col] = ReadPrintedValue({ row, col });
+                        }
+                    } else {
+                        values[col].reset();
+                    }
+                }
+                visit();
+                EnforceMemoryBudget();
+            }
+        }
+    };
+
+    // первый проход выбирает типы столбцов
+    vector<bool> has_number(size.cols, false);
+    vector<bool> has_text(size.cols, false);
+    // текст, который печатается пустым ('), хранилище считает нулём, а в
+    // выгрузке он null: такие столбцы читаются из ячеек
+    vector<bool> has_blank(size.cols, false);
+    for_each_row([&] {
+        for (int col = 0; col < size.cols; ++col) {
+            const auto& value = values[col];
+            if (!value) {
+                continue;
+            }
+            if (holds_alternative<double>(*value)) {
+                has_number[col] = true;
+            } else if (holds_alternative<FormulaError>(*value)) {
+                // в Float64 ошибку не отличить от пустой ячейки
+                has_text[col] = true;
+            } else if (!get<string_view>(*value).empty()) {
+                (ParseNumber(get<string_view>(*value)) ? has_number : has_text)[col] = true;
+            } else {
+                has_blank[col] = true;
+            }
+        }
+    });
+
+    vector<ColumnSpec> specs;
+    vector<ColumnBuilder> columns;
+    columns.reserve(size.cols);
+    for (int col = 0; col < size.cols; ++col) {
+        ColumnType type = has_number[col] && !has_text[col] ? ColumnType::Float64 : ColumnType::Utf8;
+        specs.push_back({ ColumnName(col), type });
+        columns.emplace_back(type);
+        // хранилище ветки знает только её собственные ячейки
+        from_store[col] = type == ColumnType::Float64 && !has_blank[col] && !parent_;
+    }
+
+    ArrowFileWriter writer(path, move(specs));
+    int rows_in_batch = 0;
+    size_t text_bytes = 0;
+    auto flush = [&] {
+        writer.WriteBatch(columns);
+        for (ColumnBuilder& column : columns) {
+            column.Clear();
+        }
+        rows_in_batch = 0;
+        text_bytes = 0;
+    };
+
+    ostringstream number;
+    string formatted;
+    for_each_row([&] {
+        for (int col = 0; col < size.cols; ++col) {
+            ColumnBuilder& column = columns[col];
+            const auto& value = values[col];
+            if (!value || (holds_alternative<string_view>(*value) && get<string_view>(*value).empty())) {
+                column.AppendNull();
+            } else if (column.GetType() == ColumnType::Float64) {
+                if (holds_alternative<double>(*value)) {
+                    column.AppendDouble(get<double>(*value));
+                } else {
+                    column.AppendDouble(*ParseNumber(get<string_view>(*value)));
+                }
+            } else {
+                string_view text;
+                if (holds_alternative<double>(*value)) {
+                    number.str({});
+                    number << get<double>(*value);
+                    formatted = number.str();
+                    text = formatted;
+                } else if (holds_alternative<FormulaError>(*value)) {
+                    text = get<FormulaError>(*value).ToString();
+                } else {
+                    text = get<string_view>(*value);
+                }
+                column.AppendString(text);
+                text_bytes += text.size();
+            }
+        }
+
+        if (++rows_in_batch == batch_rows || text_bytes >= EXPORT_BATCH_BYTES) {
+            flush();
+        }
+    });
+    if (rows_in_batch > 0) {
+        flush();
+    }
+    writer.Finish();
+}
+
+vector<vector<int>> Sheet::CollectPrintedRows(int first_row, int last_row, int cols) const {
+    vector<vector<int>> rows(cols);
+    auto add_cells = [&](const Sheet& sheet) {
+        for (int col : sheet.occupancy_.GetColumns()) {
+            if (col >= cols) {
+                break;
+            }
+            vector<int> column_rows = sheet.occupancy_.GetRows(col, first_row, last_row);
+            rows[col].insert(rows[col].end(), column_rows.begin(), column_rows.end());
+        }
+    };
+    // элементы массивов ячеек не имеют, пока к ним не обратятся
+    auto add_area = [&](const Range& area) {
+        for (int col = area.first.col; col <= min(area.last.col, cols - 1); ++col) {
+            for (int row = max(area.first.row, first_row); row <= min(area.last.row, last_row); ++row) {
+                rows[col].push_back(row);
+            }
+        }
+    };
+
+    add_cells(*this);
+    for (auto& [anchor, array] : arrays_) {
+        if (array.active) {
+            add_area(array.area);
+        }
+    }
+    if (parent_) {
+        add_cells(*parent_);
+        for (auto& [anchor, array] : parent_->arrays_) {
+            if (array.active && IsInherited(*anchor)) {
+                add_area(array.area);
+            }
+        }
+    }
+
+    for (vector<int>& column_rows : rows) {
+        if (!is_sorted(column_rows.begin(), column_rows.end())) {
+            sort(column_rows.begin(), column_rows.end());
+        }
+        column_rows.erase(unique(column_rows.begin(), column_rows.end()), column_rows.end());
+    }
+    return rows;
+}
+
+optional<CellInterface::ValueView> Sheet::ReadPrintedValue(Position pos) const {
+    if (const Cell* cell = FindCell(pos)) {
+        return cell->ReadValue();
+    }
+    return ReadVacantValue(pos);
+}
+
+void Sheet::EvaluateRun(const FormulaProgram& program, int col, int first_row,
+                        const vector<const Cell*>& cells) const {
+    auto start = chrono::steady_clock::now();
+    const size_t count = cells.size();
+    vector<vector<double>> inputs;
+    // строки, которые нельзя вычислить вместе со всеми: ошибка или текст во
+    // входах - такие формулы вычисляются обычным путём
+    vector<bool> scalar(count, false);
+
+    for (const auto& op : program.ops) {
+        if (op.code != FormulaProgram::OpCode::Cell) {
+            continue;
+        }
+
+        auto& column = inputs.emplace_back(count);
+        const NumericColumns::Column* source = numeric_columns_.GetColumn(col + op.col_offset);
+
+        for (size_t i = 0; i < count; ++i) {
+            Position pos{ first_row + static_cast<int>(i) + op.row_offset, col + op.col_offset };
+            if (!pos.IsValid() || !ReadRunInput(pos, source, column[i])) {
+                scalar[i] = true;
+            }
+        }
+    }
+
+    vector<double> result;
+    EvaluateProgram(program, inputs, count, result);
+
+    // общее время серии делится поровну между вычисленными в ней формулами
+    if (profiling_) {
+        auto share = (chrono::steady_clock::now() - start) / count;
+        for (size_t i = 0; i < count; ++i) {
+            if (!scalar[i]) {
+                profiler_.AddEvaluation({ first_row + static_cast<int>(i), col },
+                                        chrono::duration_cast<chrono::nanoseconds>(share), inputs.size());
+            }
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const Cell* cell = cells[i];
+
+        if (scalar[i]) {
+            cell->ReadValue();
+        } else if (isnan(result[i])) {
+            cell->SetComputedValue(FormulaError(FormulaError::Category::Arithmetic));
+        } else {
+            cell->SetComputedValue(result[i]);
+        }
+    }
+}
+
+bool Sheet::ReadRunInput(Position pos, const NumericColumns::Column*& source, double& value) const {
+    // известные числа читаются прямо из столбца, остальное - через ячейку;
+    // вычисление массива может добавить в хранилище столбцы
+    if (stale_arrays_ && RefreshArrays({ pos, pos })) {
+        source = numeric_columns_.GetColumn(pos.col);
+    }
+    if (!source || !source->IsPresent(pos.row)) {
+        GetNumericValue(pos);
+        source = numeric_columns_.GetColumn(pos.col);
+    }
+
+    if (source && source->IsNumeric(pos.row) && isfinite(source->GetValue(pos.row))) {
+        value = source->GetValue(pos.row);
+    } else if (!sheet_.count(pos) && !ReadVacantValue(pos)) {
+        value = 0;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+namespace {
+bool Intersects(const Range& lhs, const Range& rhs) {
+    return lhs.first.row <= rhs.last.row && rhs.first.row <= lhs.last.row
+        && lhs.first.col <= rhs.last.col && rhs.first.col <= lhs.last.col;
+}
+}  // namespace
+
+Range Sheet::GetArrayArea(Position anchor, Size size) {
+    return { anchor, { min(anchor.row + size.rows, Position::MAX_ROWS) - 1,
+                       min(anchor.col + size.cols, Position::MAX_COLS) - 1 } };
+}
+
+void Sheet::UpdateArrays(Position pos) {
+    vector<Cell*> anchors;
+    array_areas_.AddDependents(pos, anchors);
+    Cell* cell = FindCell(pos);
+    if (cell && (arrays_.count(cell) || cell->GetArraySize())) {
+        anchors.push_back(cell);
+    }
+    if (anchors.empty()) {
+        return;
+    }
+    UpdateArrays(move(anchors));
+
+    // пустая ячейка внутри выведенного массива (элемент, которому задали
+    // пустой текст) снова становится его элементом
+    cell = FindCell(pos);
+    if (!cell || !cell->IsEmpty()) {
+        return;
+    }
+    if (Cell* owner = FindArrayOwner(pos)) {
+        cell->SpillFrom(owner);
+    }
+}
+
+void Sheet::UpdateArrays(vector<Cell*> anchors) {
+    // первыми выводятся массивы, стоящие раньше по таблице: очередь
+    // разбирается с конца
+    sort(anchors.begin(), anchors.end(), [](const Cell* lhs, const Cell* rhs) {
+        return rhs->GetPosition() < lhs->GetPosition();
+    });
+    anchors.erase(unique(anchors.begin(), anchors.end()), anchors.end());
+
+    // освобождённая область может достаться массивам, которым она мешала
+    while (!anchors.empty()) {
+        Cell* anchor = anchors.back();
+        anchors.pop_back();
+        if (auto freed = UpdateArray(anchor)) {
+            array_areas_.AddDependents(*freed, anchors);
+        }
+    }
+}
+
+optional<Range> Sheet::UpdateArray(Cell* anchor) {
+    optional<Size> size = anchor->GetArraySize();
+    auto it = arrays_.find(anchor);
+    if (!size) {
+        if (it == arrays_.end()) {
+            return nullopt;
+        }
+        optional<Range> freed;
+        if (it->second.active) {
+            DeactivateArea(it->second);
+            freed = it->second.area;
+        }
+        MarkArrayFresh(it->second);
+        arrays_.erase(it);
+        array_areas_.Set(anchor, {});
+        return freed;
+    }
+
+    Range area = GetArrayArea(anchor->GetPosition(), *size);
+    bool inserted = it == arrays_.end();
+    if (inserted) {
+        it = arrays_.emplace(anchor, ArrayFormula{}).first;
+    }
+    ArrayFormula& array = it->second;
+
+    // обрезанная краем таблицы область тоже занята; вывод в новую область
+    // может замкнуть цикл через формулы, которые читают её ячейки
+    bool active = area.GetSize() == *size && !IsAreaOccupied(anchor, area);
+    if (active && !(array.active && array.area == area)) {
+        active = anchor->CanSpill(area);
+    }
+    if (!inserted && array.area == area && array.active == active) {
+        return nullopt;
+    }
+
+    optional<Range> freed;
+    if (array.active) {
+        DeactivateArea(array);
+        freed = array.area;
+    }
+    array.area = area;
+    array.active = active;
+    array.values.clear();
+    array_areas_.Set(anchor, { area });
+    if (active) {
+        ActivateArea(anchor, area);
+    }
+    anchor->ForceRecalculation();
+    return freed;
+}
+
+bool Sheet::IsAreaOccupied(const Cell* anchor, const Range& area) const {
+    bool occupied = false;
+    ForEachCell(area, [&](Cell* cell) {
+        occupied = occupied || (cell != anchor && !cell->IsEmpty() && !cell->IsSpill());
+    });
+    // у ветки область занимают и ячейки и массивы родителя, которых она не заменила
+    if (!occupied && parent_) {
+        parent_->ForEachCell(area, [&](Cell* cell) {
+            occupied = occupied || (!cell->IsEmpty() && !cell->IsSpill() && !FindCell(cell->GetPosition()));
+        });
+    }
+    if (occupied) {
+        return true;
+    }
+
+    vector<Cell*> others;
+    array_areas_.AddDependents(area, others);
+    if (any_of(others.begin(), others.end(), [&](const Cell* other) {
+            const ArrayFormula& array = arrays_.at(other);
+            return other != anchor && array.active && Intersects(array.area, area);
+        })) {
+        return true;
+    }
+    if (!parent_) {
+        return false;
+    }
+    vector<Cell*> inherited;
+    parent_->array_areas_.AddDependents(area, inherited);
+    return any_of(inherited.begin(), inherited.end(), [&](const Cell* other) {
+        const ArrayFormula& array = parent_->arrays_.at(other);
+        return array.active && Intersects(array.area, area) && IsInherited(*other);
+    });
+}
+
+void Sheet::ActivateArea(Cell* anchor, const Range& area) {
+    // Ячейки заводятся только у элементов, на которые ссылаются формулы или
+    // которые запрошены через GetCell(). Остальные элементы - значения
+    // массива: формулы читают их из хранилища чисел, а формулы с областями
+    // узнают об их изменении по области массива.
+    vector<Cell*> elements;
+    ForEachCell(area, [&](Cell* cell) {
+        if (cell != anchor) {
+            elements.push_back(cell);
+        }
+    });
+    for (Cell* cell : elements) {
+        cell->SpillFrom(anchor);
+    }
+    if (track_changes_) {
+        for (int row = area.first.row; row <= area.last.row; ++row) {
+            for (int col = area.first.col; col <= area.last.col; ++col) {
+                Position pos{ row, col };
+                if (!(pos == area.first) && !sheet_.count(pos)) {
+                    RecordValueChange(pos, ""s);
+                }
+            }
+        }
+    }
+    // значения элементов попадут в хранилище чисел при вычислении массива,
+    // а до тех пор их чтение вычисляет его (RefreshArrays)
+    MarkArrayStale(arrays_.at(anchor));
+
+    vector<Cell*> readers;
+    range_dependencies_.AddDependents(area, readers);
+    for (Cell* reader : readers) {
+        reader->ForceRecalculation();
+    }
+    UpdatePrintableSize(area.last);
+}
+
+void Sheet::DeactivateArea(ArrayFormula& array) {
+    const Range& area = array.area;
+    vector<Cell*> elements;
+    ForEachCell(area, [&](Cell* cell) {
+        if (cell->IsSpill()) {
+            elements.push_back(cell);
+        }
+    });
+    for (Cell* cell : elements) {
+        cell->ReleaseSpill();
+        if (cell->IsPlaceholder()) {
+            ReleaseCell(cell->GetPosition());
+        }
+    }
+    if (track_changes_ && !array.values.empty()) {
+        for (int row = area.first.row; row <= area.last.row; ++row) {
+            for (int col = area.first.col; col <= area.last.col; ++col) {
+                Position pos{ row, col };
+                if (!(pos == area.first) && !sheet_.count(pos)) {
+                    RecordValueChange(pos, ToValue(ToValueView(PeekArrayElement(array, pos))));
+                }
+            }
+        }
+    }
+    MarkArrayFresh(array);
+
+    // Значения элементов стираются из хранилища чисел словами масок, а не
+    // по одному; вычисленные значения ячеек области возвращаются в него.
+    // Индексы поиска столбцов области строятся заново при следующем поиске.
+    numeric_columns_.ResetArea(area);
+    ForEachCell(area, [&](Cell* cell) {
+        if (cell->HasCache()) {
+            numeric_columns_.Store(cell->GetPosition(), cell->ReadValue());
+        }
+    });
+    for (auto it = lookup_indexes_.begin(); it != lookup_indexes_.end();) {
+        if (it->first >= area.first.col && it->first <= area.last.col) {
+            it = lookup_indexes_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    vector<Cell*> readers;
+    range_dependencies_.AddDependents(area, readers);
+    for (Cell* reader : readers) {
+        reader->ForceRecalculation();
+    }
+    ShrinkPrintableSize(area.last);
+}
+
+FormulaInterface::Value Sheet::EvaluateArray(const Cell& anchor, const FormulaInterface& formula,
+                                             bool& changed) const {
+    auto it = arrays_.find(&anchor);
+    if (it == arrays_.end() || !it->second.active) {
+        changed = false;
+        return FormulaError(FormulaError::Category::Spill);
+    }
+
+    ArrayFormula& array = it->second;
+    const Position origin = anchor.GetPosition();
+    const Size size = array.area.GetSize();
+    const size_t count = static_cast<size_t>(size.rows) * size.cols;
+
+    // Элементы, все входы которых - конечные числа, вычисляются вместе
+    // программой формулы: вход-область даёт каждому элементу свою ячейку,
+    // вход-ячейка - всем одну и ту же. Остальные элементы, как и все
+    // элементы формулы без программы (условия, функции поиска, области
+    // разных размеров), вычисляются по одному.
+    vector<bool> scalar(count, true);
+    vector<double> result;
+    FormulaProgram program;
+    if (formula.Compile(origin, program)) {
+        scalar.assign(count, false);
+        vector<vector<double>> inputs;
+        for (const auto& op : program.ops) {
+            Position pos{ origin.row + op.row_offset, origin.col + op.col_offset };
+            if (op.code == FormulaProgram::OpCode::Cell) {
+                const NumericColumns::Column* source = nullptr;
+                double value = 0;
+                if (!pos.IsValid() || !ReadRunInput(pos, source, value)) {
+                    scalar.assign(count, true);
+                }
+                inputs.emplace_back(count, value);
+            } else if (op.code == FormulaProgram::OpCode::Range) {
+                auto& column = inputs.emplace_back(count);
+                for (int col = 0; col < size.cols; ++col) {
+                    const NumericColumns::Column* source = numeric_columns_.GetColumn(pos.col + col);
+                    for (int row = 0; row < size.rows; ++row) {
+                        size_t i = static_cast<size_t>(row) * size.cols + col;
+                        if (!ReadRunInput({ pos.row + row, pos.col + col }, source, column[i])) {
+                            scalar[i] = true;
+                        }
+                    }
+                }
+            }
+        }
+        EvaluateProgram(program, inputs, count, result);
+    }
+
+    vector<FormulaInterface::Value> values;
+    values.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        if (scalar[i]) {
+            values.push_back(formula.EvaluateElement(*this, static_cast<int>(i / size.cols),
+                                                     static_cast<int>(i % size.cols)));
+        } else if (isnan(result[i])) {
+            values.push_back(FormulaError(FormulaError::Category::Arithmetic));
+        } else {
+            values.push_back(result[i]);
+        }
+    }
+
+    changed = values != array.values;
+    array.values = move(values);
+    ++array.epoch;
+
+    // элементы без своих ячеек формулы читают из хранилища чисел
+    Sheet& self = const_cast<Sheet&>(*this);
+    for (size_t i = 1; i < count; ++i) {
+        Position pos{ origin.row + static_cast<int>(i / size.cols), origin.col + static_cast<int>(i % size.cols) };
+        self.StoreNumericValue(pos, ToValueView(array.values[i]));
+    }
+    MarkArrayFresh(array);
+    return array.values.front();
+}
+
+FormulaInterface::Value Sheet::GetArrayElement(const Cell& anchor, Position pos) const {
+    // устаревший результат сначала вычисляется
+    anchor.ReadValue();
+    auto it = arrays_.find(&anchor);
+    if (it == arrays_.end() || it->second.values.empty() || !it->second.area.Contains(pos)) {
+        return FormulaError(FormulaError::Category::Spill);
+    }
+    return PeekArrayElement(it->second, pos);
+}
+
+FormulaInterface::Value Sheet::PeekArrayElement(const ArrayFormula& array, Position pos) {
+    const int cols = array.area.GetSize().cols;
+    return array.values[static_cast<size_t>(pos.row - array.area.first.row) * cols
+                        + (pos.col - array.area.first.col)];
+}
+
+Cell* Sheet::FindArrayOwner(Position pos) const {
+    if (arrays_.empty()) {
+        return nullptr;
+    }
+    vector<Cell*> anchors;
+    array_areas_.AddDependents(pos, anchors);
+    for (Cell* anchor : anchors) {
+        if (!(anchor->GetPosition() == pos) && arrays_.at(anchor).active) {
+            return anchor;
+        }
+    }
+    return nullptr;
+}
+
+const Range* Sheet::FindActiveArea(const Cell* anchor) const {
+    if (arrays_.empty()) {
+        return nullptr;
+    }
+    auto it = arrays_.find(anchor);
+    return it != arrays_.end() && it->second.active ? &it->second.area : nullptr;
+}
+
+void Sheet::InvalidateArrayArea(const Cell* anchor, vector<Cell*>& readers) {
+    if (arrays_.empty()) {
+        return;
+    }
+    auto it = arrays_.find(anchor);
+    if (it == arrays_.end() || !it->second.active) {
+        return;
+    }
+    ArrayFormula& array = it->second;
+    const Range& area = array.area;
+    if (!array.stale) {
+        // ячейки элементов запоминают прежнее значение сами
+        if (track_changes_ && !array.values.empty()) {
+            for (int row = area.first.row; row <= area.last.row; ++row) {
+                for (int col = area.first.col; col <= area.last.col; ++col) {
+                    Position pos{ row, col };
+                    if (!(pos == area.first) && !sheet_.count(pos)) {
+                        RecordValueChange(pos, ToValue(ToValueView(PeekArrayElement(array, pos))));
+                    }
+                }
+            }
+        }
+        MarkArrayStale(array);
+    }
+    range_dependencies_.AddDependents(area, readers);
+}
+
+void Sheet::MarkArrayStale(ArrayFormula& array) const {
+    if (!array.stale) {
+        array.stale = true;
+        ++stale_arrays_;
+    }
+}
+
+void Sheet::MarkArrayFresh(ArrayFormula& array) const {
+    if (array.stale) {
+        array.stale = false;
+        --stale_arrays_;
+    }
+}
+
+bool Sheet::RefreshArrays(const Range& range) const {
+    vector<Cell*> anchors;
+    array_areas_.AddDependents(range, anchors);
+    bool refreshed = false;
+    for (Cell* anchor : anchors) {
+        auto it = arrays_.find(anchor);
+        if (it == arrays_.end() || !it->second.stale || !Intersects(it->second.area, range)) {
+            continue;
+        }
+        // формула, входы которой не изменились, не вычисляет массив заново:
+        // его значения в хранилище верны
+        anchor->ReadValue();
+        MarkArrayFresh(arrays_.at(anchor));
+        refreshed = true;
+    }
+    return refreshed;
+}
+
+uint64_t Sheet::GetArrayEpoch(const Cell& anchor) const {
+    auto it = arrays_.find(&anchor);
+    return it != arrays_.end() ? it->second.epoch : 0;
+}
+
+optional<CellInterface::ValueView> Sheet::ReadVacantValue(Position pos) const {
+    if (const Cell* anchor = FindArrayOwner(pos)) {
+        return ToValueView(GetArrayElement(*anchor, pos));
+    }
+    if (parent_) {
+        return ReadParentValue(pos);
+    }
+    return nullopt;
+}
+
+MemoryUsage Sheet::GetMemoryUsage() const {
+    MemoryUsage usage;
+    usage.cell_table = cell_table_memory_ + occupancy_.GetMemoryUsage() + layout_.capacity() * sizeof(Cell*)
+                     + layout_erased_.bucket_count() * sizeof(void*) + layout_erased_.size() * (2 * sizeof(void*) + sizeof(Cell*));
+    usage.dependencies = dependencies_memory_;
+    usage.numeric_columns = numeric_columns_.GetMemoryUsage();
+    usage.text = string_pool_.GetMemoryUsage();
+    usage.cached_values = results_.GetMemoryUsage();
+    usage.lookup_indexes = range_dependencies_.GetMemoryUsage() + array_areas_.GetMemoryUsage();
+    for (auto& [anchor, array] : arrays_) {
+        usage.cached_values += array.values.capacity() * sizeof(FormulaInterface::Value);
+    }
+    for (auto& [col, index] : lookup_indexes_) {
+        usage.lookup_indexes += index.GetMemoryUsage();
+    }
+
+    for (auto& [pos, cell] : sheet_) {
+        cell->AddMemoryUsage(usage);
+    }
+    return usage;
+}
+
+void Sheet::StartRecording(ostream& output, bool anonymize) {
+    recorder_ = make_unique<TraceWriter>(output, anonymize);
+}
+
+void Sheet::StopRecording() {
+    recorder_.reset();
+}
+
+namespace {
+string CheckpointPath(const string& journal_path) {
+    return journal_path + ".checkpoint";
+}
+}  // namespace
+
+void Sheet::OpenJournal(const string& path, JournalOptions options) {
+    EnsureNoForks();
+    if (parent_) {
+        throw logic_error("A fork of a sheet cannot be journaled");
+    }
+    if (journal_) {
+        throw logic_error("The sheet already has a journal");
+    }
+    if (!sheet_.empty()) {
+        throw logic_error("A journal can only be opened on an empty sheet");
+    }
+
+    auto start = chrono::steady_clock::now();
+    JournalStats stats;
+    uint64_t checkpoint_lsn = 0;
+    JournalReadResult log;
+
+    // Массовая загрузка: правки ячеек копятся и ложатся в таблицу пачкой
+    // (LoadCells), пока запись журнала не сдвинет или не перенесёт ячейки.
+    // Формулы разбираются при первом вычислении, а Cell::Set не ищет циклы.
+    const bool lazy = lazy_formula_parsing_;
+    lazy_formula_parsing_ = true;
+    replaying_ = true;
+    vector<pair<Position, optional<string>>> texts;
+    try {
+        checkpoint_lsn = ReadCheckpoint(CheckpointPath(path), [&](Position pos, string text) {
+            texts.emplace_back(pos, move(text));
+            ++stats.checkpoint_cells;
+        }).value_or(0);
+        log = ReadJournal(path, checkpoint_lsn, [&](TraceRecord& record) {
+            if (record.op == TraceOp::SetCell) {
+                texts.emplace_back(record.pos, move(record.text));
+            } else if (record.op == TraceOp::ClearCell) {
+                texts.emplace_back(record.pos, nullopt);
+            } else {
+                LoadCells(texts);
+                ApplyJournalRecord(record);
+            }
+            ++stats.replayed_records;
+        });
+        LoadCells(texts);
+    } catch (...) {
+        lazy_formula_parsing_ = lazy;
+        replaying_ = false;
+        throw;
+    }
+    lazy_formula_parsing_ = lazy;
+    replaying_ = false;
+
+    journal_ = make_unique<JournalWriter>(path, log.valid_size, max(checkpoint_lsn, log.last_lsn) + 1, options);
+    stats.discarded_bytes = log.file_size - log.valid_size;
+    stats.recovery_time = chrono::steady_clock::now() - start;
+    journal_->SetRecoveryStats(stats);
+}
+
+void Sheet::LoadCells(vector<pair<Position, optional<string>>>& texts) {
+    // ячейки ложатся по порядку позиций, и позицию определяет последняя
+    // правка; контрольная точка и построчная загрузка уже упорядочены
+    vector<pair<Position, size_t>> order(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        order[i] = { texts[i].first, i };
+    }
+    if (!is_sorted(order.begin(), order.end())) {
+        sort(order.begin(), order.end());
+    }
+
+    sheet_.reserve(sheet_.size() + order.size());
+
+    struct Loaded {
+        Cell* cell;
+        vector<Position> referenced_cells_pos;
+        vector<Range> ranges;
+    };
+    vector<Loaded> loaded;
+    // Новые ячейки кэша не имеют, поэтому сбрасываются один раз только
+    // формулы прежних пачек, области которых их задели, и выводятся заново
+    // задетые массивы
+    vector<Cell*> stale;
+    vector<Cell*> anchors;
+    for (size_t i = 0; i < order.size(); ++i) {
+        if (i + 1 < order.size() && order[i + 1].first == order[i].first) {
+            continue;
+        }
+        auto& [pos, text] = texts[order[i].second];
+        // ячейки, которые уже есть в таблице (загруженные до сдвига и
+        // заглушки для ссылок), правятся обычным путём
+        if (FindCell(pos)) {
+            if (text) {
+                SetCell(pos, move(*text));
+            } else {
+                ClearCell(pos);
+            }
+            continue;
+        }
+        // пустой текст, как и в SetCell(), ячейки не создаёт
+        if (!text || text->empty()) {
+            continue;
+        }
+
+        Cell* cell = AddCell(pos);
+        AddToLayout(cell);
+        Loaded& entry = loaded.emplace_back(Loaded{ cell, {}, {} });
+        cell->Load(move(*text), entry.referenced_cells_pos, entry.ranges);
+        if (cell->GetArraySize()) {
+            anchors.push_back(cell);
+        }
+        range_dependencies_.AddDependents(pos, stale);
+        array_areas_.AddDependents(pos, anchors);
+        UpdatePrintableSize(pos);
+        EnforceMemoryBudget();
+    }
+    texts.clear();
+
+    // зависимости связываются, когда на месте все ячейки пачки: заглушки
+    // заводятся только для ссылок на пустые позиции
+    for (Loaded& entry : loaded) {
+        entry.cell->Link(entry.referenced_cells_pos, move(entry.ranges));
+    }
+    sort(stale.begin(), stale.end());
+    stale.erase(unique(stale.begin(), stale.end()), stale.end());
+    for (Cell* cell : stale) {
+        cell->ForceRecalculation();
+    }
+    if (!anchors.empty()) {
+        UpdateArrays(move(anchors));
+        // пустая ячейка в области выведенного массива - его элемент
+        for (const Loaded& entry : loaded) {
+            if (entry.cell->IsEmpty() && !entry.cell->IsSpill()) {
+                if (Cell* owner = FindArrayOwner(entry.cell->GetPosition())) {
+                    entry.cell->SpillFrom(owner);
+                }
+            }
+        }
+    }
+    EnforceMemoryBudget();
+}
+
+void Sheet::Checkpoint() {
+    if (!journal_) {
+        throw logic_error("The sheet has no journal");
+    }
+    journal_->Sync();
+
+    vector<Position> cells;
+    cells.reserve(sheet_.size());
+    // элементы массивов выводятся заново вместе с формулами
+    for (auto& [pos, cell] : sheet_) {
+        if (!cell->IsEmpty() && !cell->IsSpill()) {
+            cells.push_back(pos);
+        }
+    }
+    sort(cells.begin(), cells.end());
+
+    CheckpointWriter writer(CheckpointPath(journal_->GetPath()), journal_->GetLastLsn());
+    for (Position pos : cells) {
+        writer.Add(pos, FindCell(pos)->GetTextView());
+        EnforceMemoryBudget();
+    }
+    writer.Commit();
+
+    // сбой до очистки журнала не страшен: записи, вошедшие в контрольную
+    // точку, при восстановлении пропускаются по номеру
+    journal_->Reset();
+}
+
+void Sheet::SyncJournal() {
+    if (journal_) {
+        journal_->Sync();
+    }
+}
+
+void Sheet::CloseJournal() {
+    journal_.reset();
+}
+
+JournalStats Sheet::GetJournalStats() const {
+    return journal_ ? journal_->GetStats() : JournalStats{};
+}
+
+namespace {
+// Запись области в файле подкачки: для каждой вытесненной ячейки строка,
+// столбец, длина содержимого (по 4 байта) и само содержимое
+void AppendInt(string& out, uint32_t value) {
+    char bytes[sizeof(value)];
+    memcpy(bytes, &value, sizeof(value));
+    out.append(bytes, sizeof(bytes));
+}
+
+uint32_t ReadInt(string_view data, size_t& offset) {
+    if (offset + sizeof(uint32_t) > data.size()) {
+        throw SpillFileException("Malformed spilled region");
+    }
+    uint32_t value;
+    memcpy(&value, data.data() + offset, sizeof(value));
+    offset += sizeof(value);
+    return value;
+}
+}  // namespace
+
+void Sheet::SetResultCacheCapacity(size_t capacity) {
+    EnsureNoForks();
+    results_.SetCapacity(capacity);
+}
+
+ResultCacheStats Sheet::GetResultCacheStats() const {
+    return results_.GetStats();
+}
+
+void Sheet::SetMemoryBudget(size_t bytes, string spill_path) {
+    EnsureNoForks();
+    if (parent_ && bytes) {
+        throw logic_error("A fork of a sheet cannot page its cells");
+    }
+    if (bytes == 0) {
+        PageInAll();
+        spill_file_.reset();
+        memory_budget_ = 0;
+        return;
+    }
+
+    if (!spill_file_) {
+        spill_file_ = make_unique<SpillFile>(move(spill_path));
+        memory_budget_ = bytes;
+        CountPayloads();
+    }
+    memory_budget_ = bytes;
+    EnforceMemoryBudget();
+}
+
+Sheet::PagingStats Sheet::GetPagingStats() const {
+    PagingStats stats = paging_stats_;
+    stats.paged_out_regions = 0;
+    for (auto& [key, region] : regions_) {
+        stats.paged_out_regions += region.spilled.has_value();
+    }
+    stats.spill_file_size = spill_file_ ? spill_file_->GetFileSize() : 0;
+    return stats;
+}
+
+void Sheet::PageInAll() {
+    for (auto& [key, region] : regions_) {
+        if (region.spilled) {
+            FaultIn(region.origin);
+        }
+    }
+    regions_.clear();
+    lru_.clear();
+    paging_stats_.resident_bytes = 0;
+}
+
+void Sheet::CountPayloads() {
+    for (auto& [pos, cell] : sheet_) {
+        UpdatePayloadSize(pos, 0, cell->GetPayloadSize());
+    }
+}
+
+uint64_t Sheet::RegionKey(Position pos) {
+    return Position{ pos.row / REGION_ROWS, pos.col / REGION_COLS }.Pack();
+}
+
+Sheet::Region& Sheet::TouchRegion(Position pos) const {
+    Region& region = regions_[RegionKey(pos)];
+    region.origin = { pos.row / REGION_ROWS * REGION_ROWS, pos.col / REGION_COLS * REGION_COLS };
+
+    if (region.in_lru) {
+        lru_.splice(lru_.begin(), lru_, region.lru);
+    } else {
+        region.lru = lru_.insert(lru_.begin(), RegionKey(pos));
+        region.in_lru = true;
+    }
+    return region;
+}
+
+void Sheet::UpdatePayloadSize(Position pos, size_t old_size, size_t new_size) {
+    // область вытесняется одной записью, поэтому новую ячейку в вытесненной
+    // области можно добавить только после её загрузки
+    Region& region = FaultIn(pos);
+    // оценка: разобранное позже дерево формулы сюда не попадает
+    size_t removed = min(old_size, region.bytes);
+    region.bytes = region.bytes - removed + new_size;
+    paging_stats_.resident_bytes = paging_stats_.resident_bytes - min(removed, paging_stats_.resident_bytes) + new_size;
+}
+
+Sheet::Region& Sheet::FaultIn(Position pos) const {
+    Region& region = TouchRegion(pos);
+    if (!region.spilled) {
+        return region;
+    }
+
+    string data = spill_file_->Take(*region.spilled);
+    region.spilled.reset();
+
+    size_t offset = 0;
+    while (offset < data.size()) {
+        Position cell_pos;
+        cell_pos.row = static_cast<int>(ReadInt(data, offset));
+        cell_pos.col = static_cast<int>(ReadInt(data, offset));
+        size_t size = ReadInt(data, offset);
+        if (offset + size > data.size()) {
+            throw SpillFileException("Malformed spilled region");
+        }
+
+        // вытесненные ячейки не удаляются: ClearCell сначала загружает ячейку
+        Cell* cell = sheet_.at(cell_pos).get();
+        cell->PageIn(string_view(data).substr(offset, size));
+        region.bytes += cell->GetPayloadSize();
+        offset += size;
+    }
+
+    paging_stats_.resident_bytes += region.bytes;
+    ++paging_stats_.page_ins;
+    return region;
+}
+
+void Sheet::PageOutRegion(uint64_t key) const {
+    Region& region = regions_.at(key);
+    string data;
+    string payload;
+
+    int last_row = min(region.origin.row + REGION_ROWS, Position::MAX_ROWS);
+    int last_col = min(region.origin.col + REGION_COLS, Position::MAX_COLS);
+    for (int row = region.origin.row; row < last_row; ++row) {
+        for (int col = region.origin.col; col < last_col; ++col) {
+            Cell* cell = FindCell({ row, col });
+            payload.clear();
+            if (cell && cell->PageOut(payload)) {
+                AppendInt(data, row);
+                AppendInt(data, col);
+                AppendInt(data, static_cast<uint32_t>(payload.size()));
+                data += payload;
+            }
+        }
+    }
+
+    paging_stats_.resident_bytes -= min(region.bytes, paging_stats_.resident_bytes);
+    lru_.erase(region.lru);
+
+    if (data.empty()) {
+        regions_.erase(key);
+        return;
+    }
+
+    region.bytes = 0;
+    region.in_lru = false;
+    region.spilled = spill_file_->Write(data);
+    ++paging_stats_.page_outs;
+}
+
+void Sheet::EnforceMemoryBudget() const {
+    if (memory_budget_ == 0) {
+        return;
+    }
+    // последняя использованная область остаётся в памяти в любом случае
+    while (paging_stats_.resident_bytes > memory_budget_ && lru_.size() > 1) {
+        PageOutRegion(lru_.back());
+    }
+}
+
+void Sheet::SetProfiling(bool enabled) {
+    profiling_ = enabled;
+}
+
+void Sheet::ClearProfile() {
+    profiler_.Clear();
+}
+
+vector<Sheet::ProfileEntry> Sheet::ProfileReport(size_t n) const {
+    // цепочка не может быть длиннее числа вычислявшихся ячеек, но отчёт
+    // должен оставаться читаемым
+    const size_t MAX_PATH_LENGTH = 32;
+    vector<ProfileEntry> result;
+
+    for (CellProfile& profile : profiler_.GetTop(n)) {
+        ProfileEntry& entry = result.emplace_back();
+        entry.profile = profile;
+        entry.path.push_back(profile.pos);
+
+        while (entry.path.size() < MAX_PATH_LENGTH) {
+            auto it = sheet_.find(entry.path.back());
+            if (it == sheet_.end()) {
+                break;
+            }
+
+            const CellProfile* costliest = nullptr;
+            for (Position ref : it->second->GetReferencedCells()) {
+                const CellProfile* ref_profile = profiler_.Find(ref);
+                if (ref_profile && (!costliest || ref_profile->exclusive > costliest->exclusive)) {
+                    costliest = ref_profile;
+                }
+            }
+            if (!costliest) {
+                break;
+            }
+            entry.path.push_back(costliest->pos);
+        }
+    }
+    return result;
+}
+
+void Sheet::RecordOperation(TraceOp op, Position pos, string_view text) const {
+    if (recorder_) {
+        recorder_->Write(op, pos, text);
+    }
+}
+
+void Sheet::RecordShift(TraceOp op, int first, int count) const {
+    if (recorder_) {
+        recorder_->WriteShift(op, first, count);
+    }
+}
+
+void Sheet::RecordRange(TraceOp op, const Range& range, Position target) const {
+    if (recorder_) {
+        recorder_->WriteRange(op, range, target);
+    }
+}
+
+void Sheet::JournalOperation(TraceOp op, Position pos, string_view text) {
+    if (journal_) {
+        journal_->Write(op, pos, text);
+    }
+}
+
+void Sheet::JournalShift(TraceOp op, int first, int count) {
+    if (journal_) {
+        journal_->WriteShift(op, first, count);
+    }
+}
+
+void Sheet::JournalRange(TraceOp op, const Range& range, Position target) {
+    if (journal_) {
+        journal_->WriteRange(op, range, target);
+    }
+}
+
+void Sheet::ApplyJournalRecord(TraceRecord& record) {
+    switch (record.op) {
+        case TraceOp::SetCell:
+            SetCell(record.pos, move(record.text));
+            break;
+        case TraceOp::ClearCell:
+            ClearCell(record.pos);
+            break;
+        case TraceOp::InsertRows:
+            InsertRows(record.first, record.count);
+            break;
+        case TraceOp::DeleteRows:
+            DeleteRows(record.first, record.count);
+            break;
+        case TraceOp::InsertColumns:
+            InsertColumns(record.first, record.count);
+            break;
+        case TraceOp::DeleteColumns:
+            DeleteColumns(record.first, record.count);
+            break;
+        case TraceOp::ClearRange:
+            ClearRange(record.range);
+            break;
+        case TraceOp::CopyRange:
+            CopyRange(record.range, record.pos);
+            break;
+        case TraceOp::MoveRange:
+            MoveRange(record.range, record.pos);
+            break;
+        default:
+            break;
+    }
+}
+
+uint64_t Sheet::NextRevision() {
+    return ++revision_;
+}
+
+uint64_t Sheet::GetRevision() const {
+    return revision_;
+}
+
+void Sheet::Compact() {
+    EnsureNoForks();
+    for (auto it = sheet_.begin(); it != sheet_.end();) {
+        if (it->second->IsPlaceholder() && !(parent_ && FindParentCell(it->first))) {
+            it = EraseCell(it);
+        } else {
+            ++it;
+        }
+    }
+
+    sheet_.rehash(0);
+    for (auto& [pos, cell] : sheet_) {
+        cell->CompactDependencies();
+    }
+    numeric_columns_.Compact();
+    changed_cells_.rehash(0);
+}
+
+Cell* Sheet::CreatePlaceholder(Position pos) {
+    Cell* owner = FindArrayOwner(pos);
+    if (parent_ && !owner) {
+        if (Cell* cell = ForkCell(pos)) {
+            return cell;
+        }
+    }
+    Cell* cell = AddCell(pos);
+    AddToLayout(cell);
+    // элемент выведенного массива получает ячейку при первой ссылке
+    if (owner) {
+        cell->SpillFrom(owner);
+    } else {
+        numeric_columns_.Store(pos, ""sv);
+    }
+    return cell;
+}
+
+void Sheet::ReleaseCell(Position pos) {
+    if (parent_ && FindParentCell(pos)) {
+        return;
+    }
+    EraseCell(sheet_.find(pos));
+}
+
+void Sheet::ShrinkPrintableSize(Position pos) {
+    if (pos.row + 1 == printable_size_.rows || pos.col + 1 == printable_size_.cols) {
+        printable_size_stale_ = true;
+    }
+}
+
+void Sheet::RecomputePrintableSize() const {
+    printable_size_ = { 0, 0 };
+    printable_size_stale_ = false;
+
+    for (auto& cell : sheet_) {
+        if (!cell.second->IsEmpty()) {
+            UpdatePrintableSize(cell.first);
+        }
+    }
+    for (auto& [anchor, array] : arrays_) {
+        if (array.active) {
+            UpdatePrintableSize(array.area.last);
+        }
+    }
+    if (parent_) {
+        // граница родителя заморожена: по каждому его столбцу ищется последняя
+        // строка, которую ветка не заменила своей ячейкой, окнами сверху вниз -
+        // обычно хватает одного окна, и обход не зависит от числа ячеек родителя
+        Size bound = parent_->printable_size_;
+        for (int col : parent_->occupancy_.GetColumns()) {
+            if (col >= bound.cols) {
+                break;
+            }
+            for (int last = bound.rows - 1; last >= 0; last -= OccupancyIndex::BLOCK_ROWS) {
+                vector<int> rows = parent_->occupancy_.GetRows(col, max(0, last - OccupancyIndex::BLOCK_ROWS + 1), last);
+                auto visible = find_if(rows.rbegin(), rows.rend(), [&](int row) {
+                    const Cell* cell = parent_->FindCell({ row, col });
+                    return !cell->IsEmpty() && !sheet_.count({ row, col });
+                });
+                if (visible != rows.rend()) {
+                    UpdatePrintableSize({ *visible, col });
+                    break;
+                }
+            }
+        }
+        for (auto& [anchor, array] : parent_->arrays_) {
+            if (array.active && IsInherited(*anchor)) {
+                UpdatePrintableSize(array.area.last);
+            }
+        }
+    }
+}
+
+void Sheet::UpdatePrintableSize(Position pos) const {
+    printable_size_.rows = max(pos.row + 1, printable_size_.rows);
+    printable_size_.cols = max(pos.col + 1, printable_size_.cols);
+}
+
+Cell* Sheet::FindCell(Position pos) const {
+    auto it = sheet_.find(pos);
+    return it != sheet_.end() ? it->second.get() : nullptr;
+}
+
+Cell* Sheet::AddCell(Position pos) {
+    Cell* cell = sheet_.emplace(pos, make_unique<Cell>(*this, pos)).first->second.get();
+    occupancy_.Add(pos);
+    return cell;
+}
+
+Sheet::CellTable::iterator Sheet::EraseCell(CellTable::iterator it) {
+    numeric_columns_.Reset(it->first);
+    UnmarkStale(it->first);
+    occupancy_.Remove(it->first);
+    if (!layout_.empty()) {
+        layout_erased_.insert(it->second.get());
+        if (layout_erased_.size() > layout_.size() / 2) {
+            CompactLayout();
+        }
+    }
+    return sheet_.erase(it);
+}
+
+void Sheet::AddToLayout(Cell* cell) {
+    if (layout_.empty()) {
+        return;
+    }
+    // адрес удалённой ячейки мог достаться новой
+    if (layout_erased_.count(cell)) {
+        CompactLayout();
+    }
+    layout_.push_back(cell);
+}
+
+void Sheet::CompactLayout() {
+    layout_.erase(remove_if(layout_.begin(), layout_.end(), [this](const Cell* cell) {
+        return layout_erased_.count(cell) > 0;
+    }), layout_.end());
+    layout_erased_.clear();
+}
+
+void Sheet::ForEachCell(const Range& area, const function<void(Cell*)>& func) const {
+    // обход по индексу занятости стоит столько, сколько в области ячеек,
+    // а не позиций; func может удалять ячейки, поэтому строки столбца
+    // собираются до вызовов
+    for (int col = area.first.col; col <= area.last.col; ++col) {
+        for (int row : occupancy_.GetRows(col, area.first.row, area.last.row)) {
+            if (Cell* cell = FindCell({ row, col })) {
+                func(cell);
+            }
+        }
+    }
+}
+
+const CellInterface* Sheet::FindCellInterfacePtr(Position pos) const {
+    EnsureValidPosition(pos);
+
+    auto it = sheet_.find(pos);
+    if (it != sheet_.end()) {
+        return it->second.get();
+    }
+    if (FindArrayOwner(pos)) {
+        return const_cast<Sheet*>(this)->CreatePlaceholder(pos);
+    }
+    // ячейка родителя получает в ветке представителя: сама она вычислялась
+    // бы в родителе, который ветки читают одновременно
+    return parent_ ? const_cast<Sheet*>(this)->ForkCell(pos) : nullptr;
+}
+
+void Sheet::EnsureNoForks() const {
+    if (forks_ > 0) {
+        throw logic_error("A sheet cannot be changed while it has forks");
+    }
+}
+
+const Cell* Sheet::FindParentCell(Position pos) const {
+    const Cell* cell = parent_->FindCell(pos);
+    return cell && !cell->IsEmpty() ? cell : nullptr;
+}
+
+string Sheet::GetSharedText(const Cell& cell) const {
+    lock_guard lock(fork_mutex_);
+    return cell.GetText();
+}
+
+vector<Position> Sheet::GetSharedReferences(const Cell& cell) const {
+    lock_guard lock(fork_mutex_);
+    return cell.GetReferencedCells();
+}
+
+unique_ptr<FormulaInterface> Sheet::TranslateShared(const Cell& cell, int rows, int cols) const {
+    lock_guard lock(fork_mutex_);
+    return cell.TranslateFormula(rows, cols);
+}
+
+Cell* Sheet::ForkCell(Position pos) {
+    const Cell* source = FindParentCell(pos);
+    if (!source) {
+        // элемент массива родителя без своей ячейки: массив выводится в
+        // ветке заново, и элемент получает ячейку уже в ветке
+        const Cell* anchor = FindParentArray(pos);
+        if (!anchor) {
+            return nullptr;
+        }
+        ForkArray(*anchor);
+        return FindArrayOwner(pos) ? CreatePlaceholder(pos) : nullptr;
+    }
+
+    // значение вытеснено из кэша значений формул родителя - формула
+    // вычисляется в ветке; формула-массив - вместе со своими элементами
+    if (!source->HasCache() && parent_->arrays_.count(source)) {
+        ForkArray(*source);
+        return FindCell(pos);
+    }
+    Cell* cell = AddCell(pos);
+    if (source->HasCache()) {
+        cell->ShareFrom(*source);
+    } else {
+        cell->Set(parent_->GetSharedText(*source), true);
+        MarkForked(pos);
+    }
+    return cell;
+}
+
+void Sheet::ForkArray(const Cell& source) {
+    Position at = source.GetPosition();
+    Cell* cell = FindCell(at);
+    if (!cell) {
+        cell = AddCell(at);
+    }
+    cell->Set(parent_->GetSharedText(source), true);
+    MarkForked(at);
+    // формулы родителя, читающие элементы, копируются вместе с массивом
+    ForkDependents(at);
+    UpdateArray(cell);
+}
+
+const Cell* Sheet::FindParentArray(Position pos) const {
+    const Cell* anchor = parent_->FindArrayOwner(pos);
+    return anchor && IsInherited(*anchor) ? anchor : nullptr;
+}
+
+bool Sheet::IsInherited(const Cell& anchor) const {
+    const Cell* cell = FindCell(anchor.GetPosition());
+    return !cell || cell->IsShared();
+}
+
+optional<CellInterface::ValueView> Sheet::ReadParentValue(Position pos) const {
+    const Cell* source = FindParentCell(pos);
+    if (!source) {
+        // значения выведенных массивов родитель вычислил до ветвления
+        if (const Cell* anchor = FindParentArray(pos)) {
+            return ToValueView(parent_->PeekArrayElement(parent_->arrays_.at(anchor), pos));
+        }
+        return nullopt;
+    }
+    if (source->HasCache()) {
+        return source->PeekValue();
+    }
+    return const_cast<Sheet*>(this)->ForkCell(pos)->ReadValue();
+}
+
+void Sheet::ForkDependents(Position pos) {
+    // Формулы родителя, которые зависят от pos прямо или через другие
+    // формулы, становятся в ветке копиями и вычисляются заново. Обход
+    // останавливается на ячейках, которые ветка уже заменила: их зависимые
+    // скопированы тогда же.
+    vector<Cell*> stack;
+    unordered_set<const Cell*> visited;
+    auto add_dependents = [&](Position from, const Cell* source) {
+        unordered_set<Cell*> dependents;
+        if (source) {
+            source->AddDependentsTo(dependents);
+        }
+        vector<Cell*> ranged;
+        parent_->range_dependencies_.AddDependents(from, ranged);
+        // у массива - и формулы с областями, читающие его элементы
+        if (const Range* area = parent_->FindActiveArea(source)) {
+            parent_->range_dependencies_.AddDependents(*area, ranged);
+        }
+        dependents.insert(ranged.begin(), ranged.end());
+
+        for (Cell* dependent : dependents) {
+            if (visited.insert(dependent).second) {
+                stack.push_back(dependent);
+            }
+        }
+    };
+
+    add_dependents(pos, parent_->FindCell(pos));
+    // формулы-массивы, в области которых pos, выводятся в ветке заново: их
+    // элементы скопируются как зависимые
+    vector<Cell*> anchors;
+    parent_->array_areas_.AddDependents(pos, anchors);
+    for (Cell* anchor : anchors) {
+        if (visited.insert(anchor).second) {
+            stack.push_back(anchor);
+        }
+    }
+
+    vector<Cell*> arrays;
+    while (!stack.empty()) {
+        const Cell* source = stack.back();
+        stack.pop_back();
+
+        Position at = source->GetPosition();
+        Cell* cell = FindCell(at);
+        if (cell && !cell->IsShared()) {
+            continue;
+        }
+        if (!cell) {
+            cell = AddCell(at);
+        }
+        cell->Set(parent_->GetSharedText(*source), true);
+        MarkForked(at);
+        add_dependents(at, source);
+        if (parent_->arrays_.count(source)) {
+            arrays.push_back(cell);
+        }
+    }
+    UpdateArrays(move(arrays));
+}
+
+void Sheet::MarkForked(Position pos) {
+    forked_rows_[pos.col].insert(pos.row);
+    if (!lookup_indexes_.empty()) {
+        auto it = lookup_indexes_.find(pos.col);
+        if (it != lookup_indexes_.end()) {
+            it->second.MarkStale(pos.row);
+        }
+    }
+}
+
+void Sheet::PrintContext(ostream& output, string context) const {
+    Size size = GetPrintableSize();
+
+    for (int row = 0; row < size.rows; ++ row) {
+        for(int col = 0; col < size.cols; ++col) {
+            auto it = sheet_.find({ row, col });
+            
+            if (it != sheet_.end()) {
+                const Cell* cell = it->second.get();
+                if (context == "Values"s) {
+                    visit([&](auto&& v) {
+                        output << v;
+                    }, cell->ReadValue());
+                } else {
+                    output << cell->GetTextView();
+                }
+            } else if (context == "Values"s) {
+                // элемент массива без своей ячейки или ячейка родителя
+                if (auto value = ReadVacantValue({ row, col })) {
+                    visit([&](auto&& v) {
+                        output << v;
+                    }, *value);
+                }
+            } else if (parent_) {
+                if (const Cell* source = FindParentCell({ row, col })) {
+                    output << parent_->GetSharedText(*source);
                 }
             }
 
@@ -108,6 +2734,8 @@ void Sheet::PrintContext(ostream& output, string context) const {
             }
         }
         output << "\n";
+        // напечатанные строки можно вытеснять, не дожидаясь конца печати
+        EnforceMemoryBudget();
     }
 }
 
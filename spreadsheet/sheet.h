@@ -1,20 +1,67 @@
 #pragma once
 
 #include "cell.h"
+#include "columnar_export.h"
 #include "common.h"
+#include "journal.h"
+#include "lookup_index.h"
+#include "numeric_columns.h"
+#include "occupancy_index.h"
+#include "profiler.h"
+#include "range_dependencies.h"
+#include "result_cache.h"
+#include "spill_file.h"
+#include "string_pool.h"
+#include "trace.h"
 
+#include <atomic>
 #include <functional>
+#include <iosfwd>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 struct SheetHash {
     size_t operator()(Position pos) const;
 
-    std::hash<int> hasher_;
+    std::hash<uint64_t> hasher_;
 };
 
 class Sheet : public SheetInterface {
 public:
+    Sheet();
     ~Sheet();
 
+    // Ветка таблицы для расчёта сценариев "что если". Ветка видит все ячейки
+    // этой таблицы, а хранит только своё: изменённые в ней ячейки, копии
+    // формул, которые от них зависят (они вычисляются в ветке заново), и
+    // представителей ячеек, которые ветка прочитала, - их значения берутся
+    // из кэша таблицы без копирования. Поэтому ветка стоит пропорционально
+    // тому, что в ней изменили, а не размеру таблицы.
+    // Fork() вычисляет устаревшие формулы таблицы, и пока живы её ветки,
+    // таблица не меняется: правки бросают std::logic_error. Ветки разных
+    // потоков читают таблицу одновременно; сама таблица в это время может
+    // только порождать новые ветки. Таблица должна пережить свои ветки.
+    // Ветку нельзя ветвить, в ней нельзя вставлять и удалять строки и
+    // столбцы; таблица с подкачкой (SetMemoryBudget) не ветвится.
+    std::unique_ptr<Sheet> Fork() const;
+
+    // Сценарий - тексты ячеек, которые он задаёт. RunScenarios() возвращает
+    // для каждого сценария значения ячеек outputs в ветке с его входами.
+    // Сценарии считаются в threads потоках (0 - по числу ядер); ошибка в
+    // сценарии (некорректная формула, цикл) прерывает расчёт и бросается
+    // из RunScenarios().
+    using ScenarioInputs = std::vector<std::pair<Position, std::string>>;
+    std::vector<std::vector<CellInterface::Value>> RunScenarios(const std::vector<ScenarioInputs>& scenarios,
+                                                                const std::vector<Position>& outputs,
+                                                                size_t threads = 0) const;
+
     void SetCell(Position pos, std::string text) override;
 
     const CellInterface* GetCell(Position pos) const override;
@@ -26,11 +73,463 @@ public:
 
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
+
+    // Читает из столбцового хранилища числовых значений (numeric_columns.h),
+    // к самой ячейке обращается, только если значение там неизвестно
+    std::variant<double, FormulaError> GetNumericValue(Position pos) const override;
+
+    std::variant<double, std::string, FormulaError> GetLookupKey(Position pos) const override;
+
+    // Поиск идёт по индексу столбца (lookup_index.h), который строится при
+    // первом поиске в столбце одним проходом по таблице, а дальше
+    // обновляется при каждом изменении значения его ячейки. Формулы столбца,
+    // устаревшие с прошлого поиска, перед поиском в их строках вычисляются.
+    std::optional<int> Lookup(const LookupKey& key, Range column, LookupMatch match) const override;
+
+    // Формула-массив (=A1:A10*B1:B10, см. FormulaInterface::GetArraySize)
+    // выводит результат в область своего размера, которая начинается с её
+    // ячейки: остальные ячейки области показывают элементы результата, хотя
+    // своего текста у них нет (GetText() - пустая строка), и формулы читают
+    // их как обычные ячейки. Если в области есть непустая ячейка, область
+    // выходит за край таблицы или пересекает область другого выведенного
+    // массива, результат не выводится, а значение формулы - #SPILL!; когда
+    // область освобождается, массив выводится снова. Из массивов, претендующих
+    // на одни ячейки, область получает тот, что выведен раньше. Элементы,
+    // все входы которых - числа, вычисляются вместе (см. vectorized.h),
+    // остальные - по одному. Результат хранится одним массивом значений у
+    // формулы: разбор, ячейка и зависимости - одни на всю область, а
+    // элемент получает свою ячейку, только когда на него ссылается формула
+    // или его запрашивают через GetCell().
+
+    // Вставка count строк (столбцов) перед строкой (столбцом) before и
+    // удаление count строк (столбцов), начиная с first. Ячейки дальше по
+    // таблице сдвигаются вместе со значениями и зависимостями, ссылки формул
+    // на них переписываются на месте, без повторного разбора; ссылки на
+    // удалённые ячейки становятся #REF!. Переписываются только формулы,
+    // ссылающиеся на сдвинутые или удалённые ячейки или на области,
+    // задевающие сдвигаемую полосу; ячейки полосы находятся по индексу
+    // позиций, а не обходом таблицы, и при подкачке загружаются только
+    // области полосы. Вставка, которая вытолкнула бы за край таблицы
+    // непустую ячейку, бросает InvalidPositionException и ничего не меняет.
+    void InsertRows(int before, int count = 1);
+    void DeleteRows(int first, int count = 1);
+    void InsertColumns(int before, int count = 1);
+    void DeleteColumns(int first, int count = 1);
+
+    // Операции с областью целиком. ClearRange() очищает все ячейки области
+    // (элементы выведенных массивов остаются элементами). CopyRange()
+    // копирует область source так, чтобы её первая ячейка оказалась в
+    // target: ячейки с текстом копируются, остальные ячейки новой области
+    // очищаются; ссылки скопированных формул сдвигаются вместе с ними, без
+    // повторного разбора (FormulaInterface::Translate), а ушедшие за край
+    // таблицы становятся #REF!. MoveRange() делает то же и очищает ячейки
+    // source, не попавшие в новую область; ссылки других формул на
+    // перенесённые ячейки не меняются. Области могут пересекаться.
+    // Зависимости обновляются при записи каждой ячейки, а формулы-массивы,
+    // журналы и граница печати - один раз на операцию. Новая область,
+    // выходящая за край таблицы, бросает InvalidPositionException;
+    // скопированная формула, замыкающая цикл, - CircularDependencyException,
+    // и тогда таблица остаётся прежней.
+    void ClearRange(Range area);
+    void CopyRange(Range source, Position target);
+    void MoveRange(Range source, Position target);
+
+    // Режим отложенного разбора формул для массовой загрузки: формула
+    // разбирается при первом вычислении или запросе её текста/ссылок.
+    // Синтаксически некорректная формула в этом режиме не бросает
+    // FormulaException, а вычисляется в #VALUE!.
+    void SetLazyFormulaParsing(bool enabled);
+
+    // Отслеживание изменений вычисленных значений. После включения каждая
+    // правка фиксирует ячейки, чей кэш был сброшен, вместе с их прежними
+    // значениями. DrainChangedCells() возвращает (по возрастанию) позиции,
+    // значение которых действительно изменилось с прошлого вызова, и очищает
+    // очередь. Объём работы пропорционален числу затронутых ячеек, а не
+    // размеру таблицы. Включение вычисляет все формулы один раз, чтобы
+    // зафиксировать исходные значения.
+    void EnableChangeTracking();
+    std::vector<Position> DrainChangedCells();
+
+    // Вычисляет все устаревшие формулы. Идущие подряд в столбце формулы одной
+    // формы (=A1*B1+C1, =A2*B2+C2, ...) вычисляются вместе над собранными
+    // столбцами входов (см. vectorized.h), остальные - по одной.
+    // Вызывается из PrintValues().
+    void Recalculate() const;
+
+    // Раскладывает ячейки в порядке вычисления (входы раньше зависящих от
+    // них формул): полный пересчёт обходит их в этом порядке, формулы
+    // заново размещаются в памяти подряд в том же порядке, а слоты их
+    // значений в кэше значений формул перенумеровываются по нему. Объекты
+    // Cell остаются на месте: на них указывают зависимости и привязанные
+    // ссылки формул. Порядок дополняется новыми ячейками и забывается при
+    // удалении ячейки. Полезно после массовой загрузки; ветки раскладку не
+    // меняют.
+    void OptimizeLayout();
+
+    // Выгружает вычисленные значения области печати в файл path в формате
+    // Arrow IPC (columnar_export.h), по столбцу Arrow на столбец таблицы (A,
+    // B, ...). Столбец получает тип Float64, если в нём есть числа и нет ни
+    // ошибок формул, ни текста, который формулы не читают как число; иначе
+    // тип Utf8, где числа записаны так же, как их печатает PrintValues(), а
+    // ошибки - своим текстом. Пустые ячейки - null.
+    // Строки пишутся пакетами, поэтому память выгрузки не зависит от размера
+    // таблицы. Ошибка записи бросает ColumnarExportException.
+    void ExportColumnar(const std::string& path) const;
+
+    // Подсчитывает память, занимаемую таблицей. Хеш-таблица ячеек и множества
+    // зависимостей учитываются аллокатором при каждом выделении, остальное -
+    // обходом ячеек, поэтому вызов стоит O(числа ячеек).
+    MemoryUsage GetMemoryUsage() const;
+
+    // Удаляет пустые ячейки, на которые никто не ссылается, и ужимает
+    // хеш-таблицы и хранилище чисел под текущее число ячеек. Пустые ячейки
+    // (заглушки для ссылок формул, очищенные и заданные пустым текстом)
+    // удаляются и без этого - как только на них никто не ссылается;
+    // Compact() нужен после массовых удалений, чтобы вернуть память корзин.
+    void Compact();
+
+    // Журнал операций (trace.h) для воспроизведения нагрузки программой
+    // spreadsheet_replay. Пишутся правки ячеек и областей, чтения значений ячеек
+    // (GetValue, GetValueView) и Print*, каждая с отметкой времени. При
+    // anonymize текст ячеек обезличивается (см. AnonymizeText). Поток должен
+    // жить до StopRecording() или уничтожения таблицы.
+    void StartRecording(std::ostream& output, bool anonymize = false);
+    void StopRecording();
+
+    // Журнал предзаписи (journal.h) для восстановления после сбоя. Успешные
+    // правки ячеек и областей и вставки и удаления строк и столбцов дописываются
+    // в журнал path и попадают на диск группами (JournalOptions).
+    // OpenJournal() открывается на пустой таблице и сначала восстанавливает
+    // её: загружает контрольную точку path + ".checkpoint" и применяет
+    // записи журнала после неё. Восстановление идёт массовой загрузкой -
+    // ячейки ложатся в таблицу пачками между сдвигами и переносами, их
+    // зависимости связываются после пачки, формулы разбираются отложенно,
+    // циклы не проверяются (в журнале только правки, которые прошли
+    // проверку), и ничего не вычисляется. Оборванный при сбое хвост журнала
+    // отбрасывается.
+    // Checkpoint() записывает тексты всех ячеек в новую контрольную точку и
+    // очищает журнал, чтобы восстановление не росло вместе с ним.
+    // SyncJournal() дожидается записи на диск всех правок; CloseJournal()
+    // делает то же и закрывает журнал. Какие правки переживут сбой без них,
+    // описано у JournalOptions. Ветку таблицы журналировать нельзя.
+    void OpenJournal(const std::string& path, JournalOptions options = {});
+    void Checkpoint();
+    void SyncJournal();
+    void CloseJournal();
+    JournalStats GetJournalStats() const;
+
+    // Профилирование вычислений формул: по каждой ячейке считаются число
+    // вычислений, время с вложенными вычислениями других формул и без них и
+    // число прочитанных входов. Стоит два обращения к часам на вычисление.
+    // Собранное сохраняется и после выключения, до ClearProfile().
+    void SetProfiling(bool enabled);
+    void ClearProfile();
+
+    struct ProfileEntry {
+        CellProfile profile;
+        // Цепочка самых дорогих входов: ячейка, та из её ссылок, что дороже
+        // всех вычислялась, её самая дорогая ссылка и так далее, пока ссылки
+        // вычислялись
+        std::vector<Position> path;
+    };
+    // n самых дорогих по собственному времени ячеек
+    std::vector<ProfileEntry> ProfileReport(size_t n) const;
+
+    // Подкачка. Содержимое ячеек (текст, выражения и деревья формул) держится
+    // в памяти в пределах примерно bytes байт: области таблицы по
+    // REGION_ROWS x REGION_COLS ячеек, к которым дольше всего не обращались,
+    // вытесняются в файл spill_path (пустой путь - временный файл) и
+    // загружаются обратно, когда их содержимое понадобится - при чтении
+    // ячейки, вычислении формулы или печати. Объекты ячеек, зависимости и
+    // значения формул остаются в памяти, поэтому сброс кэша и вычисление
+    // зависимых формул вытесненные области не загружают.
+    // Вытеснение происходит только в меняющих таблицу вызовах (SetCell,
+    // ClearCell, операциях над областями) и в Print*, поэтому строки из
+    // GetValueView()/GetTextView() действительны до следующего такого вызова;
+    // чтение через GetCell() ничего не вытесняет. 0 - выключить подкачку и
+    // всё загрузить.
+    void SetMemoryBudget(size_t bytes, std::string spill_path = {});
+
+    struct PagingStats {
+        size_t resident_bytes = 0;     // оценка объёма содержимого в памяти
+        size_t paged_out_regions = 0;  // сейчас в файле подкачки
+        size_t page_outs = 0;          // вытеснений областей за всё время
+        size_t page_ins = 0;           // загрузок областей за всё время
+        uint64_t spill_file_size = 0;
+    };
+    PagingStats GetPagingStats() const;
+
+    // Ограничение числа хранимых значений формул. Сверх capacity значения
+    // вытесняются - дольше хранятся те, что дольше вычислялись и к которым
+    // недавно обращались (см. ResultCache), - и вычисляются заново при
+    // следующем чтении. Время вычисления формул измеряется, только пока
+    // ограничение задано. 0 - хранить все значения.
+    void SetResultCacheCapacity(size_t capacity);
+    ResultCacheStats GetResultCacheStats() const;
+
+    static constexpr int REGION_ROWS = 256;
+    static constexpr int REGION_COLS = 16;
 private:
-    std::unordered_map<Position, std::unique_ptr<Cell>, SheetHash> sheet_;
-    Size printable_size_;
+    friend class Cell;
+
+    // счётчики CountingAllocator; объявлены раньше контейнеров, которые их используют
+    size_t cell_table_memory_ = 0;
+    size_t dependencies_memory_ = 0;
+    // текст ячеек; объявлен раньше таблицы, чтобы пережить её
+    StringPool string_pool_;
+    // значения формул; тоже объявлены раньше таблицы
+    ResultCache results_;
+
+    using CellTable = std::unordered_map<Position, std::unique_ptr<Cell>, SheetHash, std::equal_to<Position>,
+                                         CountingAllocator<std::pair<const Position, std::unique_ptr<Cell>>>>;
+    CellTable sheet_;
+    // позиции ячеек sheet_ по столбцам и строкам
+    OccupancyIndex occupancy_;
+    // ячейки в порядке вычисления (OptimizeLayout); пусто - порядка нет.
+    // Удалённые ячейки не вычёркиваются из порядка сразу, а запоминаются в
+    // layout_erased_ и пропускаются при обходе; порядок сжимается, когда
+    // их становится много.
+    std::vector<Cell*> layout_;
+    std::unordered_set<const Cell*> layout_erased_;
+    mutable Size printable_size_;
+    mutable bool printable_size_stale_ = false;
+    bool lazy_formula_parsing_ = false;
+    NumericColumns numeric_columns_;
+    // Устаревшие формулы по столбцам: из них Recalculate() собирает серии,
+    // не обходя таблицу. Позиции добавляются, когда формула теряет значение
+    // (Cell::InvalidateCaches, новая формула, вытеснение значения), и
+    // вычёркиваются при удалении ячейки; позиция формулы, которую успели
+    // вычислить при чтении, остаётся до следующего пересчёта.
+    mutable std::map<int, std::set<int>> stale_formulas_;
+
+    bool track_changes_ = false;
+    // позиция -> значение до первого изменения с прошлого DrainChangedCells()
+    std::unordered_map<Position, CellInterface::Value, SheetHash> changed_cells_;
+
+    // Счётчик изменений значений для ранней отсечки пересчёта (см. Cell::Refresh)
+    uint64_t revision_ = 1;
+
+    // формулы, зависящие от областей, и индексы столбцов для функций поиска;
+    // индексы меняются при чтении значений, поэтому доступны и из
+    // константных методов
+    RangeDependencies range_dependencies_;
+    mutable std::unordered_map<int, ColumnIndex> lookup_indexes_;
+
+    // Формулы-массивы: область, которую формула хочет занять, выведен ли в
+    // неё результат и значения его элементов по строкам. Значения меняются
+    // при вычислении формулы, поэтому доступны и из константных методов.
+    // stale - значения элементов в хранилище чисел и индексах поиска
+    // устарели, epoch - номер вычисления значений (см. Cell::SpillImpl).
+    // array_areas_ находит формулы по ячейкам их областей, stale_arrays_ -
+    // число устаревших массивов.
+    struct ArrayFormula {
+        Range area;
+        bool active = false;
+        bool stale = false;
+        uint64_t epoch = 0;
+        std::vector<FormulaInterface::Value> values;
+    };
+    mutable std::unordered_map<const Cell*, ArrayFormula> arrays_;
+    mutable size_t stale_arrays_ = 0;
+    RangeDependencies array_areas_;
+
+    struct Region {
+        Position origin;
+        size_t bytes = 0;
+        std::optional<uint64_t> spilled;     // запись в файле подкачки
+        bool in_lru = false;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    // Подкачка меняет только представление ячеек, поэтому доступна и из
+    // константных методов (печать, вычисление)
+    size_t memory_budget_ = 0;
+    mutable std::unique_ptr<SpillFile> spill_file_;
+    mutable std::unordered_map<uint64_t, Region> regions_;  // ключ - RegionKey()
+    mutable std::list<uint64_t> lru_;  // недавно использованные области - в начале
+    mutable PagingStats paging_stats_;
+
+    std::unique_ptr<TraceWriter> recorder_;
+    std::unique_ptr<JournalWriter> journal_;
+    // идёт восстановление из журнала (см. OpenJournal)
+    bool replaying_ = false;
+    bool profiling_ = false;
+    mutable Profiler profiler_;
+    // идёт Cell::Discover: чтение входа без значения прерывает вычисление
+    mutable bool discovering_inputs_ = false;
+
+    // Ветвление (см. Fork): у ветки - таблица, от которой она отделена, и
+    // строки столбцов, содержимое которых ветка заменила своим; у таблицы -
+    // число живых веток и блокировка для того, что ветки не могут читать
+    // одновременно (текст формул собирается при первом обращении, индексы
+    // функций поиска строятся при первом поиске)
+    const Sheet* parent_ = nullptr;
+    std::unordered_map<int, std::set<int>> forked_rows_;
+    mutable std::atomic<size_t> forks_{0};
+    mutable std::mutex fork_mutex_;
+
+    void RecordOperation(TraceOp op, Position pos = Position::NONE, std::string_view text = {}) const;
+    void RecordShift(TraceOp op, int first, int count) const;
+    void RecordRange(TraceOp op, const Range& range, Position target = Position::NONE) const;
+    // запись успешной правки в журнал предзаписи
+    void JournalOperation(TraceOp op, Position pos, std::string_view text = {});
+    void JournalShift(TraceOp op, int first, int count);
+    void JournalRange(TraceOp op, const Range& range, Position target = Position::NONE);
+    void ApplyJournalRecord(TraceRecord& record);
+    // Восстановление (OpenJournal): кладёт в таблицу накопленные правки
+    // ячеек (nullopt - очистка) и очищает texts
+    void LoadCells(std::vector<std::pair<Position, std::optional<std::string>>>& texts);
+    void RecordValueChange(Position pos, CellInterface::Value old_value);
+    // GetNumericValue без проверки позиции; cell - ячейка в pos, если она
+    // уже известна (привязанная ссылка формулы), иначе nullptr
+    std::variant<double, FormulaError> ReadNumericValue(Position pos, const Cell* cell) const;
+    // значение ячейки для хранилища чисел и индексов функций поиска
+    void StoreNumericValue(Position pos, const CellInterface::ValueView& value);
+    void ResetNumericValue(Position pos);
+    void MarkStale(Position pos) const;
+    void UnmarkStale(Position pos);
+    ColumnIndex& GetLookupIndex(int col) const;
+    // индекс столбца ветки: копия индекса родителя, в которой устаревшими
+    // помечены строки ветки и областей массивов
+    void BuildForkedLookupIndex(int col, ColumnIndex& index) const;
+    uint64_t NextRevision();
+    uint64_t GetRevision() const;
+
+    // серия формул одной формы в строках first_row.. столбца col
+    void EvaluateRun(const FormulaProgram& program, int col, int first_row,
+                     const std::vector<const Cell*>& cells) const;
+    // Вход серии: число в pos из столбца source (столбец pos.col; обновляется,
+    // если значение пришлось вычислить) или 0 для пустой ячейки; false -
+    // ошибка или текст, такую формулу нужно вычислить обычным путём
+    bool ReadRunInput(Position pos, const NumericColumns::Column*& source, double& value) const;
+
+    // Формулы-массивы. GetArrayArea() - область результата
+    // размера size, обрезанная краем таблицы. UpdateArrays() заново выводит
+    // массивы, на которые могла повлиять правка ячейки pos, UpdateArray() -
+    // один массив; возвращает область, которую он освободил. EvaluateArray()
+    // вычисляет все элементы массива anchor, changed - изменился ли хоть
+    // один; результат - элемент (0, 0) или #SPILL!. GetArrayElement() -
+    // элемент в pos после вычисления формулы, PeekArrayElement() - без
+    // вычисления. FindArrayOwner() - выведенный массив, элемент которого
+    // в pos (кроме ячейки самой формулы), FindActiveArea() - область
+    // выведенного массива anchor или nullptr. InvalidateArrayArea()
+    // помечает массив устаревшим при сбросе кэша формулы и добавляет в
+    // readers формулы, чьи области пересекают его область.
+    static Range GetArrayArea(Position anchor, Size size);
+    void UpdateArrays(Position pos);
+    void UpdateArrays(std::vector<Cell*> anchors);
+    std::optional<Range> UpdateArray(Cell* anchor);
+    bool IsAreaOccupied(const Cell* anchor, const Range& area) const;
+    void ActivateArea(Cell* anchor, const Range& area);
+    void DeactivateArea(ArrayFormula& array);
+    FormulaInterface::Value EvaluateArray(const Cell& anchor, const FormulaInterface& formula, bool& changed) const;
+    FormulaInterface::Value GetArrayElement(const Cell& anchor, Position pos) const;
+    static FormulaInterface::Value PeekArrayElement(const ArrayFormula& array, Position pos);
+    Cell* FindArrayOwner(Position pos) const;
+    const Range* FindActiveArea(const Cell* anchor) const;
+    void InvalidateArrayArea(const Cell* anchor, std::vector<Cell*>& readers);
+    // Сброс кэша формулы-массива не трогает значения элементов в хранилище
+    // чисел: массив помечается устаревшим, и RefreshArrays() вычисляет
+    // устаревшие массивы, задевающие range, перед чтением значений из неё;
+    // результат - были ли такие. GetArrayEpoch() - номер последнего
+    // вычисления значений массива anchor.
+    void MarkArrayStale(ArrayFormula& array) const;
+    void MarkArrayFresh(ArrayFormula& array) const;
+    bool RefreshArrays(const Range& range) const;
+    uint64_t GetArrayEpoch(const Cell& anchor) const;
+    // значение в pos, где у таблицы нет ячейки: элемент массива или, у
+    // ветки, значение родителя; nullopt - пусто
+    std::optional<CellInterface::ValueView> ReadVacantValue(Position pos) const;
+    // вычисляет значения всех ячеек
+    void ReadAllValues() const;
+    // значение ячейки в pos, как его печатает PrintValues(); nullopt - ячейки нет
+    std::optional<CellInterface::ValueView> ReadPrintedValue(Position pos) const;
+    // строки [first_row, last_row], где у столбцов до cols может быть
+    // значение: ячейки, элементы выведенных массивов и у ветки - ячейки и
+    // массивы родителя; по столбцам, по возрастанию
+    std::vector<std::vector<int>> CollectPrintedRows(int first_row, int last_row, int cols) const;
+
+    // Операции с областями (ClearRange и др.). GetTargetArea() - область
+    // размера source с первой ячейкой в target, проверенная на выход за край
+    // таблицы. CopyArea() запоминает содержимое непустых ячеек area, кроме
+    // элементов массивов, для записи со сдвигом на (rows, cols), ClearArea()
+    // очищает ячейки area, PasteArea() записывает запомненное в ячейки
+    // очищенной области area, TransferRange() - CopyRange() и MoveRange()
+    // без журналов.
+    struct CellContent {
+        Position pos;
+        std::string text;
+        // формула со сдвинутыми ссылками; nullptr - текст
+        std::unique_ptr<FormulaInterface> formula;
+    };
+    Range GetTargetArea(const Range& source, Position target) const;
+    std::vector<CellContent> CopyArea(const Range& area, int rows, int cols) const;
+    void ClearArea(const Range& area);
+    void PasteArea(const Range& area, std::vector<CellContent>& contents);
+    void TransferRange(const Range& source, const Range& area, bool clear_source);
+
+    // Сдвиг строк (rows) или столбцов начиная с first на delta: delta > 0 -
+    // вставка, delta < 0 - удаление полосы [first, first - delta)
+    void ShiftCells(bool rows, int first, int delta);
+
+    static uint64_t RegionKey(Position pos);
+    Region& TouchRegion(Position pos) const;
+    void UpdatePayloadSize(Position pos, size_t old_size, size_t new_size);
+    Region& FaultIn(Position pos) const;
+    void PageOutRegion(uint64_t key) const;
+    void EnforceMemoryBudget() const;
+    // загрузка всех областей с забыванием разбиения и учёт всего содержимого заново
+    void PageInAll();
+    void CountPayloads();
+
+    Cell* FindCell(Position pos) const;
+    // ячейки добавляются в sheet_ и удаляются из неё только здесь: вместе с
+    // ними меняются индекс позиций и столбцовое хранилище чисел
+    Cell* AddCell(Position pos);
+    CellTable::iterator EraseCell(CellTable::iterator it);
+    // дописывает новую ячейку в конец порядка вычисления, если он есть
+    void AddToLayout(Cell* cell);
+    void CompactLayout();
+    // ячейки таблицы в области по индексу занятости, по столбцам; func может
+    // удалять ячейки, но не добавлять их
+    void ForEachCell(const Range& area, const std::function<void(Cell*)>& func) const;
+
+    void EnsureNoForks() const;
+    // для веток: непустая ячейка родителя в pos или nullptr
+    const Cell* FindParentCell(Position pos) const;
+    // текст и ссылки ячейки этой таблицы для её веток
+    std::string GetSharedText(const Cell& cell) const;
+    std::vector<Position> GetSharedReferences(const Cell& cell) const;
+    std::unique_ptr<FormulaInterface> TranslateShared(const Cell& cell, int rows, int cols) const;
+    // Ячейка ветки в pos, которой в ветке ещё нет: представитель ячейки
+    // родителя или, если значения родителя нет в его кэше, копия формулы;
+    // nullptr, если у родителя нет непустой ячейки в pos
+    Cell* ForkCell(Position pos);
+    // значение ячейки родителя в pos для ветки (через ForkCell, если родитель
+    // его не хранит); nullopt - ячейки нет
+    std::optional<CellInterface::ValueView> ReadParentValue(Position pos) const;
+    // копирует в ветку формулы родителя, зависящие от pos
+    void ForkDependents(Position pos);
+    // Копия формулы-массива родителя source, выведенная в ветке. Массив
+    // родителя, элемент которого в pos, если ветка не заменила его формулу
+    // (IsInherited), - FindParentArray().
+    void ForkArray(const Cell& source);
+    const Cell* FindParentArray(Position pos) const;
+    bool IsInherited(const Cell& anchor) const;
+    void MarkForked(Position pos);
+
+    // пустая ячейка для ссылки формулы и её удаление, когда ссылок не осталось
+    // (см. Cell::UpdateDependencies); в журнал операций не попадают
+    Cell* CreatePlaceholder(Position pos);
+    void ReleaseCell(Position pos);
 
-    void UpdatePrintableSize(Position pos);
+    // Граница печати: UpdatePrintableSize() расширяет её до pos, а
+    // ShrinkPrintableSize() после удаления с края лишь помечает устаревшей -
+    // пересчитывается она при следующем GetPrintableSize(), одним проходом
+    // на сколько угодно удалений
+    void UpdatePrintableSize(Position pos) const;
+    void ShrinkPrintableSize(Position pos);
+    void RecomputePrintableSize() const;
     const CellInterface* FindCellInterfacePtr(Position pos) const;
     void PrintContext(std::ostream& output, std::string context) const;
     void EnsureValidPosition(const Position& pos) const;
@@ -0,0 +1,115 @@
+#include "spill_file.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <vector>
+
+using namespace std;
+
+namespace {
+// небольшой мусор дешевле оставить, чем переписывать файл
+const uint64_t MIN_COMPACTION_GARBAGE = 1 << 20;
+
+string MakeTemporaryPath(const void* owner) {
+    auto stamp = chrono::steady_clock::now().time_since_epoch().count();
+    string name = "spreadsheet-spill-" + to_string(stamp) + "-" + to_string(reinterpret_cast<uintptr_t>(owner));
+    return (filesystem::temp_directory_path() / name).string();
+}
+}  // namespace
+
+SpillFile::SpillFile(string path) : path_(path.empty() ? MakeTemporaryPath(this) : move(path)) {
+    file_.open(path_, ios::in | ios::out | ios::binary | ios::trunc);
+    if (!file_) {
+        throw SpillFileException("Cannot open spill file " + path_);
+    }
+}
+
+SpillFile::~SpillFile() {
+    file_.close();
+    error_code ignored;
+    filesystem::remove(path_, ignored);
+}
+
+uint64_t SpillFile::Write(string_view data) {
+    file_.seekp(file_size_);
+    file_.write(data.data(), data.size());
+    Check("write");
+
+    uint64_t id = next_id_++;
+    records_[id] = { file_size_, data.size() };
+    file_size_ += data.size();
+    live_size_ += data.size();
+    return id;
+}
+
+string SpillFile::Take(uint64_t id) {
+    auto it = records_.find(id);
+    if (it == records_.end()) {
+        throw SpillFileException("Unknown spill record " + to_string(id));
+    }
+
+    string data(it->second.size, '\0');
+    file_.seekg(it->second.offset);
+    file_.read(data.data(), data.size());
+    Check("read");
+
+    live_size_ -= it->second.size;
+    records_.erase(it);
+
+    uint64_t garbage = file_size_ - live_size_;
+    if (garbage > live_size_ && garbage >= MIN_COMPACTION_GARBAGE) {
+        Compact();
+    }
+    return data;
+}
+
+uint64_t SpillFile::GetFileSize() const {
+    return file_size_;
+}
+
+uint64_t SpillFile::GetLiveSize() const {
+    return live_size_;
+}
+
+void SpillFile::Compact() {
+    vector<Record*> live;
+    live.reserve(records_.size());
+    for (auto& [id, record] : records_) {
+        live.push_back(&record);
+    }
+    sort(live.begin(), live.end(), [](const Record* lhs, const Record* rhs) {
+        return lhs->offset < rhs->offset;
+    });
+
+    // записи только сдвигаются к началу, поэтому ещё не прочитанные не затираются
+    uint64_t offset = 0;
+    string buffer;
+    for (Record* record : live) {
+        if (record->offset != offset) {
+            buffer.resize(record->size);
+            file_.seekg(record->offset);
+            file_.read(buffer.data(), buffer.size());
+            file_.seekp(offset);
+            file_.write(buffer.data(), buffer.size());
+            Check("compact");
+            record->offset = offset;
+        }
+        offset += record->size;
+    }
+
+    file_.flush();
+    error_code error;
+    filesystem::resize_file(path_, offset, error);
+    if (error) {
+        throw SpillFileException("Cannot shrink spill file " + path_ + ": " + error.message());
+    }
+    file_size_ = offset;
+}
+
+void SpillFile::Check(const char* operation) {
+    if (!file_) {
+        file_.clear();
+        throw SpillFileException(string("Spill file ") + operation + " failed: " + path_);
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+// Исключение, выбрасываемое при ошибке чтения или записи файла подкачки
+class SpillFileException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Файл подкачки (см. Sheet::SetMemoryBudget): хранит записи произвольной
+// длины под числовыми идентификаторами. Запись, которую забрали методом
+// Take(), становится мусором; когда мусора больше, чем живых данных, живые
+// записи сдвигаются к началу файла и файл укорачивается.
+class SpillFile {
+public:
+    // Пустой путь - временный файл в каталоге для временных файлов.
+    // Файл удаляется в деструкторе.
+    explicit SpillFile(std::string path = {});
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+    ~SpillFile();
+
+    uint64_t Write(std::string_view data);
+    // Читает запись и освобождает её место
+    std::string Take(uint64_t id);
+
+    // размер файла на диске и объём живых записей в нём, в байтах
+    uint64_t GetFileSize() const;
+    uint64_t GetLiveSize() const;
+
+private:
+    struct Record {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    std::string path_;
+    std::fstream file_;
+    std::unordered_map<uint64_t, Record> records_;
+    uint64_t next_id_ = 0;
+    uint64_t file_size_ = 0;
+    uint64_t live_size_ = 0;
+
+    void Compact();
+    void Check(const char* operation);
+};
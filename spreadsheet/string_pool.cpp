@@ -0,0 +1,109 @@
+#include "string_pool.h"
+
+#include <cstring>
+#include <utility>
+
+using namespace std;
+
+PooledString::PooledString() noexcept {}
+
+PooledString::PooledString(Entry* entry) noexcept {
+    entry_ = entry;
+    size_ = POOLED;
+    ++entry->refs;
+}
+
+PooledString::PooledString(const PooledString& other) noexcept {
+    memcpy(chars_, other.chars_, sizeof(chars_));
+    size_ = other.size_;
+    if (size_ == POOLED) {
+        ++entry_->refs;
+    }
+}
+
+PooledString::PooledString(PooledString&& other) noexcept {
+    Swap(other);
+}
+
+PooledString& PooledString::operator=(PooledString other) noexcept {
+    Swap(other);
+    return *this;
+}
+
+PooledString::~PooledString() {
+    if (size_ == POOLED && --entry_->refs == 0) {
+        entry_->pool->Release(entry_);
+    }
+}
+
+string_view PooledString::View() const noexcept {
+    if (size_ == POOLED) {
+        return entry_->text;
+    }
+    return { chars_, size_ };
+}
+
+bool PooledString::IsInline() const noexcept {
+    return size_ != POOLED;
+}
+
+bool PooledString::operator==(const PooledString& rhs) const noexcept {
+    if (size_ != rhs.size_) {
+        return false;
+    }
+    if (size_ == POOLED) {
+        return entry_ == rhs.entry_;
+    }
+    return memcmp(chars_, rhs.chars_, size_) == 0;
+}
+
+bool PooledString::operator!=(const PooledString& rhs) const noexcept {
+    return !(*this == rhs);
+}
+
+void PooledString::Swap(PooledString& other) noexcept {
+    char chars[INLINE_CAPACITY];
+    memcpy(chars, chars_, sizeof(chars_));
+    memcpy(chars_, other.chars_, sizeof(chars_));
+    memcpy(other.chars_, chars, sizeof(chars_));
+    swap(size_, other.size_);
+}
+
+StringPool::StringPool() : entries_(Entries::allocator_type(&table_memory_)) {}
+
+PooledString StringPool::Intern(string_view str) {
+    if (str.size() <= PooledString::INLINE_CAPACITY) {
+        PooledString result;
+        memcpy(result.chars_, str.data(), str.size());
+        result.size_ = static_cast<uint8_t>(str.size());
+        return result;
+    }
+
+    auto it = entries_.find(str);
+    if (it == entries_.end()) {
+        auto entry = make_unique<PooledString::Entry>(PooledString::Entry{ this, 0, string(str) });
+        string_view key = entry->text;
+        entries_memory_ += sizeof(PooledString::Entry) + GetHeapSize(entry->text);
+        it = entries_.emplace(key, move(entry)).first;
+    }
+    return PooledString(it->second.get());
+}
+
+size_t StringPool::GetSize() const {
+    return entries_.size();
+}
+
+size_t StringPool::GetMemoryUsage() const {
+    return table_memory_ + entries_memory_;
+}
+
+void StringPool::Release(PooledString::Entry* entry) noexcept {
+    entries_memory_ -= sizeof(PooledString::Entry) + GetHeapSize(entry->text);
+    // ключ указывает в сам Entry, поэтому удаляем по итератору
+    entries_.erase(entries_.find(entry->text));
+
+    // опустевший пул возвращает и память корзин
+    if (entries_.empty()) {
+        Entries(entries_.get_allocator()).swap(entries_);
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "memory_usage.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+class StringPool;
+
+// Строка, выданная StringPool. Короткая строка хранится прямо в объекте,
+// длинная - в единственном экземпляре в пуле, со счётчиком ссылок. Пул
+// выдаёт равным строкам равные дескрипторы, поэтому строки одного пула
+// сравниваются без обращения к символам.
+class PooledString {
+public:
+    static constexpr size_t INLINE_CAPACITY = 15;
+
+    PooledString() noexcept;
+    PooledString(const PooledString& other) noexcept;
+    PooledString(PooledString&& other) noexcept;
+    PooledString& operator=(PooledString other) noexcept;
+    ~PooledString();
+
+    std::string_view View() const noexcept;
+    bool IsInline() const noexcept;
+
+    // Сравнивает дескрипторы; осмысленно только для строк одного пула
+    bool operator==(const PooledString& rhs) const noexcept;
+    bool operator!=(const PooledString& rhs) const noexcept;
+
+private:
+    friend class StringPool;
+
+    struct Entry {
+        StringPool* pool;
+        size_t refs;
+        std::string text;
+    };
+
+    static constexpr uint8_t POOLED = 0xFF;
+
+    explicit PooledString(Entry* entry) noexcept;
+    void Swap(PooledString& other) noexcept;
+
+    union {
+        char chars_[INLINE_CAPACITY] = {};
+        Entry* entry_;
+    };
+    // длина короткой строки или POOLED
+    uint8_t size_ = 0;
+};
+
+// Пул строк таблицы: одинаковые длинные тексты ячеек хранятся один раз.
+// Строка удаляется из пула, когда исчезает последний ссылающийся на неё
+// PooledString, поэтому пул должен пережить все выданные им строки.
+class StringPool {
+public:
+    StringPool();
+    StringPool(const StringPool&) = delete;
+    StringPool& operator=(const StringPool&) = delete;
+
+    PooledString Intern(std::string_view str);
+
+    // число различных строк, хранящихся в пуле (короткие в пул не попадают)
+    size_t GetSize() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    friend class PooledString;
+
+    void Release(PooledString::Entry* entry) noexcept;
+
+    // счётчик CountingAllocator объявлен раньше таблицы, которая им пользуется
+    size_t table_memory_ = 0;
+    // память строк: сами Entry и их текст в куче
+    size_t entries_memory_ = 0;
+
+    // ключ указывает на текст, принадлежащий Entry
+    using Entries = std::unordered_map<std::string_view, std::unique_ptr<PooledString::Entry>,
+                                       std::hash<std::string_view>, std::equal_to<std::string_view>,
+                                       CountingAllocator<std::pair<const std::string_view,
+                                                                   std::unique_ptr<PooledString::Entry>>>>;
+    Entries entries_;
+};
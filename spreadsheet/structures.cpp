@@ -1,14 +1,23 @@
 #include "common.h"
 
 #include <cctype>
-#include <sstream>
 #include <algorithm>
 
 using namespace std;
 
 const int LETTERS = 26;
 const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
+
+// Сколько букв нужно, чтобы записать последний столбец (3 для XFD)
+constexpr size_t LetterCount(int cols) {
+    size_t count = 0;
+    for (int c = cols - 1; c >= 0; c = c / LETTERS - 1) {
+        ++count;
+    }
+    return count;
+}
+
+const size_t MAX_POS_LETTER_COUNT = LetterCount(Position::MAX_COLS);
 
 const Position Position::NONE = {-1, -1};
 
@@ -17,7 +26,7 @@ bool Position::operator==(const Position rhs) const {
 }
 
 bool Position::operator<(const Position rhs) const {
-    return tie(row, col) < tie(rhs.row, rhs.col);
+    return Pack() < rhs.Pack();
 }
 
 bool Position::IsValid() const {
@@ -60,10 +69,17 @@ Position Position::FromString(string_view str) {
         return Position::NONE;
     }
 
-    int row;
-    istringstream row_in{string{digits}};
-    if (!(row_in >> row) || !row_in.eof()) {
-        return Position::NONE;
+    // Номер строки разбираем вручную: всё, что больше MAX_ROWS, сразу невалидно,
+    // поэтому переполнение int невозможно
+    int row = 0;
+    for (char ch : digits) {
+        if (!isdigit(static_cast<unsigned char>(ch))) {
+            return Position::NONE;
+        }
+        row = row * 10 + (ch - '0');
+        if (row > Position::MAX_ROWS) {
+            return Position::NONE;
+        }
     }
 
     int col = 0;
@@ -77,4 +93,33 @@ Position Position::FromString(string_view str) {
 
 bool Size::operator==(Size rhs) const {
     return tie(rows, cols) == tie(rhs.rows, rhs.cols);
+}
+
+const Range Range::NONE = {Position::NONE, Position::NONE};
+
+bool Range::operator==(const Range& rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
+
+bool Range::operator<(const Range& rhs) const {
+    return first < rhs.first || (first == rhs.first && last < rhs.last);
+}
+
+bool Range::IsValid() const {
+    return first.IsValid() && last.IsValid() && first.row <= last.row && first.col <= last.col;
+}
+
+bool Range::Contains(Position pos) const {
+    return pos.row >= first.row && pos.row <= last.row && pos.col >= first.col && pos.col <= last.col;
+}
+
+Size Range::GetSize() const {
+    return {last.row - first.row + 1, last.col - first.col + 1};
+}
+
+string Range::ToString() const {
+    if (!IsValid()) {
+        return "";
+    }
+    return first.ToString() + ":" + last.ToString();
 }
\ No newline at end of file
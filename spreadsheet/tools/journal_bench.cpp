@@ -0,0 +1,128 @@
+// spreadsheet_journal_bench: пишет <edits> правок (числа и формулы, ссылающиеся
+// на соседние строки) в таблицу с журналом предзаписи при разных размерах
+// группы и сравнивает пропускную способность журнала. Затем измеряет
+// восстановление: по одному журналу, по контрольной точке и по контрольной
+// точке с хвостом журнала.
+//
+//     spreadsheet_journal_bench [edits] [directory]
+//
+// По умолчанию 200000 правок во временном каталоге.
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+using namespace std;
+
+namespace {
+template <typename Func>
+uint64_t Measure(Func func) {
+    auto start = chrono::steady_clock::now();
+    func();
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+void RemoveJournal(const string& path) {
+    filesystem::remove(path);
+    filesystem::remove(path + ".checkpoint");
+}
+
+// i-я правка: в каждой строке число в A и формула в B
+void Edit(Sheet& sheet, int i) {
+    int row = i / 2;
+    if (i % 2 == 0) {
+        sheet.SetCell({row, 0}, to_string(i % 1000 + 0.25));
+    } else {
+        sheet.SetCell({row, 1}, row == 0 ? "=A1" : "=A" + to_string(row + 1) + "+B" + to_string(row));
+    }
+}
+
+// восстанавливает таблицу из журнала и печатает время
+void Recover(const string& name, const string& path) {
+    Sheet sheet;
+    uint64_t ns = Measure([&] {
+        sheet.OpenJournal(path);
+    });
+    JournalStats stats = sheet.GetJournalStats();
+    cout << setw(24) << left << name << right
+         << setw(12) << stats.checkpoint_cells << setw(12) << stats.replayed_records
+         << setw(12) << ns / 1e6 << '\n';
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    int edits = argc > 1 ? stoi(argv[1]) : 200000;
+    string directory = argc > 2 ? argv[2] : filesystem::temp_directory_path().string();
+    if (edits <= 0 || edits / 2 >= Position::MAX_ROWS) {
+        cerr << "Usage: " << argv[0] << " [edits (1.." << Position::MAX_ROWS * 2 - 1 << ")] [directory]" << endl;
+        return 2;
+    }
+    const string path = (filesystem::path(directory) / "spreadsheet-journal-bench.log").string();
+
+    cout << fixed << setprecision(2);
+    cout << setw(12) << "group" << setw(12) << "edits" << setw(12) << "syncs"
+         << setw(12) << "MB" << setw(12) << "edits/s" << setw(12) << "MB/s" << '\n';
+
+    // без группировки каждая правка ждёт fsync - правок меньше
+    for (size_t group : { size_t{1}, size_t{16}, size_t{256}, size_t{4096} }) {
+        RemoveJournal(path);
+        const int count = group == 1 ? min(edits, 2000) : edits;
+
+        Sheet sheet;
+        sheet.OpenJournal(path, { group, chrono::milliseconds(10) });
+        uint64_t ns = Measure([&] {
+            for (int i = 0; i < count; ++i) {
+                Edit(sheet, i);
+            }
+            sheet.SyncJournal();
+        });
+
+        JournalStats stats = sheet.GetJournalStats();
+        double megabytes = stats.bytes / 1e6;
+        cout << setw(12) << group << setw(12) << count << setw(12) << stats.syncs
+             << setw(12) << megabytes << setw(12) << setprecision(0) << count / (ns / 1e9)
+             << setw(12) << setprecision(2) << megabytes / (ns / 1e9) << '\n';
+    }
+
+    cout << '\n' << setw(24) << left << "recovery" << right
+         << setw(12) << "cells" << setw(12) << "records" << setw(12) << "ms" << '\n';
+
+    RemoveJournal(path);
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path, { 4096, chrono::milliseconds(10) });
+        for (int i = 0; i < edits; ++i) {
+            Edit(sheet, i);
+        }
+    }
+    Recover("journal only", path);
+
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path, { 4096, chrono::milliseconds(10) });
+        uint64_t ns = Measure([&] {
+            sheet.Checkpoint();
+        });
+        cout << setw(24) << left << "(checkpoint written)" << right << setw(36) << ns / 1e6 << '\n';
+    }
+    Recover("checkpoint", path);
+
+    {
+        Sheet sheet;
+        sheet.OpenJournal(path, { 4096, chrono::milliseconds(10) });
+        // хвост: каждая десятая правка повторяется
+        for (int i = 0; i < edits; i += 10) {
+            Edit(sheet, i);
+        }
+    }
+    Recover("checkpoint + tail", path);
+
+    RemoveJournal(path);
+    return 0;
+}
@@ -0,0 +1,203 @@
+// spreadsheet_layout_bench: заводит граф из <rows> строк формул в случайном
+// порядке (вперемешку с текстом, чтобы формулы рассыпались по куче) и
+// измеряет полный пересчёт после правки ячейки, от которой зависят все
+// формулы, - до и после Sheet::OptimizeLayout(). Кроме времени печатает
+// обращения к кэшу процессора и промахи по нему, если счётчики производительности
+// доступны (Linux, perf_event_open; см. /proc/sys/kernel/perf_event_paranoid).
+//
+//     spreadsheet_layout_bench [rows] [runs]
+//
+// По умолчанию 200000 строк и 5 пересчётов на раскладку.
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+namespace {
+// Счётчики обращений к последнему уровню кэша и промахов по нему для
+// текущего потока (только пользовательский код)
+class CacheCounters {
+public:
+    CacheCounters() {
+#ifdef __linux__
+        references_ = Open(PERF_COUNT_HW_CACHE_REFERENCES);
+        misses_ = Open(PERF_COUNT_HW_CACHE_MISSES);
+#endif
+    }
+
+    CacheCounters(const CacheCounters&) = delete;
+    CacheCounters& operator=(const CacheCounters&) = delete;
+
+    ~CacheCounters() {
+#ifdef __linux__
+        for (int fd : { references_, misses_ }) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+#endif
+    }
+
+    bool IsAvailable() const {
+        return references_ >= 0 && misses_ >= 0;
+    }
+
+    void Start() {
+#ifdef __linux__
+        if (IsAvailable()) {
+            for (int fd : { references_, misses_ }) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // обращения и промахи с Start(); nullopt - счётчиков нет
+    optional<pair<uint64_t, uint64_t>> Stop() {
+#ifdef __linux__
+        if (IsAvailable()) {
+            uint64_t references = 0;
+            uint64_t misses = 0;
+            ioctl(references_, PERF_EVENT_IOC_DISABLE, 0);
+            ioctl(misses_, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(references_, &references, sizeof(references)) == sizeof(references)
+                && read(misses_, &misses, sizeof(misses)) == sizeof(misses)) {
+                return pair{ references, misses };
+            }
+        }
+#endif
+        return nullopt;
+    }
+
+private:
+    int references_ = -1;
+    int misses_ = -1;
+
+#ifdef __linux__
+    static int Open(uint64_t config) {
+        perf_event_attr attr{};
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+};
+
+template <typename Func>
+uint64_t Measure(Func func) {
+    auto start = chrono::steady_clock::now();
+    func();
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+string Ref(char col, int row) {
+    return col + to_string(row + 1);
+}
+
+// Строка r: A - число, B = Z1 + A, C - B плюс C одной из 1000 строк выше,
+// D - C плюс B случайной строки. Ссылки на разные строки не дают формулам
+// столбца общей формы, поэтому они не вычисляются вместе (см. vectorized.h).
+void Fill(Sheet& sheet, int rows) {
+    mt19937 random(42);
+    vector<pair<Position, string>> cells;
+    cells.reserve(static_cast<size_t>(rows) * 5);
+    for (int r = 0; r < rows; ++r) {
+        uniform_int_distribution<int> near(max(0, r - 1000), max(0, r - 1));
+        uniform_int_distribution<int> any(0, rows - 1);
+        cells.emplace_back(Position{ r, 0 }, to_string(r % 97 + 0.5));
+        cells.emplace_back(Position{ r, 1 }, "=Z1+" + Ref('A', r));
+        cells.emplace_back(Position{ r, 2 }, r == 0 ? "=B1" : "=" + Ref('B', r) + "*0.5+" + Ref('C', near(random)));
+        cells.emplace_back(Position{ r, 3 }, "=" + Ref('C', r) + "+" + Ref('B', any(random)));
+        cells.emplace_back(Position{ r, 5 }, "note " + to_string(r));
+    }
+    shuffle(cells.begin(), cells.end(), random);
+
+    sheet.SetCell({ 0, 25 }, "1");
+    for (auto& [pos, text] : cells) {
+        sheet.SetCell(pos, text);
+    }
+    sheet.Recalculate();
+}
+
+void Run(const string& name, Sheet& sheet, int runs, CacheCounters& counters) {
+    uint64_t best = 0;
+    uint64_t references = 0;
+    uint64_t misses = 0;
+    for (int i = 0; i < runs; ++i) {
+        // все формулы зависят от Z1
+        sheet.SetCell({ 0, 25 }, to_string(i + 2));
+        counters.Start();
+        uint64_t ns = Measure([&] {
+            sheet.Recalculate();
+        });
+        auto counts = counters.Stop();
+        if (i == 0 || ns < best) {
+            best = ns;
+            if (counts) {
+                references = counts->first;
+                misses = counts->second;
+            }
+        }
+    }
+
+    cout << setw(12) << left << name << right << setw(12) << best / 1e6;
+    if (counters.IsAvailable()) {
+        cout << setw(16) << references << setw(16) << misses << setw(11)
+             << (references ? 100.0 * misses / references : 0.0) << '%';
+    } else {
+        cout << setw(16) << "n/a" << setw(16) << "n/a" << setw(12) << "n/a";
+    }
+    cout << '\n';
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    int rows = argc > 1 ? stoi(argv[1]) : 200000;
+    int runs = argc > 2 ? stoi(argv[2]) : 5;
+    if (rows <= 0 || rows > Position::MAX_ROWS || runs <= 0) {
+        cerr << "Usage: " << argv[0] << " [rows (1.." << Position::MAX_ROWS << ")] [runs]" << endl;
+        return 2;
+    }
+
+    Sheet sheet;
+    uint64_t fill = Measure([&] {
+        Fill(sheet, rows);
+    });
+    cout << fixed << setprecision(2);
+    cout << "filled " << rows << " rows in " << fill / 1e6 << " ms\n\n";
+
+    CacheCounters counters;
+    cout << setw(12) << left << "layout" << right << setw(12) << "recalc ms" << setw(16) << "cache refs"
+         << setw(16) << "cache misses" << setw(12) << "miss rate" << '\n';
+    Run("insertion", sheet, runs, counters);
+
+    uint64_t layout = Measure([&] {
+        sheet.OptimizeLayout();
+    });
+    Run("optimized", sheet, runs, counters);
+    cout << "\nOptimizeLayout: " << layout / 1e6 << " ms\n";
+    return 0;
+}
@@ -0,0 +1,156 @@
+// spreadsheet_lookup_bench: заполняет таблицу из <rows> строк (столбец A -
+// чётные числа, B - цены, C - артикулы) и выполняет по <lookups> формул
+// каждого вида: точный VLOOKUP, приближённый MATCH и XLOOKUP по тексту
+// (искомый артикул - в E1).
+// Затем чередует правки ключевого столбца с поиском, чтобы измерить
+// обновление индексов по одной строке.
+//
+//     spreadsheet_lookup_bench [rows] [lookups]
+//
+// По умолчанию 1000000 строк и 100000 поисков.
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+struct Stats {
+    vector<uint64_t> latencies;  // наносекунды
+    size_t misses = 0;
+};
+
+double Percentile(const vector<uint64_t>& sorted, double fraction) {
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+template <typename Func>
+uint64_t Measure(Func func) {
+    auto start = chrono::steady_clock::now();
+    func();
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+string Sku(int row) {
+    return "SKU-" + to_string(row);
+}
+
+// задаёт формулу в D1 и вычисляет её; промах - значение-ошибка
+void RunLookup(Sheet& sheet, const string& formula, Stats& stats) {
+    stats.latencies.push_back(Measure([&] {
+        sheet.SetCell({0, 3}, formula);
+        if (holds_alternative<FormulaError>(sheet.GetCell({0, 3})->GetValue())) {
+            ++stats.misses;
+        }
+    }));
+}
+
+void PrintRow(const string& name, Stats& stats) {
+    sort(stats.latencies.begin(), stats.latencies.end());
+    uint64_t total = 0;
+    for (uint64_t latency : stats.latencies) {
+        total += latency;
+    }
+
+    cout << setw(18) << left << name << right
+         << setw(10) << stats.latencies.size() << setw(8) << stats.misses
+         << setw(12) << Percentile(stats.latencies, 0.5) << setw(12) << Percentile(stats.latencies, 0.99)
+         << setw(12) << stats.latencies.back() / 1000.0;
+    if (total > 0) {
+        cout << setw(12) << setprecision(0) << stats.latencies.size() / (total / 1e9) << setprecision(2);
+    }
+    cout << '\n';
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    int rows = argc > 1 ? stoi(argv[1]) : 1000000;
+    int lookups = argc > 2 ? stoi(argv[2]) : 100000;
+    if (rows <= 0 || rows > Position::MAX_ROWS || lookups <= 0) {
+        cerr << "Usage: " << argv[0] << " [rows (1.." << Position::MAX_ROWS << ")] [lookups]" << endl;
+        return 2;
+    }
+
+    Sheet sheet;
+    uint64_t fill_ns = Measure([&] {
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell({row, 0}, to_string(row * 2));
+            sheet.SetCell({row, 1}, to_string(row % 997 + 0.5));
+            sheet.SetCell({row, 2}, Sku(row));
+        }
+    });
+
+    const string last = to_string(rows);
+    const string table = "A1:B" + last;
+    const string keys = "A1:A" + last;
+
+    cout << fixed << setprecision(2);
+    cout << rows << " rows filled in " << fill_ns / 1e9 << " s\n";
+
+    // первый поиск каждого вида строит индекс столбца
+    uint64_t build_ns = Measure([&] {
+        sheet.SetCell({0, 3}, "=VLOOKUP(0," + table + ",2,0)");
+        sheet.GetCell({0, 3})->GetValue();
+        sheet.SetCell({0, 3}, "=MATCH(1," + keys + ",1)");
+        sheet.GetCell({0, 3})->GetValue();
+        sheet.SetCell({0, 4}, Sku(0));
+        sheet.SetCell({0, 3}, "=XLOOKUP(E1,C1:C" + last + "," + keys + ")");
+        sheet.GetCell({0, 3})->GetValue();
+    });
+    cout << "indexes built in " << build_ns / 1e9 << " s\n\n";
+
+    mt19937 random(42);
+    uniform_int_distribution<int> any_row(0, rows - 1);
+
+    Stats exact, approximate, text, update;
+    for (int i = 0; i < lookups; ++i) {
+        RunLookup(sheet, "=VLOOKUP(" + to_string(any_row(random) * 2) + "," + table + ",2,0)", exact);
+    }
+    for (int i = 0; i < lookups; ++i) {
+        // нечётный ключ: ближайший меньший
+        RunLookup(sheet, "=MATCH(" + to_string(any_row(random) * 2 + 1) + "," + keys + ",1)", approximate);
+    }
+    // в формулах нет текстовых литералов: артикул берётся из E1, формула в D1 остаётся
+    for (int i = 0; i < lookups; ++i) {
+        string sku = Sku(any_row(random));
+        text.latencies.push_back(Measure([&] {
+            sheet.SetCell({0, 4}, sku);
+            if (holds_alternative<FormulaError>(sheet.GetCell({0, 3})->GetValue())) {
+                ++text.misses;
+            }
+        }));
+    }
+
+    // правка ключа и поиск нового значения: индекс меняется на одну строку
+    const int updates = max(1, lookups / 10);
+    for (int i = 0; i < updates; ++i) {
+        int row = any_row(random);
+        int key = rows * 2 + i * 2;
+        update.latencies.push_back(Measure([&] {
+            sheet.SetCell({row, 0}, to_string(key));
+            sheet.SetCell({0, 3}, "=MATCH(" + to_string(key) + "," + keys + ",0)");
+            if (holds_alternative<FormulaError>(sheet.GetCell({0, 3})->GetValue())) {
+                ++update.misses;
+            }
+        }));
+    }
+
+    cout << setw(18) << left << "lookup" << right
+         << setw(10) << "count" << setw(8) << "misses"
+         << setw(12) << "p50, us" << setw(12) << "p99, us" << setw(12) << "max, us"
+         << setw(12) << "ops/s" << '\n';
+    PrintRow("VLOOKUP exact", exact);
+    PrintRow("MATCH nearest", approximate);
+    PrintRow("XLOOKUP text", text);
+    PrintRow("edit + MATCH", update);
+    return 0;
+}
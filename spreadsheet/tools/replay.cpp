@@ -0,0 +1,201 @@
+// spreadsheet_replay: воспроизводит журнал операций (Sheet::StartRecording)
+// на новой таблице и выводит задержки операций по перцентилям и общую
+// пропускную способность.
+//
+//     spreadsheet_replay <trace> [--lazy]
+//
+// --lazy включает отложенный разбор формул (Sheet::SetLazyFormulaParsing).
+
+#include "sheet.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+namespace {
+// вывод Print* измеряется, но никуда не попадает
+class NullBuffer : public streambuf {
+protected:
+    int_type overflow(int_type c) override {
+        return traits_type::not_eof(c);
+    }
+
+    streamsize xsputn(const char*, streamsize count) override {
+        return count;
+    }
+};
+
+string_view OpName(TraceOp op) {
+    switch (op) {
+        case TraceOp::SetCell:
+            return "SetCell";
+        case TraceOp::ClearCell:
+            return "ClearCell";
+        case TraceOp::GetValue:
+            return "GetValue";
+        case TraceOp::PrintValues:
+            return "PrintValues";
+        case TraceOp::PrintTexts:
+            return "PrintTexts";
+        case TraceOp::InsertRows:
+            return "InsertRows";
+        case TraceOp::DeleteRows:
+            return "DeleteRows";
+        case TraceOp::InsertColumns:
+            return "InsertColumns";
+        case TraceOp::DeleteColumns:
+            return "DeleteColumns";
+        case TraceOp::ClearRange:
+            return "ClearRange";
+        case TraceOp::CopyRange:
+            return "CopyRange";
+        case TraceOp::MoveRange:
+            return "MoveRange";
+    }
+    return "";
+}
+
+struct OpStats {
+    vector<uint64_t> latencies;  // наносекунды
+    size_t errors = 0;
+};
+
+double Percentile(const vector<uint64_t>& sorted, double fraction) {
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+void Execute(Sheet& sheet, const TraceRecord& record, ostream& null_output) {
+    switch (record.op) {
+        case TraceOp::SetCell:
+            sheet.SetCell(record.pos, record.text);
+            break;
+        case TraceOp::ClearCell:
+            sheet.ClearCell(record.pos);
+            break;
+        case TraceOp::GetValue:
+            if (const CellInterface* cell = sheet.GetCell(record.pos)) {
+                cell->GetValue();
+            }
+            break;
+        case TraceOp::PrintValues:
+            sheet.PrintValues(null_output);
+            break;
+        case TraceOp::PrintTexts:
+            sheet.PrintTexts(null_output);
+            break;
+        case TraceOp::InsertRows:
+            sheet.InsertRows(record.first, record.count);
+            break;
+        case TraceOp::DeleteRows:
+            sheet.DeleteRows(record.first, record.count);
+            break;
+        case TraceOp::InsertColumns:
+            sheet.InsertColumns(record.first, record.count);
+            break;
+        case TraceOp::DeleteColumns:
+            sheet.DeleteColumns(record.first, record.count);
+            break;
+        case TraceOp::ClearRange:
+            sheet.ClearRange(record.range);
+            break;
+        case TraceOp::CopyRange:
+            sheet.CopyRange(record.range, record.pos);
+            break;
+        case TraceOp::MoveRange:
+            sheet.MoveRange(record.range, record.pos);
+            break;
+    }
+}
+
+void PrintReport(const map<TraceOp, OpStats>& stats, size_t total, double seconds, uint64_t trace_ns) {
+    cout << setw(14) << left << "operation" << right
+         << setw(10) << "count" << setw(8) << "errors"
+         << setw(12) << "p50, us" << setw(12) << "p90, us" << setw(12) << "p99, us"
+         << setw(12) << "max, us" << '\n';
+
+    cout << fixed << setprecision(2);
+    for (auto& [op, op_stats] : stats) {
+        vector<uint64_t> sorted = op_stats.latencies;
+        sort(sorted.begin(), sorted.end());
+
+        cout << setw(14) << left << OpName(op) << right
+             << setw(10) << sorted.size() << setw(8) << op_stats.errors
+             << setw(12) << Percentile(sorted, 0.5) << setw(12) << Percentile(sorted, 0.9)
+             << setw(12) << Percentile(sorted, 0.99) << setw(12) << sorted.back() / 1000.0 << '\n';
+    }
+
+    cout << '\n' << total << " operations in " << setprecision(3) << seconds << " s";
+    if (seconds > 0) {
+        cout << ", " << setprecision(0) << total / seconds << " ops/s";
+    }
+    cout << setprecision(3) << " (recorded session: " << trace_ns / 1e9 << " s)\n";
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        cerr << "Usage: " << argv[0] << " <trace> [--lazy]" << endl;
+        return 2;
+    }
+
+    ifstream input(argv[1], ios::binary);
+    if (!input) {
+        cerr << "Cannot open " << argv[1] << endl;
+        return 1;
+    }
+
+    Sheet sheet;
+    if (argc > 2 && string(argv[2]) == "--lazy") {
+        sheet.SetLazyFormulaParsing(true);
+    }
+
+    NullBuffer null_buffer;
+    ostream null_output(&null_buffer);
+    map<TraceOp, OpStats> stats;
+    size_t total = 0;
+    uint64_t trace_ns = 0;
+    chrono::steady_clock::duration elapsed{};
+
+    try {
+        TraceReader reader(input);
+        TraceRecord record;
+
+        while (reader.Read(record)) {
+            OpStats& op_stats = stats[record.op];
+            auto start = chrono::steady_clock::now();
+            try {
+                Execute(sheet, record, null_output);
+            } catch (const exception&) {
+                // неудачные правки (некорректная формула, цикл) - часть нагрузки
+                ++op_stats.errors;
+            }
+            auto duration = chrono::steady_clock::now() - start;
+
+            elapsed += duration;
+            op_stats.latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(duration).count());
+            trace_ns = record.time;
+            ++total;
+        }
+    } catch (const TraceFormatException& e) {
+        cerr << argv[1] << ": " << e.what() << endl;
+        return 1;
+    }
+
+    if (total == 0) {
+        cout << "Trace is empty" << endl;
+        return 0;
+    }
+    PrintReport(stats, total, chrono::duration<double>(elapsed).count(), trace_ns);
+    return 0;
+}
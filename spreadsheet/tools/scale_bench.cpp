@@ -0,0 +1,166 @@
+// spreadsheet_scale_bench: проверяет работу на всей сетке (Position::MAX_ROWS
+// строк и MAX_COLS столбцов).
+// 1. Разбор и запись адресов: <lookups> случайных позиций по всей сетке
+//    переводятся в текст и обратно.
+// 2. Формулы со ссылками на последние строки и столбцы сетки.
+// 3. Поиск ячеек: <cells> ячеек кладутся либо плотным блоком в 64 столбца
+//    (умещается в прежние 16384 строки), либо одним столбцом на всю высоту
+//    сетки; затем измеряется GetCell() по <lookups> случайным занятым и
+//    пустым позициям. Время поиска не должно зависеть от раскладки.
+//
+//     spreadsheet_scale_bench [cells] [lookups]
+//
+// По умолчанию 1000000 ячеек и 1000000 поисков.
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <variant>
+#include <vector>
+
+using namespace std;
+
+namespace {
+template <typename Func>
+uint64_t Measure(Func func) {
+    auto start = chrono::steady_clock::now();
+    func();
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+struct Layout {
+    string name;
+    int cols = 0;
+};
+
+// ячейки раскладки идут по строкам блока шириной cols
+Position CellAt(const Layout& layout, int index) {
+    return { index / layout.cols, index % layout.cols };
+}
+
+void PrintRow(const string& name, size_t count, uint64_t ns, size_t failures) {
+    cout << setw(28) << left << name << right << setw(10) << count
+         << setw(12) << static_cast<double>(ns) / count << setw(10) << failures << '\n';
+}
+
+void RunLayout(const Layout& layout, int cells, int lookups, mt19937& random) {
+    Sheet sheet;
+    uint64_t fill_ns = Measure([&] {
+        for (int i = 0; i < cells; ++i) {
+            sheet.SetCell(CellAt(layout, i), to_string(i));
+        }
+    });
+
+    uniform_int_distribution<int> any_cell(0, cells - 1);
+    vector<Position> hits;
+    vector<Position> misses;
+    hits.reserve(lookups);
+    misses.reserve(lookups);
+    for (int i = 0; i < lookups; ++i) {
+        hits.push_back(CellAt(layout, any_cell(random)));
+        // соседний столбец правее блока всегда пуст
+        Position miss = CellAt(layout, any_cell(random));
+        misses.push_back({ miss.row, layout.cols });
+    }
+
+    const Sheet& view = sheet;
+    size_t failures = 0;
+    uint64_t hit_ns = Measure([&] {
+        for (Position pos : hits) {
+            if (!view.GetCell(pos)) {
+                ++failures;
+            }
+        }
+    });
+    size_t miss_failures = 0;
+    uint64_t miss_ns = Measure([&] {
+        for (Position pos : misses) {
+            if (view.GetCell(pos)) {
+                ++miss_failures;
+            }
+        }
+    });
+
+    PrintRow(layout.name + " fill", cells, fill_ns, 0);
+    PrintRow(layout.name + " GetCell hit", hits.size(), hit_ns, failures);
+    PrintRow(layout.name + " GetCell miss", misses.size(), miss_ns, miss_failures);
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    int cells = argc > 1 ? stoi(argv[1]) : 1000000;
+    int lookups = argc > 2 ? stoi(argv[2]) : 1000000;
+    if (cells <= 0 || cells > Position::MAX_ROWS || lookups <= 0) {
+        cerr << "Usage: " << argv[0] << " [cells (1.." << Position::MAX_ROWS << ")] [lookups]" << endl;
+        return 2;
+    }
+
+    mt19937 random(42);
+    cout << fixed << setprecision(2);
+    cout << "grid " << Position::MAX_ROWS << " x " << Position::MAX_COLS << ", last cell "
+         << Position{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }.ToString() << "\n\n";
+    cout << setw(28) << left << "operation" << right << setw(10) << "count"
+         << setw(12) << "ns/op" << setw(10) << "failed" << '\n';
+
+    // адреса по всей сетке: текст и обратно
+    uniform_int_distribution<int> any_row(0, Position::MAX_ROWS - 1);
+    uniform_int_distribution<int> any_col(0, Position::MAX_COLS - 1);
+    vector<Position> positions;
+    positions.reserve(lookups);
+    for (int i = 0; i < lookups; ++i) {
+        positions.push_back({ any_row(random), any_col(random) });
+    }
+    vector<string> texts;
+    texts.reserve(lookups);
+    uint64_t format_ns = Measure([&] {
+        for (Position pos : positions) {
+            texts.push_back(pos.ToString());
+        }
+    });
+    size_t parse_failures = 0;
+    uint64_t parse_ns = Measure([&] {
+        for (int i = 0; i < lookups; ++i) {
+            if (!(Position::FromString(texts[i]) == positions[i])) {
+                ++parse_failures;
+            }
+        }
+    });
+    PrintRow("Position::ToString", positions.size(), format_ns, 0);
+    PrintRow("Position::FromString", positions.size(), parse_ns, parse_failures);
+
+    // формулы, ссылающиеся на край сетки
+    {
+        Sheet sheet;
+        const Position last{ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 };
+        sheet.SetCell(last, "2");
+        sheet.SetCell({ last.row, 0 }, "3");
+        sheet.SetCell({ 0, last.col }, "4");
+        const string formula = "=" + last.ToString() + "*" + Position{ last.row, 0 }.ToString() + "+"
+                               + Position{ 0, last.col }.ToString();
+
+        const int formulas = max(1, lookups / 10);
+        size_t failures = 0;
+        uint64_t ns = Measure([&] {
+            for (int i = 0; i < formulas; ++i) {
+                // текст каждый раз новый, иначе SetCell ничего бы не менял
+                sheet.SetCell({ i % 1000, 1 }, formula + "+" + to_string(i % 7));
+                auto value = sheet.GetCell({ i % 1000, 1 })->GetValue();
+                if (!holds_alternative<double>(value) || get<double>(value) != 10 + i % 7) {
+                    ++failures;
+                }
+            }
+        });
+        PrintRow("formula at grid edge", formulas, ns, failures);
+    }
+
+    cout << '\n';
+    RunLayout({ "dense 64 cols", 64 }, cells, lookups, random);
+    RunLayout({ "tall 1 col", 1 }, cells, lookups, random);
+    return 0;
+}
@@ -0,0 +1,119 @@
+// spreadsheet_vector_bench: заполняет таблицу из <rows> строк (столбцы A, B,
+// C - числа, в каждой тысячной строке C - текст) и протягивает в D формулу
+// одной формы =A{r}*B{r}+C{r}, затем пересчитывает её <runs> раз, каждый раз
+// заново задавая столбец A.
+// Для сравнения та же таблица строится с формулами двух форм через строку
+// (=A{r}*B{r}+C{r} и =C{r}+A{r}*B{r}): серий одной формы нет, и каждая
+// формула вычисляется по одной. Значения и ошибки обеих таблиц сверяются.
+//
+//     spreadsheet_vector_bench [rows] [runs]
+//
+// По умолчанию 1000000 строк и 3 пересчёта.
+
+#include "sheet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <variant>
+#include <vector>
+
+using namespace std;
+
+namespace {
+struct Result {
+    uint64_t fill_ns = 0;
+    vector<uint64_t> recalc_ns;
+    vector<CellInterface::Value> values;
+};
+
+template <typename Func>
+uint64_t Measure(Func func) {
+    auto start = chrono::steady_clock::now();
+    func();
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+}
+
+// C в каждой тысячной строке - текст: формула даёт #VALUE! в обоих режимах
+void FillInputs(Sheet& sheet, int rows, int pass) {
+    for (int row = 0; row < rows; ++row) {
+        sheet.SetCell({row, 0}, to_string(row % 1000 + pass));
+    }
+}
+
+Result Run(int rows, int runs, bool mixed_shapes) {
+    Result result;
+    Sheet sheet;
+    result.fill_ns = Measure([&] {
+        FillInputs(sheet, rows, 0);
+        for (int row = 0; row < rows; ++row) {
+            const string r = to_string(row + 1);
+            sheet.SetCell({row, 1}, to_string(row % 7 + 0.5));
+            sheet.SetCell({row, 2}, row % 1000 == 999 ? "n/a" : to_string(row % 13));
+            sheet.SetCell({row, 3}, mixed_shapes && row % 2 ? "=C" + r + "+A" + r + "*B" + r
+                                                            : "=A" + r + "*B" + r + "+C" + r);
+        }
+    });
+
+    for (int pass = 0; pass < runs; ++pass) {
+        if (pass > 0) {
+            FillInputs(sheet, rows, pass);
+        }
+        result.recalc_ns.push_back(Measure([&] {
+            sheet.Recalculate();
+        }));
+    }
+
+    result.values.reserve(rows);
+    for (int row = 0; row < rows; ++row) {
+        result.values.push_back(sheet.GetCell({row, 3})->GetValue());
+    }
+    return result;
+}
+
+void PrintRow(const string& name, const Result& result, int rows) {
+    vector<uint64_t> sorted = result.recalc_ns;
+    sort(sorted.begin(), sorted.end());
+
+    cout << setw(14) << left << name << right
+         << setw(12) << result.fill_ns / 1e6
+         << setw(12) << sorted.front() / 1e6 << setw(12) << sorted[sorted.size() / 2] / 1e6
+         << setw(14) << static_cast<double>(sorted[sorted.size() / 2]) / rows << '\n';
+}
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    int rows = argc > 1 ? stoi(argv[1]) : 1000000;
+    int runs = argc > 2 ? stoi(argv[2]) : 3;
+    if (rows <= 0 || rows > Position::MAX_ROWS || runs <= 0) {
+        cerr << "Usage: " << argv[0] << " [rows (1.." << Position::MAX_ROWS << ")] [runs]" << endl;
+        return 2;
+    }
+
+    Result vectorized = Run(rows, runs, false);
+    Result scalar = Run(rows, runs, true);
+
+    size_t mismatches = 0;
+    size_t errors = 0;
+    for (int row = 0; row < rows; ++row) {
+        if (!(vectorized.values[row] == scalar.values[row])) {
+            ++mismatches;
+        }
+        if (holds_alternative<FormulaError>(vectorized.values[row])) {
+            ++errors;
+        }
+    }
+
+    cout << fixed << setprecision(2);
+    cout << rows << " rows, " << runs << " recalculations\n\n";
+    cout << setw(14) << left << "formulas" << right
+         << setw(12) << "fill, ms" << setw(12) << "min, ms" << setw(12) << "p50, ms"
+         << setw(14) << "p50, ns/cell" << '\n';
+    PrintRow("one shape", vectorized, rows);
+    PrintRow("two shapes", scalar, rows);
+    cout << "\nerrors: " << errors << ", mismatches: " << mismatches << '\n';
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,282 @@
+#include "trace.h"
+
+#include "numeric_columns.h"
+
+#include <algorithm>
+#include <cctype>
+#include <istream>
+#include <ostream>
+
+using namespace std;
+
+namespace {
+// буфер сбрасывается в поток крупными порциями
+const size_t FLUSH_THRESHOLD = 64 * 1024;
+// длиннее текст ячейки быть не может - значит, журнал повреждён
+const uint64_t MAX_TEXT_SIZE = uint64_t{1} << 30;
+
+uint64_t Fnv1a(string_view text) {
+    uint64_t hash = 14'695'981'039'346'656'037ull;
+    for (char c : text) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1'099'511'628'211ull;
+    }
+    return hash;
+}
+
+// ненулевое число с двумя знаками после точки, зависящее только от исходного
+string PseudoNumber(string_view number) {
+    auto value = ParseNumber(number);
+    if (value && *value == 0) {
+        return "0";
+    }
+
+    uint64_t hash = Fnv1a(number);
+    string result = to_string(hash % 10'000 + 1) + ".";
+    int cents = static_cast<int>(hash / 10'000 % 100);
+    result += static_cast<char>('0' + cents / 10);
+    result += static_cast<char>('0' + cents % 10);
+    return (value && *value < 0 ? "-" : "") + result;
+}
+
+string Hashed(string_view text) {
+    static const char DIGITS[] = "0123456789abcdef";
+    uint64_t hash = Fnv1a(text);
+
+    string result = "x";
+    for (int shift = 60; shift >= 0; shift -= 4) {
+        result += DIGITS[(hash >> shift) & 0xF];
+    }
+    return result;
+}
+
+bool IsDigit(char c) {
+    return isdigit(static_cast<unsigned char>(c));
+}
+
+// ссылки и операции остаются как есть, числовые константы заменяются
+string AnonymizeFormula(string_view expression) {
+    string result;
+    size_t i = 0;
+
+    while (i < expression.size()) {
+        size_t end = i;
+
+        if (isalpha(static_cast<unsigned char>(expression[i]))) {
+            while (end < expression.size() && isalnum(static_cast<unsigned char>(expression[end]))) {
+                ++end;
+            }
+            result += expression.substr(i, end - i);
+        } else if (IsDigit(expression[i]) || expression[i] == '.') {
+            while (end < expression.size() && (IsDigit(expression[end]) || expression[end] == '.')) {
+                ++end;
+            }
+            if (end < expression.size() && (expression[end] == 'e' || expression[end] == 'E')) {
+                size_t exponent = end + 1;
+                if (exponent < expression.size() && (expression[exponent] == '+' || expression[exponent] == '-')) {
+                    ++exponent;
+                }
+                if (exponent < expression.size() && IsDigit(expression[exponent])) {
+                    end = exponent;
+                    while (end < expression.size() && IsDigit(expression[end])) {
+                        ++end;
+                    }
+                }
+            }
+            result += PseudoNumber(expression.substr(i, end - i));
+        } else {
+            result += expression[i];
+            end = i + 1;
+        }
+
+        i = end;
+    }
+    return result;
+}
+}  // namespace
+
+string AnonymizeText(string_view text) {
+    if (text.empty()) {
+        return {};
+    }
+    if (text[0] == FORMULA_SIGN && text.size() > 1) {
+        return FORMULA_SIGN + AnonymizeFormula(text.substr(1));
+    }
+
+    string prefix;
+    if (text[0] == ESCAPE_SIGN) {
+        prefix = ESCAPE_SIGN;
+        text.remove_prefix(1);
+    }
+    if (!text.empty() && ParseNumber(text)) {
+        return prefix + PseudoNumber(text);
+    }
+    return prefix + Hashed(text);
+}
+
+TraceWriter::TraceWriter(ostream& output, bool anonymize)
+    : output_(output)
+    , anonymize_(anonymize)
+    , start_(chrono::steady_clock::now()) {
+    buffer_ += TRACE_MAGIC;
+    buffer_ += static_cast<char>(TRACE_VERSION);
+    buffer_ += static_cast<char>(anonymize ? TRACE_ANONYMIZED : 0);
+}
+
+TraceWriter::~TraceWriter() {
+    Flush();
+}
+
+void TraceWriter::Write(TraceOp op, Position pos, string_view text) {
+    WriteHeader(op);
+
+    if (op == TraceOp::SetCell || op == TraceOp::ClearCell || op == TraceOp::GetValue) {
+        WriteVarint(pos.row);
+        WriteVarint(pos.col);
+    }
+    if (op == TraceOp::SetCell) {
+        string anonymized;
+        if (anonymize_) {
+            anonymized = AnonymizeText(text);
+            text = anonymized;
+        }
+        WriteVarint(text.size());
+        buffer_ += text;
+    }
+
+    if (buffer_.size() >= FLUSH_THRESHOLD) {
+        Flush();
+    }
+}
+
+void TraceWriter::WriteShift(TraceOp op, int first, int count) {
+    WriteHeader(op);
+    WriteVarint(first);
+    WriteVarint(count);
+
+    if (buffer_.size() >= FLUSH_THRESHOLD) {
+        Flush();
+    }
+}
+
+void TraceWriter::WriteRange(TraceOp op, const Range& range, Position target) {
+    WriteHeader(op);
+    WriteVarint(range.first.row);
+    WriteVarint(range.first.col);
+    WriteVarint(range.last.row);
+    WriteVarint(range.last.col);
+    if (op != TraceOp::ClearRange) {
+        WriteVarint(target.row);
+        WriteVarint(target.col);
+    }
+
+    if (buffer_.size() >= FLUSH_THRESHOLD) {
+        Flush();
+    }
+}
+
+void TraceWriter::WriteHeader(TraceOp op) {
+    auto now = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_).count();
+    uint64_t time = max<uint64_t>(now, last_time_);
+
+    buffer_ += static_cast<char>(op);
+    WriteVarint(time - last_time_);
+    last_time_ = time;
+}
+
+void TraceWriter::Flush() {
+    output_.write(buffer_.data(), buffer_.size());
+    output_.flush();
+    buffer_.clear();
+}
+
+void TraceWriter::WriteVarint(uint64_t value) {
+    while (value >= 0x80) {
+        buffer_ += static_cast<char>((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer_ += static_cast<char>(value);
+}
+
+TraceReader::TraceReader(istream& input) : input_(input) {
+    string magic(TRACE_MAGIC.size(), '\0');
+    char version = 0;
+    char flags = 0;
+
+    if (!input_.read(magic.data(), magic.size()) || magic != TRACE_MAGIC
+        || !input_.get(version) || !input_.get(flags)) {
+        throw TraceFormatException("Not a spreadsheet trace");
+    }
+    if (static_cast<uint8_t>(version) != TRACE_VERSION) {
+        throw TraceFormatException("Unsupported trace version " + to_string(static_cast<uint8_t>(version)));
+    }
+    flags_ = static_cast<uint8_t>(flags);
+}
+
+bool TraceReader::IsAnonymized() const {
+    return flags_ & TRACE_ANONYMIZED;
+}
+
+bool TraceReader::Read(TraceRecord& record) {
+    char op = 0;
+    if (!input_.get(op)) {
+        return false;
+    }
+
+    record.op = static_cast<TraceOp>(op);
+    if (record.op < TraceOp::SetCell || record.op > TraceOp::MoveRange) {
+        throw TraceFormatException("Unknown trace operation " + to_string(static_cast<uint8_t>(op)));
+    }
+
+    time_ += ReadVarint();
+    record.time = time_;
+    record.pos = Position::NONE;
+    record.text.clear();
+    record.first = record.count = 0;
+    record.range = Range::NONE;
+
+    if (record.op == TraceOp::SetCell || record.op == TraceOp::ClearCell || record.op == TraceOp::GetValue) {
+        record.pos.row = static_cast<int>(ReadVarint());
+        record.pos.col = static_cast<int>(ReadVarint());
+    }
+    if (record.op >= TraceOp::InsertRows && record.op <= TraceOp::DeleteColumns) {
+        record.first = static_cast<int>(ReadVarint());
+        record.count = static_cast<int>(ReadVarint());
+    }
+    if (record.op >= TraceOp::ClearRange) {
+        record.range.first.row = static_cast<int>(ReadVarint());
+        record.range.first.col = static_cast<int>(ReadVarint());
+        record.range.last.row = static_cast<int>(ReadVarint());
+        record.range.last.col = static_cast<int>(ReadVarint());
+        if (record.op != TraceOp::ClearRange) {
+            record.pos.row = static_cast<int>(ReadVarint());
+            record.pos.col = static_cast<int>(ReadVarint());
+        }
+    }
+    if (record.op == TraceOp::SetCell) {
+        uint64_t size = ReadVarint();
+        if (size > MAX_TEXT_SIZE) {
+            throw TraceFormatException("Malformed text length in trace");
+        }
+        record.text.resize(size);
+        if (!input_.read(record.text.data(), record.text.size())) {
+            throw TraceFormatException("Truncated trace");
+        }
+    }
+    return true;
+}
+
+uint64_t TraceReader::ReadVarint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        char byte = 0;
+        if (!input_.get(byte)) {
+            throw TraceFormatException("Truncated trace");
+        }
+        value |= uint64_t{static_cast<unsigned char>(byte) & 0x7Fu} << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+    throw TraceFormatException("Malformed varint in trace");
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "common.h"
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Журнал операций с таблицей (Sheet::StartRecording) - для воспроизведения
+// реальной нагрузки программой spreadsheet_replay (tools/replay.cpp).
+//
+// Формат: TRACE_MAGIC, байт версии, байт флагов (TRACE_ANONYMIZED), затем
+// записи. Запись - байт TraceOp, время от предыдущей записи в наносекундах,
+// для операций с ячейкой строка и столбец, для SetCell длина текста и сам
+// текст, для вставки и удаления строк и столбцов номер первой строки
+// (столбца) и их число, для операций с областью её первая и последняя
+// строка и столбец, а для CopyRange и MoveRange ещё строка и столбец, куда
+// она переносится. Целые числа записываются в формате varint (LEB128).
+inline constexpr std::string_view TRACE_MAGIC = "SSTRACE";
+inline constexpr uint8_t TRACE_VERSION = 1;
+inline constexpr uint8_t TRACE_ANONYMIZED = 1;
+
+enum class TraceOp : uint8_t {
+    SetCell = 1,
+    ClearCell,
+    GetValue,
+    PrintValues,
+    PrintTexts,
+    InsertRows,
+    DeleteRows,
+    InsertColumns,
+    DeleteColumns,
+    ClearRange,
+    CopyRange,
+    MoveRange,
+};
+
+struct TraceRecord {
+    TraceOp op = TraceOp::SetCell;
+    uint64_t time = 0;  // наносекунды от начала записи
+    Position pos = Position::NONE;
+    std::string text;
+    // вставка и удаление строк и столбцов
+    int first = 0;
+    int count = 0;
+    // операции с областью; для CopyRange и MoveRange pos - куда она переносится
+    Range range = Range::NONE;
+};
+
+// Исключение, выбрасываемое при чтении повреждённого или чужого журнала
+class TraceFormatException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+class TraceWriter {
+public:
+    // При anonymize текст ячеек заменяется функцией AnonymizeText
+    TraceWriter(std::ostream& output, bool anonymize);
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+    ~TraceWriter();
+
+    void Write(TraceOp op, Position pos = Position::NONE, std::string_view text = {});
+    void WriteShift(TraceOp op, int first, int count);
+    void WriteRange(TraceOp op, const Range& range, Position target = Position::NONE);
+    void Flush();
+
+private:
+    std::ostream& output_;
+    bool anonymize_;
+    std::chrono::steady_clock::time_point start_;
+    uint64_t last_time_ = 0;
+    std::string buffer_;
+
+    void WriteHeader(TraceOp op);
+    void WriteVarint(uint64_t value);
+};
+
+class TraceReader {
+public:
+    // Проверяет заголовок, при несовпадении бросает TraceFormatException
+    explicit TraceReader(std::istream& input);
+
+    bool IsAnonymized() const;
+
+    // Читает очередную запись; false - журнал закончился
+    bool Read(TraceRecord& record);
+
+private:
+    std::istream& input_;
+    uint8_t flags_ = 0;
+    uint64_t time_ = 0;
+
+    uint64_t ReadVarint();
+};
+
+// Обезличивает текст ячейки, сохраняя то, что влияет на вычисления: формулы
+// остаются формулами с теми же ссылками и операциями, но другими константами;
+// текст, который формулы читают как число, остаётся числом (ноль - нулём);
+// прочий текст заменяется хешем. Одинаковый текст даёт одинаковый результат.
+std::string AnonymizeText(std::string_view text);
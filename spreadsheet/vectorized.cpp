@@ -0,0 +1,156 @@
+#include "vectorized.h"
+
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+using OpCode = FormulaProgram::OpCode;
+
+constexpr double NaN = numeric_limits<double>::quiet_NaN();
+
+// Бесконечность заменяется на NaN: NaN сохраняется во всех последующих
+// операциях, а бесконечность может снова стать конечным числом (1/inf == 0),
+// тогда как поэлементное вычисление остановилось бы на первой же ошибке.
+double Poison(double value) {
+    return isfinite(value) ? value : NaN;
+}
+
+double ApplyScalar(OpCode code, double lhs, double rhs) {
+    switch (code) {
+        case OpCode::Add:
+            return Poison(lhs + rhs);
+        case OpCode::Subtract:
+            return Poison(lhs - rhs);
+        case OpCode::Multiply:
+            return Poison(lhs * rhs);
+        case OpCode::Divide:
+            return Poison(lhs / rhs);
+        default:
+            assert(false && "Unknown Binary Op");
+            return NaN;
+    }
+}
+
+#if defined(__AVX2__)
+constexpr size_t LANES = 4;
+
+__m256d ApplyLanes(OpCode code, __m256d lhs, __m256d rhs) {
+    __m256d result;
+    switch (code) {
+        case OpCode::Add:
+            result = _mm256_add_pd(lhs, rhs);
+            break;
+        case OpCode::Subtract:
+            result = _mm256_sub_pd(lhs, rhs);
+            break;
+        case OpCode::Multiply:
+            result = _mm256_mul_pd(lhs, rhs);
+            break;
+        default:
+            result = _mm256_div_pd(lhs, rhs);
+            break;
+    }
+    // x - x == 0 только для конечных x
+    __m256d finite = _mm256_cmp_pd(_mm256_sub_pd(result, result), _mm256_setzero_pd(), _CMP_EQ_OQ);
+    return _mm256_blendv_pd(_mm256_set1_pd(NaN), result, finite);
+}
+
+void ApplyBinary(OpCode code, double* lhs, const double* rhs, size_t count) {
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        __m256d result = ApplyLanes(code, _mm256_loadu_pd(lhs + i), _mm256_loadu_pd(rhs + i));
+        _mm256_storeu_pd(lhs + i, result);
+    }
+    for (; i < count; ++i) {
+        lhs[i] = ApplyScalar(code, lhs[i], rhs[i]);
+    }
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+constexpr size_t LANES = 2;
+
+__m128d ApplyLanes(OpCode code, __m128d lhs, __m128d rhs) {
+    __m128d result;
+    switch (code) {
+        case OpCode::Add:
+            result = _mm_add_pd(lhs, rhs);
+            break;
+        case OpCode::Subtract:
+            result = _mm_sub_pd(lhs, rhs);
+            break;
+        case OpCode::Multiply:
+            result = _mm_mul_pd(lhs, rhs);
+            break;
+        default:
+            result = _mm_div_pd(lhs, rhs);
+            break;
+    }
+    // x - x == 0 только для конечных x
+    __m128d finite = _mm_cmpeq_pd(_mm_sub_pd(result, result), _mm_setzero_pd());
+    return _mm_or_pd(_mm_and_pd(finite, result), _mm_andnot_pd(finite, _mm_set1_pd(NaN)));
+}
+
+void ApplyBinary(OpCode code, double* lhs, const double* rhs, size_t count) {
+    size_t i = 0;
+    for (; i + LANES <= count; i += LANES) {
+        __m128d result = ApplyLanes(code, _mm_loadu_pd(lhs + i), _mm_loadu_pd(rhs + i));
+        _mm_storeu_pd(lhs + i, result);
+    }
+    for (; i < count; ++i) {
+        lhs[i] = ApplyScalar(code, lhs[i], rhs[i]);
+    }
+}
+#else
+void ApplyBinary(OpCode code, double* lhs, const double* rhs, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        lhs[i] = ApplyScalar(code, lhs[i], rhs[i]);
+    }
+}
+#endif
+
+}  // namespace
+
+void EvaluateProgram(const FormulaProgram& program, const vector<vector<double>>& inputs,
+                     size_t count, vector<double>& result) {
+    vector<vector<double>> stack;
+    size_t next_input = 0;
+
+    for (const auto& op : program.ops) {
+        switch (op.code) {
+            case OpCode::Number:
+                stack.emplace_back(count, op.number);
+                break;
+            case OpCode::Cell:
+            case OpCode::Range:
+                assert(next_input < inputs.size() && inputs[next_input].size() >= count);
+                stack.emplace_back(inputs[next_input].begin(), inputs[next_input].begin() + count);
+                ++next_input;
+                break;
+            case OpCode::Negate:
+                assert(!stack.empty());
+                for (double& value : stack.back()) {
+                    value = -value;
+                }
+                break;
+            default: {
+                assert(stack.size() >= 2);
+                vector<double> rhs = move(stack.back());
+                stack.pop_back();
+                ApplyBinary(op.code, stack.back().data(), rhs.data(), count);
+                break;
+            }
+        }
+    }
+
+    assert(stack.size() == 1);
+    result = move(stack.back());
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "formula.h"
+
+#include <cstddef>
+#include <vector>
+
+// Вычисляет программу формулы сразу для count строк.
+// inputs[i][row] - числовое значение i-й по порядку ссылки программы
+// (OpCode::Cell или OpCode::Range) для строки row. Все входы должны быть конечными числами:
+// строки с ошибками или текстом вычисляются по одной обычным путём.
+// В result[row] записывается значение формулы или NaN, если хотя бы одна
+// операция дала бесконечность или NaN - это соответствует ошибке #ARITHM!.
+// Операции выполняются SIMD-ядрами (AVX2 или SSE2, если они доступны при
+// сборке), иначе обычным циклом.
+void EvaluateProgram(const FormulaProgram& program, const std::vector<std::vector<double>>& inputs,
+                     size_t count, std::vector<double>& result);